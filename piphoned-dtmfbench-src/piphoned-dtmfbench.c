@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include "dtmf_detector.h"
+
+/* Detector settings used unless given on the command line; the same
+ * as the daemon's defaults. */
+#define DEFAULT_MIN_LEVEL -30
+#define DEFAULT_TWIST 8
+#define DEFAULT_REVERSE_TWIST 4
+
+/* Samples handed to the detector at once, as the capture thread of
+ * the daemon does (20 ms). */
+#define CHUNK_SIZE 160
+
+/* Each file is run through the detector repeatedly until this much
+ * CPU time has been spent, for a stable measurement. */
+#define MIN_MEASURE_NS 200000000LL
+
+/* Name of the list of files and the keys expected in them in a
+ * corpus directory. */
+#define CORPUS_LIST "corpus.txt"
+
+#define MAX_KEYS 64
+
+/**
+ * One recording of the generated corpus.
+ */
+struct CorpusEntry
+{
+  const char* name;     /*< File name without extension */
+  const char* keys;     /*< Keys to press */
+  const char* expected; /*< Keys a correct detector finds; "-" for none */
+  float level_db;       /*< Level of each tone in dBFS */
+  float twist_db;       /*< How much louder the row tone is than the column tone */
+  float offset;         /*< Relative frequency error, e.g. 0.015 */
+  int on_ms;            /*< Length of each tone */
+  int off_ms;           /*< Pause after each tone */
+  float snr_db;         /*< Signal to white noise ratio; 0 for no noise */
+};
+
+static const struct CorpusEntry s_corpus[] = {
+  {"clean",         "123A456B789C*0#D", "123A456B789C*0#D", -8.0f, 0.0f, 0.0f, 100, 100, 0.0f},
+  {"weak",          "2580", "2580", -24.0f, 0.0f, 0.0f, 100, 100, 0.0f},
+  {"too-weak",      "2580", "-", -36.0f, 0.0f, 0.0f, 100, 100, 0.0f},
+  {"noisy",         "147*", "147*", -10.0f, 0.0f, 0.0f, 100, 100, 12.0f},
+  {"twist",         "369#", "369#", -10.0f, 6.0f, 0.0f, 100, 100, 0.0f},
+  {"reverse-twist", "369#", "-", -10.0f, -7.0f, 0.0f, 100, 100, 0.0f},
+  {"fast",          "9876", "9876", -10.0f, 0.0f, 0.0f, 45, 45, 0.0f},
+  {"too-short",     "1234", "-", -10.0f, 0.0f, 0.0f, 10, 100, 0.0f},
+  {"high",          "5D", "5D", -10.0f, 0.0f, 0.015f, 100, 100, 0.0f},
+  {"low",           "5D", "5D", -10.0f, 0.0f, -0.015f, 100, 100, 0.0f},
+  {"off-frequency", "5D", "-", -10.0f, 0.0f, 0.05f, 100, 100, 0.0f},
+};
+
+static const float s_row_frequencies[4] = {697.0f, 770.0f, 852.0f, 941.0f};
+static const float s_column_frequencies[4] = {1209.0f, 1336.0f, 1477.0f, 1633.0f};
+static const char s_keys[] = "123A456B789C*0#D";
+
+static int generate_corpus(const char* directory);
+static void add_key(float* signal, size_t start, size_t length, char key, float level_db, float twist_db, float offset);
+static void add_tones(float* signal, size_t start, size_t length, const float* frequencies, int count, float level_db);
+static void add_voice(float* signal, size_t length);
+static void add_noise(float* signal, size_t length, float snr_db);
+static bool write_wav(const char* path, const float* signal, size_t length);
+static int16_t* read_wav(const char* path, size_t* p_length);
+static bool run_file(const char* path, const char* expected, int min_level, int twist, int reverse_twist, double* p_load);
+static int run_corpus(const char* directory, int min_level, int twist, int reverse_twist);
+static void put16(unsigned char* target, unsigned int value);
+static void put32(unsigned char* target, unsigned long value);
+static unsigned long get32(const unsigned char* source);
+static unsigned int get16(const unsigned char* source);
+
+int main(int argc, char* argv[])
+{
+  int min_level = DEFAULT_MIN_LEVEL;
+  int twist = DEFAULT_TWIST;
+  int reverse_twist = DEFAULT_REVERSE_TWIST;
+  const char* corpus = NULL;
+  const char* generate = NULL;
+  double load = 0.0;
+  double max_load = 0.0;
+  int failures = 0;
+  int opt = 0;
+  int i = 0;
+
+  while ((opt = getopt(argc, argv, "l:t:r:c:g:h")) != -1) {
+    switch (opt) {
+    case 'l':
+      min_level = atoi(optarg);
+      break;
+    case 't':
+      twist = atoi(optarg);
+      break;
+    case 'r':
+      reverse_twist = atoi(optarg);
+      break;
+    case 'c':
+      corpus = optarg;
+      break;
+    case 'g':
+      generate = optarg;
+      break;
+    default:
+      printf("Usage: %s [-l LEVEL] [-t TWIST] [-r TWIST] FILE...\n"
+             "       %s [-l LEVEL] [-t TWIST] [-r TWIST] -c DIRECTORY\n"
+             "       %s -g DIRECTORY\n\n"
+             "Runs piphoned's DTMF detector over WAV files (8 kHz, mono, 16 bit) and\n"
+             "prints the keys found in each and the share of one CPU core the\n"
+             "detector needs to keep up with the audio. The options correspond to\n"
+             "the dtmf_min_level (dBFS, default %d), dtmf_twist (dB, default %d)\n"
+             "and dtmf_reverse_twist (dB, default %d) settings of the daemon.\n\n"
+             "-g writes a corpus of test recordings to DIRECTORY, and -c checks the\n"
+             "detector against such a corpus, listed in DIRECTORY/%s.\n",
+             argv[0], argv[0], argv[0], DEFAULT_MIN_LEVEL, DEFAULT_TWIST, DEFAULT_REVERSE_TWIST, CORPUS_LIST);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (generate)
+    return generate_corpus(generate);
+  if (corpus)
+    return run_corpus(corpus, min_level, twist, reverse_twist);
+
+  if (optind >= argc) {
+    fprintf(stderr, "No WAV files given. See -h.\n");
+    return 1;
+  }
+
+  for(i=optind; i < argc; i++) {
+    if (!run_file(argv[i], NULL, min_level, twist, reverse_twist, &load))
+      failures++;
+    if (load > max_load)
+      max_load = load;
+  }
+
+  printf("Highest detector load: %.3f %% of one core.\n", max_load);
+  return failures ? 2 : 0;
+}
+
+/**
+ * Writes the recordings of `s_corpus` plus two without any keys, a
+ * dial tone and a synthetic voice, to `directory`, along with the
+ * list of expected keys.
+ */
+static int generate_corpus(const char* directory)
+{
+  char path[PATH_MAX];
+  FILE* p_list = NULL;
+  float* signal = NULL;
+  size_t length = 0;
+  size_t position = 0;
+  size_t i = 0;
+  size_t j = 0;
+
+  snprintf(path, PATH_MAX, "%s/%s", directory, CORPUS_LIST);
+  p_list = fopen(path, "w");
+  if (!p_list) {
+    fprintf(stderr, "Cannot write '%s': %m\n", path);
+    return 2;
+  }
+
+  fprintf(p_list, "# File and the keys the DTMF detector must find in it (- for none)\n");
+
+  for(i=0; i < sizeof(s_corpus) / sizeof(s_corpus[0]); i++) {
+    const struct CorpusEntry* p_entry = &s_corpus[i];
+    size_t on = p_entry->on_ms * PIPHONED_DTMF_SAMPLE_RATE / 1000;
+    size_t off = p_entry->off_ms * PIPHONED_DTMF_SAMPLE_RATE / 1000;
+
+    length = (strlen(p_entry->keys) * (on + off) + 2 * off);
+    signal = (float*) calloc(length, sizeof(float));
+
+    position = off;
+    for(j=0; p_entry->keys[j]; j++) {
+      add_key(signal, position, on, p_entry->keys[j], p_entry->level_db, p_entry->twist_db, p_entry->offset);
+      position += on + off;
+    }
+
+    if (p_entry->snr_db > 0.0f)
+      add_noise(signal, length, p_entry->snr_db);
+
+    snprintf(path, PATH_MAX, "%s/%s.wav", directory, p_entry->name);
+    if (!write_wav(path, signal, length)) {
+      free(signal);
+      fclose(p_list);
+      return 2;
+    }
+
+    fprintf(p_list, "%s.wav %s\n", p_entry->name, p_entry->expected);
+    free(signal);
+  }
+
+  /* Dial tone as sent by European exchanges: 425 Hz, then North
+   * American 350 + 440 Hz */
+  length = 2 * PIPHONED_DTMF_SAMPLE_RATE;
+  signal = (float*) calloc(length, sizeof(float));
+  add_tones(signal, 0, length / 2, (const float[]) {425.0f}, 1, -6.0f);
+  add_tones(signal, length / 2, length / 2, (const float[]) {350.0f, 440.0f}, 2, -9.0f);
+  snprintf(path, PATH_MAX, "%s/dial-tone.wav", directory);
+  if (!write_wav(path, signal, length)) {
+    free(signal);
+    fclose(p_list);
+    return 2;
+  }
+  fprintf(p_list, "dial-tone.wav -\n");
+  free(signal);
+
+  length = 4 * PIPHONED_DTMF_SAMPLE_RATE;
+  signal = (float*) calloc(length, sizeof(float));
+  add_voice(signal, length);
+  snprintf(path, PATH_MAX, "%s/voice.wav", directory);
+  if (!write_wav(path, signal, length)) {
+    free(signal);
+    fclose(p_list);
+    return 2;
+  }
+  fprintf(p_list, "voice.wav -\n");
+  free(signal);
+
+  fclose(p_list);
+  printf("Wrote %zu recordings to %s.\n", sizeof(s_corpus) / sizeof(s_corpus[0]) + 2, directory);
+  return 0;
+}
+
+/**
+ * Runs all files listed in `directory`/CORPUS_LIST and compares the
+ * keys found with the ones expected.
+ */
+static int run_corpus(const char* directory, int min_level, int twist, int reverse_twist)
+{
+  char path[PATH_MAX];
+  char line[PATH_MAX];
+  char file[NAME_MAX + 1];
+  char expected[MAX_KEYS + 1];
+  FILE* p_list = NULL;
+  double load = 0.0;
+  double max_load = 0.0;
+  int count = 0;
+  int failures = 0;
+
+  snprintf(path, PATH_MAX, "%s/%s", directory, CORPUS_LIST);
+  p_list = fopen(path, "r");
+  if (!p_list) {
+    fprintf(stderr, "Cannot open '%s': %m\n", path);
+    return 2;
+  }
+
+  while (fgets(line, PATH_MAX, p_list)) {
+    if (line[0] == '#' || sscanf(line, "%255s %64s", file, expected) != 2)
+      continue;
+
+    if (snprintf(path, PATH_MAX, "%s/%s", directory, file) >= PATH_MAX)
+      continue;
+    count++;
+    if (!run_file(path, expected, min_level, twist, reverse_twist, &load))
+      failures++;
+    if (load > max_load)
+      max_load = load;
+  }
+
+  fclose(p_list);
+
+  printf("%d of %d recordings as expected. Highest detector load: %.3f %% of one core.\n", count - failures, count, max_load);
+  return failures ? 2 : 0;
+}
+
+/**
+ * Runs a single file through the detector and prints what was found.
+ * If `expected` is given, the keys found must match. `p_load`
+ * receives the CPU time needed per second of audio, in percent.
+ */
+static bool run_file(const char* path, const char* expected, int min_level, int twist, int reverse_twist, double* p_load)
+{
+  struct Piphoned_DtmfDetector detector;
+  char keys[MAX_KEYS + 1];
+  size_t num_keys = 0;
+  int16_t* samples = NULL;
+  size_t length = 0;
+  size_t i = 0;
+  struct timespec start;
+  struct timespec end;
+  long long elapsed = 0;
+  long runs = 0;
+  bool ok = true;
+
+  *p_load = 0.0;
+
+  samples = read_wav(path, &length);
+  if (!samples)
+    return false;
+
+  /* First run collects the keys */
+  piphoned_dtmfdetector_init(&detector, min_level, twist, reverse_twist);
+  for(i=0; i < length; i += CHUNK_SIZE) {
+    size_t chunk = length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE;
+    num_keys += piphoned_dtmfdetector_process(&detector, samples + i, chunk, keys + num_keys, MAX_KEYS - num_keys);
+  }
+  keys[num_keys] = '\0';
+
+  /* Further runs only measure */
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+  do {
+    char scratch[MAX_KEYS];
+
+    piphoned_dtmfdetector_reset(&detector);
+    for(i=0; i < length; i += CHUNK_SIZE) {
+      size_t chunk = length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE;
+      piphoned_dtmfdetector_process(&detector, samples + i, chunk, scratch, MAX_KEYS);
+    }
+
+    runs++;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+  } while (elapsed < MIN_MEASURE_NS);
+
+  *p_load = 100.0 * ((double) elapsed / runs) / (1e9 * length / PIPHONED_DTMF_SAMPLE_RATE);
+
+  if (expected)
+    ok = strcmp(expected, num_keys > 0 ? keys : "-") == 0;
+
+  printf("%-40s %-18s %6.1f ns/sample %7.3f %% CPU%s%s\n", path, num_keys > 0 ? keys : "-",
+         (double) elapsed / runs / length, *p_load,
+         ok ? "" : "  FAILED, expected ", ok ? "" : expected);
+
+  free(samples);
+  return ok;
+}
+
+/***************************************
+ * Signal synthesis
+ ***************************************/
+
+static void add_key(float* signal, size_t start, size_t length, char key, float level_db, float twist_db, float offset)
+{
+  int index = strchr(s_keys, key) - s_keys;
+  float row = s_row_frequencies[index / 4] * (1.0f + offset);
+  float column = s_column_frequencies[index % 4] * (1.0f + offset);
+
+  add_tones(signal, start, length, &row, 1, level_db + twist_db / 2.0f);
+  add_tones(signal, start, length, &column, 1, level_db - twist_db / 2.0f);
+}
+
+static void add_tones(float* signal, size_t start, size_t length, const float* frequencies, int count, float level_db)
+{
+  float amplitude = powf(10.0f, level_db / 20.0f);
+  size_t i = 0;
+  int k = 0;
+
+  for(i=0; i < length; i++) {
+    for(k=0; k < count; k++)
+      signal[start + i] += amplitude * sinf(2.0f * (float) M_PI * frequencies[k] * i / PIPHONED_DTMF_SAMPLE_RATE);
+  }
+}
+
+/**
+ * Something speech-like: a gliding fundamental with its harmonics,
+ * cut into syllables. Harmonics regularly pass DTMF frequencies,
+ * which the detector must not take as keys.
+ */
+static void add_voice(float* signal, size_t length)
+{
+  double phase = 0.0;
+  size_t i = 0;
+  int k = 0;
+
+  for(i=0; i < length; i++) {
+    double t = (double) i / PIPHONED_DTMF_SAMPLE_RATE;
+    double f0 = 130.0 + 40.0 * sin(2.0 * M_PI * 0.7 * t);
+    double envelope = 0.5 * (1.0 - cos(2.0 * M_PI * 4.0 * t)); /* Four syllables a second */
+    double sample = 0.0;
+
+    phase += 2.0 * M_PI * f0 / PIPHONED_DTMF_SAMPLE_RATE;
+    for(k=1; k * f0 < PIPHONED_DTMF_SAMPLE_RATE / 2; k++)
+      sample += sin(k * phase) / k;
+
+    signal[i] += 0.2 * envelope * sample;
+  }
+}
+
+/**
+ * Adds white noise `snr_db` below the power of the signal.
+ */
+static void add_noise(float* signal, size_t length, float snr_db)
+{
+  uint32_t state = 2463534242u;
+  double power = 0.0;
+  float amplitude = 0.0f;
+  size_t i = 0;
+
+  for(i=0; i < length; i++)
+    power += signal[i] * signal[i];
+
+  /* Uniform noise in [-a, a] has a power of a²/3 */
+  amplitude = sqrtf(3.0f * power / length / powf(10.0f, snr_db / 10.0f));
+
+  for(i=0; i < length; i++) {
+    state ^= state << 13; /* xorshift32 */
+    state ^= state >> 17;
+    state ^= state << 5;
+    signal[i] += amplitude * (2.0f * state / 4294967295.0f - 1.0f);
+  }
+}
+
+/***************************************
+ * WAV files
+ ***************************************/
+
+static bool write_wav(const char* path, const float* signal, size_t length)
+{
+  unsigned char header[44];
+  FILE* p_file = NULL;
+  size_t i = 0;
+
+  p_file = fopen(path, "wb");
+  if (!p_file) {
+    fprintf(stderr, "Cannot write '%s': %m\n", path);
+    return false;
+  }
+
+  memcpy(header, "RIFF", 4);
+  put32(header + 4, 36 + 2 * length);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put32(header + 16, 16);
+  put16(header + 20, 1); /* PCM */
+  put16(header + 22, 1); /* Mono */
+  put32(header + 24, PIPHONED_DTMF_SAMPLE_RATE);
+  put32(header + 28, 2 * PIPHONED_DTMF_SAMPLE_RATE);
+  put16(header + 32, 2);
+  put16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  put32(header + 40, 2 * length);
+  fwrite(header, 44, 1, p_file);
+
+  for(i=0; i < length; i++) {
+    float value = signal[i] * 32767.0f;
+    unsigned char bytes[2];
+
+    if (value > 32767.0f)
+      value = 32767.0f;
+    else if (value < -32768.0f)
+      value = -32768.0f;
+
+    put16(bytes, (uint16_t) (int16_t) lrintf(value));
+    fwrite(bytes, 2, 1, p_file);
+  }
+
+  fclose(p_file);
+  return true;
+}
+
+/**
+ * Reads a 8 kHz mono 16 bit PCM WAV file. Returns the samples, to be
+ * freed by the caller, or NULL on error.
+ */
+static int16_t* read_wav(const char* path, size_t* p_length)
+{
+  unsigned char chunk[8];
+  unsigned char format[16];
+  bool has_format = false;
+  int16_t* samples = NULL;
+  FILE* p_file = NULL;
+  size_t i = 0;
+
+  p_file = fopen(path, "rb");
+  if (!p_file) {
+    fprintf(stderr, "Cannot open '%s': %m\n", path);
+    return NULL;
+  }
+
+  if (fread(chunk, 8, 1, p_file) != 1 || memcmp(chunk, "RIFF", 4) != 0
+      || fread(chunk, 4, 1, p_file) != 1 || memcmp(chunk, "WAVE", 4) != 0) {
+    fprintf(stderr, "'%s' is not a WAV file.\n", path);
+    fclose(p_file);
+    return NULL;
+  }
+
+  while (fread(chunk, 8, 1, p_file) == 1) {
+    unsigned long size = get32(chunk + 4);
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+      if (fread(format, 16, 1, p_file) != 1)
+        break;
+      fseek(p_file, size - 16 + (size & 1), SEEK_CUR);
+      has_format = true;
+    }
+    else if (memcmp(chunk, "data", 4) == 0) {
+      if (!has_format || get16(format) != 1 || get16(format + 2) != 1 || get32(format + 4) != PIPHONED_DTMF_SAMPLE_RATE || get16(format + 14) != 16) {
+        fprintf(stderr, "'%s' is not 8 kHz mono 16 bit PCM.\n", path);
+        break;
+      }
+
+      *p_length = size / 2;
+      samples = (int16_t*) malloc(*p_length * sizeof(int16_t));
+      for(i=0; i < *p_length; i++) {
+        unsigned char bytes[2];
+
+        if (fread(bytes, 2, 1, p_file) != 1) {
+          *p_length = i;
+          break;
+        }
+        samples[i] = (int16_t) get16(bytes);
+      }
+
+      fclose(p_file);
+      return samples;
+    }
+    else {
+      fseek(p_file, size + (size & 1), SEEK_CUR);
+    }
+  }
+
+  if (!samples)
+    fprintf(stderr, "'%s' has no audio data.\n", path);
+
+  fclose(p_file);
+  return NULL;
+}
+
+/* WAV files are little endian, whatever the machine is */
+
+static void put16(unsigned char* target, unsigned int value)
+{
+  target[0] = value & 0xff;
+  target[1] = (value >> 8) & 0xff;
+}
+
+static void put32(unsigned char* target, unsigned long value)
+{
+  put16(target, value & 0xffff);
+  put16(target + 2, (value >> 16) & 0xffff);
+}
+
+static unsigned int get16(const unsigned char* source)
+{
+  return source[0] | (source[1] << 8);
+}
+
+static unsigned long get32(const unsigned char* source)
+{
+  return get16(source) | ((unsigned long) get16(source + 2) << 16);
+}
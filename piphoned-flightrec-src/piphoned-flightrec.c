@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "flightrec.h"
+
+/* Names for the linphone enums recorded in the file. Kept here so
+ * that this program does not need linphone at all. */
+static const char* s_call_states[] = {
+  "Idle", "IncomingReceived", "OutgoingInit", "OutgoingProgress",
+  "OutgoingRinging", "OutgoingEarlyMedia", "Connected", "StreamsRunning",
+  "Pausing", "Paused", "Resuming", "Refered", "Error", "End",
+  "PausedByRemote", "UpdatedByRemote", "IncomingEarlyMedia", "Updating",
+  "Released"
+};
+static const char* s_registration_states[] = {
+  "None", "Progress", "Ok", "Cleared", "Failed"
+};
+static const char* s_errors[] = {
+  "unknown", "invalid SIP URI", "INVITE failed", "call error",
+  "sound device unusable", "GPIO poll failed", "ZRTP SAS token file"
+};
+static const char* s_load_levels[] = {
+  "normal", "reduced bitrate", "no echo canceller", "minimum bitrate"
+};
+static const char* s_startup_phases[] = {
+  "config file", "user lookup", "wiringPi", "gpio edge", "SIP core",
+  "sound probe", "registration", "whole startup"
+};
+
+#define NAME(table, index) ((index) < sizeof(table) / sizeof(table[0]) ? table[(index)] : "?")
+
+static void print_event(const struct Piphoned_FlightRec_Header* p_header, const struct Piphoned_FlightRec_Event* p_event, uint64_t previous);
+
+int main(int argc, char* argv[])
+{
+  FILE* p_file = NULL;
+  struct Piphoned_FlightRec_Header header;
+  struct Piphoned_FlightRec_Event* events = NULL;
+  uint32_t count = 0;
+  uint32_t i = 0;
+  uint64_t previous = 0;
+  struct stat fileinfo;
+
+  if (argc != 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+    printf("Usage: %s FILE\n\nPrints the events recorded in the piphoned flight recorder FILE\n(see the 'flightrecorder' configuration option), oldest first.\n", argv[0]);
+    return argc == 2 ? 0 : 1;
+  }
+
+  p_file = fopen(argv[1], "rb");
+  if (!p_file) {
+    fprintf(stderr, "Cannot open '%s': %m\n", argv[1]);
+    return 2;
+  }
+
+  if (fread(&header, sizeof(header), 1, p_file) != 1 || header.magic != PIPHONED_FLIGHTREC_MAGIC) {
+    fprintf(stderr, "'%s' is not a piphoned flight recorder file.\n", argv[1]);
+    fclose(p_file);
+    return 2;
+  }
+  if (header.version != PIPHONED_FLIGHTREC_VERSION || header.event_size != sizeof(struct Piphoned_FlightRec_Event)) {
+    fprintf(stderr, "Unsupported flight recorder file version %u.\n", header.version);
+    fclose(p_file);
+    return 2;
+  }
+
+  /* The capacity sizes the allocation and masks the ring index */
+  if (header.capacity == 0
+      || header.capacity > PIPHONED_FLIGHTREC_MAX_EVENTS
+      || (header.capacity & (header.capacity - 1)) != 0
+      || fstat(fileno(p_file), &fileinfo) != 0
+      || (size_t) fileinfo.st_size != sizeof(header) + (size_t) header.capacity * sizeof(struct Piphoned_FlightRec_Event)) {
+    fprintf(stderr, "Flight recorder file has an invalid capacity of %u events for its size.\n", header.capacity);
+    fclose(p_file);
+    return 2;
+  }
+
+  events = (struct Piphoned_FlightRec_Event*) malloc(header.capacity * sizeof(struct Piphoned_FlightRec_Event));
+  if (fread(events, sizeof(struct Piphoned_FlightRec_Event), header.capacity, p_file) != header.capacity) {
+    fprintf(stderr, "Flight recorder file is truncated.\n");
+    free(events);
+    fclose(p_file);
+    return 2;
+  }
+  fclose(p_file);
+
+  count = header.head < header.capacity ? header.head : header.capacity;
+  printf("--- %u of %u recorded events ---\n", count, header.head);
+
+  for(i = header.head - count; i != header.head; i++) {
+    const struct Piphoned_FlightRec_Event* p_event = &events[i & (header.capacity - 1)];
+
+    if (p_event->sequence != i + 1) /* Torn write during a crash */
+      continue;
+
+    print_event(&header, p_event, previous);
+    previous = p_event->timestamp;
+  }
+
+  printf("--- End of recorded events ---\n");
+
+  free(events);
+  return 0;
+}
+
+/**
+ * Prints a single event with its wall clock time and the time
+ * passed since the previous event. Wall clock times are derived
+ * from the clock pair of the last startup and are wrong for events
+ * recorded before a reboot.
+ */
+static void print_event(const struct Piphoned_FlightRec_Header* p_header, const struct Piphoned_FlightRec_Event* p_event, uint64_t previous)
+{
+  uint64_t realtime = p_header->realtime_base - (p_header->monotonic_base - p_event->timestamp);
+  time_t seconds = realtime / 1000000000ULL;
+  char timebuf[64];
+  double delta = previous ? (double) (int64_t) (p_event->timestamp - previous) / 1000000.0 : 0.0;
+
+  strftime(timebuf, 64, "%Y-%m-%dT%H:%M:%S", localtime(&seconds));
+  printf("%s.%06lu %+12.3fms  ", timebuf, (unsigned long) (realtime % 1000000000ULL) / 1000, delta);
+
+  switch (p_event->type) {
+  case PIPHONED_FLIGHTREC_STARTUP:
+    printf("STARTUP      pid %u\n", p_event->arg2);
+    break;
+  case PIPHONED_FLIGHTREC_SHUTDOWN:
+    printf("SHUTDOWN\n");
+    break;
+  case PIPHONED_FLIGHTREC_GPIO_EDGE:
+    printf("GPIO         edge on pin %u\n", p_event->arg1);
+    break;
+  case PIPHONED_FLIGHTREC_DIGIT:
+    printf("DIGIT        %u (line %u)\n", p_event->arg1, p_event->arg2 + 1);
+    break;
+  case PIPHONED_FLIGHTREC_HOOK:
+    printf("HOOK         %s (line %u)\n", p_event->arg1 ? "hung up" : "lifted", p_event->arg2 + 1);
+    break;
+  case PIPHONED_FLIGHTREC_CALL_STATE:
+    printf("CALL         %s (call %08x)\n", NAME(s_call_states, p_event->arg1), p_event->arg2);
+    break;
+  case PIPHONED_FLIGHTREC_REGISTRATION:
+    printf("REGISTER     %s (proxy %u)\n", NAME(s_registration_states, p_event->arg1), p_event->arg2 + 1);
+    break;
+  case PIPHONED_FLIGHTREC_ERROR:
+    printf("ERROR        %s (%u)\n", NAME(s_errors, p_event->arg1), p_event->arg2);
+    break;
+  case PIPHONED_FLIGHTREC_FLASH:
+    printf("FLASH        %u ms on hook (line %u)\n", p_event->arg1, p_event->arg2 + 1);
+    break;
+  case PIPHONED_FLIGHTREC_LOAD_LEVEL:
+    printf("LOAD         %s (system CPU %u%%, piphoned CPU %u%%, late packets %.1f%%)\n",
+           NAME(s_load_levels, p_event->arg1), p_event->arg2 & 0xff, (p_event->arg2 >> 8) & 0xff, (p_event->arg2 >> 16) / 10.0);
+    break;
+  case PIPHONED_FLIGHTREC_STARTUP_PHASE:
+    if (p_event->arg1 >> 8)
+      printf("PHASE        %s took %u ms (line %u)\n", NAME(s_startup_phases, p_event->arg1 & 0xff), p_event->arg2, p_event->arg1 >> 8);
+    else
+      printf("PHASE        %s took %u ms\n", NAME(s_startup_phases, p_event->arg1 & 0xff), p_event->arg2);
+    break;
+  default:
+    printf("UNKNOWN      type %u (%u, %u)\n", p_event->type, p_event->arg1, p_event->arg2);
+    break;
+  }
+}
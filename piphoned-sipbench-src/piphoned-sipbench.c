@@ -0,0 +1,1300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "flightrec.h"
+
+/**
+ * Loopback call benchmark. Starts a minimal SIP registrar and
+ * stateless proxy on 127.0.0.1 and two piphoned instances with the
+ * real linphone backend, file audio and simulated hardware (the
+ * `simulate` command). Then it places calls from the first to the
+ * second instance, driving their handsets over their standard input
+ * and watching their state through their flight recorder files. All
+ * timestamps are CLOCK_MONOTONIC, which all processes share.
+ *
+ * The proxy only understands what linphone sends over UDP on the
+ * loopback interface: one Via per header line, no compact header
+ * forms except "v", no authentication.
+ */
+
+/* Linphone enum values as recorded in the flight recorder. Kept here
+ * so that this program does not need linphone at all. */
+#define CALL_INCOMING_RECEIVED 1
+#define CALL_STREAMS_RUNNING 7
+#define CALL_RELEASED 18
+#define NUM_CALL_STATES 19
+#define REGISTRATION_OK 2
+
+#define MAX_MESSAGE 8192     /* Largest SIP datagram handled */
+#define MAX_REGISTRATIONS 8  /* Users the registrar can hold */
+#define CALLER_USER "100"
+#define CALLEE_USER "200"
+#define STARTUP_TIMEOUT 30000 /* Milliseconds to wait for registration */
+#define STEP_TIMEOUT 10000    /* Milliseconds to wait for each call step */
+#define CALL_HOLD_TIME 100    /* Milliseconds to stay in the call */
+#define IDLE_TIME 50          /* Milliseconds to stay idle between calls */
+
+struct Registration
+{
+  bool used;
+  char user[64];              /*< User part of the registered address */
+  struct sockaddr_in address; /*< Where to send requests for `user` */
+  uint64_t first_register;    /*< When the first REGISTER arrived */
+};
+
+/**
+ * The registrar/proxy and what it has seen so far.
+ */
+struct Proxy
+{
+  int fd;
+  int port;
+  char address[64]; /*< "127.0.0.1:port" */
+  struct Registration registrations[MAX_REGISTRATIONS];
+
+  unsigned long invites;    /*< Initial INVITEs seen (retransmissions not counted) */
+  uint64_t last_invite;
+  char invite_callid[256];
+  unsigned long invite_oks; /*< 200 OKs to INVITEs seen */
+  uint64_t last_invite_ok;
+  char invite_ok_callid[256];
+  unsigned long byes;       /*< BYEs seen */
+  unsigned long forwarded;  /*< Messages forwarded */
+  unsigned long dropped;    /*< Messages not understood */
+};
+
+/**
+ * A piphoned instance under test.
+ */
+struct Instance
+{
+  const char* name;
+  const char* user;
+  int sip_port;
+  int audio_port;
+  pid_t pid;
+  FILE* p_control;  /*< Its standard input */
+  char flightrec_path[PATH_MAX];
+
+  struct Piphoned_FlightRec_Header* p_header; /*< Mapped flight recorder, NULL until it exists */
+  size_t mapping_size;
+  uint32_t read_index; /*< Next flight recorder event to process */
+
+  unsigned long call_states[NUM_CALL_STATES];  /*< How often each call state was entered */
+  uint64_t call_state_time[NUM_CALL_STATES];   /*< When each call state was last entered */
+  uint64_t registered_at;                      /*< When the first registration succeeded */
+  uint64_t spawned_at;
+
+  unsigned long cpu_ticks_start; /*< CPU time used when the calls started */
+  long rss_start;                /*< RSS in kB when the calls started */
+};
+
+/**
+ * Latency samples of one kind, in milliseconds.
+ */
+struct LatencySamples
+{
+  double* samples;
+  unsigned int count;
+};
+
+static char s_workdir[64];
+static struct Proxy s_proxy;
+static struct Instance s_caller = { .name = "caller", .user = CALLER_USER };
+static struct Instance s_callee = { .name = "callee", .user = CALLEE_USER };
+
+static bool setup_proxy(int port);
+static void handle_message(char* message, size_t length, const struct sockaddr_in* p_from);
+static void handle_register(char* message, const char* headers_end, const struct sockaddr_in* p_from);
+static void forward_request(char* message, const char* headers_end, size_t length, const struct sockaddr_in* p_from);
+static void forward_response(char* message, const char* headers_end, size_t length);
+static void send_reply(char* message, const char* headers_end, const struct sockaddr_in* p_from, const char* status, const char* extra_headers);
+static char* next_line(char* line, const char* headers_end);
+static bool header_is(const char* line, const char* name, const char* compact);
+static const char* header_value(const char* line);
+static void copy_header_value(const char* line, char* target, size_t size);
+static char* append(char* target, const char* end, const char* format, ...);
+static char* append_via_with_source(char* target, const char* end, const char* line, const char* line_end, const struct sockaddr_in* p_from);
+static bool parse_uri(const char* uri, char* user, size_t user_size, char* host, size_t host_size, int* p_port);
+static struct Registration* find_registration(const char* user);
+static bool spawn_instance(struct Instance* p_instance, const char* piphoned, int proxy_port);
+static bool write_instance_config(struct Instance* p_instance, int proxy_port, char* path);
+static bool write_silence(const char* path);
+static void update_instance(struct Instance* p_instance);
+static void pump(int timeout_ms);
+static bool wait_counter(const unsigned long* p_counter, unsigned long old_value, unsigned int timeout_ms);
+static void send_command(struct Instance* p_instance, const char* command);
+static bool run_call(unsigned int number, struct LatencySamples* p_hookoff, struct LatencySamples* p_answer, struct LatencySamples* p_media);
+static unsigned long cpu_ticks(pid_t pid);
+static long rss_kb(pid_t pid);
+static void stop_instances();
+static void remove_workdir();
+static uint64_t now_ns();
+static double ns_to_ms(uint64_t ns);
+static void report(const char* name, struct LatencySamples* p_samples);
+static int compare_doubles(const void* p_a, const void* p_b);
+static void print_help(const char* progname);
+
+int main(int argc, char* argv[])
+{
+  unsigned int calls = 100;
+  int port = 15060;
+  bool keep = false;
+  int option = 0;
+  unsigned int i = 0;
+  int retval = 0;
+  struct LatencySamples registration = { NULL, 0 };
+  struct LatencySamples hookoff = { NULL, 0 };
+  struct LatencySamples answer = { NULL, 0 };
+  struct LatencySamples media = { NULL, 0 };
+  struct Instance* instances[2] = { &s_caller, &s_callee };
+  long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+  while ((option = getopt(argc, argv, "hkn:p:")) > 0) { /* Single = intended */
+    switch(option) {
+    case 'h':
+      print_help(argv[0]);
+      return 0;
+    case 'k':
+      keep = true;
+      break;
+    case 'n':
+      calls = atoi(optarg);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    default: /* '?' */
+      fprintf(stderr, "Invalid option encountered, see -h.\n");
+      return 1;
+    }
+  }
+
+  if (optind >= argc || calls == 0 || port <= 0 || port > 65000) {
+    print_help(argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  strcpy(s_workdir, "/tmp/piphoned-sipbench-XXXXXX");
+  if (!mkdtemp(s_workdir)) {
+    fprintf(stderr, "Cannot create working directory: %m\n");
+    return 2;
+  }
+
+  if (!setup_proxy(port)) {
+    retval = 2;
+    goto finish;
+  }
+
+  /* Port layout: proxy, caller and callee SIP, then RTP further up */
+  s_caller.sip_port = port + 1;
+  s_caller.audio_port = port + 10;
+  s_callee.sip_port = port + 2;
+  s_callee.audio_port = port + 20;
+
+  if (!spawn_instance(&s_caller, argv[optind], port) || !spawn_instance(&s_callee, argv[optind], port)) {
+    retval = 2;
+    goto finish;
+  }
+
+  /* Wait for both to register */
+  for(i=0; i < STARTUP_TIMEOUT && (!s_caller.registered_at || !s_callee.registered_at); i++)
+    pump(1);
+
+  if (!s_caller.registered_at || !s_callee.registered_at) {
+    fprintf(stderr, "The piphoned instances did not register within %d seconds. See %s/*.out.\n", STARTUP_TIMEOUT / 1000, s_workdir);
+    keep = true;
+    retval = 3;
+    goto finish;
+  }
+
+  registration.samples = (double*) malloc(2 * sizeof(double));
+  for(i=0; i < 2; i++) {
+    struct Registration* p_registration = find_registration(instances[i]->user);
+    if (p_registration)
+      registration.samples[registration.count++] = ns_to_ms(instances[i]->registered_at - p_registration->first_register);
+
+    printf("%s: registered %.3fms after start\n", instances[i]->name, ns_to_ms(instances[i]->registered_at - instances[i]->spawned_at));
+    instances[i]->cpu_ticks_start = cpu_ticks(instances[i]->pid);
+    instances[i]->rss_start = rss_kb(instances[i]->pid);
+  }
+
+  /* Calls */
+  hookoff.samples = (double*) malloc(calls * sizeof(double));
+  answer.samples = (double*) malloc(calls * sizeof(double));
+  media.samples = (double*) malloc(calls * sizeof(double));
+
+  for(i=0; i < calls; i++) {
+    if (!run_call(i + 1, &hookoff, &answer, &media)) {
+      keep = true;
+      retval = 4;
+      break;
+    }
+
+    if ((i + 1) % 100 == 0) {
+      printf("%u calls done\n", i + 1);
+      fflush(stdout);
+    }
+  }
+
+  /* Report */
+  printf("\nCompleted %u of %u calls, %lu SIP messages forwarded, %lu dropped.\n\n", i, calls, s_proxy.forwarded, s_proxy.dropped);
+  report("REGISTER to 200 OK", &registration);
+  report("hook-off to INVITE", &hookoff);
+  report("INVITE to 200 OK", &answer);
+  report("200 OK to media", &media);
+  printf("\n");
+
+  for(i=0; i < 2; i++) {
+    unsigned long ticks = cpu_ticks(instances[i]->pid) - instances[i]->cpu_ticks_start;
+    long rss = rss_kb(instances[i]->pid);
+
+    printf("%-8s CPU %.3fms/call  RSS %ldkB -> %ldkB (%+.3fkB/call)\n",
+           instances[i]->name,
+           hookoff.count ? ticks * 1000.0 / ticks_per_second / hookoff.count : 0.0,
+           instances[i]->rss_start, rss,
+           hookoff.count ? (double) (rss - instances[i]->rss_start) / hookoff.count : 0.0);
+  }
+
+ finish:
+  stop_instances();
+
+  if (s_proxy.fd > 0)
+    close(s_proxy.fd);
+
+  if (keep)
+    printf("Working directory kept: %s\n", s_workdir);
+  else
+    remove_workdir();
+
+  free(registration.samples);
+  free(hookoff.samples);
+  free(answer.samples);
+  free(media.samples);
+
+  return retval;
+}
+
+/**
+ * Runs a single call from the caller to the callee and records its
+ * latencies.
+ */
+static bool run_call(unsigned int number, struct LatencySamples* p_hookoff, struct LatencySamples* p_answer, struct LatencySamples* p_media)
+{
+  unsigned long invites = s_proxy.invites;
+  unsigned long invite_oks = s_proxy.invite_oks;
+  unsigned long byes = s_proxy.byes;
+  unsigned long incoming = s_callee.call_states[CALL_INCOMING_RECEIVED];
+  unsigned long streams = s_caller.call_states[CALL_STREAMS_RUNNING];
+  unsigned long caller_released = s_caller.call_states[CALL_RELEASED];
+  unsigned long callee_released = s_callee.call_states[CALL_RELEASED];
+  uint64_t lifted = 0;
+  unsigned int i = 0;
+
+  send_command(&s_caller, "dial " CALLEE_USER);
+  lifted = now_ns();
+  send_command(&s_caller, "lift");
+
+  if (!wait_counter(&s_proxy.invites, invites, STEP_TIMEOUT)) {
+    fprintf(stderr, "Call %u: caller sent no INVITE.\n", number);
+    return false;
+  }
+  p_hookoff->samples[p_hookoff->count++] = ns_to_ms(s_proxy.last_invite - lifted);
+
+  if (!wait_counter(&s_callee.call_states[CALL_INCOMING_RECEIVED], incoming, STEP_TIMEOUT)) {
+    fprintf(stderr, "Call %u: callee did not ring.\n", number);
+    return false;
+  }
+  send_command(&s_callee, "lift");
+
+  if (!wait_counter(&s_proxy.invite_oks, invite_oks, STEP_TIMEOUT)) {
+    fprintf(stderr, "Call %u: callee did not answer.\n", number);
+    return false;
+  }
+  p_answer->samples[p_answer->count++] = ns_to_ms(s_proxy.last_invite_ok - s_proxy.last_invite);
+
+  if (!wait_counter(&s_caller.call_states[CALL_STREAMS_RUNNING], streams, STEP_TIMEOUT)) {
+    fprintf(stderr, "Call %u: no media streams on the caller side.\n", number);
+    return false;
+  }
+  p_media->samples[p_media->count++] = ns_to_ms(s_caller.call_state_time[CALL_STREAMS_RUNNING] - s_proxy.last_invite_ok);
+
+  for(i=0; i < CALL_HOLD_TIME; i++)
+    pump(1);
+
+  send_command(&s_caller, "hangup");
+  if (!wait_counter(&s_proxy.byes, byes, STEP_TIMEOUT)) {
+    fprintf(stderr, "Call %u: caller sent no BYE.\n", number);
+    return false;
+  }
+  send_command(&s_callee, "hangup");
+
+  if (!wait_counter(&s_caller.call_states[CALL_RELEASED], caller_released, STEP_TIMEOUT) ||
+      !wait_counter(&s_callee.call_states[CALL_RELEASED], callee_released, STEP_TIMEOUT)) {
+    fprintf(stderr, "Call %u: call was not released.\n", number);
+    return false;
+  }
+
+  for(i=0; i < IDLE_TIME; i++)
+    pump(1);
+
+  return true;
+}
+
+/***************************************
+ * Registrar and proxy
+ ***************************************/
+
+static bool setup_proxy(int port)
+{
+  struct sockaddr_in address;
+
+  memset(&s_proxy, '\0', sizeof(struct Proxy));
+  s_proxy.port = port;
+  sprintf(s_proxy.address, "127.0.0.1:%d", port);
+
+  s_proxy.fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s_proxy.fd < 0) {
+    fprintf(stderr, "Cannot create socket: %m\n");
+    return false;
+  }
+
+  memset(&address, '\0', sizeof(struct sockaddr_in));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(s_proxy.fd, (struct sockaddr*) &address, sizeof(struct sockaddr_in)) < 0) {
+    fprintf(stderr, "Cannot bind to %s: %m\n", s_proxy.address);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Handles a single datagram received by the proxy.
+ */
+static void handle_message(char* message, size_t length, const struct sockaddr_in* p_from)
+{
+  char* headers_end = strstr(message, "\r\n\r\n");
+
+  if (length < 12 || !headers_end) { /* Keepalives and garbage */
+    s_proxy.dropped++;
+    return;
+  }
+  headers_end += 2; /* Keep the CRLF of the last header */
+
+  if (strncmp(message, "SIP/2.0 ", 8) == 0)
+    forward_response(message, headers_end, length);
+  else if (strncmp(message, "REGISTER ", 9) == 0)
+    handle_register(message, headers_end, p_from);
+  else
+    forward_request(message, headers_end, length, p_from);
+}
+
+/**
+ * Registers (or unregisters, for an expiry of 0) the user in the To
+ * header at the address the request came from, and answers 200 OK.
+ */
+static void handle_register(char* message, const char* headers_end, const struct sockaddr_in* p_from)
+{
+  char* line = NULL;
+  char user[64];
+  char host[256];
+  int port = 0;
+  bool unregister = false;
+  struct Registration* p_registration = NULL;
+  int i = 0;
+
+  memset(user, '\0', 64);
+
+  for(line = next_line(message, headers_end); line; line = next_line(line, headers_end)) {
+    if (header_is(line, "To", "t")) {
+      char value[512];
+      copy_header_value(line, value, 512);
+      parse_uri(value, user, 64, host, 256, &port);
+    }
+    else if (header_is(line, "Expires", NULL) && atoi(header_value(line)) == 0) {
+      unregister = true;
+    }
+    else if (header_is(line, "Contact", "m")) {
+      const char* expires = strstr(line, "expires=");
+      if (expires && expires < strstr(line, "\r\n") && atoi(expires + 8) == 0)
+        unregister = true;
+    }
+  }
+
+  if (user[0] == '\0') {
+    s_proxy.dropped++;
+    return;
+  }
+
+  p_registration = find_registration(user);
+  if (!p_registration && !unregister) {
+    for(i=0; i < MAX_REGISTRATIONS; i++) {
+      if (!s_proxy.registrations[i].used) {
+        p_registration = &s_proxy.registrations[i];
+        memset(p_registration, '\0', sizeof(struct Registration));
+        p_registration->used = true;
+        strcpy(p_registration->user, user);
+        p_registration->first_register = now_ns();
+        break;
+      }
+    }
+  }
+
+  if (p_registration) {
+    if (unregister)
+      p_registration->used = false;
+    else
+      p_registration->address = *p_from;
+  }
+
+  send_reply(message, headers_end, p_from, "200 OK", unregister ? "Expires: 0\r\n" : "Expires: 3600\r\n");
+}
+
+/**
+ * Forwards a request to the registered address of the user in the
+ * Request-URI, or to the address in the Request-URI itself for
+ * in-dialog requests. Adds a Via and, for initial INVITEs, a
+ * Record-Route so that the BYE passes here as well.
+ */
+static void forward_request(char* message, const char* headers_end, size_t length, const struct sockaddr_in* p_from)
+{
+  char output[MAX_MESSAGE];
+  char* p_out = output;
+  const char* end = output + MAX_MESSAGE;
+  char method[32];
+  char uri[512];
+  char user[64];
+  char host[256];
+  char branch[128];
+  char callid[256];
+  int port = 0;
+  bool has_to_tag = false;
+  bool first_via = true;
+  struct sockaddr_in target;
+  char* line = NULL;
+  char* first_line_end = strstr(message, "\r\n");
+
+  memset(branch, '\0', 128);
+  memset(callid, '\0', 256);
+
+  if (sscanf(message, "%31s %511s", method, uri) != 2 || !parse_uri(uri, user, 64, host, 256, &port)) {
+    s_proxy.dropped++;
+    return;
+  }
+
+  memset(&target, '\0', sizeof(struct sockaddr_in));
+  target.sin_family = AF_INET;
+
+  if (port == s_proxy.port && (strcmp(host, "127.0.0.1") == 0 || strcmp(host, "localhost") == 0)) {
+    struct Registration* p_registration = find_registration(user);
+    if (!p_registration) {
+      if (strcmp(method, "ACK") != 0)
+        send_reply(message, headers_end, p_from, "404 Not Found", "");
+      return;
+    }
+    target = p_registration->address;
+  }
+  else {
+    if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+      s_proxy.dropped++;
+      return;
+    }
+    target.sin_port = htons(port);
+  }
+
+  /* Collect what is needed from the headers first */
+  for(line = next_line(message, headers_end); line; line = next_line(line, headers_end)) {
+    if (header_is(line, "Via", "v") && branch[0] == '\0') {
+      const char* p_branch = strstr(line, "branch=");
+      if (p_branch)
+        sscanf(p_branch + 7, "%127[^;\r\n ]", branch);
+    }
+    else if (header_is(line, "To", "t")) {
+      const char* p_tag = strstr(line, ";tag=");
+      has_to_tag = p_tag && p_tag < strstr(line, "\r\n");
+    }
+    else if (header_is(line, "Call-ID", "i")) {
+      copy_header_value(line, callid, 256);
+    }
+  }
+
+  /* Request line and our own Via. The branch is derived from the
+   * incoming one, so that CANCEL and ACK match the INVITE. */
+  p_out = append(p_out, end, "%.*s\r\n", (int) (first_line_end - message), message);
+  p_out = append(p_out, end, "Via: SIP/2.0/UDP %s;branch=z9hG4bK-sb-%s\r\n", s_proxy.address, branch);
+  if (strcmp(method, "INVITE") == 0 && !has_to_tag)
+    p_out = append(p_out, end, "Record-Route: <sip:%s;lr>\r\n", s_proxy.address);
+
+  for(line = next_line(message, headers_end); line; line = next_line(line, headers_end)) {
+    char* line_end = strstr(line, "\r\n") + 2;
+
+    if (header_is(line, "Route", NULL) && strstr(line, s_proxy.address) && strstr(line, s_proxy.address) < line_end)
+      continue; /* That's us */
+
+    if (header_is(line, "Via", "v") && first_via) {
+      p_out = append_via_with_source(p_out, end, line, line_end, p_from);
+      first_via = false;
+      continue;
+    }
+
+    p_out = append(p_out, end, "%.*s", (int) (line_end - line), line);
+  }
+
+  p_out = append(p_out, end, "\r\n");
+  if (p_out + (message + length - (headers_end + 2)) > end) {
+    s_proxy.dropped++;
+    return;
+  }
+  memcpy(p_out, headers_end + 2, message + length - (headers_end + 2));
+  p_out += message + length - (headers_end + 2);
+
+  if (strcmp(method, "INVITE") == 0 && !has_to_tag && strcmp(callid, s_proxy.invite_callid) != 0) {
+    s_proxy.invites++;
+    s_proxy.last_invite = now_ns();
+    strcpy(s_proxy.invite_callid, callid);
+  }
+  else if (strcmp(method, "BYE") == 0) {
+    s_proxy.byes++;
+  }
+
+  sendto(s_proxy.fd, output, p_out - output, 0, (struct sockaddr*) &target, sizeof(struct sockaddr_in));
+  s_proxy.forwarded++;
+}
+
+/**
+ * Removes our Via from a response and sends it to the address in
+ * the next one.
+ */
+static void forward_response(char* message, const char* headers_end, size_t length)
+{
+  char output[MAX_MESSAGE];
+  char* p_out = output;
+  const char* end = output + MAX_MESSAGE;
+  char* line = NULL;
+  char* first_line_end = strstr(message, "\r\n");
+  int via_count = 0;
+  int status = atoi(message + 8);
+  char cseq[64];
+  char callid[256];
+  char host[256];
+  int port = 5060;
+  struct sockaddr_in target;
+
+  memset(cseq, '\0', 64);
+  memset(callid, '\0', 256);
+  memset(host, '\0', 256);
+
+  p_out = append(p_out, end, "%.*s\r\n", (int) (first_line_end - message), message);
+
+  for(line = next_line(message, headers_end); line; line = next_line(line, headers_end)) {
+    char* line_end = strstr(line, "\r\n") + 2;
+
+    if (header_is(line, "Via", "v")) {
+      via_count++;
+
+      if (via_count == 1) {
+        if (!strstr(line, s_proxy.address) || strstr(line, s_proxy.address) > line_end) {
+          s_proxy.dropped++; /* Not sent through us */
+          return;
+        }
+        continue;
+      }
+      else if (via_count == 2) {
+        const char* p_param = NULL;
+
+        /* SIP/2.0/UDP host:port;params */
+        sscanf(header_value(line), "%*s %255[^:;\r\n]:%d", host, &port);
+        if ((p_param = strstr(line, "received=")) && p_param < line_end)
+          sscanf(p_param + 9, "%255[^;\r\n ]", host);
+        if ((p_param = strstr(line, "rport=")) && p_param < line_end)
+          port = atoi(p_param + 6);
+      }
+    }
+    else if (header_is(line, "CSeq", NULL)) {
+      copy_header_value(line, cseq, 64);
+    }
+    else if (header_is(line, "Call-ID", "i")) {
+      copy_header_value(line, callid, 256);
+    }
+
+    p_out = append(p_out, end, "%.*s", (int) (line_end - line), line);
+  }
+
+  memset(&target, '\0', sizeof(struct sockaddr_in));
+  target.sin_family = AF_INET;
+  target.sin_port = htons(port);
+  if (via_count < 2 || inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+    s_proxy.dropped++;
+    return;
+  }
+
+  p_out = append(p_out, end, "\r\n");
+  if (p_out + (message + length - (headers_end + 2)) > end) {
+    s_proxy.dropped++;
+    return;
+  }
+  memcpy(p_out, headers_end + 2, message + length - (headers_end + 2));
+  p_out += message + length - (headers_end + 2);
+
+  if (status == 200 && strstr(cseq, "INVITE") && strcmp(callid, s_proxy.invite_ok_callid) != 0) {
+    s_proxy.invite_oks++;
+    s_proxy.last_invite_ok = now_ns();
+    strcpy(s_proxy.invite_ok_callid, callid);
+  }
+
+  sendto(s_proxy.fd, output, p_out - output, 0, (struct sockaddr*) &target, sizeof(struct sockaddr_in));
+  s_proxy.forwarded++;
+}
+
+/**
+ * Answers a request directly with the given status line and extra
+ * headers (each CRLF-terminated).
+ */
+static void send_reply(char* message, const char* headers_end, const struct sockaddr_in* p_from, const char* status, const char* extra_headers)
+{
+  char output[MAX_MESSAGE];
+  char* p_out = output;
+  const char* end = output + MAX_MESSAGE;
+  char* line = NULL;
+  bool first_via = true;
+
+  p_out = append(p_out, end, "SIP/2.0 %s\r\n", status);
+
+  for(line = next_line(message, headers_end); line; line = next_line(line, headers_end)) {
+    char* line_end = strstr(line, "\r\n") + 2;
+
+    if (header_is(line, "Via", "v")) {
+      if (first_via) {
+        p_out = append_via_with_source(p_out, end, line, line_end, p_from);
+        first_via = false;
+      }
+      else {
+        p_out = append(p_out, end, "%.*s", (int) (line_end - line), line);
+      }
+    }
+    else if (header_is(line, "To", "t")) {
+      const char* p_tag = strstr(line, ";tag=");
+      if (p_tag && p_tag < line_end)
+        p_out = append(p_out, end, "%.*s", (int) (line_end - line), line);
+      else
+        p_out = append(p_out, end, "%.*s;tag=sipbench\r\n", (int) (line_end - 2 - line), line);
+    }
+    else if (header_is(line, "From", "f") || header_is(line, "Call-ID", "i") ||
+             header_is(line, "CSeq", NULL) || header_is(line, "Contact", "m")) {
+      p_out = append(p_out, end, "%.*s", (int) (line_end - line), line);
+    }
+  }
+
+  p_out = append(p_out, end, "%sContent-Length: 0\r\n\r\n", extra_headers);
+
+  sendto(s_proxy.fd, output, p_out - output, 0, (const struct sockaddr*) p_from, sizeof(struct sockaddr_in));
+}
+
+/**
+ * Returns the start of the header line following `line`, or NULL at
+ * the end of the headers. Pass the start of the message to get the
+ * first header.
+ */
+static char* next_line(char* line, const char* headers_end)
+{
+  char* eol = strstr(line, "\r\n");
+
+  if (!eol || eol + 2 >= headers_end)
+    return NULL;
+
+  return eol + 2;
+}
+
+/**
+ * Checks whether the header line is the header `name` or its
+ * compact form `compact` (may be NULL).
+ */
+static bool header_is(const char* line, const char* name, const char* compact)
+{
+  size_t length = strlen(name);
+
+  if (strncasecmp(line, name, length) == 0 && (line[length] == ':' || line[length] == ' '))
+    return true;
+  if (compact && strncasecmp(line, compact, 1) == 0 && (line[1] == ':' || line[1] == ' '))
+    return true;
+
+  return false;
+}
+
+static const char* header_value(const char* line)
+{
+  const char* value = strchr(line, ':') + 1;
+
+  while (*value == ' ')
+    value++;
+
+  return value;
+}
+
+static void copy_header_value(const char* line, char* target, size_t size)
+{
+  const char* value = header_value(line);
+  size_t length = strstr(value, "\r\n") - value;
+
+  if (length >= size)
+    length = size - 1;
+
+  memcpy(target, value, length);
+  target[length] = '\0';
+}
+
+/**
+ * snprintf() to `target`, never writing past `end`. Returns the new
+ * end of the written data.
+ */
+static char* append(char* target, const char* end, const char* format, ...)
+{
+  va_list args;
+  int written = 0;
+
+  va_start(args, format);
+  written = vsnprintf(target, end - target, format, args);
+  va_end(args);
+
+  if (written < 0 || target + written >= end)
+    return (char*) end - 1;
+
+  return target + written;
+}
+
+/**
+ * Copies a Via header line, adding the address the message actually
+ * came from (RFC 3581), so that responses find their way back.
+ */
+static char* append_via_with_source(char* target, const char* end, const char* line, const char* line_end, const struct sockaddr_in* p_from)
+{
+  char address[INET_ADDRSTRLEN];
+  const char* p_rport = strstr(line, ";rport");
+  int length = line_end - 2 - line;
+
+  inet_ntop(AF_INET, &p_from->sin_addr, address, INET_ADDRSTRLEN);
+
+  /* Drop an empty rport parameter, it is filled in below */
+  if (p_rport && p_rport < line_end && (p_rport[6] == ';' || p_rport[6] == '\r')) {
+    target = append(target, end, "%.*s", (int) (p_rport - line), line);
+    line = p_rport + 6;
+    length = line_end - 2 - line;
+  }
+
+  return append(target, end, "%.*s;received=%s;rport=%d\r\n", length, line, address, ntohs(p_from->sin_port));
+}
+
+/**
+ * Splits a SIP URI, optionally in angle brackets, into user, host
+ * and port (5060 if absent).
+ */
+static bool parse_uri(const char* uri, char* user, size_t user_size, char* host, size_t host_size, int* p_port)
+{
+  const char* start = strstr(uri, "sip:");
+  const char* at = NULL;
+  size_t length = 0;
+
+  if (!start)
+    return false;
+  start += 4;
+
+  user[0] = '\0';
+  at = strpbrk(start, "@>;");
+  if (at && *at == '@') {
+    length = at - start;
+    if (length >= user_size)
+      length = user_size - 1;
+    memcpy(user, start, length);
+    user[length] = '\0';
+    start = at + 1;
+  }
+
+  length = strcspn(start, ":;>");
+  if (length >= host_size)
+    length = host_size - 1;
+  memcpy(host, start, length);
+  host[length] = '\0';
+
+  *p_port = start[length] == ':' ? atoi(start + length + 1) : 5060;
+  return true;
+}
+
+static struct Registration* find_registration(const char* user)
+{
+  int i = 0;
+
+  for(i=0; i < MAX_REGISTRATIONS; i++) {
+    if (s_proxy.registrations[i].used && strcmp(s_proxy.registrations[i].user, user) == 0)
+      return &s_proxy.registrations[i];
+  }
+
+  return NULL;
+}
+
+/***************************************
+ * piphoned instances
+ ***************************************/
+
+/**
+ * Writes the instance's configuration file and starts it with the
+ * `simulate` command, its standard input connected to `p_control`
+ * and its output going to NAME.out in the working directory.
+ */
+static bool spawn_instance(struct Instance* p_instance, const char* piphoned, int proxy_port)
+{
+  char config[PATH_MAX];
+  char output[PATH_MAX];
+  int fds[2];
+
+  if (!write_instance_config(p_instance, proxy_port, config))
+    return false;
+
+  sprintf(output, "%s/%s.out", s_workdir, p_instance->name);
+
+  if (pipe(fds) < 0) {
+    fprintf(stderr, "Cannot create pipe: %m\n");
+    return false;
+  }
+
+  p_instance->spawned_at = now_ns();
+  p_instance->pid = fork();
+  if (p_instance->pid < 0) {
+    fprintf(stderr, "Fork failed: %m\n");
+    return false;
+  }
+  else if (p_instance->pid == 0) { /* Child */
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+
+    execl(piphoned, piphoned, "-c", config, "simulate", (char*) NULL);
+    fprintf(stderr, "Cannot execute %s: %m\n", piphoned);
+    _exit(127);
+  }
+
+  /* Parent */
+  close(fds[0]);
+  p_instance->p_control = fdopen(fds[1], "w");
+  return true;
+}
+
+static bool write_instance_config(struct Instance* p_instance, int proxy_port, char* path)
+{
+  char silence[PATH_MAX];
+  FILE* p_file = NULL;
+
+  sprintf(silence, "%s/silence.wav", s_workdir);
+  if (access(silence, R_OK) != 0 && !write_silence(silence))
+    return false;
+
+  sprintf(path, "%s/%s.conf", s_workdir, p_instance->name);
+  p_file = fopen(path, "w");
+  if (!p_file) {
+    fprintf(stderr, "Cannot write %s: %m\n", path);
+    return false;
+  }
+
+  fprintf(p_file, "[General]\n");
+  fprintf(p_file, "pidfile = %s/%s.pid\n", s_workdir, p_instance->name);
+  fprintf(p_file, "phonelog = %s/%s.calls\n", s_workdir, p_instance->name);
+  fprintf(p_file, "messagesdir = %s\n", s_workdir);
+  fprintf(p_file, "zrtp_secrets_file = %s/%s.zrtp\n", s_workdir, p_instance->name);
+  fprintf(p_file, "auto_domain = 127.0.0.1:%d\n", proxy_port);
+  fprintf(p_file, "firewall_policy = no\n");
+  fprintf(p_file, "sip_port = %d\n", p_instance->sip_port);
+  fprintf(p_file, "audio_port = %d\n", p_instance->audio_port);
+  fprintf(p_file, "play_file = %s\n", silence);
+  fprintf(p_file, "record_file = %s/%s.rec.wav\n", s_workdir, p_instance->name);
+  fprintf(p_file, "dial_readback = no\n");
+  fprintf(p_file, "flightrecorder = %s/%s.flightrec\n", s_workdir, p_instance->name);
+  fprintf(p_file, "\n[Loopback]\n");
+  fprintf(p_file, "username = %s\n", p_instance->user);
+  fprintf(p_file, "password = sipbench\n");
+  fprintf(p_file, "displayname = %s\n", p_instance->name);
+  fprintf(p_file, "server = 127.0.0.1:%d\n", proxy_port);
+  fprintf(p_file, "realm = 127.0.0.1\n");
+
+  fclose(p_file);
+
+  sprintf(p_instance->flightrec_path, "%s/%s.flightrec", s_workdir, p_instance->name);
+  return true;
+}
+
+/**
+ * Writes one second of 8 kHz 16-bit mono silence as a WAV file.
+ */
+static bool write_silence(const char* path)
+{
+  FILE* p_file = fopen(path, "wb");
+  uint32_t data_size = 8000 * 2;
+  uint32_t riff_size = 36 + data_size;
+  uint32_t format_size = 16;
+  uint16_t format = 1;   /* PCM */
+  uint16_t channels = 1;
+  uint32_t rate = 8000;
+  uint32_t byte_rate = 8000 * 2;
+  uint16_t block_align = 2;
+  uint16_t bits = 16;
+  char* data = NULL;
+
+  if (!p_file) {
+    fprintf(stderr, "Cannot write %s: %m\n", path);
+    return false;
+  }
+
+  fwrite("RIFF", 1, 4, p_file);
+  fwrite(&riff_size, 4, 1, p_file);
+  fwrite("WAVEfmt ", 1, 8, p_file);
+  fwrite(&format_size, 4, 1, p_file);
+  fwrite(&format, 2, 1, p_file);
+  fwrite(&channels, 2, 1, p_file);
+  fwrite(&rate, 4, 1, p_file);
+  fwrite(&byte_rate, 4, 1, p_file);
+  fwrite(&block_align, 2, 1, p_file);
+  fwrite(&bits, 2, 1, p_file);
+  fwrite("data", 1, 4, p_file);
+  fwrite(&data_size, 4, 1, p_file);
+
+  data = (char*) calloc(data_size, 1);
+  fwrite(data, 1, data_size, p_file);
+  free(data);
+
+  fclose(p_file);
+  return true;
+}
+
+/**
+ * Maps the instance's flight recorder once it exists and processes
+ * all events recorded since the last call, up to the first one that
+ * is still being written.
+ */
+static void update_instance(struct Instance* p_instance)
+{
+  const struct Piphoned_FlightRec_Event* events = NULL;
+  uint32_t head = 0;
+
+  if (!p_instance->p_header) {
+    struct stat info;
+    int fd = open(p_instance->flightrec_path, O_RDONLY);
+    void* p_mapping = NULL;
+
+    if (fd < 0)
+      return;
+
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(struct Piphoned_FlightRec_Header)) {
+      close(fd);
+      return;
+    }
+
+    p_mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p_mapping == MAP_FAILED)
+      return;
+
+    p_instance->p_header = (struct Piphoned_FlightRec_Header*) p_mapping;
+    p_instance->mapping_size = info.st_size;
+
+    if (p_instance->p_header->magic != PIPHONED_FLIGHTREC_MAGIC ||
+        p_instance->p_header->version != PIPHONED_FLIGHTREC_VERSION ||
+        p_instance->p_header->event_size != sizeof(struct Piphoned_FlightRec_Event) ||
+        p_instance->mapping_size < sizeof(struct Piphoned_FlightRec_Header) + p_instance->p_header->capacity * sizeof(struct Piphoned_FlightRec_Event)) {
+      munmap(p_mapping, p_instance->mapping_size); /* Not set up yet */
+      p_instance->p_header = NULL;
+      return;
+    }
+  }
+
+  events = (const struct Piphoned_FlightRec_Event*) (p_instance->p_header + 1);
+  head = __atomic_load_n(&p_instance->p_header->head, __ATOMIC_ACQUIRE);
+
+  if (head - p_instance->read_index > p_instance->p_header->capacity)
+    p_instance->read_index = head - p_instance->p_header->capacity; /* Overrun, should not happen */
+
+  for(; p_instance->read_index != head; p_instance->read_index++) {
+    const struct Piphoned_FlightRec_Event* p_event = &events[p_instance->read_index & (p_instance->p_header->capacity - 1)];
+
+    /* Still being written; picked up again by the next call */
+    if (__atomic_load_n(&p_event->sequence, __ATOMIC_ACQUIRE) != p_instance->read_index + 1)
+      break;
+
+    if (p_event->type == PIPHONED_FLIGHTREC_CALL_STATE && p_event->arg1 < NUM_CALL_STATES) {
+      p_instance->call_states[p_event->arg1]++;
+      p_instance->call_state_time[p_event->arg1] = p_event->timestamp;
+    }
+    else if (p_event->type == PIPHONED_FLIGHTREC_REGISTRATION && p_event->arg1 == REGISTRATION_OK && !p_instance->registered_at) {
+      p_instance->registered_at = p_event->timestamp;
+    }
+  }
+}
+
+/**
+ * Handles the proxy traffic arriving within `timeout_ms` and then
+ * catches up with the flight recorders.
+ */
+static void pump(int timeout_ms)
+{
+  struct pollfd pfd;
+  char message[MAX_MESSAGE];
+  struct sockaddr_in from;
+  socklen_t fromlength = sizeof(struct sockaddr_in);
+  ssize_t length = 0;
+
+  pfd.fd = s_proxy.fd;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, timeout_ms) > 0) {
+    while ((length = recvfrom(s_proxy.fd, message, MAX_MESSAGE - 1, MSG_DONTWAIT, (struct sockaddr*) &from, &fromlength)) > 0) {
+      message[length] = '\0';
+      handle_message(message, length, &from);
+      fromlength = sizeof(struct sockaddr_in);
+    }
+  }
+
+  update_instance(&s_caller);
+  update_instance(&s_callee);
+}
+
+/**
+ * Pumps until the counter differs from `old_value`.
+ *
+ * \returns false on timeout.
+ */
+static bool wait_counter(const unsigned long* p_counter, unsigned long old_value, unsigned int timeout_ms)
+{
+  uint64_t deadline = now_ns() + timeout_ms * 1000000ULL;
+
+  while (*p_counter == old_value) {
+    if (now_ns() > deadline)
+      return false;
+
+    pump(1);
+  }
+
+  return true;
+}
+
+static void send_command(struct Instance* p_instance, const char* command)
+{
+  fprintf(p_instance->p_control, "%s\n", command);
+  fflush(p_instance->p_control);
+}
+
+/**
+ * User plus system CPU time of the process in clock ticks.
+ */
+static unsigned long cpu_ticks(pid_t pid)
+{
+  char path[64];
+  char buf[1024];
+  char* p_stats = NULL;
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  FILE* p_file = NULL;
+
+  sprintf(path, "/proc/%d/stat", pid);
+  p_file = fopen(path, "r");
+  if (!p_file)
+    return 0;
+
+  memset(buf, '\0', 1024);
+  fread(buf, 1, 1023, p_file);
+  fclose(p_file);
+
+  /* The command name may contain spaces; fields are counted after it */
+  p_stats = strrchr(buf, ')');
+  if (!p_stats || sscanf(p_stats + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return 0;
+
+  return utime + stime;
+}
+
+/**
+ * Resident set size of the process in kB.
+ */
+static long rss_kb(pid_t pid)
+{
+  char path[64];
+  char line[256];
+  long rss = 0;
+  FILE* p_file = NULL;
+
+  sprintf(path, "/proc/%d/status", pid);
+  p_file = fopen(path, "r");
+  if (!p_file)
+    return 0;
+
+  while (fgets(line, 256, p_file)) {
+    if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+      break;
+  }
+
+  fclose(p_file);
+  return rss;
+}
+
+/**
+ * Asks both instances to quit and waits for them, keeping the proxy
+ * running so that they can unregister. Kills them if they take too
+ * long.
+ */
+static void stop_instances()
+{
+  struct Instance* instances[2] = { &s_caller, &s_callee };
+  uint64_t deadline = now_ns() + 30000000000ULL;
+  int i = 0;
+
+  for(i=0; i < 2; i++) {
+    if (instances[i]->p_control) {
+      send_command(instances[i], "quit");
+      fclose(instances[i]->p_control);
+      instances[i]->p_control = NULL;
+    }
+  }
+
+  for(i=0; i < 2; i++) {
+    while (instances[i]->pid > 0) {
+      if (waitpid(instances[i]->pid, NULL, WNOHANG) == instances[i]->pid) {
+        instances[i]->pid = 0;
+        break;
+      }
+
+      if (now_ns() > deadline) {
+        fprintf(stderr, "%s did not terminate, killing it.\n", instances[i]->name);
+        kill(instances[i]->pid, SIGKILL);
+        waitpid(instances[i]->pid, NULL, 0);
+        instances[i]->pid = 0;
+        break;
+      }
+
+      if (s_proxy.fd > 0)
+        pump(10);
+      else
+        usleep(10000);
+    }
+
+    if (instances[i]->p_header) {
+      munmap(instances[i]->p_header, instances[i]->mapping_size);
+      instances[i]->p_header = NULL;
+    }
+  }
+}
+
+static void remove_workdir()
+{
+  DIR* p_dir = opendir(s_workdir);
+  struct dirent* p_entry = NULL;
+  char path[PATH_MAX];
+
+  if (!p_dir)
+    return;
+
+  while ((p_entry = readdir(p_dir))) {
+    if (strcmp(p_entry->d_name, ".") == 0 || strcmp(p_entry->d_name, "..") == 0)
+      continue;
+
+    snprintf(path, PATH_MAX, "%s/%s", s_workdir, p_entry->d_name);
+    unlink(path);
+  }
+
+  closedir(p_dir);
+  rmdir(s_workdir);
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double ns_to_ms(uint64_t ns)
+{
+  return (double) (int64_t) ns / 1000000.0;
+}
+
+/**
+ * Prints count, minimum, mean, median, 95th percentile and maximum
+ * of the given samples. Sorts the samples.
+ */
+static void report(const char* name, struct LatencySamples* p_samples)
+{
+  double sum = 0.0;
+  unsigned int i = 0;
+
+  if (p_samples->count == 0) {
+    printf("%-20s no samples\n", name);
+    return;
+  }
+
+  qsort(p_samples->samples, p_samples->count, sizeof(double), compare_doubles);
+
+  for(i=0; i < p_samples->count; i++)
+    sum += p_samples->samples[i];
+
+  printf("%-20s n=%u min=%.3fms mean=%.3fms p50=%.3fms p95=%.3fms max=%.3fms\n",
+         name, p_samples->count, p_samples->samples[0], sum / p_samples->count,
+         p_samples->samples[(p_samples->count - 1) * 50 / 100],
+         p_samples->samples[(p_samples->count - 1) * 95 / 100],
+         p_samples->samples[p_samples->count - 1]);
+}
+
+static int compare_doubles(const void* p_a, const void* p_b)
+{
+  double a = *(const double*) p_a;
+  double b = *(const double*) p_b;
+
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void print_help(const char* progname)
+{
+  printf("Usage:\n\
+%s [-n CALLS] [-p PORT] [-k] PIPHONED\n\
+\n\
+Starts a SIP registrar on 127.0.0.1:PORT and two instances of the\n\
+piphoned executable PIPHONED that register there, then places CALLS\n\
+calls from one to the other and reports signalling and media setup\n\
+latencies as well as CPU time and memory used per call.\n\
+\n\
+Options:\n\
+\n\
+-n CALLS: Number of calls to place (default 100).\n\
+-p PORT: Registrar port (default 15060). The instances use PORT+1,\n\
+         PORT+2 for SIP and ports from PORT+10 for RTP.\n\
+-k: Keep the working directory with the logs and configuration.\n", progname);
+}
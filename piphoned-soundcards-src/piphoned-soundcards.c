@@ -1,6 +1,57 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
 #include <linphone/linphonecore.h>
 
+/* Prefix of the sound devices linphone drives through ALSA, and the
+ * name it gives the ALSA default device. */
+#define ALSA_PREFIX "ALSA: "
+#define ALSA_DEFAULT_NAME "default device"
+
+/* Sample rate the latency benchmark runs at unless given on the
+ * command line; the rate of wideband calls. */
+#define DEFAULT_BENCH_RATE 16000
+
+/* Each period size is streamed this long, with the test click
+ * played after the first second. */
+#define BENCH_SECONDS 3
+
+/* The playback buffer holds this many periods, as with the
+ * sound_buffer the benchmark recommends. */
+#define BENCH_PERIODS 3
+
+/* A captured sample louder than this is the test click coming back */
+#define CLICK_THRESHOLD 8000
+#define CLICK_LENGTH 8
+
+static const unsigned int s_rates[] = {8000, 11025, 16000, 22050, 32000, 44100, 48000};
+static const snd_pcm_format_t s_formats[] = {SND_PCM_FORMAT_U8, SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE};
+static const snd_pcm_uframes_t s_period_sizes[] = {40, 80, 160, 320, 640};
+
+/**
+ * Outcome of streaming at one period size.
+ */
+struct BenchResult
+{
+  snd_pcm_uframes_t period; /*< Period size in frames */
+  bool works;               /*< Could both devices be set up with it? */
+  int xruns;                /*< Over- and underruns while streaming */
+  double latency_ms;        /*< Round trip of the click; negative if it never came back */
+};
+
+static bool alsa_name(const char* device, char* target, size_t size);
+static void probe_device(const char* device);
+static void probe_stream(const char* pcm_name, snd_pcm_stream_t stream);
+static int run_bench(const char* playback, const char* capture, unsigned int rate);
+static bool bench_period(const char* playback, const char* capture, unsigned int rate, struct BenchResult* p_result);
+static int setup_pcm(snd_pcm_t* p_pcm, unsigned int rate, snd_pcm_uframes_t period);
+static double elapsed_ms(const struct timespec* p_start);
+
 int main(int argc, char* argv[])
 {
   LinphoneCoreVTable vtable = {0};
@@ -9,19 +60,351 @@ int main(int argc, char* argv[])
   unsigned int i = 0;
 
   if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
-    printf("This program lists the soundcards piphoned does understand. It accepts no options.");
+    printf("Usage: %s\n"
+           "       %s bench PLAYBACK CAPTURE [RATE]\n\n"
+           "Without arguments, lists the soundcards piphoned does understand along\n"
+           "with the sample rates and formats each one supports natively and how\n"
+           "long it takes to open.\n\n"
+           "`bench' plays a click on the ALSA device PLAYBACK and waits for it on\n"
+           "the ALSA device CAPTURE at several period sizes, counting over- and\n"
+           "underruns, and prints the piphoned.conf settings that worked best.\n"
+           "RATE defaults to %d Hz. Connect the devices with a cable, or use the\n"
+           "snd-aloop module (hw:Loopback,0,0 and hw:Loopback,1,0) or the null\n"
+           "device to try it without sound hardware.\n",
+           argv[0], argv[0], DEFAULT_BENCH_RATE);
     return 0;
   }
 
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    if (argc < 4) {
+      fprintf(stderr, "bench needs a playback and a capture device. See -h.\n");
+      return 1;
+    }
+    return run_bench(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : DEFAULT_BENCH_RATE);
+  }
+
   p_linphone = linphone_core_new(&vtable, NULL, NULL, NULL);
   devices = linphone_core_get_sound_devices(p_linphone);
 
   printf("--- List of detected devices ---\n");
   for(i=0; devices[i] != NULL; i++) {
     printf("Device %i: %s\n", i, devices[i]);
+    probe_device(devices[i]);
   }
   printf("--- End of list of detected devices ---\n");
 
   linphone_core_destroy(p_linphone);
   return 0;
 }
+
+/**
+ * Writes the ALSA PCM name of the linphone sound device `device`
+ * into `target`: "default" for ALSA's default device, "hw:N" for a
+ * card. Returns false for devices not driven through ALSA or cards
+ * that cannot be found.
+ */
+bool alsa_name(const char* device, char* target, size_t size)
+{
+  const char* card = NULL;
+  char* name = NULL;
+  int index = -1;
+
+  if (strncmp(device, ALSA_PREFIX, strlen(ALSA_PREFIX)) != 0)
+    return false;
+
+  card = device + strlen(ALSA_PREFIX);
+  if (strcmp(card, ALSA_DEFAULT_NAME) == 0) {
+    snprintf(target, size, "default");
+    return true;
+  }
+
+  while (snd_card_next(&index) == 0 && index >= 0) {
+    if (snd_card_get_name(index, &name) < 0)
+      continue;
+
+    if (strcmp(name, card) == 0) {
+      free(name);
+      snprintf(target, size, "hw:%d", index);
+      return true;
+    }
+
+    free(name);
+  }
+
+  return false;
+}
+
+/**
+ * Prints what the linphone sound device `device` can do for playback
+ * and capture.
+ */
+void probe_device(const char* device)
+{
+  char pcm_name[32];
+
+  if (!alsa_name(device, pcm_name, sizeof(pcm_name))) {
+    printf("    not an ALSA card, not probed\n");
+    return;
+  }
+
+  probe_stream(pcm_name, SND_PCM_STREAM_PLAYBACK);
+  probe_stream(pcm_name, SND_PCM_STREAM_CAPTURE);
+}
+
+/**
+ * Opens the ALSA PCM `pcm_name` in the given direction and prints
+ * how long that took and which rates, formats and channel counts it
+ * supports without converting.
+ */
+void probe_stream(const char* pcm_name, snd_pcm_stream_t stream)
+{
+  const char* direction = stream == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture";
+  snd_pcm_t* p_pcm = NULL;
+  snd_pcm_hw_params_t* p_params = NULL;
+  struct timespec start;
+  unsigned int min_channels = 0;
+  unsigned int max_channels = 0;
+  double open_ms = 0.0;
+  size_t i = 0;
+  int err = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  err = snd_pcm_open(&p_pcm, pcm_name, stream, SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE);
+  open_ms = elapsed_ms(&start);
+  if (err < 0) {
+    printf("    %-8s %s: cannot open: %s\n", direction, pcm_name, snd_strerror(err));
+    return;
+  }
+
+  snd_pcm_hw_params_alloca(&p_params);
+  if ((err = snd_pcm_hw_params_any(p_pcm, p_params)) < 0) {
+    printf("    %-8s %s: cannot query: %s\n", direction, pcm_name, snd_strerror(err));
+    snd_pcm_close(p_pcm);
+    return;
+  }
+
+  printf("    %-8s %s: opened in %.1f ms, rates", direction, pcm_name, open_ms);
+  for(i=0; i < sizeof(s_rates) / sizeof(s_rates[0]); i++) {
+    if (snd_pcm_hw_params_test_rate(p_pcm, p_params, s_rates[i], 0) == 0)
+      printf(" %u", s_rates[i]);
+  }
+
+  printf(", formats");
+  for(i=0; i < sizeof(s_formats) / sizeof(s_formats[0]); i++) {
+    if (snd_pcm_hw_params_test_format(p_pcm, p_params, s_formats[i]) == 0)
+      printf(" %s", snd_pcm_format_name(s_formats[i]));
+  }
+
+  snd_pcm_hw_params_get_channels_min(p_params, &min_channels);
+  snd_pcm_hw_params_get_channels_max(p_params, &max_channels);
+  printf(", %u-%u channels\n", min_channels, max_channels);
+
+  snd_pcm_close(p_pcm);
+}
+
+/**
+ * Runs the latency benchmark over all period sizes in
+ * `s_period_sizes`, prints the results and the recommended
+ * piphoned.conf settings.
+ */
+int run_bench(const char* playback, const char* capture, unsigned int rate)
+{
+  struct BenchResult results[sizeof(s_period_sizes) / sizeof(s_period_sizes[0])];
+  const struct BenchResult* p_best = NULL;
+  bool loopback = false;
+  size_t i = 0;
+
+  if (rate == 0) {
+    fprintf(stderr, "Invalid sample rate.\n");
+    return 1;
+  }
+
+  printf("--- Latency of %s -> %s at %u Hz ---\n", playback, capture, rate);
+  for(i=0; i < sizeof(s_period_sizes) / sizeof(s_period_sizes[0]); i++) {
+    struct BenchResult* p_result = &results[i];
+
+    p_result->period = s_period_sizes[i];
+    if (!bench_period(playback, capture, rate, p_result)) {
+      printf("Period %4lu frames (%5.1f ms): not supported\n", p_result->period, p_result->period * 1000.0 / rate);
+      continue;
+    }
+
+    if (p_result->latency_ms >= 0.0) {
+      loopback = true;
+      printf("Period %4lu frames (%5.1f ms): round trip %6.1f ms, %d xruns\n", p_result->period, p_result->period * 1000.0 / rate, p_result->latency_ms, p_result->xruns);
+    }
+    else
+      printf("Period %4lu frames (%5.1f ms): click not captured, %d xruns\n", p_result->period, p_result->period * 1000.0 / rate, p_result->xruns);
+  }
+  printf("--- End of latency measurements ---\n");
+
+  /* The smallest period that streamed without xruns and, if any
+   * click came back at all, got its click back */
+  for(i=0; i < sizeof(s_period_sizes) / sizeof(s_period_sizes[0]); i++) {
+    if (results[i].works && results[i].xruns == 0 && (!loopback || results[i].latency_ms >= 0.0)) {
+      p_best = &results[i];
+      break;
+    }
+  }
+
+  if (!p_best) {
+    printf("No period size streamed without xruns; keep piphoned's defaults.\n");
+    return 2;
+  }
+
+  if (!loopback)
+    printf("The click never came back, so the period size is chosen by xruns alone.\n");
+
+  printf("--- Recommended piphoned.conf settings ---\n");
+  printf("sound_rate = %u\n", rate);
+  printf("sound_period = %lu\n", p_best->period);
+  printf("sound_buffer = %lu\n", p_best->period * BENCH_PERIODS);
+  printf("--- End of recommended settings ---\n");
+  return 0;
+}
+
+/**
+ * Streams BENCH_SECONDS of silence with a click after the first
+ * second from `playback` to `capture` with the period size in
+ * `p_result`, and fills in the rest of `p_result`. Returns false if
+ * the devices cannot be set up that way.
+ */
+bool bench_period(const char* playback, const char* capture, unsigned int rate, struct BenchResult* p_result)
+{
+  snd_pcm_t* p_playback = NULL;
+  snd_pcm_t* p_capture = NULL;
+  snd_pcm_uframes_t period = p_result->period;
+  int16_t* p_buffer = NULL;
+  long iterations = (long) rate * BENCH_SECONDS / period;
+  long click_at = rate / period;
+  long click_frame = -1;
+  long written = 0;
+  long captured = 0;
+  long i = 0;
+  snd_pcm_uframes_t j = 0;
+  snd_pcm_sframes_t n = 0;
+  bool success = false;
+  int err = 0;
+
+  p_result->works = false;
+  p_result->xruns = 0;
+  p_result->latency_ms = -1.0;
+
+  if ((err = snd_pcm_open(&p_playback, playback, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+    fprintf(stderr, "Cannot open %s for playback: %s\n", playback, snd_strerror(err));
+    goto finish;
+  }
+  if ((err = snd_pcm_open(&p_capture, capture, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+    fprintf(stderr, "Cannot open %s for capture: %s\n", capture, snd_strerror(err));
+    goto finish;
+  }
+  if (setup_pcm(p_playback, rate, period) < 0 || setup_pcm(p_capture, rate, period) < 0)
+    goto finish;
+
+  p_buffer = (int16_t*) calloc(period, sizeof(int16_t));
+  if (!p_buffer)
+    goto finish;
+
+  /* Queue all but one period of silence, so that the first read
+   * doesn't starve the playback */
+  for(i=0; i < BENCH_PERIODS - 1; i++)
+    written += snd_pcm_writei(p_playback, p_buffer, period) > 0 ? period : 0;
+
+  snd_pcm_start(p_capture);
+
+  for(i=0; i < iterations; i++) {
+    n = snd_pcm_readi(p_capture, p_buffer, period);
+    if (n < 0) {
+      if (n == -EPIPE)
+        p_result->xruns++;
+      snd_pcm_recover(p_capture, n, 1);
+      snd_pcm_start(p_capture);
+      n = 0;
+    }
+
+    for(j=0; click_frame >= 0 && p_result->latency_ms < 0.0 && j < (snd_pcm_uframes_t) n; j++) {
+      if (abs(p_buffer[j]) > CLICK_THRESHOLD)
+        p_result->latency_ms = (captured + (long) j - click_frame) * 1000.0 / rate;
+    }
+    captured += n;
+
+    memset(p_buffer, 0, period * sizeof(int16_t));
+    if (i == click_at) {
+      for(j=0; j < CLICK_LENGTH && j < period; j++)
+        p_buffer[j] = j % 2 ? -30000 : 30000;
+      click_frame = written;
+    }
+
+    n = snd_pcm_writei(p_playback, p_buffer, period);
+    if (n < 0) {
+      if (n == -EPIPE)
+        p_result->xruns++;
+      snd_pcm_recover(p_playback, n, 1);
+      n = 0;
+    }
+    written += n;
+  }
+
+  p_result->works = true;
+  success = true;
+
+ finish:
+  free(p_buffer);
+  if (p_capture)
+    snd_pcm_close(p_capture);
+  if (p_playback) {
+    snd_pcm_drop(p_playback);
+    snd_pcm_close(p_playback);
+  }
+
+  return success;
+}
+
+/**
+ * Sets up `p_pcm` for mono 16 bit audio at `rate` with exactly the
+ * given period size and BENCH_PERIODS periods. Playback starts only
+ * once all but one period are queued.
+ */
+int setup_pcm(snd_pcm_t* p_pcm, unsigned int rate, snd_pcm_uframes_t period)
+{
+  snd_pcm_hw_params_t* p_hw = NULL;
+  snd_pcm_sw_params_t* p_sw = NULL;
+  snd_pcm_uframes_t buffer = period * BENCH_PERIODS;
+  unsigned int granted_rate = rate;
+  int err = 0;
+
+  snd_pcm_hw_params_alloca(&p_hw);
+  snd_pcm_sw_params_alloca(&p_sw);
+
+  if ((err = snd_pcm_hw_params_any(p_pcm, p_hw)) < 0
+      || (err = snd_pcm_hw_params_set_access(p_pcm, p_hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0
+      || (err = snd_pcm_hw_params_set_format(p_pcm, p_hw, SND_PCM_FORMAT_S16_LE)) < 0
+      || (err = snd_pcm_hw_params_set_channels(p_pcm, p_hw, 1)) < 0
+      || (err = snd_pcm_hw_params_set_rate_near(p_pcm, p_hw, &granted_rate, NULL)) < 0
+      || (err = snd_pcm_hw_params_set_period_size(p_pcm, p_hw, period, 0)) < 0
+      || (err = snd_pcm_hw_params_set_buffer_size(p_pcm, p_hw, buffer)) < 0
+      || (err = snd_pcm_hw_params(p_pcm, p_hw)) < 0)
+    return err;
+
+  if (granted_rate != rate)
+    return -EINVAL;
+
+  if ((err = snd_pcm_sw_params_current(p_pcm, p_sw)) < 0
+      || (err = snd_pcm_sw_params_set_start_threshold(p_pcm, p_sw, period * (BENCH_PERIODS - 1))) < 0
+      || (err = snd_pcm_sw_params_set_avail_min(p_pcm, p_sw, period)) < 0
+      || (err = snd_pcm_sw_params(p_pcm, p_sw)) < 0)
+    return err;
+
+  return 0;
+}
+
+/**
+ * Milliseconds passed since `p_start` on the monotonic clock.
+ */
+double elapsed_ms(const struct timespec* p_start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - p_start->tv_sec) * 1000.0 + (now.tv_nsec - p_start->tv_nsec) / 1000000.0;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "allocstats.h"
+
+/**
+ * Allocation counter. When built with PIPHONED_COUNT_ALLOCATIONS,
+ * the linker redirects every malloc(), calloc() and realloc() call
+ * in piphoned's own object files to the wrappers below
+ * (-Wl,--wrap=malloc etc.). Allocations inside libraries such as
+ * linphone or libc are not affected, so the counter tells exactly
+ * whether piphoned's code allocates in its steady state. The
+ * benchmark and the soak test report it per call.
+ */
+
+static unsigned long s_allocations = 0; /* Shared resource! */
+
+#ifdef PIPHONED_COUNT_ALLOCATIONS
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+  __atomic_add_fetch(&s_allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+  __atomic_add_fetch(&s_allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+  __atomic_add_fetch(&s_allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+#endif
+
+bool piphoned_allocstats_enabled()
+{
+#ifdef PIPHONED_COUNT_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+unsigned long piphoned_allocstats_count()
+{
+  return __atomic_load_n(&s_allocations, __ATOMIC_RELAXED);
+}
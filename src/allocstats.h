@@ -0,0 +1,9 @@
+#ifndef PIPHONED_ALLOCSTATS_H
+#define PIPHONED_ALLOCSTATS_H
+#include <stdbool.h>
+#include "config.h"
+
+bool piphoned_allocstats_enabled();         /*< Was piphoned built with PIPHONED_COUNT_ALLOCATIONS? */
+unsigned long piphoned_allocstats_count();  /*< Heap allocations made by piphoned's own code so far */
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+#include "arena.h"
+
+/**
+ * Startup arena. All long-lived state of piphoned (the phone
+ * manager, the SIP core and its backend, the trigger monitors) is
+ * carved out of one block that is allocated and written to once
+ * when the mainloop starts. Nothing is ever returned to it, which
+ * is fine because that state lives until shutdown; the point is
+ * that after startup the daemon does not need to call malloc()
+ * anymore and, with `lock_memory`, all of that memory is resident.
+ *
+ * Allocating without an arena, or when it is exhausted, falls back
+ * to malloc(), so callers always use piphoned_arena_alloc() and
+ * piphoned_arena_release() and never need to know where the memory
+ * came from.
+ */
+
+#define ARENA_ALIGNMENT 16 /* Enough for any type we store */
+
+static char* sp_arena = NULL; /* Start of the arena */
+static size_t s_size = 0;     /* Size of the arena */
+static size_t s_used = 0;     /* Bytes handed out */
+
+/**
+ * Allocates an arena of `size` bytes and touches all of its pages.
+ */
+bool piphoned_arena_init(size_t size)
+{
+  sp_arena = (char*) malloc(size);
+  if (!sp_arena) {
+    syslog(LOG_ERR, "Failed to allocate %zu bytes arena: %m", size);
+    return false;
+  }
+
+  memset(sp_arena, '\0', size); /* Prefault */
+  s_size = size;
+  s_used = 0;
+
+  syslog(LOG_DEBUG, "Allocated %zu bytes arena.", size);
+  return true;
+}
+
+/**
+ * Frees the arena. All memory allocated from it becomes invalid.
+ */
+void piphoned_arena_free()
+{
+  if (!sp_arena)
+    return;
+
+  syslog(LOG_DEBUG, "Releasing arena, %zu of %zu bytes were used.", s_used, s_size);
+
+  free(sp_arena);
+  sp_arena = NULL;
+  s_size = 0;
+  s_used = 0;
+}
+
+/**
+ * Returns `size` bytes of zeroed memory from the arena, or from
+ * the heap if there is no arena or it is exhausted. Only the thread
+ * running the mainloop may call this.
+ */
+void* piphoned_arena_alloc(size_t size)
+{
+  size_t aligned = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+  void* ptr = NULL;
+
+  if (!sp_arena)
+    return calloc(1, size);
+
+  if (s_size - s_used < aligned) {
+    syslog(LOG_WARNING, "Arena exhausted (%zu of %zu bytes used), allocating %zu bytes from the heap. Increase PIPHONED_ARENA_SIZE.", s_used, s_size, size);
+    return calloc(1, size);
+  }
+
+  ptr = sp_arena + s_used;
+  s_used += aligned;
+
+  return ptr;
+}
+
+/**
+ * Gives back memory obtained from piphoned_arena_alloc(). Heap
+ * memory is freed, arena memory stays reserved until
+ * piphoned_arena_free().
+ */
+void piphoned_arena_release(void* ptr)
+{
+  if (sp_arena && (char*) ptr >= sp_arena && (char*) ptr < sp_arena + s_size)
+    return;
+
+  free(ptr);
+}
+
+size_t piphoned_arena_used()
+{
+  return s_used;
+}
@@ -0,0 +1,13 @@
+#ifndef PIPHONED_ARENA_H
+#define PIPHONED_ARENA_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "config.h"
+
+bool piphoned_arena_init(size_t size);   /*< Allocate and prefault the arena */
+void piphoned_arena_free();              /*< Release the arena and everything in it */
+void* piphoned_arena_alloc(size_t size); /*< Zeroed memory that lives until piphoned_arena_free() */
+void piphoned_arena_release(void* ptr);  /*< Counterpart of piphoned_arena_alloc() */
+size_t piphoned_arena_used();            /*< Bytes handed out so far */
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "benchmark.h"
+#include "hwactions.h"
+#include "allocstats.h"
+
+/**
+ * The benchmark drives the simulated hardware from a separate thread
+ * exactly like a user would: dial a number, lift the handset, wait
+ * for the call to go out, talk a bit and hang up. The fake SIP
+ * backend timestamps the signalling it sends, so the latency of the
+ * whole hwactions -> mainloop -> phone manager path can be measured
+ * without a SIP account or sound card.
+ */
+
+#define BENCHMARK_NUMBER "5551234" /* Digits dialed in each cycle */
+#define INVITE_TIMEOUT 30000       /* Milliseconds to wait for the INVITE */
+#define BYE_TIMEOUT 10000          /* Milliseconds to wait for the BYE */
+#define CALL_HOLD_TIME 500         /* Milliseconds to stay in the call */
+#define IDLE_TIME 200              /* Milliseconds to stay idle between cycles */
+
+/**
+ * Latency samples of one kind, in milliseconds.
+ */
+struct LatencySamples
+{
+  double* samples;
+  unsigned int count;
+};
+
+static struct Piphoned_SipCore* sp_core = NULL;
+static unsigned int s_cycles = 0;
+static unsigned int s_completed = 0;
+static struct LatencySamples s_invite_latency;
+static struct LatencySamples s_bye_latency;
+static unsigned long s_warm_allocations = 0; /* Allocation count after the first cycle */
+static unsigned long s_allocations = 0;      /* Allocations in all later cycles */
+static pthread_t s_thread;
+static bool s_running = false;
+static bool s_abort = false; /* Shared resource! */
+
+static void* benchmark_thread(void* arg);
+static bool wait_for_counter(struct Piphoned_SipCore_FakeStats* p_stats, const unsigned long* p_counter, unsigned long old_value, unsigned int timeout_ms);
+static bool sleep_milliseconds(unsigned int ms);
+static double milliseconds_between(const struct timespec* p_start, const struct timespec* p_end);
+static void report(const char* name, struct LatencySamples* p_samples);
+static int compare_doubles(const void* p_a, const void* p_b);
+
+/**
+ * Starts the benchmark thread. The simulated hardware must have been
+ * enabled with piphoned_hwactions_set_simulated() and `p_core` must
+ * be using the fake backend. When all `cycles` have been run, the
+ * process sends itself SIGTERM to end the mainloop.
+ */
+bool piphoned_benchmark_start(struct Piphoned_SipCore* p_core, unsigned int cycles)
+{
+  sp_core = p_core;
+  s_cycles = cycles;
+  s_completed = 0;
+  s_abort = false;
+  s_warm_allocations = 0;
+  s_allocations = 0;
+
+  s_invite_latency.samples = (double*) malloc(cycles * sizeof(double));
+  s_invite_latency.count = 0;
+  s_bye_latency.samples = (double*) malloc(cycles * sizeof(double));
+  s_bye_latency.count = 0;
+
+  piphoned_sipcore_fake_set_outcome(p_core, PIPHONED_SIPCORE_FAKE_ANSWER, 100, 200);
+
+  if (pthread_create(&s_thread, NULL, benchmark_thread, NULL) != 0) {
+    syslog(LOG_CRIT, "Failed to start benchmark thread: %m");
+    return false;
+  }
+
+  s_running = true;
+  syslog(LOG_NOTICE, "Benchmark started with %u call cycles.", cycles);
+  return true;
+}
+
+/**
+ * Stops the benchmark thread if it is still running, prints the
+ * latency report and frees the samples.
+ *
+ * \returns 0 if all cycles completed, 5 otherwise.
+ */
+int piphoned_benchmark_finish()
+{
+  int retval = 0;
+
+  if (!s_running)
+    return 5;
+
+  __atomic_store_n(&s_abort, true, __ATOMIC_RELEASE);
+  pthread_join(s_thread, NULL);
+  s_running = false;
+
+  printf("Completed %u of %u call cycles.\n", s_completed, s_cycles);
+  syslog(LOG_NOTICE, "Benchmark completed %u of %u call cycles.", s_completed, s_cycles);
+
+  report("hook-off to INVITE", &s_invite_latency);
+  report("hang-up to BYE", &s_bye_latency);
+
+  /* The first cycle is allowed to warm up lazily created state */
+  if (piphoned_allocstats_enabled() && s_completed > 1)
+    printf("%-20s %.2f per call cycle (%lu in %u cycles after the first)\n", "allocations",
+           (double) s_allocations / (s_completed - 1), s_allocations, s_completed - 1);
+
+  if (s_completed < s_cycles)
+    retval = 5;
+
+  free(s_invite_latency.samples);
+  free(s_bye_latency.samples);
+  s_invite_latency.samples = NULL;
+  s_bye_latency.samples = NULL;
+  sp_core = NULL;
+
+  return retval;
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static void* benchmark_thread(void* arg)
+{
+  struct Piphoned_SipCore_FakeStats stats;
+  struct timespec start;
+  unsigned int i = 0;
+
+  /* Give the proxies time to register */
+  sleep_milliseconds(IDLE_TIME);
+
+  for(i=0; i < s_cycles; i++) {
+    /* Dial while on hook, then lift the handset */
+    piphoned_hwactions_simulate_digits(0, BENCHMARK_NUMBER);
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    piphoned_hwactions_simulate_hook(0, false);
+
+    if (!wait_for_counter(&stats, &stats.invites, stats.invites, INVITE_TIMEOUT)) {
+      syslog(LOG_ERR, "Benchmark cycle %u: no INVITE was sent.", i + 1);
+      break;
+    }
+    s_invite_latency.samples[s_invite_latency.count++] = milliseconds_between(&start, &stats.last_invite);
+
+    if (!sleep_milliseconds(CALL_HOLD_TIME))
+      break;
+
+    /* Hang up */
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    piphoned_hwactions_simulate_hook(0, true);
+
+    if (!wait_for_counter(&stats, &stats.byes, stats.byes, BYE_TIMEOUT)) {
+      syslog(LOG_ERR, "Benchmark cycle %u: no BYE was sent.", i + 1);
+      break;
+    }
+    s_bye_latency.samples[s_bye_latency.count++] = milliseconds_between(&start, &stats.last_bye);
+
+    s_completed++;
+    if (s_completed == 1)
+      s_warm_allocations = piphoned_allocstats_count();
+    else
+      s_allocations = piphoned_allocstats_count() - s_warm_allocations;
+
+    if (!sleep_milliseconds(IDLE_TIME))
+      break;
+  }
+
+  /* Ask the mainloop to terminate unless somebody else did already */
+  if (!__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE))
+    kill(getpid(), SIGTERM);
+
+  return NULL;
+}
+
+/**
+ * Polls the fake backend's statistics into `p_stats` until the
+ * counter pointed to by `p_counter`, which must be a member of
+ * `p_stats`, differs from `old_value`.
+ *
+ * \returns false on timeout or if the benchmark is aborted.
+ */
+static bool wait_for_counter(struct Piphoned_SipCore_FakeStats* p_stats, const unsigned long* p_counter, unsigned long old_value, unsigned int timeout_ms)
+{
+  unsigned int waited = 0;
+
+  while (waited < timeout_ms) {
+    piphoned_sipcore_fake_get_stats(sp_core, p_stats);
+    if (*p_counter != old_value)
+      return true;
+
+    if (!sleep_milliseconds(1))
+      return false;
+    waited++;
+  }
+
+  return false;
+}
+
+/**
+ * Sleeps for the given time unless the benchmark is aborted.
+ *
+ * \returns false if the benchmark was aborted.
+ */
+static bool sleep_milliseconds(unsigned int ms)
+{
+  struct timespec duration;
+
+  if (__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE))
+    return false;
+
+  duration.tv_sec = ms / 1000;
+  duration.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&duration, NULL);
+
+  return !__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE);
+}
+
+static double milliseconds_between(const struct timespec* p_start, const struct timespec* p_end)
+{
+  return (p_end->tv_sec - p_start->tv_sec) * 1000.0 + (p_end->tv_nsec - p_start->tv_nsec) / 1000000.0;
+}
+
+/**
+ * Prints count, minimum, mean, median, 95th percentile and maximum
+ * of the given samples to stdout and syslog. Sorts the samples.
+ */
+static void report(const char* name, struct LatencySamples* p_samples)
+{
+  double sum = 0.0;
+  double p50 = 0.0;
+  double p95 = 0.0;
+  unsigned int i = 0;
+
+  if (p_samples->count == 0) {
+    printf("%-20s no samples\n", name);
+    return;
+  }
+
+  qsort(p_samples->samples, p_samples->count, sizeof(double), compare_doubles);
+
+  for(i=0; i < p_samples->count; i++)
+    sum += p_samples->samples[i];
+
+  p50 = p_samples->samples[(p_samples->count - 1) * 50 / 100];
+  p95 = p_samples->samples[(p_samples->count - 1) * 95 / 100];
+
+  printf("%-20s n=%u min=%.3fms mean=%.3fms p50=%.3fms p95=%.3fms max=%.3fms\n",
+         name, p_samples->count, p_samples->samples[0], sum / p_samples->count,
+         p50, p95, p_samples->samples[p_samples->count - 1]);
+  syslog(LOG_NOTICE, "Benchmark %s: n=%u min=%.3fms mean=%.3fms p50=%.3fms p95=%.3fms max=%.3fms",
+         name, p_samples->count, p_samples->samples[0], sum / p_samples->count,
+         p50, p95, p_samples->samples[p_samples->count - 1]);
+}
+
+static int compare_doubles(const void* p_a, const void* p_b)
+{
+  double a = *(const double*) p_a;
+  double b = *(const double*) p_b;
+
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
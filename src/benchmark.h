@@ -0,0 +1,9 @@
+#ifndef PIPHONED_BENCHMARK_H
+#define PIPHONED_BENCHMARK_H
+#include <stdbool.h>
+#include "sipcore.h"
+
+bool piphoned_benchmark_start(struct Piphoned_SipCore* p_core, unsigned int cycles); /*< Start driving the simulated hardware */
+int piphoned_benchmark_finish(); /*< Wait for the benchmark and print the report */
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+#include "cache_file.h"
+
+/**
+ * Cache files, for results that take long to find out but only
+ * change with the hardware (see codecs.c and sound_cache.c). Each
+ * starts with a line naming its format and version and a line with a
+ * key, an FNV-1a hash of whatever the results depend on, followed by
+ * the entries in a format of the caller's choice. A file with another
+ * key is stale and ignored, so it is rewritten after a change.
+ */
+
+/**
+ * Continues the FNV-1a hash `hash` with the bytes of `str`. Start
+ * with PIPHONED_CACHEFILE_HASH_START.
+ */
+uint32_t piphoned_cachefile_hash(uint32_t hash, const char* str)
+{
+  const char* p = NULL;
+
+  for(p = str; *p; p++)
+    hash = (hash ^ (unsigned char) *p) * 16777619u;
+
+  return hash;
+}
+
+/**
+ * Opens the cache file at `path` and checks its header. Returns the
+ * file positioned at the first entry, or NULL if there is no file,
+ * it is not of format `magic`, or it was written for another key; in
+ * the latter case `p_stale` is set, so the caller can tell why.
+ */
+FILE* piphoned_cachefile_open(const char* path, const char* magic, uint32_t key, bool* p_stale)
+{
+  FILE* p_file = NULL;
+  char line[512];
+  unsigned int filekey = 0;
+
+  *p_stale = false;
+
+  p_file = fopen(path, "r");
+  if (!p_file)
+    return NULL;
+
+  if (!fgets(line, sizeof(line), p_file) || strncmp(line, magic, strlen(magic)) != 0) {
+    syslog(LOG_WARNING, "Ignoring cache file '%s' of unknown format.", path);
+    goto fail;
+  }
+  if (!fgets(line, sizeof(line), p_file) || sscanf(line, "key %8x", &filekey) != 1 || filekey != key) {
+    *p_stale = true;
+    goto fail;
+  }
+
+  return p_file;
+
+ fail:
+  fclose(p_file);
+  return NULL;
+}
+
+/**
+ * Creates or truncates the cache file at `path` and writes its
+ * header. Returns the file to write the entries to, or NULL if it
+ * cannot be written.
+ */
+FILE* piphoned_cachefile_create(const char* path, const char* magic, uint32_t key)
+{
+  FILE* p_file = fopen(path, "w");
+
+  if (!p_file) {
+    syslog(LOG_WARNING, "Failed to write cache file '%s': %m", path);
+    return NULL;
+  }
+
+  fprintf(p_file, "%s\nkey %08x\n", magic, key);
+  return p_file;
+}
@@ -0,0 +1,13 @@
+#ifndef PIPHONED_CACHE_FILE_H
+#define PIPHONED_CACHE_FILE_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIPHONED_CACHEFILE_HASH_START 2166136261u /* FNV-1a offset basis */
+
+uint32_t piphoned_cachefile_hash(uint32_t hash, const char* str); /*< Continue the FNV-1a `hash` with `str` */
+FILE* piphoned_cachefile_open(const char* path, const char* magic, uint32_t key, bool* p_stale); /*< Open a cache file for reading its entries; NULL if missing, invalid or stale */
+FILE* piphoned_cachefile_create(const char* path, const char* magic, uint32_t key); /*< Write a cache file's header; NULL on failure */
+
+#endif
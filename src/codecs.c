@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <linphone/linphonecore.h>
+#include "codecs.h"
+#include "configfile.h"
+#include "cache_file.h"
+
+/**
+ * Choosing the audio codecs by what they cost on this CPU. Linphone's
+ * default codec order prefers opus and speex, which take a
+ * noticeable share of a Raspberry Pi 1 for every call, while the G.711
+ * codecs are almost free but need more bandwidth. How much a codec
+ * costs depends on the CPU and on how mediastreamer was built, so it
+ * is measured on the spot: every enabled codec encodes and decodes a
+ * test signal once. The results are kept for all lines and, if
+ * `codec_cache` is set, written to disk together with a key
+ * identifying the CPU, so that later starts on the same hardware can
+ * skip the measurement.
+ */
+
+#define CACHE_MAGIC "piphoned-codecs 1"
+
+/**
+ * What a codec costs on this CPU.
+ */
+struct CodecCost
+{
+  char mime[32];
+  int rate;
+  int channels;
+  double cost; /*< Share of one core in percent for encoding and decoding one stream; negative if unmeasurable */
+};
+
+static struct CodecCost s_costs[PIPHONED_SIPCORE_MAX_CODECS]; /* Measured or cached codec costs */
+static int s_num_costs = 0;
+static bool s_cache_loaded = false; /* Has the cache file been tried already? */
+static uint32_t s_cpu_key = 0; /* Identifies the CPU and SIP backend the costs are valid for */
+
+static void compute_cpu_key(const struct Piphoned_SipCore* p_core);
+static void load_cache();
+static void save_cache();
+static struct CodecCost* find_cost(const struct Piphoned_SipCore_Codec* p_codec);
+static int compare_codecs(const void* p_a, const void* p_b);
+static double codec_cost(const struct Piphoned_SipCore_Codec* p_codec);
+
+void piphoned_codecs_configure(struct Piphoned_SipCore* p_core, const char* linename)
+{
+  struct Piphoned_SipCore_Codec codecs[PIPHONED_SIPCORE_MAX_CODECS];
+  int num_codecs = 0;
+  int num_measured = 0;
+  int cheapest = -1;
+  bool within_budget = false;
+  int i = 0;
+
+  if (g_piphoned_config_info.codec_cpu_budget <= 0)
+    return;
+
+  if (!s_cache_loaded) {
+    compute_cpu_key(p_core);
+    load_cache();
+    s_cache_loaded = true;
+  }
+
+  num_codecs = p_core->p_ops->get_audio_codecs(p_core, codecs, PIPHONED_SIPCORE_MAX_CODECS);
+
+  /* Measure the enabled codecs the cache does not know yet */
+  for(i=0; i < num_codecs; i++) {
+    struct CodecCost* p_cost = NULL;
+
+    if (!codecs[i].enabled || find_cost(&codecs[i]) || s_num_costs >= PIPHONED_SIPCORE_MAX_CODECS)
+      continue;
+
+    p_cost = &s_costs[s_num_costs++];
+    strcpy(p_cost->mime, codecs[i].mime);
+    p_cost->rate = codecs[i].rate;
+    p_cost->channels = codecs[i].channels;
+    p_cost->cost = p_core->p_ops->measure_codec(p_core, &codecs[i]);
+    num_measured++;
+  }
+
+  if (num_measured > 0) {
+    syslog(LOG_NOTICE, "Measured the CPU cost of %d audio codecs.", num_measured);
+    save_cache();
+  }
+
+  /* Drop what exceeds the budget, but always keep the cheapest codec
+   * so that calls remain possible at all */
+  for(i=0; i < num_codecs; i++) {
+    double cost = codec_cost(&codecs[i]);
+
+    if (!codecs[i].enabled || cost < 0)
+      continue;
+
+    if (cost <= g_piphoned_config_info.codec_cpu_budget)
+      within_budget = true;
+    else
+      codecs[i].enabled = false;
+
+    if (cheapest < 0 || cost < codec_cost(&codecs[cheapest]))
+      cheapest = i;
+  }
+  if (!within_budget && cheapest >= 0) {
+    syslog(LOG_WARNING, "No audio codec fits into the CPU budget of %d%% on line %s. Keeping %s/%d only.", g_piphoned_config_info.codec_cpu_budget, linename, codecs[cheapest].mime, codecs[cheapest].rate);
+    codecs[cheapest].enabled = true;
+  }
+
+  qsort(codecs, num_codecs, sizeof(struct Piphoned_SipCore_Codec), compare_codecs);
+  p_core->p_ops->set_audio_codecs(p_core, codecs, num_codecs);
+
+  syslog(LOG_INFO, "Audio codecs of line %s (budget %d%%, preferring %s):", linename, g_piphoned_config_info.codec_cpu_budget, g_piphoned_config_info.codec_preference == PIPHONED_CODECS_PREFER_BANDWIDTH ? "bandwidth" : "quality");
+  for(i=0; i < num_codecs; i++) {
+    double cost = codec_cost(&codecs[i]);
+
+    if (cost < 0)
+      syslog(LOG_INFO, "  %-8s %5d Hz %d ch %6d bit/s   cost unknown  %s", codecs[i].mime, codecs[i].rate, codecs[i].channels, codecs[i].bitrate, codecs[i].enabled ? "enabled" : "disabled");
+    else
+      syslog(LOG_INFO, "  %-8s %5d Hz %d ch %6d bit/s  %6.2f%% CPU   %s", codecs[i].mime, codecs[i].rate, codecs[i].channels, codecs[i].bitrate, cost, codecs[i].enabled ? "enabled" : "disabled");
+  }
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Derives the cache key from the CPU model as /proc/cpuinfo reports
+ * it and from the SIP backend, using FNV-1a.
+ */
+static void compute_cpu_key(const struct Piphoned_SipCore* p_core)
+{
+  static const char* fields[] = {"model name", "Hardware", "Revision", "CPU part", "CPU revision"};
+  FILE* p_file = fopen("/proc/cpuinfo", "r");
+  char line[512];
+  size_t i = 0;
+
+  s_cpu_key = piphoned_cachefile_hash(PIPHONED_CACHEFILE_HASH_START, p_core->p_ops->name);
+
+  if (p_file) {
+    while (fgets(line, sizeof(line), p_file)) {
+      for(i=0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strncmp(line, fields[i], strlen(fields[i])) == 0) {
+          s_cpu_key = piphoned_cachefile_hash(s_cpu_key, line);
+          break;
+        }
+      }
+    }
+    fclose(p_file);
+  }
+}
+
+/**
+ * Reads the codec costs from the cache file, if there is one and it
+ * was written on this CPU.
+ */
+static void load_cache()
+{
+  FILE* p_file = NULL;
+  char line[512];
+  bool stale = false;
+
+  if (strlen(g_piphoned_config_info.codec_cache) == 0)
+    return;
+
+  p_file = piphoned_cachefile_open(g_piphoned_config_info.codec_cache, CACHE_MAGIC, s_cpu_key, &stale);
+  if (stale)
+    syslog(LOG_NOTICE, "Codec cache file '%s' is from another CPU, recalibrating.", g_piphoned_config_info.codec_cache);
+  if (!p_file)
+    return;
+
+  while (s_num_costs < PIPHONED_SIPCORE_MAX_CODECS && fgets(line, sizeof(line), p_file)) {
+    struct CodecCost* p_cost = &s_costs[s_num_costs];
+
+    if (sscanf(line, "%31s %d %d %lf", p_cost->mime, &p_cost->rate, &p_cost->channels, &p_cost->cost) == 4)
+      s_num_costs++;
+  }
+
+  syslog(LOG_INFO, "Read the CPU cost of %d audio codecs from '%s'.", s_num_costs, g_piphoned_config_info.codec_cache);
+  fclose(p_file);
+}
+
+static void save_cache()
+{
+  FILE* p_file = NULL;
+  int i = 0;
+
+  if (strlen(g_piphoned_config_info.codec_cache) == 0)
+    return;
+
+  p_file = piphoned_cachefile_create(g_piphoned_config_info.codec_cache, CACHE_MAGIC, s_cpu_key);
+  if (!p_file)
+    return;
+
+  for(i=0; i < s_num_costs; i++)
+    fprintf(p_file, "%s %d %d %.3f\n", s_costs[i].mime, s_costs[i].rate, s_costs[i].channels, s_costs[i].cost);
+
+  fclose(p_file);
+}
+
+static struct CodecCost* find_cost(const struct Piphoned_SipCore_Codec* p_codec)
+{
+  int i = 0;
+
+  for(i=0; i < s_num_costs; i++) {
+    if (strcasecmp(s_costs[i].mime, p_codec->mime) == 0 && s_costs[i].rate == p_codec->rate && s_costs[i].channels == p_codec->channels)
+      return &s_costs[i];
+  }
+
+  return NULL;
+}
+
+/**
+ * The codec's cost, or -1 if it is unknown. Codecs that could not be
+ * measured have no encoder or decoder and count as unknown as well.
+ */
+static double codec_cost(const struct Piphoned_SipCore_Codec* p_codec)
+{
+  struct CodecCost* p_cost = find_cost(p_codec);
+
+  return p_cost ? p_cost->cost : -1.0;
+}
+
+/**
+ * qsort() comparison putting enabled codecs first, in the order of
+ * the configured preference, and the cheaper of two otherwise equal
+ * codecs first.
+ */
+static int compare_codecs(const void* p_a, const void* p_b)
+{
+  const struct Piphoned_SipCore_Codec* p_codec_a = (const struct Piphoned_SipCore_Codec*) p_a;
+  const struct Piphoned_SipCore_Codec* p_codec_b = (const struct Piphoned_SipCore_Codec*) p_b;
+  double cost_a = codec_cost(p_codec_a);
+  double cost_b = codec_cost(p_codec_b);
+
+  /* Unknown costs last */
+  if (cost_a < 0)
+    cost_a = 1e9;
+  if (cost_b < 0)
+    cost_b = 1e9;
+
+  if (p_codec_a->enabled != p_codec_b->enabled)
+    return p_codec_a->enabled ? -1 : 1;
+
+  if (g_piphoned_config_info.codec_preference == PIPHONED_CODECS_PREFER_BANDWIDTH) {
+    if (p_codec_a->bitrate != p_codec_b->bitrate)
+      return p_codec_a->bitrate < p_codec_b->bitrate ? -1 : 1;
+  }
+  else {
+    if (p_codec_a->rate != p_codec_b->rate)
+      return p_codec_a->rate > p_codec_b->rate ? -1 : 1;
+  }
+
+  if (cost_a != cost_b)
+    return cost_a < cost_b ? -1 : 1;
+
+  return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef PIPHONED_CODECS_H
+#define PIPHONED_CODECS_H
+#include "sipcore.h"
+
+/**
+ * Measures what the SIP core's audio codecs cost on this CPU, unless
+ * the codec cache already knows, and enables and orders the codecs
+ * according to `codec_cpu_budget` and `codec_preference`. The
+ * measurement is done only once for all lines.
+ */
+void piphoned_codecs_configure(struct Piphoned_SipCore* p_core, const char* linename);
+
+#endif
@@ -2,14 +2,32 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
 #include <syslog.h>
+#include <linux/limits.h>
 #include "commandline.h"
 
 struct Piphoned_Commandline_Info g_cli_options;
 
+/* Upper limits for -n and -s; the soak test allocates a latency
+ * sample per call of the interval */
+#define MAX_CYCLES 100000000
+#define MAX_SOAK_INTERVAL 1000000
+
+/* The daemon changes to / before SIGHUP reloads the configuration
+ * file, so a relative -c argument is made absolute */
+static char s_config_file[PATH_MAX];
+
+/* Same for --startup-trace, whose file is written after the change
+ * and usually does not exist yet, so realpath() cannot be used */
+static char s_startup_trace[PATH_MAX];
+
 static void setup_defaults();
 static void process_options(int argc, char* argv[]);
 static void print_help(const char* progname);
+static bool parse_count(const char* arg, unsigned int max, unsigned int* p_count);
+static bool make_absolute(const char* path, char* buf, size_t size);
 
 /**
  * Sets up the global `g_cli_options` variable that contains the
@@ -27,8 +45,12 @@ void piphoned_commandline_info_from_argv(int argc, char* argv[])
  */
 void process_options(int argc, char* argv[])
 {
+  static const struct option long_options[] = {
+    {"startup-trace", required_argument, NULL, 'T'},
+    {NULL, 0, NULL, 0}
+  };
   int option = 0;
-  while ((option = getopt(argc, argv, "dhc:l:")) > 0) { /* Single = intended */
+  while ((option = getopt_long(argc, argv, "dhc:l:n:s:g:", long_options, NULL)) > 0) { /* Single = intended */
     switch(option) {
     case 'd':
       g_cli_options.daemonize = false;
@@ -37,11 +59,36 @@ void process_options(int argc, char* argv[])
       print_help(argv[0]);
       break;
     case 'c':
-      g_cli_options.config_file = optarg;
+      if (realpath(optarg, s_config_file))
+        g_cli_options.config_file = s_config_file;
+      else
+        g_cli_options.config_file = optarg; /* Reported when opening it */
       break;
     case 'l':
       g_cli_options.loglevel = atoi(optarg);
       break;
+    case 'n':
+      if (!parse_count(optarg, MAX_CYCLES, &g_cli_options.benchmark_cycles)) {
+        fprintf(stderr, "Invalid number of benchmark cycles, see -h.\n");
+        exit(1);
+      }
+      break;
+    case 's':
+      if (!parse_count(optarg, MAX_SOAK_INTERVAL, &g_cli_options.soak_interval)) {
+        fprintf(stderr, "Invalid soak sample interval, see -h.\n");
+        exit(1);
+      }
+      break;
+    case 'g':
+      g_cli_options.soak_max_growth = strtoul(optarg, NULL, 10);
+      break;
+    case 'T':
+      if (!make_absolute(optarg, s_startup_trace, sizeof(s_startup_trace))) {
+        fprintf(stderr, "Invalid startup trace path, see -h.\n");
+        exit(1);
+      }
+      g_cli_options.startup_trace = s_startup_trace;
+      break;
     default: /* '?' */
       fprintf(stderr, "Invalid option encountered, see -h.\n");
       exit(1);
@@ -59,10 +106,61 @@ void process_options(int argc, char* argv[])
     g_cli_options.command = PIPHONED_COMMAND_STOP;
   else if (strcmp(argv[optind], "restart") == 0)
     g_cli_options.command = PIPHONED_COMMAND_RESTART;
+  else if (strcmp(argv[optind], "benchmark") == 0)
+    g_cli_options.command = PIPHONED_COMMAND_BENCHMARK;
+  else if (strcmp(argv[optind], "simulate") == 0)
+    g_cli_options.command = PIPHONED_COMMAND_SIMULATE;
+  else if (strcmp(argv[optind], "soak") == 0)
+    g_cli_options.command = PIPHONED_COMMAND_SOAK;
   else {
     fprintf(stderr, "Invalid command encountered, see -h.\n");
     exit(1);
   }
+
+  /* The number of calls defaults differently per command */
+  if (g_cli_options.benchmark_cycles == 0)
+    g_cli_options.benchmark_cycles = g_cli_options.command == PIPHONED_COMMAND_SOAK ? 100000 : 10;
+}
+
+/**
+ * Parses `arg` as a count from 1 to `max` into `p_count`. Returns
+ * false for anything else, including negative numbers, which
+ * strtoul() would wrap around.
+ */
+static bool parse_count(const char* arg, unsigned int max, unsigned int* p_count)
+{
+  char* p_end = NULL;
+  unsigned long count = 0;
+
+  if (strchr(arg, '-'))
+    return false;
+
+  errno = 0;
+  count = strtoul(arg, &p_end, 10);
+  if (errno != 0 || p_end == arg || *p_end != '\0' || count == 0 || count > max)
+    return false;
+
+  *p_count = count;
+  return true;
+}
+
+/**
+ * Prefixes a relative `path` with the current working directory.
+ * Returns false if the result does not fit into `buf`.
+ */
+static bool make_absolute(const char* path, char* buf, size_t size)
+{
+  char cwd[PATH_MAX];
+  int len = 0;
+
+  if (path[0] == '/')
+    len = snprintf(buf, size, "%s", path);
+  else if (getcwd(cwd, sizeof(cwd)))
+    len = snprintf(buf, size, "%s/%s", cwd, path);
+  else
+    return false;
+
+  return len > 0 && (size_t)len < size;
 }
 
 /**
@@ -74,19 +172,45 @@ void setup_defaults()
   g_cli_options.daemonize = true;
   g_cli_options.config_file = "/etc/piphoned.conf";
   g_cli_options.loglevel = LOG_NOTICE;
+  g_cli_options.benchmark_cycles = 0; /* See process_options() */
+  g_cli_options.soak_interval = 1000;
+  g_cli_options.soak_max_growth = 1024;
+  g_cli_options.startup_trace = NULL;
 }
 
 void print_help(const char* progname)
 {
   printf("Usage:\n\
-%s [-d] [-c FILE] COMMAND\n\
+%s [-d] [-c FILE] [-n COUNT] [-s EVERY] [-g KB] [--startup-trace FILE] COMMAND\n\
 \n\
 Options:\n\
 \n\
 -d: Do not fork (for debugging)\n\
 -c FILE: Use FILE as the config file instead of /etc/piphoned.conf\n\
 -l LEVEL: Use LEVEL as the log level. 7 is debug, 0 is basically silence.\n\
+-n COUNT: Number of calls the 'benchmark' command (default 10) or the\n\
+          'soak' command (default 100000) places.\n\
+-s EVERY: Sample resource usage every EVERY calls in the 'soak'\n\
+          command (default 1000).\n\
+-g KB: Memory growth in kB that makes the 'soak' command fail\n\
+       (default 1024).\n\
+--startup-trace FILE: Write the startup phases as a Chrome trace\n\
+       (chrome://tracing, Perfetto) to FILE, an absolute path.\n\
+\n\
+COMMAND may be 'start', 'stop', 'restart', 'benchmark', 'simulate',\n\
+or 'soak'.\n\
+\n\
+'benchmark' runs in the foreground without root rights, using\n\
+simulated hardware and a simulated SIP server, and reports the\n\
+hook-off to INVITE and hang-up to BYE latencies.\n\
+\n\
+'simulate' runs in the foreground without root rights, using the\n\
+configured SIP backend and simulated hardware controlled by the\n\
+commands 'dial DIGITS', 'keypad KEYS', 'lift', 'hangup', 'flash',\n\
+'line N' and 'quit' on stdin.\n\
 \n\
-COMMAND may be 'start', 'stop', or 'restart'.\n", progname);
+'soak' is a long-running 'benchmark' that cycles through outgoing,\n\
+accepted, declined, missed, waiting and busy calls and fails if\n\
+memory, file descriptors or threads leak.\n", progname);
   exit(0);
 }
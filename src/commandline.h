@@ -6,7 +6,10 @@ enum Piphoned_Commandline_Command
 {
   PIPHONED_COMMAND_START = 1,
   PIPHONED_COMMAND_STOP,
-  PIPHONED_COMMAND_RESTART
+  PIPHONED_COMMAND_RESTART,
+  PIPHONED_COMMAND_BENCHMARK,
+  PIPHONED_COMMAND_SIMULATE,
+  PIPHONED_COMMAND_SOAK
 };
 
 struct Piphoned_Commandline_Info
@@ -14,6 +17,10 @@ struct Piphoned_Commandline_Info
   bool daemonize;          /*< Do we want to fork()? */
   const char* config_file; /*< Configuration file to load */
   int loglevel;            /*< Syslog log level, from 7 (debug) to 0 (nothing) */
+  unsigned int benchmark_cycles; /*< Number of calls the `benchmark` and `soak` commands place */
+  unsigned int soak_interval;    /*< Number of calls between two samples of the `soak` command */
+  unsigned long soak_max_growth; /*< Memory growth in kB after which the `soak` command fails */
+  const char* startup_trace;     /*< File to write the Chrome trace of the startup to; NULL for none */
 
   enum Piphoned_Commandline_Command command; /*< Command to run */
 };
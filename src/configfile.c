@@ -3,9 +3,50 @@
 #include <string.h>
 #include <stdbool.h>
 #include <syslog.h>
+#include <sched.h>
+#include <sys/stat.h>
 #include <linphone/linphonecore.h>
 #include "configfile.h"
 #include "userinfo.h"
+#include "flightrec.h"
+
+/* Ports linphone uses if none are configured */
+#define DEFAULT_SIP_PORT 5060
+#define DEFAULT_AUDIO_PORT 7078
+
+/* On-hook pulses in this window (ms) are hook flashes */
+#define DEFAULT_HOOK_FLASH_MIN 100
+#define DEFAULT_HOOK_FLASH_MAX 600
+
+/* Keypad tone detection; see dtmf_detector.c */
+#define DEFAULT_KEYPAD_TIMEOUT 4
+#define DEFAULT_DTMF_MIN_LEVEL -30
+#define DEFAULT_DTMF_TWIST 8
+#define DEFAULT_DTMF_REVERSE_TWIST 4
+
+/* Call progress tones; see tones.c */
+#define DEFAULT_TONE_COUNTRY "de"
+
+/* Ring for a second every five seconds; see ringer.c */
+#define DEFAULT_RING_ON 1000
+#define DEFAULT_RING_OFF 4000
+
+/* Codec selection; see codecs.c */
+#define DEFAULT_CODEC_CPU_BUDGET 30
+
+/* Seconds `piphoned stop' waits before killing the daemon */
+#define DEFAULT_STOP_TIMEOUT 10
+
+/* Load control during calls; see load_controller.c */
+#define DEFAULT_LOAD_CONTROL_HIGH 90
+#define DEFAULT_LOAD_CONTROL_LOW 60
+#define DEFAULT_LOAD_CONTROL_LATE 5
+
+/* Room for the strings not taken from the file: the built-in
+ * defaults, "default" and the "lineN" names */
+#define GENERATED_STRINGS_SIZE (32 + 16 * PIPHONED_MAX_LINES)
+
+#define NUM_OF(array) (sizeof(array) / sizeof((array)[0]))
 
 struct Piphoned_Config_ParsedFile g_piphoned_config_info;
 
@@ -13,20 +54,92 @@ static void piphoned_config_parse_file(FILE* p_file, struct Piphoned_Config_Pars
 static void piphoned_config_parse_ini_separator(const char* line, struct Piphoned_Config_ParsedFile* p_info);
 static void piphoned_config_parse_ini_line(const char* line, struct Piphoned_Config_ParsedFile* p_info);
 static void piphoned_config_parse_ini_generalline(const char* line, struct Piphoned_Config_ParsedFile* p_info);
+static bool piphoned_config_parse_cadence(const char* value, struct Piphoned_Config_ParsedFile* p_info);
 static void piphoned_config_parse_ini_proxyline(const char* line, struct Piphoned_Config_ParsedFile* p_info);
+static void piphoned_config_parse_ini_lineline(const char* line, struct Piphoned_Config_ParsedFile* p_info);
+static void piphoned_config_complete_lines(struct Piphoned_Config_ParsedFile* p_info);
+static struct Piphoned_Config_ParsedFile_LineTable* piphoned_config_new_line(struct Piphoned_Config_ParsedFile* p_info);
 static bool piphoned_config_parse_ini_key(const char* line, char* key, char* value);
 static void piphoned_config_parsed_file_free(struct Piphoned_Config_ParsedFile* p_file);
+static void piphoned_config_keep_restart_settings(struct Piphoned_Config_ParsedFile* p_new);
+static const char* piphoned_config_intern(struct Piphoned_Config_ParsedFile* p_info, const char* str);
+static void piphoned_config_clear_strings(void* p_table, const size_t* offsets, size_t num);
+static void piphoned_config_move_strings(struct Piphoned_Config_ParsedFile* p_info, void* p_table, const size_t* offsets, size_t num);
+static void piphoned_config_rebase_strings(void* p_table, const size_t* offsets, size_t num, const char* p_old, char* p_new, size_t size);
+static void piphoned_config_compact(struct Piphoned_Config_ParsedFile* p_info);
+static size_t piphoned_config_strings_length(const struct Piphoned_Config_ParsedFile* p_info);
 
 enum Piphoned_Config_ParsedFile_ParseState {
   PIPHONED_CONFIG_PARSED_FILE_STOPPED = 0,     /* Parsing finished */
   PIPHONED_CONFIG_PARSED_FILE_STARTING,        /* Parsing just started */
   PIPHONED_CONFIG_PARSED_FILE_PARSING_GENERAL, /* Parsing the [General] section of the config file */
-  PIPHONED_CONFIG_PARSED_FILE_PARSING_PROXY    /* Parsing a proxy section of the config file */
+  PIPHONED_CONFIG_PARSED_FILE_PARSING_PROXY,   /* Parsing a proxy section of the config file */
+  PIPHONED_CONFIG_PARSED_FILE_PARSING_LINE     /* Parsing a [Line] section of the config file */
 };
 
 /* The current state of the config file parser */
 static enum Piphoned_Config_ParsedFile_ParseState s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_STOPPED;
 
+/* Where the string settings are in each table, to treat them alike
+ * when clearing them and moving them to another string pool */
+static const size_t s_general_strings[] = {
+  offsetof(struct Piphoned_Config_ParsedFile, pidfile),
+  offsetof(struct Piphoned_Config_ParsedFile, handoff_socket),
+  offsetof(struct Piphoned_Config_ParsedFile, auto_domain),
+  offsetof(struct Piphoned_Config_ParsedFile, ring_sound_device),
+  offsetof(struct Piphoned_Config_ParsedFile, playback_sound_device),
+  offsetof(struct Piphoned_Config_ParsedFile, capture_sound_device),
+  offsetof(struct Piphoned_Config_ParsedFile, zrtp_secrets_file),
+  offsetof(struct Piphoned_Config_ParsedFile, stunserver),
+  offsetof(struct Piphoned_Config_ParsedFile, messages_dir),
+  offsetof(struct Piphoned_Config_ParsedFile, flightrec_file),
+  offsetof(struct Piphoned_Config_ParsedFile, sip_backend),
+  offsetof(struct Piphoned_Config_ParsedFile, play_file),
+  offsetof(struct Piphoned_Config_ParsedFile, record_file),
+  offsetof(struct Piphoned_Config_ParsedFile, keypad_device),
+  offsetof(struct Piphoned_Config_ParsedFile, tone_device),
+  offsetof(struct Piphoned_Config_ParsedFile, tone_country),
+  offsetof(struct Piphoned_Config_ParsedFile, ringer_device),
+  offsetof(struct Piphoned_Config_ParsedFile, ring_file),
+  offsetof(struct Piphoned_Config_ParsedFile, codec_cache),
+  offsetof(struct Piphoned_Config_ParsedFile, sound_cache)
+};
+static const size_t s_proxy_strings[] = {
+  offsetof(struct Piphoned_Config_ParsedFile_ProxyTable, name),
+  offsetof(struct Piphoned_Config_ParsedFile_ProxyTable, username),
+  offsetof(struct Piphoned_Config_ParsedFile_ProxyTable, password),
+  offsetof(struct Piphoned_Config_ParsedFile_ProxyTable, displayname),
+  offsetof(struct Piphoned_Config_ParsedFile_ProxyTable, server),
+  offsetof(struct Piphoned_Config_ParsedFile_ProxyTable, realm)
+};
+static const size_t s_line_strings[] = {
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, name),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, auto_domain),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, ring_sound_device),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, playback_sound_device),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, capture_sound_device),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, keypad_device),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, tone_device),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, ringer_device),
+  offsetof(struct Piphoned_Config_ParsedFile_LineTable, proxy)
+};
+
+/* The string setting at `offset' in `p_table' */
+#define STRING_AT(p_table, offset) (*(const char**) ((char*) (p_table) + (offset)))
+
+/* Settings a reload cannot change in the running daemon keep their
+ * old value, with a note that they need a restart */
+#define KEEP_NUMBER(p_new, field, key)                                  \
+  if ((p_new)->field != g_piphoned_config_info.field) {                 \
+    syslog(LOG_WARNING, "Setting '%s' changes only on restart.", key);  \
+    (p_new)->field = g_piphoned_config_info.field;                      \
+  }
+#define KEEP_STRING(p_new, field, key)                                  \
+  if (strcmp((p_new)->field, g_piphoned_config_info.field) != 0) {      \
+    syslog(LOG_WARNING, "Setting '%s' changes only on restart.", key);  \
+    (p_new)->field = g_piphoned_config_info.field;                      \
+  }
+
 /**
  * Initialize the global configuration info. When this function is called,
  * it populates the global variable `g_piphoned_config_info` with the
@@ -48,6 +161,7 @@ void piphoned_config_init(const char* configfile)
   s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_STOPPED;
 
   fclose(p_file);
+  piphoned_config_log_footprint();
 }
 
 /**
@@ -59,6 +173,112 @@ void piphoned_config_free()
   piphoned_config_parsed_file_free(&g_piphoned_config_info);
 }
 
+/**
+ * Parses the given configuration file anew for reloading it, into a
+ * dynamically allocated ParsedFile to hand to piphoned_config_apply().
+ * Unlike piphoned_config_init(), an unreadable file is not fatal.
+ */
+struct Piphoned_Config_ParsedFile* piphoned_config_parse_new(const char* configfile)
+{
+  FILE* p_file = fopen(configfile, "r");
+  struct Piphoned_Config_ParsedFile* p_new = NULL;
+
+  if (!p_file) {
+    syslog(LOG_ERR, "Failed to open config file '%s': %m. Keeping the current configuration.", configfile);
+    return NULL;
+  }
+
+  p_new = (struct Piphoned_Config_ParsedFile*) malloc(sizeof(struct Piphoned_Config_ParsedFile));
+  memset(p_new, '\0', sizeof(struct Piphoned_Config_ParsedFile));
+
+  s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_STARTING;
+  piphoned_config_parse_file(p_file, p_new);
+  s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_STOPPED;
+
+  fclose(p_file);
+  return p_new;
+}
+
+/**
+ * Each line has a SIP core and threads of its own, so adding,
+ * removing or renaming lines needs a restart.
+ */
+bool piphoned_config_same_lines(const struct Piphoned_Config_ParsedFile* p_new)
+{
+  int i = 0;
+
+  if (p_new->num_lines != g_piphoned_config_info.num_lines)
+    return false;
+
+  for(i=0; i < p_new->num_lines; i++) {
+    if (strcmp(p_new->lines[i]->name, g_piphoned_config_info.lines[i]->name) != 0)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Makes `p_new` the global configuration, except for what only
+ * takes effect on restart: the user, files and sockets set up while
+ * still root, the SIP backend and ports, scheduling and codecs, and
+ * the set of lines. The line tables stay at their addresses, as the
+ * rest of piphoned points into them. The phone managers have to be
+ * done with the old proxy tables (see
+ * piphoned_phonemanager_reload()), which are freed here, as is
+ * `p_new`. So is the old string pool: whatever kept a string setting
+ * of its own has to fetch it anew.
+ */
+void piphoned_config_apply(struct Piphoned_Config_ParsedFile* p_new)
+{
+  struct Piphoned_Config_ParsedFile_LineTable* p_linetable = NULL;
+  int i = 0;
+
+  piphoned_config_keep_restart_settings(p_new);
+
+  /* The call log stays open */
+  if (p_new->p_calllogfile)
+    fclose(p_new->p_calllogfile);
+  p_new->p_calllogfile = g_piphoned_config_info.p_calllogfile;
+
+  if (piphoned_config_same_lines(p_new)) {
+    for(i=0; i < p_new->num_lines; i++) {
+      p_linetable = g_piphoned_config_info.lines[i];
+
+      KEEP_NUMBER(p_new->lines[i], sip_port, "sip_port");
+      KEEP_NUMBER(p_new->lines[i], audio_port, "audio_port");
+      KEEP_NUMBER(p_new->lines[i], sound_rate, "sound_rate");
+
+      memcpy(p_linetable, p_new->lines[i], sizeof(struct Piphoned_Config_ParsedFile_LineTable));
+      free(p_new->lines[i]);
+      p_new->lines[i] = p_linetable;
+    }
+  }
+  else {
+    syslog(LOG_WARNING, "Adding, removing or renaming lines needs a restart. Keeping the current lines.");
+
+    while (--p_new->num_lines >= 0)
+      free(p_new->lines[p_new->num_lines]);
+    free(p_new->lines);
+
+    p_new->lines = g_piphoned_config_info.lines;
+    p_new->num_lines = g_piphoned_config_info.num_lines;
+    g_piphoned_config_info.lines = NULL;
+  }
+
+  /* The lines belong to `p_new' now, and the strings kept from the
+   * current configuration go into its pool */
+  piphoned_config_compact(p_new);
+
+  g_piphoned_config_info.num_lines = 0;
+  piphoned_config_parsed_file_free(&g_piphoned_config_info);
+
+  memcpy(&g_piphoned_config_info, p_new, sizeof(struct Piphoned_Config_ParsedFile));
+  free(p_new);
+
+  piphoned_config_log_footprint();
+}
+
 /**
  * Parses the given FILE* as a configuration file and stores the information
  * found in `p_info`. This function creates dynamically allocated information
@@ -67,8 +287,47 @@ void piphoned_config_free()
 void piphoned_config_parse_file(FILE* p_file, struct Piphoned_Config_ParsedFile* p_info)
 {
   char line[512];
+  struct stat filestat;
+
+  /* No setting is longer than the file it comes from, so a pool of
+   * the file's size takes them all while parsing. Compacted below. */
+  if (fstat(fileno(p_file), &filestat) < 0) {
+    syslog(LOG_WARNING, "Cannot determine the size of the configuration file: %m");
+    filestat.st_size = 0;
+  }
+  p_info->strings_size = filestat.st_size + GENERATED_STRINGS_SIZE;
+  p_info->strings_used = 0;
+  p_info->p_strings = (char*) malloc(p_info->strings_size);
+  piphoned_config_intern(p_info, ""); /* Unset settings all point here */
+  piphoned_config_clear_strings(p_info, s_general_strings, NUM_OF(s_general_strings));
 
   p_info->num_proxies = 0; /* At start, we do not have any proxies defined */
+  p_info->stop_timeout = DEFAULT_STOP_TIMEOUT;
+  p_info->flightrec_events = 16384;
+  p_info->sip_backend = piphoned_config_intern(p_info, "linphone");
+  p_info->dial_readback = true;
+  p_info->lock_memory = false;
+  p_info->rt_policy = SCHED_FIFO;
+  p_info->gpio_cpu = -1;
+  p_info->audio_cpu = -1;
+  p_info->sip_cpu = -1;
+  p_info->hook_flash_min = DEFAULT_HOOK_FLASH_MIN;
+  p_info->hook_flash_max = DEFAULT_HOOK_FLASH_MAX;
+  p_info->keypad_timeout = DEFAULT_KEYPAD_TIMEOUT;
+  p_info->dtmf_min_level = DEFAULT_DTMF_MIN_LEVEL;
+  p_info->dtmf_twist = DEFAULT_DTMF_TWIST;
+  p_info->dtmf_reverse_twist = DEFAULT_DTMF_REVERSE_TWIST;
+  p_info->tone_country = piphoned_config_intern(p_info, DEFAULT_TONE_COUNTRY);
+  p_info->bell_pin = -1;
+  p_info->ring_cadence[0] = DEFAULT_RING_ON;
+  p_info->ring_cadence[1] = DEFAULT_RING_OFF;
+  p_info->ring_cadence_steps = 2;
+  p_info->codec_cpu_budget = DEFAULT_CODEC_CPU_BUDGET;
+  p_info->codec_preference = PIPHONED_CODECS_PREFER_QUALITY;
+  p_info->load_control_high = DEFAULT_LOAD_CONTROL_HIGH;
+  p_info->load_control_low = DEFAULT_LOAD_CONTROL_LOW;
+  p_info->load_control_late = DEFAULT_LOAD_CONTROL_LATE;
+  p_info->adaptive_jitter_buffer = -1;
 
   while (!feof(p_file)) {
     memset(line, '\0', 512);
@@ -79,35 +338,59 @@ void piphoned_config_parse_file(FILE* p_file, struct Piphoned_Config_ParsedFile*
     else
       piphoned_config_parse_ini_line(line, p_info);
   }
+
+  piphoned_config_complete_lines(p_info);
+
+  if (p_info->hook_flash_min < 0 || p_info->hook_flash_max < p_info->hook_flash_min) {
+    syslog(LOG_ERR, "Ignoring invalid hook flash window from %d to %d ms in configuration file.", p_info->hook_flash_min, p_info->hook_flash_max);
+    p_info->hook_flash_min = DEFAULT_HOOK_FLASH_MIN;
+    p_info->hook_flash_max = DEFAULT_HOOK_FLASH_MAX;
+  }
+
+  piphoned_config_compact(p_info);
 }
 
 /**
- * Parses the given line as an INI separator and appends a new, dynamically
- * created ProxyTable to `p_info->proxies` (and increments `num_proxies`).
+ * Parses the given line as an INI separator. Each [Line] section
+ * appends a new, dynamically created LineTable to `p_info->lines`,
+ * and any other section except [General] a new ProxyTable to
+ * `p_info->proxies` (incrementing `num_lines` or `num_proxies`).
  */
 void piphoned_config_parse_ini_separator(const char* line, struct Piphoned_Config_ParsedFile* p_info)
 {
   char sectionname[512];
   size_t length = strlen(line);
 
-  if (p_info->num_proxies >= PIPHONED_MAX_PROXY_NUM) {
-    syslog(LOG_CRIT, "The maximum number of proxies (%d) has been reached; ignoring configuration file section '%s'", PIPHONED_MAX_PROXY_NUM, line);
-    return;
-  }
-
   memset(sectionname, '\0', 512);
   strncpy(sectionname, line+1, length - 3); /* => max 510 byte, terminating NUL guaranteed; 3 = "]\n\0" */
 
   if (strcmp(sectionname, "General") == 0) {
     s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_PARSING_GENERAL;
   }
+  else if (strcmp(sectionname, "Line") == 0) {
+    if (p_info->num_lines >= PIPHONED_MAX_LINES) {
+      syslog(LOG_CRIT, "The maximum number of lines (%d) has been reached; ignoring configuration file section '%s'", PIPHONED_MAX_LINES, line);
+      s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_STARTING;
+      return;
+    }
+
+    piphoned_config_new_line(p_info);
+    s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_PARSING_LINE;
+  }
+  else if (p_info->num_proxies >= PIPHONED_MAX_PROXY_NUM) {
+    syslog(LOG_CRIT, "The maximum number of proxies (%d) has been reached; ignoring configuration file section '%s'", PIPHONED_MAX_PROXY_NUM, line);
+    s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_STARTING;
+  }
   else {
     struct Piphoned_Config_ParsedFile_ProxyTable* p_proxytable = (struct Piphoned_Config_ParsedFile_ProxyTable*) malloc(sizeof(struct Piphoned_Config_ParsedFile_ProxyTable));
     memset(p_proxytable, '\0', sizeof(struct Piphoned_Config_ParsedFile_ProxyTable));
 
-    strcpy(p_proxytable->name, sectionname);
+    piphoned_config_clear_strings(p_proxytable, s_proxy_strings, NUM_OF(s_proxy_strings));
+    p_proxytable->name = piphoned_config_intern(p_info, sectionname);
+
+    /* Grown one at a time; configuration files have a handful */
+    p_info->proxies = (struct Piphoned_Config_ParsedFile_ProxyTable**) realloc(p_info->proxies, (p_info->num_proxies + 1) * sizeof(struct Piphoned_Config_ParsedFile_ProxyTable*));
     p_info->proxies[p_info->num_proxies++] = p_proxytable;
-    /* TODO: Check we don't exceed PIPHONED_MAX_PROXY_NUM */
 
     s_current_parsestate = PIPHONED_CONFIG_PARSED_FILE_PARSING_PROXY;
   }
@@ -131,6 +414,9 @@ void piphoned_config_parse_ini_line(const char* line, struct Piphoned_Config_Par
   case PIPHONED_CONFIG_PARSED_FILE_PARSING_PROXY:
     piphoned_config_parse_ini_proxyline(line, p_info);
     break;
+  case PIPHONED_CONFIG_PARSED_FILE_PARSING_LINE:
+    piphoned_config_parse_ini_lineline(line, p_info);
+    break;
   default:
     syslog(LOG_WARNING, "Encountered config file line in unexpected state %d", s_current_parsestate);
     break;
@@ -159,7 +445,13 @@ void piphoned_config_parse_ini_generalline(const char* line, struct Piphoned_Con
     p_info->gid = piphoned_userinfo_get_gid(value);
   }
   else if (strcmp(key, "pidfile") == 0) {
-    strcpy(p_info->pidfile, value);
+    p_info->pidfile = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "stop_timeout") == 0) {
+    p_info->stop_timeout = atoi(value);
+  }
+  else if (strcmp(key, "handoff_socket") == 0) {
+    p_info->handoff_socket = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "hangup_pin") == 0) {
     p_info->hangup_pin = atoi(value);
@@ -171,16 +463,16 @@ void piphoned_config_parse_ini_generalline(const char* line, struct Piphoned_Con
     p_info->dial_count_pin = atoi(value);
   }
   else if (strcmp(key, "auto_domain") == 0) {
-    strcpy(p_info->auto_domain, value);
+    p_info->auto_domain = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "ring_sound_device") == 0) {
-    strcpy(p_info->ring_sound_device, value);
+    p_info->ring_sound_device = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "playback_sound_device") == 0) {
-    strcpy(p_info->playback_sound_device, value);
+    p_info->playback_sound_device = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "capture_sound_device") == 0) {
-    strcpy(p_info->capture_sound_device, value);
+    p_info->capture_sound_device = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "audiogroup") == 0) {
     p_info->audiogroup = piphoned_userinfo_get_gid(value);
@@ -193,10 +485,10 @@ void piphoned_config_parse_ini_generalline(const char* line, struct Piphoned_Con
     }
   }
   else if (strcmp(key, "zrtp_secrets_file") == 0) {
-    strcpy(p_info->zrtp_secrets_file, value);
+    p_info->zrtp_secrets_file = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "stunserver") == 0) {
-    strcpy(p_info->stunserver, value);
+    p_info->stunserver = piphoned_config_intern(p_info, value);
   }
   else if (strcmp(key, "firewall_policy") == 0) {
     if (strcmp(value, "no") == 0) {
@@ -222,7 +514,149 @@ void piphoned_config_parse_ini_generalline(const char* line, struct Piphoned_Con
     }
   }
   else if (strcmp(key, "messagesdir") == 0) {
-    strcpy(p_info->messages_dir, value);
+    p_info->messages_dir = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "flightrecorder") == 0) {
+    p_info->flightrec_file = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "flightrecorder_events") == 0) {
+    long events = strtol(value, NULL, 10);
+
+    if (events <= 0 || events > PIPHONED_FLIGHTREC_MAX_EVENTS)
+      syslog(LOG_ERR, "Ignoring invalid flightrecorder_events '%s' in configuration file; it must be between 1 and %d.", value, PIPHONED_FLIGHTREC_MAX_EVENTS);
+    else
+      p_info->flightrec_events = events;
+  }
+  else if (strcmp(key, "sip_backend") == 0) {
+    p_info->sip_backend = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "sip_port") == 0) {
+    p_info->sip_port = atoi(value);
+  }
+  else if (strcmp(key, "audio_port") == 0) {
+    p_info->audio_port = atoi(value);
+  }
+  else if (strcmp(key, "play_file") == 0) {
+    p_info->play_file = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "record_file") == 0) {
+    p_info->record_file = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "dial_readback") == 0) {
+    p_info->dial_readback = strcmp(value, "yes") == 0;
+  }
+  else if (strcmp(key, "lock_memory") == 0) {
+    p_info->lock_memory = strcmp(value, "yes") == 0;
+  }
+  else if (strcmp(key, "rt_policy") == 0) {
+    if (strcmp(value, "fifo") == 0)
+      p_info->rt_policy = SCHED_FIFO;
+    else if (strcmp(value, "rr") == 0)
+      p_info->rt_policy = SCHED_RR;
+    else
+      syslog(LOG_ERR, "Ignoring invalid scheduling policy '%s' for key '%s' in [General] section of configuration file.", value, key);
+  }
+  else if (strcmp(key, "gpio_priority") == 0) {
+    p_info->gpio_priority = atoi(value);
+  }
+  else if (strcmp(key, "gpio_cpu") == 0) {
+    p_info->gpio_cpu = atoi(value);
+  }
+  else if (strcmp(key, "audio_priority") == 0) {
+    p_info->audio_priority = atoi(value);
+  }
+  else if (strcmp(key, "audio_cpu") == 0) {
+    p_info->audio_cpu = atoi(value);
+  }
+  else if (strcmp(key, "sip_priority") == 0) {
+    p_info->sip_priority = atoi(value);
+  }
+  else if (strcmp(key, "sip_cpu") == 0) {
+    p_info->sip_cpu = atoi(value);
+  }
+  else if (strcmp(key, "hook_flash_min") == 0) {
+    p_info->hook_flash_min = atoi(value);
+  }
+  else if (strcmp(key, "hook_flash_max") == 0) {
+    p_info->hook_flash_max = atoi(value);
+  }
+  else if (strcmp(key, "keypad_device") == 0) {
+    p_info->keypad_device = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "keypad_timeout") == 0) {
+    p_info->keypad_timeout = atoi(value);
+  }
+  else if (strcmp(key, "dtmf_min_level") == 0) {
+    p_info->dtmf_min_level = atoi(value);
+  }
+  else if (strcmp(key, "dtmf_twist") == 0) {
+    p_info->dtmf_twist = atoi(value);
+  }
+  else if (strcmp(key, "dtmf_reverse_twist") == 0) {
+    p_info->dtmf_reverse_twist = atoi(value);
+  }
+  else if (strcmp(key, "tone_device") == 0) {
+    p_info->tone_device = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "tone_country") == 0) {
+    p_info->tone_country = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "ringer_device") == 0) {
+    p_info->ringer_device = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "ring_file") == 0) {
+    p_info->ring_file = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "bell_pin") == 0) {
+    p_info->bell_pin = atoi(value);
+  }
+  else if (strcmp(key, "ring_cadence") == 0) {
+    if (!piphoned_config_parse_cadence(value, p_info))
+      syslog(LOG_ERR, "Ignoring invalid ring_cadence '%s' in configuration file.", value);
+  }
+  else if (strcmp(key, "codec_cpu_budget") == 0) {
+    p_info->codec_cpu_budget = atoi(value);
+  }
+  else if (strcmp(key, "codec_preference") == 0) {
+    if (strcmp(value, "quality") == 0)
+      p_info->codec_preference = PIPHONED_CODECS_PREFER_QUALITY;
+    else if (strcmp(value, "bandwidth") == 0)
+      p_info->codec_preference = PIPHONED_CODECS_PREFER_BANDWIDTH;
+    else
+      syslog(LOG_ERR, "Ignoring invalid codec_preference '%s' in configuration file.", value);
+  }
+  else if (strcmp(key, "codec_cache") == 0) {
+    p_info->codec_cache = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "sound_cache") == 0) {
+    p_info->sound_cache = piphoned_config_intern(p_info, value);
+  }
+  else if (strcmp(key, "load_control_high") == 0) {
+    p_info->load_control_high = atoi(value);
+  }
+  else if (strcmp(key, "load_control_low") == 0) {
+    p_info->load_control_low = atoi(value);
+  }
+  else if (strcmp(key, "load_control_late") == 0) {
+    p_info->load_control_late = atoi(value);
+  }
+  else if (strcmp(key, "sound_rate") == 0) {
+    p_info->sound_rate = strcmp(value, "native") == 0 ? PIPHONED_SOUND_RATE_NATIVE : atoi(value);
+  }
+  else if (strcmp(key, "sound_period") == 0) {
+    p_info->sound_period = atoi(value);
+  }
+  else if (strcmp(key, "sound_buffer") == 0) {
+    p_info->sound_buffer = atoi(value);
+  }
+  else if (strcmp(key, "jitter_buffer") == 0) {
+    p_info->jitter_buffer = atoi(value);
+  }
+  else if (strcmp(key, "adaptive_jitter_buffer") == 0) {
+    p_info->adaptive_jitter_buffer = strcmp(value, "yes") == 0;
+  }
+  else if (strcmp(key, "echo_tail") == 0) {
+    p_info->echo_tail = strcmp(value, "off") == 0 ? PIPHONED_ECHO_CANCELLER_OFF : atoi(value);
   }
   else {
     syslog(LOG_ERR, "Ignoring invalid key '%s' in [General] section of configuration file.", key);
@@ -247,21 +681,209 @@ void piphoned_config_parse_ini_proxyline(const char* line, struct Piphoned_Confi
   syslog(LOG_DEBUG, "Configuration keypair in [%s] section: '%s' => '%s'", p_proxytable->name, key, value);
 
   if (strcmp(key, "username") == 0)
-    strcpy(p_proxytable->username, value);
+    p_proxytable->username = piphoned_config_intern(p_info, value);
   else if (strcmp(key, "password") == 0)
-    strcpy(p_proxytable->password, value);
+    p_proxytable->password = piphoned_config_intern(p_info, value);
   else if (strcmp(key, "displayname") == 0)
-    strcpy(p_proxytable->displayname, value);
+    p_proxytable->displayname = piphoned_config_intern(p_info, value);
   else if (strcmp(key, "server") == 0)
-    strcpy(p_proxytable->server, value);
+    p_proxytable->server = piphoned_config_intern(p_info, value);
   else if (strcmp(key, "realm") == 0)
-    strcpy(p_proxytable->realm, value);
+    p_proxytable->realm = piphoned_config_intern(p_info, value);
   else if (strcmp(key, "publish") == 0)
     p_proxytable->use_publish = strcmp(value, "yes") == 0;
+  else if (strcmp(key, "dtmf") == 0) {
+    if (strcmp(value, "rfc2833") == 0)
+      p_proxytable->dtmf_method = PIPHONED_DTMF_RFC2833;
+    else if (strcmp(value, "info") == 0)
+      p_proxytable->dtmf_method = PIPHONED_DTMF_SIP_INFO;
+    else
+      syslog(LOG_ERR, "Ignoring invalid DTMF method '%s' in [%s] section of configuration file.", value, p_proxytable->name);
+  }
   else
     syslog(LOG_ERR, "Ignoring invalid key '%s' in [%s] section of configuration file.", p_proxytable->name, key);
 }
 
+/**
+ * Parses the given line as a setting in a [Line] section.
+ */
+void piphoned_config_parse_ini_lineline(const char* line, struct Piphoned_Config_ParsedFile* p_info)
+{
+  char key[512];
+  char value[512];
+  struct Piphoned_Config_ParsedFile_LineTable* p_linetable = NULL;
+
+  if (!piphoned_config_parse_ini_key(line, key, value)) {
+    syslog(LOG_WARNING, "Ignoring malformed configuration file line '%s'", line);
+    return;
+  }
+
+  p_linetable = p_info->lines[p_info->num_lines - 1];
+  syslog(LOG_DEBUG, "Configuration keypair in [Line] section %d: '%s' => '%s'", p_info->num_lines, key, value);
+
+  if (strcmp(key, "name") == 0)
+    p_linetable->name = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "hangup_pin") == 0)
+    p_linetable->hangup_pin = atoi(value);
+  else if (strcmp(key, "dial_action_pin") == 0)
+    p_linetable->dial_action_pin = atoi(value);
+  else if (strcmp(key, "dial_count_pin") == 0)
+    p_linetable->dial_count_pin = atoi(value);
+  else if (strcmp(key, "auto_domain") == 0)
+    p_linetable->auto_domain = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "ring_sound_device") == 0)
+    p_linetable->ring_sound_device = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "playback_sound_device") == 0)
+    p_linetable->playback_sound_device = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "capture_sound_device") == 0)
+    p_linetable->capture_sound_device = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "keypad_device") == 0)
+    p_linetable->keypad_device = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "tone_device") == 0)
+    p_linetable->tone_device = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "ringer_device") == 0)
+    p_linetable->ringer_device = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "bell_pin") == 0)
+    p_linetable->bell_pin = atoi(value);
+  else if (strcmp(key, "proxy") == 0)
+    p_linetable->proxy = piphoned_config_intern(p_info, value);
+  else if (strcmp(key, "sip_port") == 0)
+    p_linetable->sip_port = atoi(value);
+  else if (strcmp(key, "audio_port") == 0)
+    p_linetable->audio_port = atoi(value);
+  else if (strcmp(key, "sound_rate") == 0)
+    p_linetable->sound_rate = strcmp(value, "native") == 0 ? PIPHONED_SOUND_RATE_NATIVE : atoi(value);
+  else if (strcmp(key, "sound_period") == 0)
+    p_linetable->sound_period = atoi(value);
+  else if (strcmp(key, "sound_buffer") == 0)
+    p_linetable->sound_buffer = atoi(value);
+  else if (strcmp(key, "jitter_buffer") == 0)
+    p_linetable->jitter_buffer = atoi(value);
+  else if (strcmp(key, "adaptive_jitter_buffer") == 0)
+    p_linetable->adaptive_jitter_buffer = strcmp(value, "yes") == 0;
+  else if (strcmp(key, "echo_tail") == 0)
+    p_linetable->echo_tail = strcmp(value, "off") == 0 ? PIPHONED_ECHO_CANCELLER_OFF : atoi(value);
+  else
+    syslog(LOG_ERR, "Ignoring invalid key '%s' in [Line] section of configuration file.", key);
+}
+
+/**
+ * Appends a new, dynamically created LineTable with all values
+ * unset to `p_info->lines`.
+ */
+static struct Piphoned_Config_ParsedFile_LineTable* piphoned_config_new_line(struct Piphoned_Config_ParsedFile* p_info)
+{
+  struct Piphoned_Config_ParsedFile_LineTable* p_linetable = (struct Piphoned_Config_ParsedFile_LineTable*) malloc(sizeof(struct Piphoned_Config_ParsedFile_LineTable));
+  char name[16];
+
+  memset(p_linetable, '\0', sizeof(struct Piphoned_Config_ParsedFile_LineTable));
+  piphoned_config_clear_strings(p_linetable, s_line_strings, NUM_OF(s_line_strings));
+
+  p_linetable->hangup_pin = -1;
+  p_linetable->dial_action_pin = -1;
+  p_linetable->dial_count_pin = -1;
+  p_linetable->bell_pin = -1;
+  p_linetable->adaptive_jitter_buffer = -1;
+  snprintf(name, sizeof(name), "line%d", p_info->num_lines + 1);
+  p_linetable->name = piphoned_config_intern(p_info, name);
+
+  p_info->lines = (struct Piphoned_Config_ParsedFile_LineTable**) realloc(p_info->lines, (p_info->num_lines + 1) * sizeof(struct Piphoned_Config_ParsedFile_LineTable*));
+  p_info->lines[p_info->num_lines++] = p_linetable;
+  return p_linetable;
+}
+
+/**
+ * Fills in what the [Line] sections left unset from the [General]
+ * section. Without any [Line] section, the [General] section
+ * describes the one and only line, as in older configuration files.
+ * Each line runs its own SIP core, so lines without explicit ports
+ * get ports of their own next to the general ones.
+ */
+static void piphoned_config_complete_lines(struct Piphoned_Config_ParsedFile* p_info)
+{
+  int i = 0;
+
+  if (p_info->num_lines == 0) {
+    struct Piphoned_Config_ParsedFile_LineTable* p_linetable = piphoned_config_new_line(p_info);
+
+    p_linetable->name = piphoned_config_intern(p_info, "default");
+    p_linetable->hangup_pin = p_info->hangup_pin;
+    p_linetable->dial_action_pin = p_info->dial_action_pin;
+    p_linetable->dial_count_pin = p_info->dial_count_pin;
+    p_linetable->bell_pin = p_info->bell_pin;
+  }
+
+  for(i=0; i < p_info->num_lines; i++) {
+    struct Piphoned_Config_ParsedFile_LineTable* p_linetable = p_info->lines[i];
+
+    if (strlen(p_linetable->auto_domain) == 0)
+      p_linetable->auto_domain = p_info->auto_domain;
+    if (strlen(p_linetable->ring_sound_device) == 0)
+      p_linetable->ring_sound_device = p_info->ring_sound_device;
+    if (strlen(p_linetable->playback_sound_device) == 0)
+      p_linetable->playback_sound_device = p_info->playback_sound_device;
+    if (strlen(p_linetable->capture_sound_device) == 0)
+      p_linetable->capture_sound_device = p_info->capture_sound_device;
+    if (strlen(p_linetable->keypad_device) == 0)
+      p_linetable->keypad_device = p_info->keypad_device;
+    if (strlen(p_linetable->tone_device) == 0)
+      p_linetable->tone_device = p_info->tone_device;
+    if (strlen(p_linetable->ringer_device) == 0)
+      p_linetable->ringer_device = p_info->ringer_device;
+    if (p_linetable->sound_rate == 0)
+      p_linetable->sound_rate = p_info->sound_rate;
+    if (p_linetable->sound_period == 0)
+      p_linetable->sound_period = p_info->sound_period;
+    if (p_linetable->sound_buffer == 0)
+      p_linetable->sound_buffer = p_info->sound_buffer;
+    if (p_linetable->jitter_buffer == 0)
+      p_linetable->jitter_buffer = p_info->jitter_buffer;
+    if (p_linetable->adaptive_jitter_buffer < 0)
+      p_linetable->adaptive_jitter_buffer = p_info->adaptive_jitter_buffer;
+    if (p_linetable->echo_tail == 0)
+      p_linetable->echo_tail = p_info->echo_tail;
+
+    if (p_linetable->sip_port == 0 && (p_info->sip_port > 0 || i > 0))
+      p_linetable->sip_port = (p_info->sip_port > 0 ? p_info->sip_port : DEFAULT_SIP_PORT) + i;
+    if (p_linetable->audio_port == 0 && (p_info->audio_port > 0 || i > 0))
+      p_linetable->audio_port = (p_info->audio_port > 0 ? p_info->audio_port : DEFAULT_AUDIO_PORT) + 2 * i; /* RTP and RTCP */
+  }
+}
+
+/**
+ * Parses a ring cadence like "400,200,400,2000": milliseconds the
+ * ringer is on, off, on, off and so on, at least one on and off step
+ * each. Leaves `p_info` alone and returns false if it is invalid.
+ */
+static bool piphoned_config_parse_cadence(const char* value, struct Piphoned_Config_ParsedFile* p_info)
+{
+  int cadence[PIPHONED_MAX_RING_CADENCE] = {0};
+  int steps = 0;
+  const char* p = value;
+  char* p_end = NULL;
+
+  while (*p) {
+    long ms = strtol(p, &p_end, 10);
+
+    if (p_end == p || ms <= 0 || steps == PIPHONED_MAX_RING_CADENCE)
+      return false;
+
+    cadence[steps++] = (int) ms;
+    p = p_end;
+    while (*p == ' ')
+      p++;
+    if (*p == ',')
+      p++;
+  }
+
+  if (steps < 2 || steps % 2 != 0)
+    return false;
+
+  memcpy(p_info->ring_cadence, cadence, sizeof(cadence));
+  p_info->ring_cadence_steps = steps;
+  return true;
+}
+
 /**
  * Parses a single "key = value" line. The results are placed in the given
  * arguments, where each is required to have a size of at least 512 byte
@@ -338,6 +960,39 @@ static bool piphoned_config_parse_ini_key(const char* line, char* key, char* val
   return true;
 }
 
+/**
+ * Resets the settings in `p_new` that need a restart to the current
+ * ones.
+ */
+static void piphoned_config_keep_restart_settings(struct Piphoned_Config_ParsedFile* p_new)
+{
+  KEEP_NUMBER(p_new, uid, "uid");
+  KEEP_NUMBER(p_new, gid, "gid");
+  KEEP_NUMBER(p_new, audiogroup, "audiogroup");
+  KEEP_STRING(p_new, pidfile, "pidfile");
+  KEEP_STRING(p_new, handoff_socket, "handoff_socket");
+  KEEP_STRING(p_new, zrtp_secrets_file, "zrtp_secrets_file");
+  KEEP_STRING(p_new, stunserver, "stunserver");
+  KEEP_NUMBER(p_new, firewall_policy, "firewall_policy");
+  KEEP_STRING(p_new, flightrec_file, "flightrecorder");
+  KEEP_NUMBER(p_new, flightrec_events, "flightrecorder_events");
+  KEEP_STRING(p_new, sip_backend, "sip_backend");
+  KEEP_NUMBER(p_new, sip_port, "sip_port");
+  KEEP_NUMBER(p_new, audio_port, "audio_port");
+  KEEP_STRING(p_new, play_file, "play_file");
+  KEEP_STRING(p_new, record_file, "record_file");
+  KEEP_NUMBER(p_new, lock_memory, "lock_memory");
+  KEEP_NUMBER(p_new, rt_policy, "rt_policy");
+  KEEP_NUMBER(p_new, audio_priority, "audio_priority");
+  KEEP_NUMBER(p_new, audio_cpu, "audio_cpu");
+  KEEP_NUMBER(p_new, sip_priority, "sip_priority");
+  KEEP_NUMBER(p_new, sip_cpu, "sip_cpu");
+  KEEP_NUMBER(p_new, codec_cpu_budget, "codec_cpu_budget");
+  KEEP_NUMBER(p_new, codec_preference, "codec_preference");
+  KEEP_STRING(p_new, codec_cache, "codec_cache");
+  KEEP_STRING(p_new, sound_cache, "sound_cache");
+}
+
 /**
  * Frees all dynamically allocated information related to the configuration.
  * The `p_file` pointer itself stays valid.
@@ -347,6 +1002,174 @@ void piphoned_config_parsed_file_free(struct Piphoned_Config_ParsedFile* p_file)
   while (--p_file->num_proxies >= 0) {
     free(p_file->proxies[p_file->num_proxies]);
   }
+  while (--p_file->num_lines >= 0) {
+    free(p_file->lines[p_file->num_lines]);
+  }
+
+  free(p_file->proxies);
+  free(p_file->lines);
+  free(p_file->p_strings);
+
+  p_file->proxies = NULL;
+  p_file->lines = NULL;
+  p_file->p_strings = NULL;
+  p_file->strings_size = 0;
+  p_file->strings_used = 0;
 
   p_file->num_proxies = 0; /* recover -1 */
+  p_file->num_lines = 0;
+}
+
+/**
+ * Logs the memory the global configuration takes: the ParsedFile
+ * itself, the proxy and line tables and the string pool.
+ */
+void piphoned_config_log_footprint()
+{
+  const struct Piphoned_Config_ParsedFile* p_info = &g_piphoned_config_info;
+  size_t proxies = p_info->num_proxies * (sizeof(struct Piphoned_Config_ParsedFile_ProxyTable) + sizeof(struct Piphoned_Config_ParsedFile_ProxyTable*));
+  size_t lines = p_info->num_lines * (sizeof(struct Piphoned_Config_ParsedFile_LineTable) + sizeof(struct Piphoned_Config_ParsedFile_LineTable*));
+
+  syslog(LOG_INFO,
+         "Configuration takes %zu bytes: %zu general, %zu for %d proxies, %zu for %d lines, %zu of strings.",
+         sizeof(struct Piphoned_Config_ParsedFile) + proxies + lines + p_info->strings_size,
+         sizeof(struct Piphoned_Config_ParsedFile),
+         proxies, p_info->num_proxies,
+         lines, p_info->num_lines,
+         p_info->strings_size);
+}
+
+/**
+ * Returns `str' from the string pool of `p_info', adding it if it
+ * is not there yet. The pool never moves while parsing, as it is
+ * sized for the whole file up front; should it still run out, the
+ * setting is logged and left empty.
+ */
+static const char* piphoned_config_intern(struct Piphoned_Config_ParsedFile* p_info, const char* str)
+{
+  size_t length = strlen(str) + 1;
+  size_t offset = 0;
+
+  /* Settings repeat across sections, e.g. the server of several
+   * accounts with the same provider */
+  while (offset < p_info->strings_used) {
+    if (strcmp(p_info->p_strings + offset, str) == 0)
+      return p_info->p_strings + offset;
+
+    offset += strlen(p_info->p_strings + offset) + 1;
+  }
+
+  if (p_info->strings_used + length > p_info->strings_size) {
+    syslog(LOG_ERR, "No room left for configuration setting '%s'; ignoring it.", str);
+    return p_info->p_strings; /* "" */
+  }
+
+  memcpy(p_info->p_strings + p_info->strings_used, str, length);
+  p_info->strings_used += length;
+  return p_info->p_strings + offset;
+}
+
+/**
+ * Sets the `num` string settings at `offsets` in `p_table` to the
+ * empty string.
+ */
+static void piphoned_config_clear_strings(void* p_table, const size_t* offsets, size_t num)
+{
+  size_t i = 0;
+
+  for(i=0; i < num; i++)
+    STRING_AT(p_table, offsets[i]) = "";
+}
+
+/**
+ * Interns the `num` string settings at `offsets` in `p_table` into
+ * the string pool of `p_info`, wherever they pointed before.
+ */
+static void piphoned_config_move_strings(struct Piphoned_Config_ParsedFile* p_info, void* p_table, const size_t* offsets, size_t num)
+{
+  size_t i = 0;
+
+  for(i=0; i < num; i++)
+    STRING_AT(p_table, offsets[i]) = piphoned_config_intern(p_info, STRING_AT(p_table, offsets[i]));
+}
+
+/**
+ * Makes the `num` string settings at `offsets` in `p_table` point
+ * into `p_new` where they pointed into the `size` bytes at `p_old`.
+ */
+static void piphoned_config_rebase_strings(void* p_table, const size_t* offsets, size_t num, const char* p_old, char* p_new, size_t size)
+{
+  size_t i = 0;
+
+  for(i=0; i < num; i++) {
+    const char* str = STRING_AT(p_table, offsets[i]);
+
+    if (str >= p_old && str < p_old + size)
+      STRING_AT(p_table, offsets[i]) = p_new + (str - p_old);
+  }
+}
+
+/**
+ * Upper bound for the string pool of `p_info`: the length of all of
+ * its string settings, as if none were shared.
+ */
+static size_t piphoned_config_strings_length(const struct Piphoned_Config_ParsedFile* p_info)
+{
+  size_t length = 1; /* "" */
+  size_t i = 0;
+  int j = 0;
+
+  for(i=0; i < NUM_OF(s_general_strings); i++)
+    length += strlen(STRING_AT(p_info, s_general_strings[i])) + 1;
+
+  for(j=0; j < p_info->num_proxies; j++)
+    for(i=0; i < NUM_OF(s_proxy_strings); i++)
+      length += strlen(STRING_AT(p_info->proxies[j], s_proxy_strings[i])) + 1;
+
+  for(j=0; j < p_info->num_lines; j++)
+    for(i=0; i < NUM_OF(s_line_strings); i++)
+      length += strlen(STRING_AT(p_info->lines[j], s_line_strings[i])) + 1;
+
+  return length;
+}
+
+/**
+ * Gathers all string settings of `p_info` into a new string pool of
+ * exactly the size they need, and frees the old one. The settings may
+ * point anywhere before, e.g. into the pool of another ParsedFile.
+ */
+static void piphoned_config_compact(struct Piphoned_Config_ParsedFile* p_info)
+{
+  char* p_old = p_info->p_strings;
+  char* p_exact = NULL;
+  int i = 0;
+
+  /* Gather them in a pool sized for the worst case */
+  p_info->strings_size = piphoned_config_strings_length(p_info);
+  p_info->strings_used = 0;
+  p_info->p_strings = (char*) malloc(p_info->strings_size);
+  piphoned_config_intern(p_info, "");
+
+  piphoned_config_move_strings(p_info, p_info, s_general_strings, NUM_OF(s_general_strings));
+  for(i=0; i < p_info->num_proxies; i++)
+    piphoned_config_move_strings(p_info, p_info->proxies[i], s_proxy_strings, NUM_OF(s_proxy_strings));
+  for(i=0; i < p_info->num_lines; i++)
+    piphoned_config_move_strings(p_info, p_info->lines[i], s_line_strings, NUM_OF(s_line_strings));
+
+  free(p_old);
+
+  /* Shared settings leave part of it unused; move them into one of
+   * the exact size */
+  p_exact = (char*) malloc(p_info->strings_used);
+  memcpy(p_exact, p_info->p_strings, p_info->strings_used);
+
+  piphoned_config_rebase_strings(p_info, s_general_strings, NUM_OF(s_general_strings), p_info->p_strings, p_exact, p_info->strings_used);
+  for(i=0; i < p_info->num_proxies; i++)
+    piphoned_config_rebase_strings(p_info->proxies[i], s_proxy_strings, NUM_OF(s_proxy_strings), p_info->p_strings, p_exact, p_info->strings_used);
+  for(i=0; i < p_info->num_lines; i++)
+    piphoned_config_rebase_strings(p_info->lines[i], s_line_strings, NUM_OF(s_line_strings), p_info->p_strings, p_exact, p_info->strings_used);
+
+  free(p_info->p_strings);
+  p_info->p_strings = p_exact;
+  p_info->strings_size = p_info->strings_used;
 }
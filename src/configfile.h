@@ -1,21 +1,81 @@
 #ifndef PIPHONED_CONFIGFILE_H
 #define PIPHONED_CONFIGFILE_H
 #include <stdbool.h>
+#include <stddef.h>
 #include <linux/limits.h>
+#include <linphone/linphonecore.h>
 #include "config.h"
 
+/**
+ * Maximum number of on and off steps of the ring cadence.
+ */
+#define PIPHONED_MAX_RING_CADENCE 8
+
+/**
+ * How digits dialed during a call are sent to the remote side.
+ */
+enum Piphoned_DtmfMethod {
+  PIPHONED_DTMF_RFC2833 = 0, /* RTP telephone-event packets in the audio stream */
+  PIPHONED_DTMF_SIP_INFO     /* SIP INFO requests */
+};
+
+/* Value of `sound_rate` asking for the capture card's native rate */
+#define PIPHONED_SOUND_RATE_NATIVE -1
+
+/* Value of `echo_tail` switching the echo canceller off */
+#define PIPHONED_ECHO_CANCELLER_OFF -1
+
+/**
+ * What to prefer when ordering the audio codecs.
+ */
+enum Piphoned_CodecPreference {
+  PIPHONED_CODECS_PREFER_QUALITY = 0, /* Higher sample rates first */
+  PIPHONED_CODECS_PREFER_BANDWIDTH    /* Lower bitrates first */
+};
+
 /**
  * Configuration data for a single proxy.
  */
 struct Piphoned_Config_ParsedFile_ProxyTable
 {
-  char name[512];        /*< Name of the ini section */
-  char username[512];    /*< Username for authentication */
-  char password[512];    /*< Password for authentication */
-  char displayname[512]; /*< How your name is displayed to other users */
-  char server[PATH_MAX]; /*< SIP server to connect to */
-  char realm[PATH_MAX];  /*< Realm the SIP server asks for */
+  const char* name;      /*< Name of the ini section */
+  const char* username;  /*< Username for authentication */
+  const char* password;  /*< Password for authentication */
+  const char* displayname; /*< How your name is displayed to other users */
+  const char* server;    /*< SIP server to connect to */
+  const char* realm;     /*< Realm the SIP server asks for */
   bool use_publish;      /*< Issue PUBLISH after REGISTER? */
+  enum Piphoned_DtmfMethod dtmf_method; /*< How to send digits dialed during a call */
+};
+
+/**
+ * Configuration data for a single line, i.e. one handset with its
+ * own pins, sound devices and proxy. Settings not given in the
+ * [Line] section are taken over from the [General] section.
+ */
+struct Piphoned_Config_ParsedFile_LineTable
+{
+  const char* name;                /*< Name of the line for logging */
+  int hangup_pin;                  /*< Pin to wait for hangup interrupt on; -1 if unset */
+  int dial_action_pin;             /*< Pin to check for start/stop number dialing; -1 if unset */
+  int dial_count_pin;              /*< Pin to check for the actual digits dialed; -1 if unset */
+  const char* auto_domain;         /*< Domain to append to numbers dialed */
+  const char* ring_sound_device;   /*< Name of the ALSA device used for the ring tone */
+  const char* playback_sound_device; /*< Name of the ALSA device used for playback */
+  const char* capture_sound_device; /*< Name of the ALSA device used for capture */
+  const char* keypad_device;       /*< ALSA PCM to listen for keypad tones on; empty for a rotary dial */
+  const char* tone_device;         /*< ALSA PCM to play dial, ringback and busy tones on; empty for none */
+  const char* ringer_device;       /*< ALSA PCM to play `ring_file` on; empty for linphone's ringer */
+  int bell_pin;                    /*< Output pin driving a bell or buzzer; -1 if unset */
+  const char* proxy;               /*< Name of the provider section to register with; empty for all */
+  int sip_port;                    /*< Local SIP UDP port; 0 for the default */
+  int audio_port;                  /*< Local RTP audio port; 0 for the default */
+  int sound_rate;                  /*< Call audio sample rate in Hz; PIPHONED_SOUND_RATE_NATIVE for the capture card's own; 0 if unset */
+  int sound_period;                /*< ALSA period of piphoned's own sound devices in frames; 0 if unset */
+  int sound_buffer;                /*< ALSA buffer of piphoned's own sound devices in frames; 0 if unset */
+  int jitter_buffer;               /*< Jitter buffer depth in ms; 0 if unset */
+  int adaptive_jitter_buffer;      /*< 1 if the jitter buffer may grow, 0 if not; -1 if unset */
+  int echo_tail;                   /*< Echo canceller tail in ms; PIPHONED_ECHO_CANCELLER_OFF to disable it; 0 if unset */
 };
 
 /**
@@ -26,22 +86,74 @@ struct Piphoned_Config_ParsedFile
   int uid;                /*< User ID to run as */
   int gid;                /*< Group ID to run as */
   int audiogroup;         /*< Group ID of the audio access group */
-  char pidfile[PATH_MAX]; /*< PID file to write to */
+  const char* pidfile;    /*< PID file to write to */
+  int stop_timeout;       /*< Seconds `stop' waits for the daemon to exit before killing it; 0 waits forever */
+  const char* handoff_socket;    /*< Unix socket `restart' takes the phone over through; empty to stop and start */
   int hangup_pin;         /*< Pin to wait for hangup interrupt on */
   int dial_action_pin;    /*< Pin to check for start/stop number dialing */
   int dial_count_pin;     /*< Pin to check for the actual digits dialed */
-  char auto_domain[PATH_MAX]; /*< Domain to append to numbers dialed */
-  char ring_sound_device[512];     /*< Name of the ALSA device used for the ring tone */
-  char playback_sound_device[512]; /*< Name of the ALSA device used for playback */
-  char capture_sound_device[512];  /*< Name of the ALSA device used for capture */
+  const char* auto_domain;    /*< Domain to append to numbers dialed */
+  const char* ring_sound_device;   /*< Name of the ALSA device used for the ring tone */
+  const char* playback_sound_device; /*< Name of the ALSA device used for playback */
+  const char* capture_sound_device; /*< Name of the ALSA device used for capture */
   FILE* p_calllogfile; /*< File to write phone logs into */
-  char zrtp_secrets_file[PATH_MAX]; /*< Path to the file where to store the ZRTP secrets */
-  char stunserver[512]; /*< Domain of a STUN server to use, if firewall_policy is set to LinphonePolicyUseStun */
+  const char* zrtp_secrets_file;    /*< Path to the file where to store the ZRTP secrets */
+  const char* stunserver; /*< Domain of a STUN server to use, if firewall_policy is set to LinphonePolicyUseStun */
   LinphoneFirewallPolicy firewall_policy; /* Firewall policy to use */
-  char messages_dir[PATH_MAX]; /*< Path to the directory where unanswered calls are written to. */
+  const char* messages_dir;    /*< Path to the directory where unanswered calls are written to. */
+  const char* flightrec_file;    /*< Flight recorder file; empty if the recorder is disabled */
+  int flightrec_events;          /*< Number of events the flight recorder keeps */
+  const char* sip_backend;       /*< SIP core implementation to use ("linphone" or "fake") */
+  int sip_port;                  /*< Local SIP UDP port; 0 for the default */
+  int audio_port;                /*< Local RTP audio port; 0 for the default */
+  const char* play_file;         /*< If set, send this WAV file instead of using the sound devices */
+  const char* record_file;       /*< Where to record the remote side when `play_file` is set */
+  bool dial_readback;            /*< Play back the dialed number before calling? */
+  bool lock_memory;              /*< Lock all memory into RAM with mlockall()? */
+  int rt_policy;                 /*< SCHED_FIFO or SCHED_RR for threads with a real-time priority */
+  int gpio_priority;             /*< Real-time priority of the GPIO threads; 0 for normal scheduling */
+  int gpio_cpu;                  /*< CPU to pin the GPIO threads to; -1 for any */
+  int audio_priority;            /*< Real-time priority of the media threads; 0 for normal scheduling */
+  int audio_cpu;                 /*< CPU to pin the media threads to; -1 for any */
+  int sip_priority;              /*< Real-time priority of the mainloop; 0 for normal scheduling */
+  int sip_cpu;                   /*< CPU to pin the mainloop to; -1 for any */
+  int hook_flash_min;            /*< Shortest on-hook pulse in ms that counts as a hook flash */
+  int hook_flash_max;            /*< Longest on-hook pulse in ms that counts as a hook flash */
+  const char* keypad_device;     /*< ALSA PCM to listen for keypad tones on; empty for a rotary dial */
+  int keypad_timeout;            /*< Seconds after the last key until a keypad number is dialed */
+  int dtmf_min_level;            /*< Level in dBFS each keypad tone must reach */
+  int dtmf_twist;                /*< How many dB the row tone may be louder than the column tone */
+  int dtmf_reverse_twist;        /*< How many dB the column tone may be louder than the row tone */
+  const char* tone_device;       /*< ALSA PCM to play dial, ringback and busy tones on; empty for none */
+  const char* tone_country;      /*< Country whose tones to play, e.g. "de" */
+  const char* ringer_device;     /*< ALSA PCM to play `ring_file` on; empty for linphone's ringer */
+  const char* ring_file;         /*< WAV file to ring with */
+  int bell_pin;                  /*< Output pin driving a bell or buzzer; -1 if unset */
+  int ring_cadence[PIPHONED_MAX_RING_CADENCE]; /*< Milliseconds the ringer is alternately on and off */
+  int ring_cadence_steps;        /*< Number of entries in `ring_cadence` */
+  int codec_cpu_budget;          /*< Share of one core in percent a call's codec may use; 0 keeps the SIP core's codec setup */
+  enum Piphoned_CodecPreference codec_preference; /*< How to order the codecs within the budget */
+  const char* codec_cache;       /*< File to keep the measured codec costs in; empty for none */
+  const char* sound_cache;       /*< File to keep the sound devices found working in; empty for none */
+  int load_control_high;         /*< CPU use in percent above which calls are cut back; 0 disables load control */
+  int load_control_low;          /*< CPU use in percent below which calls may recover */
+  int load_control_late;         /*< Percentage of late audio packets that counts as overload */
+  int sound_rate;                /*< Call audio sample rate in Hz; PIPHONED_SOUND_RATE_NATIVE for the capture card's own; 0 if unset */
+  int sound_period;              /*< ALSA period of piphoned's own sound devices in frames; 0 if unset */
+  int sound_buffer;              /*< ALSA buffer of piphoned's own sound devices in frames; 0 if unset */
+  int jitter_buffer;             /*< Jitter buffer depth in ms; 0 if unset */
+  int adaptive_jitter_buffer;    /*< 1 if the jitter buffer may grow, 0 if not; -1 if unset */
+  int echo_tail;                 /*< Echo canceller tail in ms; PIPHONED_ECHO_CANCELLER_OFF to disable it; 0 if unset */
 
-  struct Piphoned_Config_ParsedFile_ProxyTable* proxies[PIPHONED_MAX_PROXY_NUM]; /*< Configuration for the proxies */
+  struct Piphoned_Config_ParsedFile_ProxyTable** proxies; /*< Configuration for the proxies */
   int num_proxies; /*< Number of proxy configs in `proxies` */
+
+  struct Piphoned_Config_ParsedFile_LineTable** lines; /*< Configuration for the lines; always at least one */
+  int num_lines; /*< Number of line configs in `lines` */
+
+  char* p_strings;     /*< Pool all the string settings above point into */
+  size_t strings_size; /*< Bytes allocated for `p_strings` */
+  size_t strings_used; /*< Bytes of `p_strings` in use */
 };
 
 /**
@@ -51,5 +163,11 @@ extern struct Piphoned_Config_ParsedFile g_piphoned_config_info;
 
 void piphoned_config_init(const char* configfile); /*< Read the given configuration file */
 void piphoned_config_free(); /*< Free all dynamically allocated configuration settings */
+void piphoned_config_log_footprint(); /*< Log how much memory the configuration takes */
+
+/* Reloading */
+struct Piphoned_Config_ParsedFile* piphoned_config_parse_new(const char* configfile); /*< Read the given configuration file again; NULL if unreadable */
+bool piphoned_config_same_lines(const struct Piphoned_Config_ParsedFile* p_new);       /*< Does `p_new' describe the lines we drive? */
+void piphoned_config_apply(struct Piphoned_Config_ParsedFile* p_new);                 /*< Take over `p_new' as far as possible without a restart; frees it */
 
 #endif
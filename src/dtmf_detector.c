@@ -0,0 +1,228 @@
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+#include "dtmf_detector.h"
+
+/**
+ * DTMF detector. Each block of PIPHONED_DTMF_BLOCK_SIZE samples is
+ * run through one Goertzel filter per DTMF frequency. A block shows
+ * a key if the strongest row and column tone are loud enough, stand
+ * out from the other tones of their group, are balanced within the
+ * allowed twist and make up most of the block's energy, which keeps
+ * speech and music from being taken as key presses. A key counts as
+ * pressed once it was seen in PRESS_BLOCKS consecutive blocks and as
+ * released once something else was.
+ */
+
+/* A tone must be this many times (in power) stronger than every
+ * other tone of its group; about 8 dB. */
+#define RELATIVE_PEAK 6.3f
+
+/* The two tones must make up at least this share of the energy of
+ * a block. */
+#define MIN_TONE_SHARE 0.5f
+
+/* Consecutive blocks a key (or silence) has to be seen in before it
+ * is taken as pressed (or released). */
+#define PRESS_BLOCKS 2
+
+static const float s_frequencies[PIPHONED_DTMF_NUM_TONES] = {
+  697.0f, 770.0f, 852.0f, 941.0f,   /* Rows */
+  1209.0f, 1336.0f, 1477.0f, 1633.0f /* Columns */
+};
+
+static const char s_keys[4][4] = {
+  {'1', '2', '3', 'A'},
+  {'4', '5', '6', 'B'},
+  {'7', '8', '9', 'C'},
+  {'*', '0', '#', 'D'}
+};
+
+static char finish_block(struct Piphoned_DtmfDetector* p_detector);
+static int strongest_tone(const float* power, int first);
+static bool stands_out(const float* power, int first, int peak);
+static float decibels_to_ratio(int decibels);
+
+/**
+ * Prepares `p_detector`. `min_level_db` is the level (in dBFS) each
+ * of the two tones must reach at least; the twists are how many dB
+ * the row tone may be louder than the column tone and vice versa.
+ */
+void piphoned_dtmfdetector_init(struct Piphoned_DtmfDetector* p_detector, int min_level_db, int max_twist_db, int max_reverse_twist_db)
+{
+  float full_scale = PIPHONED_DTMF_BLOCK_SIZE / 2.0f; /* Goertzel amplitude of a full scale tone */
+  float amplitude = full_scale * powf(10.0f, min_level_db / 20.0f);
+  int k = 0;
+
+  memset(p_detector, '\0', sizeof(struct Piphoned_DtmfDetector));
+
+  for(k=0; k < PIPHONED_DTMF_NUM_TONES; k++)
+    p_detector->coefficients[k] = 2.0f * cosf(2.0f * (float) M_PI * s_frequencies[k] / PIPHONED_DTMF_SAMPLE_RATE);
+
+  p_detector->min_power = amplitude * amplitude;
+  p_detector->max_twist = decibels_to_ratio(max_twist_db);
+  p_detector->max_reverse_twist = decibels_to_ratio(max_reverse_twist_db);
+}
+
+/**
+ * Forgets all audio seen so far, e.g. when the audio stream is
+ * interrupted. The settings are kept.
+ */
+void piphoned_dtmfdetector_reset(struct Piphoned_DtmfDetector* p_detector)
+{
+  memset(p_detector->s1, '\0', sizeof(p_detector->s1));
+  memset(p_detector->s2, '\0', sizeof(p_detector->s2));
+  p_detector->block_energy = 0.0f;
+  p_detector->block_fill = 0;
+  p_detector->block_digit = '\0';
+  p_detector->current_digit = '\0';
+  p_detector->hits = 0;
+}
+
+/**
+ * Runs `count` 16 bit samples at PIPHONED_DTMF_SAMPLE_RATE through
+ * the detector. Each key pressed is stored in `digits` once ('0' to
+ * '9', '*', '#' and 'A' to 'D'), up to `max_digits` of them. Returns
+ * the number of keys stored. Samples may be passed in chunks of any
+ * size; blocks carry over between calls.
+ */
+size_t piphoned_dtmfdetector_process(struct Piphoned_DtmfDetector* p_detector, const int16_t* samples, size_t count, char* digits, size_t max_digits)
+{
+  float coefficients[PIPHONED_DTMF_NUM_TONES] __attribute__((aligned(16)));
+  float s1[PIPHONED_DTMF_NUM_TONES] __attribute__((aligned(16)));
+  float s2[PIPHONED_DTMF_NUM_TONES] __attribute__((aligned(16)));
+  size_t num_digits = 0;
+  size_t i = 0;
+  int k = 0;
+
+  /* Local copies tell the compiler nothing else aliases them */
+  memcpy(coefficients, p_detector->coefficients, sizeof(coefficients));
+
+  while (i < count) {
+    size_t start = i;
+    size_t end = i + (PIPHONED_DTMF_BLOCK_SIZE - p_detector->block_fill);
+    float energy = p_detector->block_energy;
+    char digit = '\0';
+
+    if (end > count)
+      end = count;
+
+    memcpy(s1, p_detector->s1, sizeof(s1));
+    memcpy(s2, p_detector->s2, sizeof(s2));
+
+    for(; i < end; i++) {
+      float x = samples[i] * (1.0f / 32768.0f);
+
+      for(k=0; k < PIPHONED_DTMF_NUM_TONES; k++) {
+        float s0 = x + coefficients[k] * s1[k] - s2[k];
+        s2[k] = s1[k];
+        s1[k] = s0;
+      }
+
+      energy += x * x;
+    }
+
+    memcpy(p_detector->s1, s1, sizeof(s1));
+    memcpy(p_detector->s2, s2, sizeof(s2));
+    p_detector->block_energy = energy;
+    p_detector->block_fill += (int) (end - start);
+
+    if (p_detector->block_fill < PIPHONED_DTMF_BLOCK_SIZE)
+      break;
+
+    digit = finish_block(p_detector);
+    if (digit && num_digits < max_digits)
+      digits[num_digits++] = digit;
+  }
+
+  return num_digits;
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Evaluates the block that just filled up, resets the filters for
+ * the next one and returns the key that is pressed from now on, if
+ * any.
+ */
+static char finish_block(struct Piphoned_DtmfDetector* p_detector)
+{
+  float power[PIPHONED_DTMF_NUM_TONES];
+  char digit = '\0';
+  int row = 0;
+  int column = 0;
+  int k = 0;
+
+  for(k=0; k < PIPHONED_DTMF_NUM_TONES; k++) {
+    float s1 = p_detector->s1[k];
+    float s2 = p_detector->s2[k];
+    power[k] = s1 * s1 + s2 * s2 - p_detector->coefficients[k] * s1 * s2;
+  }
+
+  row = strongest_tone(power, 0);
+  column = strongest_tone(power, 4);
+
+  if (power[row] >= p_detector->min_power && power[column] >= p_detector->min_power
+      && power[row] <= power[column] * p_detector->max_twist
+      && power[column] <= power[row] * p_detector->max_reverse_twist
+      && stands_out(power, 0, row) && stands_out(power, 4, column)
+      && (power[row] + power[column]) * 2.0f / PIPHONED_DTMF_BLOCK_SIZE >= MIN_TONE_SHARE * p_detector->block_energy)
+    digit = s_keys[row][column - 4];
+
+  memset(p_detector->s1, '\0', sizeof(p_detector->s1));
+  memset(p_detector->s2, '\0', sizeof(p_detector->s2));
+  p_detector->block_energy = 0.0f;
+  p_detector->block_fill = 0;
+
+  if (digit == p_detector->block_digit)
+    p_detector->hits++;
+  else {
+    p_detector->block_digit = digit;
+    p_detector->hits = 1;
+  }
+
+  if (p_detector->hits != PRESS_BLOCKS || digit == p_detector->current_digit)
+    return '\0';
+
+  p_detector->current_digit = digit;
+  return digit;
+}
+
+/**
+ * Index of the strongest of the four tones starting at `first`.
+ */
+static int strongest_tone(const float* power, int first)
+{
+  int best = first;
+  int k = 0;
+
+  for(k=first + 1; k < first + 4; k++) {
+    if (power[k] > power[best])
+      best = k;
+  }
+
+  return best;
+}
+
+/**
+ * Checks that tone `peak` is RELATIVE_PEAK times stronger than the
+ * other tones of its group of four starting at `first`.
+ */
+static bool stands_out(const float* power, int first, int peak)
+{
+  int k = 0;
+
+  for(k=first; k < first + 4; k++) {
+    if (k != peak && power[k] * RELATIVE_PEAK > power[peak])
+      return false;
+  }
+
+  return true;
+}
+
+static float decibels_to_ratio(int decibels)
+{
+  return powf(10.0f, decibels / 10.0f);
+}
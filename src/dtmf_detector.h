@@ -0,0 +1,53 @@
+#ifndef PIPHONED_DTMF_DETECTOR_H
+#define PIPHONED_DTMF_DETECTOR_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Sample rate the detector works at. Audio has to be captured (or
+ * resampled) to this rate.
+ */
+#define PIPHONED_DTMF_SAMPLE_RATE 8000
+
+/**
+ * Number of samples per Goertzel block, about 13 ms at 8 kHz. A tone
+ * of the 40 ms ITU-T Q.24 requires to be accepted always covers two
+ * whole blocks, and the bins are still narrow enough to tell
+ * neighbouring DTMF frequencies apart.
+ */
+#define PIPHONED_DTMF_BLOCK_SIZE 102
+
+/**
+ * Number of frequencies in the DTMF matrix: four rows, four columns.
+ */
+#define PIPHONED_DTMF_NUM_TONES 8
+
+/**
+ * State of a DTMF detector. Create one per audio stream with
+ * piphoned_dtmfdetector_init(); it needs no further resources.
+ */
+struct Piphoned_DtmfDetector
+{
+  /* The Goertzel filters of all eight tones are run side by side
+   * over the same samples; keeping them in arrays lets the compiler
+   * turn the inner loop into SIMD instructions. */
+  float coefficients[PIPHONED_DTMF_NUM_TONES] __attribute__((aligned(16))); /*< 2cos(2πf/fs) per tone; rows first */
+  float s1[PIPHONED_DTMF_NUM_TONES] __attribute__((aligned(16)));           /*< Filter state, previous sample */
+  float s2[PIPHONED_DTMF_NUM_TONES] __attribute__((aligned(16)));           /*< Filter state, sample before that */
+  float block_energy;      /*< Sum of the squared samples of the current block */
+  int block_fill;          /*< Samples in the current block so far */
+
+  float min_power;         /*< Goertzel power a tone needs at least */
+  float max_twist;         /*< Power ratio the row tone may exceed the column tone by */
+  float max_reverse_twist; /*< Power ratio the column tone may exceed the row tone by */
+
+  char block_digit;        /*< Digit seen in the last block, '\0' if none */
+  char current_digit;      /*< Key reported as held down, '\0' if none */
+  int hits;                /*< Consecutive blocks `block_digit` was seen in */
+};
+
+void piphoned_dtmfdetector_init(struct Piphoned_DtmfDetector* p_detector, int min_level_db, int max_twist_db, int max_reverse_twist_db);
+void piphoned_dtmfdetector_reset(struct Piphoned_DtmfDetector* p_detector);
+size_t piphoned_dtmfdetector_process(struct Piphoned_DtmfDetector* p_detector, const int16_t* samples, size_t count, char* digits, size_t max_digits);
+
+#endif
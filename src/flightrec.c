@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "flightrec.h"
+
+static struct Piphoned_FlightRec_Header* sp_header = NULL; /* Start of the mapping, NULL if disabled */
+static struct Piphoned_FlightRec_Event* sp_events = NULL;  /* First event slot in the mapping */
+static size_t s_mapping_size = 0;
+static uint32_t s_mask = 0; /* capacity - 1 */
+
+static uint64_t clock_nanoseconds(clockid_t clock);
+
+/**
+ * Opens (and if necessary creates) the flight recorder file at `path`
+ * and maps it into memory. If the file already contains a recording
+ * of the same capacity, recording continues where it left off, so
+ * the history from before a crash is kept.
+ *
+ * Since the file is a shared mapping, recording an event does not
+ * involve any system call, and the data survives a crash of this
+ * process. Put the file on a tmpfs (like /run) if the kernel should
+ * not write it back to disk at all.
+ *
+ * \param path     File to record into.
+ * \param capacity Number of events to keep, at most
+ *                 PIPHONED_FLIGHTREC_MAX_EVENTS. Rounded up to the
+ *                 next power of two.
+ *
+ * \returns false if the file could not be set up. Recording calls
+ * are silently ignored in that case.
+ */
+bool piphoned_flightrec_init(const char* path, uint32_t capacity)
+{
+  int fd = -1;
+  uint32_t slots = 1;
+  struct stat fileinfo;
+  bool reuse = false;
+
+  if (capacity == 0 || capacity > PIPHONED_FLIGHTREC_MAX_EVENTS) {
+    syslog(LOG_ERR, "Invalid flight recorder capacity of %u events, not recording.", capacity);
+    return false;
+  }
+
+  while (slots < capacity)
+    slots <<= 1;
+
+  s_mapping_size = sizeof(struct Piphoned_FlightRec_Header) + slots * sizeof(struct Piphoned_FlightRec_Event);
+
+  fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to open flight recorder file '%s': %m", path);
+    return false;
+  }
+
+  if (fstat(fd, &fileinfo) == 0 && (size_t) fileinfo.st_size == s_mapping_size)
+    reuse = true;
+  else if (ftruncate(fd, s_mapping_size) != 0) {
+    syslog(LOG_ERR, "Failed to size flight recorder file '%s': %m", path);
+    close(fd);
+    return false;
+  }
+
+  sp_header = (struct Piphoned_FlightRec_Header*) mmap(NULL, s_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); /* The mapping keeps the file referenced */
+
+  if (sp_header == MAP_FAILED) {
+    syslog(LOG_ERR, "Failed to map flight recorder file '%s': %m", path);
+    sp_header = NULL;
+    return false;
+  }
+
+  if (reuse && (sp_header->magic != PIPHONED_FLIGHTREC_MAGIC
+                || sp_header->version != PIPHONED_FLIGHTREC_VERSION
+                || sp_header->capacity != slots
+                || sp_header->event_size != sizeof(struct Piphoned_FlightRec_Event)))
+    reuse = false;
+
+  if (!reuse) {
+    memset(sp_header, '\0', s_mapping_size);
+    sp_header->magic      = PIPHONED_FLIGHTREC_MAGIC;
+    sp_header->version    = PIPHONED_FLIGHTREC_VERSION;
+    sp_header->capacity   = slots;
+    sp_header->event_size = sizeof(struct Piphoned_FlightRec_Event);
+  }
+
+  sp_header->realtime_base  = clock_nanoseconds(CLOCK_REALTIME);
+  sp_header->monotonic_base = clock_nanoseconds(CLOCK_MONOTONIC);
+
+  sp_events = (struct Piphoned_FlightRec_Event*) (sp_header + 1);
+  s_mask = slots - 1;
+
+  syslog(LOG_INFO, "Flight recorder %s '%s' with %u event slots.", reuse ? "continuing in" : "initialized", path, slots);
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_STARTUP, 0, getpid());
+
+  return true;
+}
+
+/**
+ * Records the shutdown and unmaps the recorder file.
+ */
+void piphoned_flightrec_free()
+{
+  if (!sp_header)
+    return;
+
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_SHUTDOWN, 0, 0);
+  munmap(sp_header, s_mapping_size);
+
+  sp_header = NULL;
+  sp_events = NULL;
+}
+
+/**
+ * Records an event. Safe to call from any thread; does nothing if
+ * the recorder is not set up. The slot's sequence number is cleared
+ * before and set after the other fields, so the decoder can tell a
+ * write torn by a crash from the event of the previous round.
+ */
+void piphoned_flightrec_record(uint16_t type, uint16_t arg1, uint32_t arg2)
+{
+  struct Piphoned_FlightRec_Event* p_event = NULL;
+  uint32_t index = 0;
+
+  if (!sp_header)
+    return;
+
+  index = __atomic_fetch_add(&sp_header->head, 1, __ATOMIC_RELAXED);
+  p_event = &sp_events[index & s_mask];
+
+  __atomic_store_n(&p_event->sequence, 0, __ATOMIC_RELEASE);
+  p_event->timestamp = clock_nanoseconds(CLOCK_MONOTONIC);
+  p_event->arg1      = arg1;
+  p_event->arg2      = arg2;
+  p_event->type      = type;
+  __atomic_store_n(&p_event->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t clock_nanoseconds(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,76 @@
+#ifndef PIPHONED_FLIGHTREC_H
+#define PIPHONED_FLIGHTREC_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIPHONED_FLIGHTREC_MAGIC 0x52465050 /* "PPFR" */
+#define PIPHONED_FLIGHTREC_VERSION 2
+#define PIPHONED_FLIGHTREC_MAX_EVENTS (1 << 24) /* 384 MiB of events; more is a typo */
+
+/**
+ * Kinds of events the flight recorder knows about. The meaning
+ * of the two event arguments depends on the type. Only ever
+ * append to this list, the numbers end up in recorder files.
+ */
+enum Piphoned_FlightRec_EventType {
+  PIPHONED_FLIGHTREC_NONE = 0,     /* Unused slot */
+  PIPHONED_FLIGHTREC_STARTUP,      /* arg2: PID */
+  PIPHONED_FLIGHTREC_SHUTDOWN,     /* No arguments */
+  PIPHONED_FLIGHTREC_GPIO_EDGE,    /* arg1: wiringPi pin */
+  PIPHONED_FLIGHTREC_DIGIT,        /* arg1: decoded digit, arg2: line index */
+  PIPHONED_FLIGHTREC_HOOK,         /* arg1: 1 if hung up, 0 if lifted, arg2: line index */
+  PIPHONED_FLIGHTREC_CALL_STATE,   /* arg1: LinphoneCallState, arg2: call handle */
+  PIPHONED_FLIGHTREC_REGISTRATION, /* arg1: LinphoneRegistrationState, arg2: proxy index */
+  PIPHONED_FLIGHTREC_ERROR,        /* arg1: Piphoned_FlightRec_Error, arg2: detail */
+  PIPHONED_FLIGHTREC_FLASH,        /* arg1: on-hook time in ms, arg2: line index */
+  PIPHONED_FLIGHTREC_LOAD_LEVEL,   /* arg1: Piphoned_LoadLevel, arg2: system CPU % | piphoned CPU % << 8 | late packets in 0.1 % << 16 */
+  PIPHONED_FLIGHTREC_STARTUP_PHASE /* arg1: Piphoned_StartupPhase (PIPHONED_NUM_STARTUP_PHASES for all of the startup) | line index + 1 << 8 (0 for the process), arg2: duration in ms */
+};
+
+/**
+ * Error codes for PIPHONED_FLIGHTREC_ERROR events.
+ */
+enum Piphoned_FlightRec_Error {
+  PIPHONED_FLIGHTREC_ERR_INVALID_URI = 1, /* Refused to dial a malformed SIP URI */
+  PIPHONED_FLIGHTREC_ERR_INVITE,          /* linphone_core_invite() failed */
+  PIPHONED_FLIGHTREC_ERR_CALL,            /* Call went into the error state */
+  PIPHONED_FLIGHTREC_ERR_SOUND_DEVICE,    /* A sound device is unusable */
+  PIPHONED_FLIGHTREC_ERR_GPIO_POLL,       /* poll() on a GPIO node failed; arg2: errno */
+  PIPHONED_FLIGHTREC_ERR_AUTHTOKEN        /* ZRTP SAS token could not be written */
+};
+
+/**
+ * A single recorded event. Kept at 24 bytes so that recording is
+ * a handful of stores into an already mapped page.
+ */
+struct Piphoned_FlightRec_Event
+{
+  uint64_t timestamp; /*< CLOCK_MONOTONIC time in nanoseconds */
+  uint16_t type;      /*< One of Piphoned_FlightRec_EventType */
+  uint16_t arg1;      /*< First argument, see event type */
+  uint32_t arg2;      /*< Second argument, see event type */
+  uint32_t sequence;  /*< `head` the event was written at plus one, stored last; 0 while being written */
+  uint32_t padding;   /*< Pad to 24 bytes */
+};
+
+/**
+ * Layout of the start of a recorder file. The events follow
+ * directly after the header.
+ */
+struct Piphoned_FlightRec_Header
+{
+  uint32_t magic;       /*< PIPHONED_FLIGHTREC_MAGIC */
+  uint32_t version;     /*< PIPHONED_FLIGHTREC_VERSION */
+  uint32_t capacity;    /*< Number of event slots, always a power of two */
+  uint32_t event_size;  /*< sizeof(struct Piphoned_FlightRec_Event) */
+  uint64_t realtime_base;  /*< CLOCK_REALTIME at the last startup, in nanoseconds */
+  uint64_t monotonic_base; /*< CLOCK_MONOTONIC at the same moment, in nanoseconds */
+  uint32_t head;        /*< Total number of events ever written (wraps). Shared resource! */
+  uint32_t padding[7];  /*< Pad to 64 bytes */
+};
+
+bool piphoned_flightrec_init(const char* path, uint32_t capacity); /*< Map the recorder file */
+void piphoned_flightrec_free();                                   /*< Unmap the recorder file */
+void piphoned_flightrec_record(uint16_t type, uint16_t arg1, uint32_t arg2); /*< Record an event */
+
+#endif
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE /* accept4(), MSG_CMSG_CLOEXEC */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linphone/linphonecore.h>
+#include "handoff.h"
+#include "configfile.h"
+#include "process.h"
+
+/**
+ * Restarting without making the phone unreachable. With
+ * `handoff_socket` set, the daemon listens on that Unix socket, and
+ * `piphoned restart` starts the new process right away instead of
+ * stopping the old one first. The new process does its privileged
+ * setup, then asks the old one for the phone:
+ *
+ *   new -> old: HANDOFF <pid>
+ *   old -> new: RELEASED <line>=<0|1> ...
+ *   new -> old: CONFIRMED
+ *
+ * The old daemon waits until no line has a call, then closes its SIP
+ * cores without unregistering and frees the GPIO pins and sound
+ * devices. It passes on which lines were registered. The new process
+ * binds the same SIP ports, so the bindings at the registrars stay
+ * valid, and SIP retransmissions reach it during the short gap. It
+ * confirms once the lines registered before are registered again,
+ * and then the old daemon exits. If the new process dies or does not
+ * confirm in time, the old daemon takes the phone back.
+ *
+ * Along with RELEASED, the old daemon passes the listening handoff
+ * socket, so that it survives any number of restarts without root
+ * rights. Linphone cannot adopt sockets opened elsewhere, so the SIP
+ * and RTP sockets themselves are not passed; the ports are.
+ */
+
+/* How long the old daemon waits for the confirmation, in seconds */
+#define CONFIRM_TIMEOUT 60
+
+/* How long a new process that failed gets to exit after SIGTERM
+ * unless `stop_timeout` is set, in seconds */
+#define STOP_TIMEOUT 10
+
+/* How long a connection may take to send its request, in seconds */
+#define REQUEST_TIMEOUT 5
+
+#define MAX_MESSAGE_LENGTH 1024
+
+static int s_listen_fd = -1;  /* Old daemon: listening socket */
+static int s_peer_fd = -1;    /* Connection to the other process */
+static pid_t s_peer_pid = 0;  /* Old daemon: PID of the new process */
+static int s_peer_pidfd = -1; /* Old daemon: pidfd of the new process, -1 without pidfds */
+static int s_request_fd = -1; /* Old daemon: connection whose request is not complete yet */
+static struct timespec s_request_start; /* When `s_request_fd' was accepted */
+static char s_lines[MAX_MESSAGE_LENGTH]; /* " name=flag" for every line */
+
+static bool read_line(int fd, char* target, size_t size, int timeout, int* p_passed_fd);
+static bool write_line(int fd, const char* line, int passed_fd);
+static int peek_line(int fd, size_t size);
+static void drop_request(const char* reason);
+static bool peer_trusted(int fd, pid_t pid);
+
+bool piphoned_handoff_listen()
+{
+  struct sockaddr_un address;
+  const char* path = g_piphoned_config_info.handoff_socket;
+  mode_t mask = 0;
+  int result = 0;
+
+  if (strlen(path) == 0)
+    return true;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    syslog(LOG_ERR, "Handoff socket path '%s' is too long.", path);
+    return false;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  s_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s_listen_fd < 0) {
+    syslog(LOG_ERR, "Failed to create handoff socket: %m");
+    return false;
+  }
+
+  /* A left-over socket of a previous daemon, or of the one handing
+   * over to us, which does not accept anymore */
+  unlink(path);
+
+  /* Only we and root may ask for the phone. The socket is created
+   * that way rather than restricted afterwards. */
+  mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+  result = bind(s_listen_fd, (struct sockaddr*) &address, sizeof(address));
+  umask(mask);
+
+  if (result < 0 || listen(s_listen_fd, 1) < 0) {
+    syslog(LOG_ERR, "Failed to listen on handoff socket '%s': %m", path);
+    goto fail;
+  }
+
+  chown(path, g_piphoned_config_info.uid, g_piphoned_config_info.gid);
+
+  syslog(LOG_INFO, "Accepting handoff requests on '%s'.", path);
+  return true;
+
+ fail:
+  close(s_listen_fd);
+  s_listen_fd = -1;
+  return false;
+}
+
+/**
+ * Never blocks: a request that has not fully arrived yet is looked
+ * at again in the next mainloop iteration, and dropped if it takes
+ * longer than REQUEST_TIMEOUT.
+ */
+bool piphoned_handoff_requested()
+{
+  char message[MAX_MESSAGE_LENGTH];
+  struct timespec now;
+  pid_t pid = 0;
+  int complete = 0;
+
+  /* The new process is not asked for the phone while taking it over */
+  if (s_peer_fd >= 0)
+    return s_peer_pid != 0;
+  if (s_listen_fd < 0)
+    return false;
+
+  if (s_request_fd < 0) {
+    s_request_fd = accept4(s_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (s_request_fd < 0)
+      return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &s_request_start);
+  }
+
+  complete = peek_line(s_request_fd, sizeof(message));
+  if (complete < 0) {
+    drop_request("Ignoring invalid handoff request.");
+    return false;
+  }
+  if (complete == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - s_request_start.tv_sec >= REQUEST_TIMEOUT)
+      drop_request("Ignoring incomplete handoff request.");
+    return false;
+  }
+
+  /* The whole line is there, reading it does not wait */
+  if (!read_line(s_request_fd, message, sizeof(message), 0, NULL) || sscanf(message, "HANDOFF %d", &pid) != 1 || pid <= 0) {
+    drop_request("Ignoring invalid handoff request.");
+    return false;
+  }
+
+  if (!peer_trusted(s_request_fd, pid)) {
+    drop_request(NULL);
+    return false;
+  }
+
+  s_peer_pidfd = piphoned_process_open(pid);
+  if (s_peer_pidfd < 0 && errno != ENOSYS) {
+    syslog(LOG_WARNING, "Ignoring handoff request of process %d: %m", pid);
+    drop_request(NULL);
+    return false;
+  }
+
+  syslog(LOG_NOTICE, "Process %d asks for the phone, handing over once all lines are idle.", pid);
+  s_peer_pid = pid;
+  s_peer_fd = s_request_fd;
+  s_request_fd = -1;
+  s_lines[0] = '\0';
+  return true;
+}
+
+void piphoned_handoff_note_line(const char* linename, bool registered)
+{
+  size_t length = strlen(s_lines);
+
+  snprintf(s_lines + length, sizeof(s_lines) - length, " %s=%d", linename, registered);
+}
+
+void piphoned_handoff_release()
+{
+  char message[MAX_MESSAGE_LENGTH + 16];
+
+  snprintf(message, sizeof(message), "RELEASED%s", s_lines);
+  if (!write_line(s_peer_fd, message, s_listen_fd))
+    syslog(LOG_ERR, "Failed to hand over to process %d: %m", s_peer_pid);
+}
+
+bool piphoned_handoff_wait_confirmation()
+{
+  char message[MAX_MESSAGE_LENGTH];
+  bool confirmed = false;
+
+  confirmed = read_line(s_peer_fd, message, sizeof(message), CONFIRM_TIMEOUT * 1000, NULL) && strcmp(message, "CONFIRMED") == 0;
+
+  /* A new process that is still running but did not get its lines
+   * registered gives the phone back */
+  if (!confirmed && !piphoned_process_wait_exit(s_peer_pid, s_peer_pidfd, 0)) {
+    int timeout = g_piphoned_config_info.stop_timeout > 0 ? g_piphoned_config_info.stop_timeout : STOP_TIMEOUT;
+
+    syslog(LOG_ERR, "Process %d did not take over within %d seconds, stopping it.", s_peer_pid, CONFIRM_TIMEOUT);
+    if (piphoned_process_signal(s_peer_pid, s_peer_pidfd, SIGTERM) < 0 || !piphoned_process_wait_exit(s_peer_pid, s_peer_pidfd, timeout * 1000)) {
+      syslog(LOG_WARNING, "Process %d did not exit within %d seconds, sending SIGKILL.", s_peer_pid, timeout);
+      if (piphoned_process_signal(s_peer_pid, s_peer_pidfd, SIGKILL) < 0 || !piphoned_process_wait_exit(s_peer_pid, s_peer_pidfd, PIPHONED_PROCESS_KILL_TIMEOUT))
+        syslog(LOG_CRIT, "Cannot kill process %d.", s_peer_pid);
+    }
+  }
+
+  close(s_peer_fd);
+  if (s_peer_pidfd >= 0)
+    close(s_peer_pidfd);
+
+  s_peer_fd = -1;
+  s_peer_pidfd = -1;
+  s_peer_pid = 0;
+  return confirmed;
+}
+
+bool piphoned_handoff_take_over()
+{
+  struct sockaddr_un address;
+  char message[MAX_MESSAGE_LENGTH];
+  const char* path = g_piphoned_config_info.handoff_socket;
+  int fd = -1;
+
+  if (strlen(path) == 0 || strlen(path) >= sizeof(address.sun_path))
+    return false;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    syslog(LOG_INFO, "No daemon to take over from at '%s': %m", path);
+    close(fd);
+    return false;
+  }
+
+  if (!peer_trusted(fd, 0)) {
+    close(fd);
+    return false;
+  }
+
+  snprintf(message, sizeof(message), "HANDOFF %d", getpid());
+  if (!write_line(fd, message, -1)) {
+    close(fd);
+    return false;
+  }
+
+  /* The old daemon finishes its calls first, however long they take */
+  syslog(LOG_NOTICE, "Waiting for the running daemon to hand over the phone.");
+  if (!read_line(fd, message, sizeof(message), -1, &s_listen_fd) || strncmp(message, "RELEASED", 8) != 0) {
+    syslog(LOG_ERR, "The running daemon did not hand over the phone.");
+    piphoned_handoff_free();
+    close(fd);
+    return false;
+  }
+
+  strcpy(s_lines, message + 8);
+  s_peer_fd = fd;
+  syslog(LOG_NOTICE, "Took over the phone, registered lines were:%s", strlen(s_lines) > 0 ? s_lines : " none");
+  return true;
+}
+
+bool piphoned_handoff_is_pending()
+{
+  /* Only the old daemon knows the PID of its peer */
+  return s_peer_fd >= 0 && s_peer_pid == 0;
+}
+
+bool piphoned_handoff_was_registered(const char* linename)
+{
+  char entry[256];
+
+  snprintf(entry, sizeof(entry), " %s=1", linename);
+  return strstr(s_lines, entry) != NULL;
+}
+
+void piphoned_handoff_confirm()
+{
+  if (!write_line(s_peer_fd, "CONFIRMED", -1))
+    syslog(LOG_WARNING, "Failed to confirm the handoff: %m");
+  else
+    syslog(LOG_NOTICE, "Handoff complete.");
+
+  close(s_peer_fd);
+  s_peer_fd = -1;
+}
+
+void piphoned_handoff_free()
+{
+  if (s_peer_fd >= 0)
+    close(s_peer_fd);
+  if (s_peer_pidfd >= 0)
+    close(s_peer_pidfd);
+  if (s_request_fd >= 0)
+    close(s_request_fd);
+  if (s_listen_fd >= 0)
+    close(s_listen_fd);
+
+  s_peer_fd = -1;
+  s_peer_pidfd = -1;
+  s_request_fd = -1;
+  s_listen_fd = -1;
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Reads one newline-terminated message into `target`, without the
+ * newline, waiting at most `timeout` ms for each part of it, or
+ * forever if negative. A file descriptor passed along is stored in
+ * `p_passed_fd`, or closed if that is NULL.
+ */
+static bool read_line(int fd, char* target, size_t size, int timeout, int* p_passed_fd)
+{
+  struct pollfd pfd;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* p_cmsg = NULL;
+  char control[CMSG_SPACE(sizeof(int))];
+  size_t length = 0;
+  ssize_t n = 0;
+  int ready = 0;
+  int passed_fd = -1;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (length < size - 1) {
+    ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return false;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = target + length;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+      return false;
+
+    p_cmsg = CMSG_FIRSTHDR(&msg);
+    if (p_cmsg && p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&passed_fd, CMSG_DATA(p_cmsg), sizeof(int));
+      if (p_passed_fd)
+        *p_passed_fd = passed_fd;
+      else
+        close(passed_fd);
+    }
+
+    if (target[length] == '\n') {
+      target[length] = '\0';
+      return true;
+    }
+    length++;
+  }
+
+  return false;
+}
+
+/**
+ * Looks whether a whole line of less than `size` bytes is waiting
+ * on `fd`, without reading it or waiting for it. Returns 1 if so, 0
+ * if not yet, and -1 if none will come (closed, failed, too long).
+ */
+static int peek_line(int fd, size_t size)
+{
+  char buffer[MAX_MESSAGE_LENGTH];
+  ssize_t n = 0;
+
+  if (size > sizeof(buffer))
+    size = sizeof(buffer);
+
+  n = recv(fd, buffer, size, MSG_PEEK | MSG_DONTWAIT);
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  if (n == 0)
+    return -1;
+  if (memchr(buffer, '\n', n))
+    return 1;
+
+  return (size_t) n < size ? 0 : -1;
+}
+
+/**
+ * Closes the connection of an unfinished request, logging `reason`
+ * unless it is NULL.
+ */
+static void drop_request(const char* reason)
+{
+  if (reason)
+    syslog(LOG_WARNING, "%s", reason);
+
+  close(s_request_fd);
+  s_request_fd = -1;
+}
+
+/**
+ * Checks that the process at the other end of `fd` runs as root or
+ * as piphoned's user and, unless `pid` is 0, is process `pid`.
+ */
+static bool peer_trusted(int fd, pid_t pid)
+{
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+    syslog(LOG_WARNING, "Cannot determine the process at the other end of the handoff socket: %m");
+    return false;
+  }
+
+  if (credentials.uid != 0 && credentials.uid != geteuid() && credentials.uid != (uid_t) g_piphoned_config_info.uid) {
+    syslog(LOG_WARNING, "Ignoring handoff peer %d running as user %d.", (int) credentials.pid, (int) credentials.uid);
+    return false;
+  }
+
+  if (pid != 0 && credentials.pid != pid) {
+    syslog(LOG_WARNING, "Ignoring handoff request of process %d claiming to be process %d.", (int) credentials.pid, (int) pid);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Sends `line` plus a newline, and `passed_fd` along with it unless
+ * it is negative.
+ */
+static bool write_line(int fd, const char* line, int passed_fd)
+{
+  char message[MAX_MESSAGE_LENGTH + 32];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* p_cmsg = NULL;
+  char control[CMSG_SPACE(sizeof(int))];
+  int length = snprintf(message, sizeof(message), "%s\n", line);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = message;
+  iov.iov_len = length;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (passed_fd >= 0) {
+    memset(control, '\0', sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    p_cmsg = CMSG_FIRSTHDR(&msg);
+    p_cmsg->cmsg_level = SOL_SOCKET;
+    p_cmsg->cmsg_type = SCM_RIGHTS;
+    p_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(p_cmsg), &passed_fd, sizeof(int));
+  }
+
+  return sendmsg(fd, &msg, MSG_NOSIGNAL) == length;
+}
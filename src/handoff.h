@@ -0,0 +1,20 @@
+#ifndef PIPHONED_HANDOFF_H
+#define PIPHONED_HANDOFF_H
+#include <stdbool.h>
+
+/* Old daemon */
+bool piphoned_handoff_listen();              /*< Accept handoff requests on `handoff_socket'; call while still root */
+bool piphoned_handoff_requested();           /*< Has a new process asked for the phone? Call once per mainloop iteration */
+void piphoned_handoff_note_line(const char* linename, bool registered); /*< Pass a line's registration state on */
+void piphoned_handoff_release();             /*< Tell the new process the phone is free now */
+bool piphoned_handoff_wait_confirmation();   /*< Wait until the new process has taken over; false if it failed */
+
+/* New process */
+bool piphoned_handoff_take_over();           /*< Ask a running daemon for the phone; false if there is none */
+bool piphoned_handoff_is_pending();          /*< Does the old daemon still wait for our confirmation? */
+bool piphoned_handoff_was_registered(const char* linename); /*< Was the line registered in the old daemon? */
+void piphoned_handoff_confirm();             /*< Let the old daemon exit */
+
+void piphoned_handoff_free();                /*< Close all handoff sockets */
+
+#endif
@@ -11,6 +11,10 @@
 #include "hwactions.h"
 #include "configfile.h"
 #include "trigger_monitor.h"
+#include "interrupt_handler.h"
+#include "logring.h"
+#include "flightrec.h"
+#include "arena.h"
 
 /**
  * Maximum length of a SIP uri.
@@ -19,56 +23,130 @@
 #define MAX_SIP_URI_LENGTH 512
 
 /**
- * Keeping track of our allocated TriggerMonitor instances.
+ * Number of digits dialed during a call that may wait for the
+ * mainloop to send them. Must be a power of two.
  */
-struct TriggerMonitorListItem
+#define MAX_INCALL_DIGITS 16
+
+/**
+ * A digit dialed during a call, waiting to be sent.
+ */
+struct IncallDigit
 {
-  struct Piphoned_HwActions_TriggerMonitor* p_monitor;
-  struct TriggerMonitorListItem* p_next;
+  char digit;                /*< '0' to '9' */
+  struct timespec dialed_at; /*< When the dial came to rest (CLOCK_MONOTONIC) */
 };
 
-static struct TriggerMonitorListItem* sp_trigger_monitors = NULL; /*< Keeping track of our allocated TriggerMonitor instances */
-static bool s_is_reading_hwdigit = false; /* Are we dialing a digit right now? Shared resource! */
-static int s_hwdigit = -1; /* Current dialed digit. Shared, but only sequencially in different threads. */
-static char s_sip_uri[MAX_SIP_URI_LENGTH]; /* The full dialed SIP URI. Shared resource! */
-static struct timeval s_dial_timestamp;
+/**
+ * State of the hardware of one line: its pins, the digits dialed on
+ * it and its hook switch. Digits dialed while the handset is lifted
+ * go to `incall_digits` instead of `sip_uri`.
+ */
+struct HwLine
+{
+  const struct Piphoned_Config_ParsedFile_LineTable* p_config; /*< Pins and auto domain of the line */
+  struct Piphoned_HwActions_TriggerMonitor* p_action_monitor;  /*< Monitor of the dial action pin */
+  struct Piphoned_HwActions_TriggerMonitor* p_count_monitor;   /*< Monitor of the dial count pin */
+  bool is_reading_hwdigit;     /*< Are we dialing a digit right now? Shared resource! */
+  int hwdigit;                 /*< Current dialed digit. Shared, but only sequencially in different threads. */
+  char sip_uri[MAX_SIP_URI_LENGTH]; /*< The full dialed SIP URI. Shared resource! */
+  struct timeval dial_timestamp;
+  bool is_monitored;           /*< Are the line's GPIO pins watched? */
+  bool number_complete;        /*< Was the keypad number ended with '#'? Shared resource! */
+  bool hook_raw_hung_up;       /*< Hook switch level after the last edge. Shared resource! */
+  struct timespec hook_changed_at; /*< When `hook_raw_hung_up` last changed (CLOCK_MONOTONIC) */
+  bool hook_reported_hung_up;  /*< Hook state last reported to the mainloop */
+  bool flash_wanted;           /*< Would a hook flash mean anything right now? Shared resource! */
+  bool flash_pending;          /*< Hook flash the mainloop has not taken yet. Shared resource! */
+  struct IncallDigit incall_digits[MAX_INCALL_DIGITS]; /*< Ring of digits to send during a call */
+  unsigned int incall_head;    /*< Count of digits ever queued. Shared resource! */
+  unsigned int incall_tail;    /*< Count of digits ever taken. Shared resource! */
+  pthread_mutex_t hwdigit_mutex; /*< Protects `is_reading_hwdigit`, `sip_uri` and queueing to `incall_digits` */
+  pthread_mutex_t hook_mutex;  /*< Protects the `hook_*` members */
+};
 
-/* This mutex protects the access to s_is_reading_hwdigit and s_sip_uri. */
-static pthread_mutex_t s_hwdigit_mutex;
+static struct HwLine s_lines[PIPHONED_MAX_LINES];
+static int s_num_lines = 0;
+static bool s_simulated = false;        /* Hardware replaced by piphoned_hwactions_simulate_*() calls? */
 
 static void dial_action_callback(int pin, void* arg);
 static void dial_count_callback(int pin, void* arg);
+static void hook_callback(int pin, void* arg);
+static void hook_changed(struct HwLine* p_line, bool hung_up);
+static long milliseconds_since(const struct timespec* p_then);
+static bool is_line_hung_up(struct HwLine* p_line);
+static void append_digit(struct HwLine* p_line, char digit);
 
 /**
- * Sets up the callbacks for the interrupts on the Raspberry Pi’s pins.
+ * Sets up the callbacks for the interrupts on the Raspberry Pi’s pins
+ * of all configured lines.
  */
 void piphoned_hwactions_init()
 {
-  memset(s_sip_uri, '\0', MAX_SIP_URI_LENGTH);
-  gettimeofday(&s_dial_timestamp, NULL);
+  int i = 0;
+
+  s_num_lines = g_piphoned_config_info.num_lines;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct HwLine* p_line = &s_lines[i];
+
+    memset(p_line, '\0', sizeof(struct HwLine));
+    p_line->p_config = g_piphoned_config_info.lines[i];
+    p_line->hwdigit = -1;
+    p_line->hook_raw_hung_up = true;
+    p_line->hook_reported_hung_up = true;
+    pthread_mutex_init(&p_line->hwdigit_mutex, NULL);
+    pthread_mutex_init(&p_line->hook_mutex, NULL);
+    gettimeofday(&p_line->dial_timestamp, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &p_line->hook_changed_at);
+  }
+
+  if (s_simulated) {
+    syslog(LOG_NOTICE, "Hardware is simulated, not monitoring any GPIO pins.");
+    return;
+  }
+
+  for(i=0; i < s_num_lines; i++) {
+    struct HwLine* p_line = &s_lines[i];
+    bool is_keypad = strlen(p_line->p_config->keypad_device) > 0;
 
-  pinMode(g_piphoned_config_info.hangup_pin, INPUT);
+    if (p_line->p_config->hangup_pin < 0) {
+      syslog(LOG_ERR, "Line %s lacks hangup_pin. Not monitoring it.", p_line->p_config->name);
+      continue;
+    }
+    if (!is_keypad && (p_line->p_config->dial_action_pin < 0 || p_line->p_config->dial_count_pin < 0)) {
+      syslog(LOG_ERR, "Line %s lacks one of dial_action_pin and dial_count_pin. Not monitoring it.", p_line->p_config->name);
+      continue;
+    }
+
+    p_line->is_monitored = true;
+    pinMode(p_line->p_config->hangup_pin, INPUT);
+    p_line->hook_raw_hung_up = digitalRead(p_line->p_config->hangup_pin) == LOW;
+    p_line->hook_reported_hung_up = p_line->hook_raw_hung_up;
 
-  /* The grace time values used in this function as the first argument
-   * to piphoned_hwactions_triggermonitor_new() describe the timespan
-   * in which the lowlevel hardware triggers should be ignored if they
-   * happen to fast in a sequence (which happens all the time). The
-   * exact values used have been found by trial&error.
-   * TODO: Make them configurable? */
+    /* The hook switch is not run through a trigger monitor: telling a
+     * hook flash from a hang-up needs the time of every edge, which
+     * the monitor's grace time would swallow. hook_changed() sorts
+     * out contact bounce itself. */
+    piphoned_handle_pin_interrupt(p_line->p_config->hangup_pin, INT_EDGE_BOTH, hook_callback, p_line);
 
-  struct Piphoned_HwActions_TriggerMonitor* p_monitor = piphoned_hwactions_triggermonitor_new(100000, g_piphoned_config_info.dial_action_pin, dial_action_callback, NULL);
-  piphoned_hwactions_triggermonitor_setup(p_monitor, INT_EDGE_BOTH);
+    /* Keypad lines are dialed through tones, see keypad.c */
+    if (is_keypad)
+      continue;
 
-  sp_trigger_monitors = (struct TriggerMonitorListItem*) malloc(sizeof(struct TriggerMonitorListItem));
-  sp_trigger_monitors->p_monitor = p_monitor;
-  sp_trigger_monitors->p_next = NULL;
+    /* The grace time values used in this function as the first argument
+     * to piphoned_hwactions_triggermonitor_new() describe the timespan
+     * in which the lowlevel hardware triggers should be ignored if they
+     * happen to fast in a sequence (which happens all the time). The
+     * exact values used have been found by trial&error.
+     * TODO: Make them configurable? */
 
-  p_monitor = piphoned_hwactions_triggermonitor_new(70000, g_piphoned_config_info.dial_count_pin, dial_count_callback, NULL);
-  piphoned_hwactions_triggermonitor_setup(p_monitor, INT_EDGE_FALLING);
+    p_line->p_action_monitor = piphoned_hwactions_triggermonitor_new(100000, p_line->p_config->dial_action_pin, dial_action_callback, p_line);
+    piphoned_hwactions_triggermonitor_setup(p_line->p_action_monitor, INT_EDGE_BOTH);
 
-  sp_trigger_monitors->p_next = (struct TriggerMonitorListItem*) malloc(sizeof(struct TriggerMonitorListItem));
-  sp_trigger_monitors->p_next->p_monitor = p_monitor;
-  sp_trigger_monitors->p_next->p_next = NULL;
+    p_line->p_count_monitor = piphoned_hwactions_triggermonitor_new(70000, p_line->p_config->dial_count_pin, dial_count_callback, p_line);
+    piphoned_hwactions_triggermonitor_setup(p_line->p_count_monitor, INT_EDGE_FALLING);
+  }
 }
 
 /**
@@ -76,36 +154,242 @@ void piphoned_hwactions_init()
  */
 void piphoned_hwactions_free()
 {
-  struct TriggerMonitorListItem* p_item = sp_trigger_monitors;
+  int i = 0;
+
   syslog(LOG_DEBUG, "Asking all monitors to terminate.");
 
-  while(p_item->p_next) {
-    struct TriggerMonitorListItem* p_next = p_item->p_next;
-    piphoned_hwactions_triggermonitor_free(p_item->p_monitor);
-    free(p_item);
-    p_item = p_next;
-  }
+  for(i=0; i < s_num_lines; i++) {
+    if (!s_simulated && s_lines[i].is_monitored)
+      piphoned_terminate_pin_interrupt_handler(s_lines[i].p_config->hangup_pin);
 
-  piphoned_hwactions_triggermonitor_free(p_item->p_monitor);
-  free(p_item);
+    piphoned_hwactions_triggermonitor_free(s_lines[i].p_action_monitor);
+    piphoned_hwactions_triggermonitor_free(s_lines[i].p_count_monitor);
+    s_lines[i].p_action_monitor = NULL;
+    s_lines[i].p_count_monitor = NULL;
+    pthread_mutex_destroy(&s_lines[i].hwdigit_mutex);
+    pthread_mutex_destroy(&s_lines[i].hook_mutex);
+  }
 
   syslog(LOG_DEBUG, "All monitors terminated.");
-  sp_trigger_monitors = NULL;
+  s_num_lines = 0;
+}
+
+/**
+ * Checks if the phone of the given line is on the base. Lifting the
+ * handset is reported at once, and so is putting it down unless a
+ * hook flash is wanted on the line (see
+ * piphoned_hwactions_set_flash_wanted()). In that case the handset
+ * has to stay down longer than the `hook_flash_max` setting before
+ * the line counts as hung up, as it could still turn out to be a
+ * flash.
+ */
+bool piphoned_hwactions_is_phone_hung_up(int line)
+{
+  struct HwLine* p_line = &s_lines[line];
+  bool hung_up = false;
+
+  /* Catches edges the interrupt thread missed, e.g. when the pin
+   * changed faster than it could be read back. */
+  if (!s_simulated && p_line->is_monitored)
+    hook_changed(p_line, digitalRead(p_line->p_config->hangup_pin) == LOW);
+
+  pthread_mutex_lock(&p_line->hook_mutex);
+
+  if (!p_line->hook_raw_hung_up)
+    p_line->hook_reported_hung_up = false;
+  else if (!p_line->hook_reported_hung_up) {
+    if (!__atomic_load_n(&p_line->flash_wanted, __ATOMIC_ACQUIRE)
+        || milliseconds_since(&p_line->hook_changed_at) > g_piphoned_config_info.hook_flash_max)
+      p_line->hook_reported_hung_up = true;
+  }
+
+  hung_up = p_line->hook_reported_hung_up;
+  pthread_mutex_unlock(&p_line->hook_mutex);
+
+  return hung_up;
+}
+
+/**
+ * Tell whether a hook flash would mean anything on the given line,
+ * i.e. whether there is a waiting or held call to switch to. As long
+ * as it does not, putting down the handset hangs up immediately.
+ */
+void piphoned_hwactions_set_flash_wanted(int line, bool wanted)
+{
+  __atomic_store_n(&s_lines[line].flash_wanted, wanted, __ATOMIC_RELEASE);
+}
+
+/**
+ * Replace the GPIO pins by the piphoned_hwactions_simulate_*()
+ * functions. Has to be called before piphoned_hwactions_init(). The
+ * simulated phones start out hung up.
+ */
+void piphoned_hwactions_set_simulated(bool simulated)
+{
+  s_simulated = simulated;
+}
+
+/**
+ * Simulate lifting (`hung_up` false) or putting down (`hung_up` true)
+ * the handset of the given line. May be called from any thread.
+ */
+void piphoned_hwactions_simulate_hook(int line, bool hung_up)
+{
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_GPIO_EDGE, s_lines[line].p_config->hangup_pin, 0);
+  hook_changed(&s_lines[line], hung_up);
+}
+
+/**
+ * Simulate a hook flash on the given line. May be called from any
+ * thread. Putting the handset down and lifting it again quickly with
+ * piphoned_hwactions_simulate_hook() has the same effect.
+ */
+void piphoned_hwactions_simulate_flash(int line)
+{
+  __atomic_store_n(&s_lines[line].flash_pending, true, __ATOMIC_RELEASE);
 }
 
 /**
- * Checks if the phone is on the base.
+ * Simulate dialing the given digits on the rotary dial of the given
+ * line. Digits are handled exactly as if they had been dialed on the
+ * hardware: appended to the URI while the handset is on the base,
+ * sent into the call otherwise. May be called from any thread.
  */
-bool piphoned_hwactions_is_phone_hung_up()
+void piphoned_hwactions_simulate_digits(int line, const char* digits)
 {
-  return digitalRead(g_piphoned_config_info.hangup_pin) == LOW;
+  struct HwLine* p_line = &s_lines[line];
+  int i = 0;
+
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+
+  for(i=0; digits[i]; i++)
+    append_digit(p_line, digits[i]);
+
+  gettimeofday(&p_line->dial_timestamp, NULL);
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
 }
 
 /**
- * Get a dialed SIP URI which is guaranteed to be NUL-terminated and
- * start with the sequence "sip:" (without the quotes). The
- * `auto_domain` setting from the configuration file is automatically
- * appanded after an @ sign.
+ * Enter a key pressed on the keypad of the given line, as detected
+ * from its tones. Digits and '*' are appended to the SIP URI, '#'
+ * ends the number; the other keys are ignored.
+ */
+void piphoned_hwactions_keypad_digit(int line, char key)
+{
+  struct HwLine* p_line = &s_lines[line];
+  int length = 0;
+
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+
+  length = strlen(p_line->sip_uri);
+  if (key == '#') {
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_DIGIT, 11, line); /* Event code of RFC 4733 */
+    p_line->number_complete = length > 0;
+  }
+  else if ((key >= '0' && key <= '9') || key == '*') {
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_DIGIT, key == '*' ? 10 : key - '0', line);
+
+    if (length < MAX_SIP_URI_LENGTH - 1)
+      p_line->sip_uri[length] = key;
+    else
+      PIPHONED_LOG(LOG_ERR, "Reached maximum length of SIP URI (%d). Ignoring new key.", MAX_SIP_URI_LENGTH);
+  }
+  else {
+    PIPHONED_LOG(LOG_DEBUG, "Ignoring keypad key without a meaning.");
+  }
+
+  gettimeofday(&p_line->dial_timestamp, NULL);
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
+}
+
+/**
+ * Checks whether anything has been dialed on the given line since the
+ * last call.
+ */
+bool piphoned_hwactions_is_dialing(int line)
+{
+  struct HwLine* p_line = &s_lines[line];
+  bool dialing = false;
+
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+  dialing = p_line->sip_uri[0] != '\0';
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
+
+  return dialing;
+}
+
+/**
+ * Checks whether a number entered on the keypad of the given line is
+ * complete, i.e. ended with '#' or not continued for the
+ * `keypad_timeout` setting.
+ */
+bool piphoned_hwactions_is_number_complete(int line)
+{
+  struct HwLine* p_line = &s_lines[line];
+  struct timeval now;
+  bool complete = false;
+
+  gettimeofday(&now, NULL);
+
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+  if (p_line->sip_uri[0] != '\0')
+    complete = p_line->number_complete || now.tv_sec - p_line->dial_timestamp.tv_sec >= g_piphoned_config_info.keypad_timeout;
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
+
+  return complete;
+}
+
+/**
+ * Forget whatever has been dialed on the given line so far.
+ */
+void piphoned_hwactions_clear_sip_uri(int line)
+{
+  struct HwLine* p_line = &s_lines[line];
+
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+  memset(p_line->sip_uri, '\0', MAX_SIP_URI_LENGTH);
+  p_line->number_complete = false;
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
+}
+
+/**
+ * Checks whether the handset of the given line was flashed since the
+ * last call, and resets that. Each flash is reported exactly once.
+ */
+bool piphoned_hwactions_take_flash(int line)
+{
+  return __atomic_exchange_n(&s_lines[line].flash_pending, false, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Takes the oldest digit dialed during a call on the given line, if
+ * any. `p_dialed_at` receives the time the dial came to rest, so that
+ * the caller can keep an eye on how long digits wait. Digits are
+ * queued whenever the handset is lifted; the caller has to discard
+ * them if there is no call to send them to.
+ */
+bool piphoned_hwactions_take_incall_digit(int line, char* p_digit, struct timespec* p_dialed_at)
+{
+  struct HwLine* p_line = &s_lines[line];
+  unsigned int tail = p_line->incall_tail;
+  struct IncallDigit* p_entry = NULL;
+
+  if (tail == __atomic_load_n(&p_line->incall_head, __ATOMIC_ACQUIRE))
+    return false;
+
+  p_entry = &p_line->incall_digits[tail & (MAX_INCALL_DIGITS - 1)];
+  *p_digit = p_entry->digit;
+  *p_dialed_at = p_entry->dialed_at;
+
+  __atomic_store_n(&p_line->incall_tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * Get the SIP URI dialed on the given line, which is guaranteed to be
+ * NUL-terminated and start with the sequence "sip:" (without the
+ * quotes). The line's `auto_domain` setting from the configuration
+ * file is automatically appanded after an @ sign.
  *
  * The URI is reset afterwards, i.e. if you call this function again
  * immediately, you’ll get a zero-length string.
@@ -113,27 +397,122 @@ bool piphoned_hwactions_is_phone_hung_up()
  * `target` has to be at least MAX_SIP_URI length bytes long and is
  * guaranteed to be NUL-terminated on return.
  */
-void piphoned_hwactions_get_sip_uri(char* target)
+void piphoned_hwactions_get_sip_uri(int line, char* target)
 {
+  struct HwLine* p_line = &s_lines[line];
+
   memset(target, '\0', MAX_SIP_URI_LENGTH);
 
-  pthread_mutex_lock(&s_hwdigit_mutex);
-  sprintf(target, "sip:%s@%s", s_sip_uri, g_piphoned_config_info.auto_domain);
-  memset(s_sip_uri, '\0', MAX_SIP_URI_LENGTH);
-  pthread_mutex_unlock(&s_hwdigit_mutex);
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+  snprintf(target, MAX_SIP_URI_LENGTH, "sip:%s@%s", p_line->sip_uri, p_line->p_config->auto_domain);
+  memset(p_line->sip_uri, '\0', MAX_SIP_URI_LENGTH);
+  p_line->number_complete = false;
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
 }
 
-static void dial_action_callback(int pin, void* arg)
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static bool is_line_hung_up(struct HwLine* p_line)
 {
-  /* If a user dials while phoning, ignore it for now. It could later
-   * be used for automatic customer service handling. */
-  if (!piphoned_hwactions_is_phone_hung_up()) {
-    syslog(LOG_NOTICE, "Ignoring attempt to input a digit while the phone is not hung up.");
+  if (s_simulated)
+    return __atomic_load_n(&p_line->hook_raw_hung_up, __ATOMIC_ACQUIRE);
+
+  return digitalRead(p_line->p_config->hangup_pin) == LOW;
+}
+
+/**
+ * Hands a decoded digit on. Call with `hwdigit_mutex` held. While the
+ * handset is on the base, the digit is part of the number to call and
+ * appended to `sip_uri`; otherwise it is meant for the remote side of
+ * a call (an IVR menu, say) and queued to be sent right away.
+ */
+static void append_digit(struct HwLine* p_line, char digit)
+{
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_DIGIT, digit - '0', p_line - s_lines);
+
+  if (is_line_hung_up(p_line)) {
+    int length = strlen(p_line->sip_uri);
+
+    /* Check we don’t exceed maxmium length of string (-> segfault) */
+    if (length >= MAX_SIP_URI_LENGTH - 1) {
+      PIPHONED_LOG(LOG_ERR, "Reached maximum length of SIP URI (%d). Ignoring new digit %d.", MAX_SIP_URI_LENGTH, digit - '0');
+      return;
+    }
+
+    /* Append to the URI string, which is NUL-filled for empty digits already. */
+    p_line->sip_uri[length] = digit;
+  }
+  else {
+    unsigned int head = p_line->incall_head;
+    struct IncallDigit* p_entry = NULL;
+
+    if (head - __atomic_load_n(&p_line->incall_tail, __ATOMIC_ACQUIRE) >= MAX_INCALL_DIGITS) {
+      PIPHONED_LOG(LOG_WARNING, "Too many digits dialed during the call. Ignoring new digit %d.", digit - '0');
+      return;
+    }
+
+    p_entry = &p_line->incall_digits[head & (MAX_INCALL_DIGITS - 1)];
+    p_entry->digit = digit;
+    clock_gettime(CLOCK_MONOTONIC, &p_entry->dialed_at);
+    __atomic_store_n(&p_line->incall_head, head + 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void hook_callback(int pin, void* arg)
+{
+  hook_changed((struct HwLine*) arg, digitalRead(pin) == LOW);
+}
+
+/**
+ * Feeds a new level of the hook switch into the flash classifier.
+ * Lifting the handset after it has been down for a time within the
+ * configured hook flash window makes a flash, unless the mainloop
+ * already took the line as hung up. Shorter on-hook pulses are
+ * contact bounce and are ignored; levels that did not change are
+ * ignored as well.
+ */
+static void hook_changed(struct HwLine* p_line, bool hung_up)
+{
+  long duration = 0;
+
+  pthread_mutex_lock(&p_line->hook_mutex);
+
+  if (hung_up == p_line->hook_raw_hung_up) {
+    pthread_mutex_unlock(&p_line->hook_mutex);
     return;
   }
 
+  duration = milliseconds_since(&p_line->hook_changed_at);
+  if (!hung_up && !p_line->hook_reported_hung_up
+      && duration >= g_piphoned_config_info.hook_flash_min
+      && duration <= g_piphoned_config_info.hook_flash_max) {
+    PIPHONED_LOG(LOG_DEBUG, "Hook flash of %d ms detected.", (int) duration);
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_FLASH, duration, p_line - s_lines);
+    __atomic_store_n(&p_line->flash_pending, true, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&p_line->hook_raw_hung_up, hung_up, __ATOMIC_RELEASE);
+  clock_gettime(CLOCK_MONOTONIC, &p_line->hook_changed_at);
+
+  pthread_mutex_unlock(&p_line->hook_mutex);
+}
+
+static long milliseconds_since(const struct timespec* p_then)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - p_then->tv_sec) * 1000 + (now.tv_nsec - p_then->tv_nsec) / 1000000;
+}
+
+static void dial_action_callback(int pin, void* arg)
+{
+  struct HwLine* p_line = (struct HwLine*) arg;
+
   /* Signal start/stop of reading a single digit */
-  pthread_mutex_lock(&s_hwdigit_mutex);
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
 
   /* Sometimes there is an interrupt on the dial action pin although it shouldn't.
    * Nobody touched it, it just happens. In that case s_reading_digit is set to
@@ -142,40 +521,30 @@ static void dial_action_callback(int pin, void* arg)
    * since the start of the inputting a suspiciously large number of seconds
    * has passed, we ignore that and instead treat the new interrupt as the
    * start of a digit. */
-  if (s_is_reading_hwdigit) {
+  if (p_line->is_reading_hwdigit) {
     struct timeval timestamp;
     gettimeofday(&timestamp, NULL);
-    if (timestamp.tv_sec - s_dial_timestamp.tv_sec > 10) {
-      syslog(LOG_WARNING, "Suspiciously large time difference between the last two digit input interrupts detected. Treating this interrupt as a digit start instead of a digit end.");
-      s_is_reading_hwdigit = false;
+    if (timestamp.tv_sec - p_line->dial_timestamp.tv_sec > 10) {
+      PIPHONED_LOG(LOG_WARNING, "Suspiciously large time difference between the last two digit input interrupts detected. Treating this interrupt as a digit start instead of a digit end.");
+      p_line->is_reading_hwdigit = false;
     }
   }
 
-  if (s_is_reading_hwdigit) {
-    int length = 0;
-
+  if (p_line->is_reading_hwdigit) {
     /* Signal end; also blocks possible unexpected post-calls in dial_count_callback() */
-    syslog(LOG_DEBUG, "End of digit.");
-    s_is_reading_hwdigit = false;
+    PIPHONED_LOG(LOG_DEBUG, "End of digit.");
+    p_line->is_reading_hwdigit = false;
 
-    /* Check we don’t exceed maxmium length of string (-> segfault) */
-    length = strlen(s_sip_uri);
-    if (length >= MAX_SIP_URI_LENGTH) {
-      syslog(LOG_ERR, "Reached maximum length of SIP URI (%d). Ignoring new digit %d.", MAX_SIP_URI_LENGTH, s_hwdigit);
-      return;
-    }
-
-    /* Append to the URI string, which is NUL-filled for empty digits already. */
-    sprintf(s_sip_uri + length, "%d", s_hwdigit);
+    append_digit(p_line, '0' + p_line->hwdigit);
   }
   else {
-    syslog(LOG_DEBUG, "Start of digit.");
-    s_hwdigit = 0; /* Reset for getting a new digit */
-    s_is_reading_hwdigit = true;
+    PIPHONED_LOG(LOG_DEBUG, "Start of digit.");
+    p_line->hwdigit = 0; /* Reset for getting a new digit */
+    p_line->is_reading_hwdigit = true;
   }
 
-  gettimeofday(&s_dial_timestamp, NULL);
-  pthread_mutex_unlock(&s_hwdigit_mutex);
+  gettimeofday(&p_line->dial_timestamp, NULL);
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
 }
 
 /**
@@ -186,15 +555,17 @@ static void dial_action_callback(int pin, void* arg)
  */
 static void dial_count_callback(int pin, void* arg)
 {
+  struct HwLine* p_line = (struct HwLine*) arg;
+
   /* If this gets triggered while we are not dialing, ignore it. */
-  pthread_mutex_lock(&s_hwdigit_mutex);
-  if (!s_is_reading_hwdigit) {
-    pthread_mutex_unlock(&s_hwdigit_mutex);
+  pthread_mutex_lock(&p_line->hwdigit_mutex);
+  if (!p_line->is_reading_hwdigit) {
+    pthread_mutex_unlock(&p_line->hwdigit_mutex);
     return;
   }
-  pthread_mutex_unlock(&s_hwdigit_mutex);
+  pthread_mutex_unlock(&p_line->hwdigit_mutex);
 
   /* Count one digit up. 10 counts as zero (last digit on hardware numpad). */
-  if (++s_hwdigit >= 10)
-    s_hwdigit = 0;
+  if (++p_line->hwdigit >= 10)
+    p_line->hwdigit = 0;
 }
@@ -1,10 +1,23 @@
 #ifndef PIPHONED_HWACTIONS_H
 #define PIPHONED_HWACTIONS_H
 #include <stdbool.h>
+#include <time.h>
 
-void piphoned_hwactions_init();                 /*< Initialize interrupt callbacks. */
+void piphoned_hwactions_init();                 /*< Initialize interrupt callbacks of all lines. */
 void piphoned_hwactions_free();                 /*< Cleanup all the callbacks */
-bool piphoned_hwactions_is_phone_hung_up();     /*< Is the phone on the base? */
-void piphoned_hwactions_get_sip_uri(char* target); /*< Get the URI dialed. */
+bool piphoned_hwactions_is_phone_hung_up(int line);          /*< Is the phone of the line on the base? */
+void piphoned_hwactions_get_sip_uri(int line, char* target); /*< Get the URI dialed on the line. */
+bool piphoned_hwactions_take_flash(int line);                /*< Was the handset flashed since the last call? */
+bool piphoned_hwactions_take_incall_digit(int line, char* p_digit, struct timespec* p_dialed_at); /*< Next digit dialed off-hook */
+void piphoned_hwactions_keypad_digit(int line, char key);    /*< Enter a key detected from keypad tones. */
+bool piphoned_hwactions_is_dialing(int line);                /*< Has anything been dialed yet? */
+bool piphoned_hwactions_is_number_complete(int line);        /*< Is the number entered on the keypad complete? */
+void piphoned_hwactions_clear_sip_uri(int line);             /*< Forget what has been dialed. */
+void piphoned_hwactions_set_flash_wanted(int line, bool wanted); /*< Delay hang-ups that may be flashes? */
+
+void piphoned_hwactions_set_simulated(bool simulated);               /*< Do not use the GPIO pins. */
+void piphoned_hwactions_simulate_hook(int line, bool hung_up);       /*< Simulate lifting/putting down the handset. */
+void piphoned_hwactions_simulate_digits(int line, const char* digits); /*< Simulate dialing. */
+void piphoned_hwactions_simulate_flash(int line);                    /*< Simulate a hook flash. */
 
 #endif
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <pthread.h>
 #include <poll.h>
 #include <linux/limits.h>
@@ -37,11 +38,15 @@
 #include <unistd.h>
 #include <wiringPi.h>
 #include "interrupt_handler.h"
+#include "logring.h"
+#include "flightrec.h"
+#include "rtsched.h"
+#include "startup.h"
 
 /**
- * Private struct for the data that has to be passed into the
- * pthread thread function. Note it encapsulates the user data
- * passed to piphoned_handle_pin_interrupt()!
+ * Private struct for the data the dispatcher needs for each pin.
+ * Note it encapsulates the user data passed to
+ * piphoned_handle_pin_interrupt()!
  */
 struct Piphoned_InterruptHandler_Data
 {
@@ -49,17 +54,30 @@ struct Piphoned_InterruptHandler_Data
   int hardware_pin;               /*< BCM GPIO hardware pin number corresponding to `pin` */
   void (*p_callback)(int, void*); /*< Sub-callback for the user-defined action to take */
   void* p_userdata;               /*< Custom userdata pointer passed through to the sub-callback */
-  bool terminate;                 /*< If set to true, terminate the poll thread. Shared resource! */
+  bool active;                    /*< Is the dispatcher supposed to watch this pin? Shared resource! */
 };
 
-static void* device_interrupt_handler(void* arg);
+static void* dispatcher_thread(void* arg);
+static bool start_dispatcher();
+static void stop_dispatcher();
+static void wake_dispatcher();
 
 /* Variables for maintaining pin-specific information (there is a
  * maximum of 64 pins on the Raspberry Pi). */
 static int s_sysfs_fds[64]= { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
-static pthread_t s_threads[64];
 static struct Piphoned_InterruptHandler_Data s_interrupt_handler_datas[64];
-static pthread_mutex_t s_termination_mutexes[64];
+
+/* All pins of all lines are watched by one dispatcher thread, which
+ * poll()s their device nodes together with a pipe used to wake it up
+ * when the set of pins changes. */
+static pthread_t s_dispatcher;
+static bool s_dispatcher_running = false;
+static int s_wakeup_pipe[2] = { -1, -1 };
+static pthread_mutex_t s_dispatcher_mutex = PTHREAD_MUTEX_INITIALIZER; /* Protects the `active` flags and the members below */
+static pthread_cond_t s_dispatcher_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long s_requested_generation = 0; /* Bumped on each change of the set of pins. Shared resource! */
+static unsigned long s_seen_generation = 0;      /* Last generation the dispatcher picked up. Shared resource! */
+static bool s_stop_dispatcher = false;           /* Shared resource! */
 
 /**
  * Waits for an interrupt and executes a callback.
@@ -70,9 +88,11 @@ static pthread_mutex_t s_termination_mutexes[64];
  * because it passes both the pin that the callback function is run for and
  * a custom data pointer to the callback function.
  *
- * The waiting for the interrupt is done in a separate thread, and thus, when
- * the interrupt happens, the callback function is run in that separate thread.
- * If you access a shared resource, be sure to protect it with a mutex.
+ * The waiting for the interrupt is done in a separate thread shared by
+ * all pins, and thus, when the interrupt happens, the callback function
+ * is run in that separate thread. If you access a shared resource, be
+ * sure to protect it with a mutex. Keep the callback short, as the
+ * interrupts of all other pins wait for it.
  *
  * \param pin WiringPi pin number to wait on.
  * \param edge_type INT_EDGE_FALLING, INT_EDGE_RISING, INT_EDGE_BOTH, or INT_EDGE_SETUP.
@@ -140,7 +160,11 @@ bool piphoned_handle_pin_interrupt(int pin, int edge_type, void (*p_callback)(in
 
     syslog(LOG_DEBUG, "Setting up /sys node for kernel interrupt (%s)", command);
 
-    if ((status = system(command)) != 0) { /* Single = intended */
+    piphoned_startup_begin(PIPHONED_STARTUP_GPIO_EDGE, NULL);
+    status = system(command);
+    piphoned_startup_end(PIPHONED_STARTUP_GPIO_EDGE, NULL);
+
+    if (status != 0) {
       syslog(LOG_ERR, "Executing '%s' failed with status '%d'.", command, status);
       return false;
     }
@@ -163,27 +187,33 @@ bool piphoned_handle_pin_interrupt(int pin, int edge_type, void (*p_callback)(in
     read(s_sysfs_fds[hardware_pin], &data, 1);
   }
 
+  if (!s_dispatcher_running && !start_dispatcher()) {
+    close(s_sysfs_fds[hardware_pin]);
+    s_sysfs_fds[hardware_pin] = -1;
+    return false;
+  }
+
+  pthread_mutex_lock(&s_dispatcher_mutex);
   s_interrupt_handler_datas[hardware_pin].pin          = pin;
   s_interrupt_handler_datas[hardware_pin].hardware_pin = hardware_pin;
   s_interrupt_handler_datas[hardware_pin].p_callback   = p_callback;
   s_interrupt_handler_datas[hardware_pin].p_userdata   = p_userdata;
-  s_interrupt_handler_datas[hardware_pin].terminate    = false;
+  s_interrupt_handler_datas[hardware_pin].active       = true;
+  s_requested_generation++;
+  pthread_mutex_unlock(&s_dispatcher_mutex);
 
-  syslog(LOG_DEBUG, "Spawning new thread for monitoring the hardware device '%s'", sysfs_path);
-  if (pthread_create(&s_threads[hardware_pin], NULL, device_interrupt_handler, &s_interrupt_handler_datas[hardware_pin]) != 0) {
-    syslog(LOG_ERR, "Failed to start interrupt handler thread: %m");
-    return false;
-  }
+  syslog(LOG_DEBUG, "Handing the hardware device '%s' to the GPIO dispatcher", sysfs_path);
+  wake_dispatcher();
 
   return true;
 }
 
 /**
- * Asks the interrupt handler thread for the given pin to terminate
- * and blocks until the termination has succeeded. This function
- * cleans up all resources that were acquired for the handler,
- * so that you can set up a new interrupt handler on the pin
- * after this function has returned.
+ * Asks the dispatcher to stop watching the given pin and blocks
+ * until it did so. This function cleans up all resources that were
+ * acquired for the handler, so that you can set up a new interrupt
+ * handler on the pin after this function has returned. When the last
+ * pin is gone, the dispatcher thread terminates.
  *
  * \param pin The pin to terminate the handler for.
  *
@@ -193,6 +223,9 @@ bool piphoned_handle_pin_interrupt(int pin, int edge_type, void (*p_callback)(in
 void piphoned_terminate_pin_interrupt_handler(int pin)
 {
   int hardware_pin = wpiPinToGpio(pin);
+  unsigned long generation = 0;
+  bool any_active = false;
+  int i = 0;
 
   /* If the file descriptor for the device node is -1, there is no
    * handler running */
@@ -201,17 +234,35 @@ void piphoned_terminate_pin_interrupt_handler(int pin)
 
   syslog(LOG_DEBUG, "Requesting termination of pin interrupt handler on pin %d (BCM GPIO pin %d)", pin, hardware_pin);
 
-  pthread_mutex_lock(&s_termination_mutexes[hardware_pin]);
-  s_interrupt_handler_datas[hardware_pin].terminate = true;
-  pthread_mutex_unlock(&s_termination_mutexes[hardware_pin]);
+  pthread_mutex_lock(&s_dispatcher_mutex);
+  s_interrupt_handler_datas[hardware_pin].active = false;
+  generation = ++s_requested_generation;
+
+  for(i=0; i < 64; i++) {
+    if (s_interrupt_handler_datas[i].active)
+      any_active = true;
+  }
+  pthread_mutex_unlock(&s_dispatcher_mutex);
+
+  if (any_active) {
+    /* Once the dispatcher picked up the new set of pins, it is
+     * guaranteed to neither poll this pin nor run its callback. */
+    wake_dispatcher();
+
+    pthread_mutex_lock(&s_dispatcher_mutex);
+    while (s_seen_generation < generation)
+      pthread_cond_wait(&s_dispatcher_cond, &s_dispatcher_mutex);
+    pthread_mutex_unlock(&s_dispatcher_mutex);
+  }
+  else {
+    stop_dispatcher();
+  }
 
-  pthread_join(s_threads[hardware_pin], NULL);
   syslog(LOG_DEBUG, "Interrupt handler on pin %d has terminated. Cleanup.", pin);
 
-  /* At this point, the thread is guaranteed to be terminated. We can
-   * now clean up everything so that it looks like before the interrupt
+  /* At this point, nothing refers to the pin anymore. We can now
+   * clean up everything so that it looks like before the interrupt
    * handler was registered. */
-  memset(&s_threads[hardware_pin], '\0', sizeof(pthread_t));
   memset(&s_interrupt_handler_datas[hardware_pin], '\0', sizeof(struct Piphoned_InterruptHandler_Data));
 
   close(s_sysfs_fds[hardware_pin]);
@@ -220,59 +271,140 @@ void piphoned_terminate_pin_interrupt_handler(int pin)
   syslog(LOG_DEBUG, "Cleanup on pin %d finished.", pin);
 }
 
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static bool start_dispatcher()
+{
+  if (pipe(s_wakeup_pipe) < 0) {
+    syslog(LOG_ERR, "Failed to create GPIO dispatcher wakeup pipe: %m");
+    return false;
+  }
+
+  s_stop_dispatcher = false;
+  s_requested_generation = 0;
+  s_seen_generation = 0;
+
+  syslog(LOG_DEBUG, "Spawning GPIO dispatcher thread");
+  if (pthread_create(&s_dispatcher, NULL, dispatcher_thread, NULL) != 0) {
+    syslog(LOG_ERR, "Failed to start GPIO dispatcher thread: %m");
+    close(s_wakeup_pipe[0]);
+    close(s_wakeup_pipe[1]);
+    s_wakeup_pipe[0] = s_wakeup_pipe[1] = -1;
+    return false;
+  }
+
+  s_dispatcher_running = true;
+  return true;
+}
+
+static void stop_dispatcher()
+{
+  if (!s_dispatcher_running)
+    return;
+
+  pthread_mutex_lock(&s_dispatcher_mutex);
+  s_stop_dispatcher = true;
+  pthread_mutex_unlock(&s_dispatcher_mutex);
+
+  wake_dispatcher();
+  pthread_join(s_dispatcher, NULL);
+
+  close(s_wakeup_pipe[0]);
+  close(s_wakeup_pipe[1]);
+  s_wakeup_pipe[0] = s_wakeup_pipe[1] = -1;
+  s_dispatcher_running = false;
+}
+
+static void wake_dispatcher()
+{
+  char byte = 0;
+  write(s_wakeup_pipe[1], &byte, 1); /* Ignore failure; a full pipe wakes it up anyway */
+}
+
 /**
- * This function is run as the thread that watches a GPIO device node.
- * If the device triggers, a callback function is executed. Processing
- * starts again after the callback completes.
+ * This function is run as the thread that watches the GPIO device
+ * nodes of all pins. If one of them triggers, its callback function
+ * is executed. Processing starts again after the callback completes.
  *
  * Note that in case of multiple consecutive interrupts that happen while
- * the callback is still running, the callback will be executed immediately
+ * a callback is still running, the callback will be executed immediately
  * again and again, until all interrupts have been handled.
  */
-void* device_interrupt_handler(void* arg)
+static void* dispatcher_thread(void* arg)
 {
-  struct Piphoned_InterruptHandler_Data* p_handler_data = (struct Piphoned_InterruptHandler_Data*) arg;
-  struct pollfd polldata;
-  int fd = 0;
-  char data;
+  struct pollfd polldata[65]; /* All pins plus the wakeup pipe */
+  struct Piphoned_InterruptHandler_Data* handlers[65];
+  int count = 0;
   int result = 0;
+  int i = 0;
+  char data;
 
   syslog(LOG_DEBUG, "Spawned thread successfully");
-  fd = s_sysfs_fds[p_handler_data->hardware_pin];
-
-  polldata.fd = fd;
-  polldata.events = POLLPRI;
+  piphoned_rtsched_apply(PIPHONED_RTSCHED_GPIO);
 
-  syslog(LOG_DEBUG, "Entering lowlevel interrupt loop for file descriptor %d", fd);
+  syslog(LOG_DEBUG, "Entering lowlevel interrupt loop");
   while(true) {
-    result = 0;
+    /* Pick up the current set of pins, which is a shared resource */
+    pthread_mutex_lock(&s_dispatcher_mutex);
+
+    if (s_stop_dispatcher) {
+      pthread_mutex_unlock(&s_dispatcher_mutex);
+      break;
+    }
+
+    polldata[0].fd = s_wakeup_pipe[0];
+    polldata[0].events = POLLIN;
+    handlers[0] = NULL;
+    count = 1;
+
+    for(i=0; i < 64; i++) {
+      if (s_interrupt_handler_datas[i].active) {
+        polldata[count].fd = s_sysfs_fds[i];
+        polldata[count].events = POLLPRI;
+        handlers[count] = &s_interrupt_handler_datas[i];
+        count++;
+      }
+    }
 
-    result = poll(&polldata, 1, 2000);
+    s_seen_generation = s_requested_generation;
+    pthread_cond_broadcast(&s_dispatcher_cond);
+    pthread_mutex_unlock(&s_dispatcher_mutex);
+
+    result = poll(polldata, count, -1);
     if (result < 0) {
-      syslog(LOG_ERR, "Failed to poll() data from pin %d: %m", p_handler_data->pin);
+      if (errno == EINTR)
+        continue;
+
+      piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_GPIO_POLL, errno);
+      PIPHONED_LOG(LOG_ERR, "Failed to poll() data from the GPIO pins: %m");
       continue;
     }
-    else if (result == 0) { /* timeout */
-      /* Check termination condition, which is a shared resource */
-      pthread_mutex_lock(&s_termination_mutexes[p_handler_data->hardware_pin]);
-
-      if (p_handler_data->terminate)
-        break;
 
-      pthread_mutex_unlock(&s_termination_mutexes[p_handler_data->hardware_pin]);
+    /* Set of pins changed or termination requested */
+    if (polldata[0].revents & POLLIN) {
+      read(s_wakeup_pipe[0], &data, 1);
       continue;
     }
 
-    /* We only wait for something to appear. What it is is not important. Read
-     * the data, discard it. wiringPi sourcecode comments say it will only ever be
-     * one char, so consume that. */
-    read(fd, &data, 1); /* Ignore failure */
-    lseek(fd, 0, SEEK_SET);
+    for(i=1; i < count; i++) {
+      if (!(polldata[i].revents & POLLPRI))
+        continue;
 
-    /* Call the callback function */
-    p_handler_data->p_callback(p_handler_data->pin, p_handler_data->p_userdata);
+      /* We only wait for something to appear. What it is is not important. Read
+       * the data, discard it. wiringPi sourcecode comments say it will only ever be
+       * one char, so consume that. */
+      read(polldata[i].fd, &data, 1); /* Ignore failure */
+      lseek(polldata[i].fd, 0, SEEK_SET);
+
+      piphoned_flightrec_record(PIPHONED_FLIGHTREC_GPIO_EDGE, handlers[i]->pin, 0);
+
+      /* Call the callback function */
+      handlers[i]->p_callback(handlers[i]->pin, handlers[i]->p_userdata);
+    }
   }
 
-  syslog(LOG_DEBUG, "Terminating lowlevel interrupt loop for file descriptor %d", fd);
+  syslog(LOG_DEBUG, "Terminating lowlevel interrupt loop");
   return NULL;
 }
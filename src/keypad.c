@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include <linphone/linphonecore.h>
+#include "keypad.h"
+#include "configfile.h"
+#include "hwactions.h"
+#include "dtmf_detector.h"
+#include "logring.h"
+#include "rtsched.h"
+#include "sound_params.h"
+
+/**
+ * Touch-tone keypads. Phones with a keypad instead of a rotary dial
+ * send the keys as DTMF tones into the handset's microphone line.
+ * For each line with a `keypad_device`, a thread captures that ALSA
+ * device while the handset is lifted for dialing, runs the audio
+ * through the DTMF detector and enters the keys with
+ * piphoned_hwactions_keypad_digit(), exactly where dialed pulses go.
+ * The device is only held open while listening, so that linphone can
+ * have it once the call is set up.
+ */
+
+/* Samples read from the device at once (20 ms) */
+#define CAPTURE_CHUNK 160
+
+/* Buffer latency requested from ALSA, in microseconds */
+#define CAPTURE_LATENCY 100000
+
+/* Keys the detector may report from one chunk; a key takes at least
+ * two blocks, so there is never more than one. */
+#define MAX_CHUNK_KEYS 4
+
+/**
+ * State of the keypad of one line.
+ */
+struct KeypadLine
+{
+  int line;                    /*< Index of the line */
+  const char* device;          /*< ALSA PCM to capture */
+  pthread_t thread;            /*< Listening thread */
+  bool is_running;             /*< Was `thread` started? */
+  bool listen;                 /*< Should the thread capture now? Shared resource! */
+  bool stop;                   /*< Should the thread terminate? Shared resource! */
+  pthread_mutex_t mutex;       /*< Protects `listen` and `stop` */
+  pthread_cond_t cond;         /*< Signalled when `listen` or `stop` change */
+  struct Piphoned_DtmfDetector detector; /*< Only used by `thread` */
+  int16_t samples[CAPTURE_CHUNK];        /*< Only used by `thread` */
+};
+
+static struct KeypadLine s_keypads[PIPHONED_MAX_LINES];
+static int s_num_lines = 0;
+
+static void* keypad_thread(void* arg);
+static void capture(struct KeypadLine* p_keypad);
+static bool should_listen(struct KeypadLine* p_keypad);
+
+/**
+ * Starts a listening thread for each line with a `keypad_device`.
+ * The threads stay idle until piphoned_keypad_listen() is called.
+ */
+bool piphoned_keypad_init()
+{
+  int i = 0;
+
+  s_num_lines = g_piphoned_config_info.num_lines;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct KeypadLine* p_keypad = &s_keypads[i];
+
+    memset(p_keypad, '\0', sizeof(struct KeypadLine));
+    p_keypad->line = i;
+    p_keypad->device = g_piphoned_config_info.lines[i]->keypad_device;
+
+    if (strlen(p_keypad->device) == 0)
+      continue;
+
+    pthread_mutex_init(&p_keypad->mutex, NULL);
+    pthread_cond_init(&p_keypad->cond, NULL);
+    piphoned_dtmfdetector_init(&p_keypad->detector,
+                               g_piphoned_config_info.dtmf_min_level,
+                               g_piphoned_config_info.dtmf_twist,
+                               g_piphoned_config_info.dtmf_reverse_twist);
+
+    if (pthread_create(&p_keypad->thread, NULL, keypad_thread, p_keypad) != 0) {
+      syslog(LOG_ERR, "Failed to start keypad thread for line %s: %m", g_piphoned_config_info.lines[i]->name);
+      pthread_cond_destroy(&p_keypad->cond);
+      pthread_mutex_destroy(&p_keypad->mutex);
+      return false;
+    }
+
+    p_keypad->is_running = true;
+    syslog(LOG_INFO, "Listening for keypad tones of line %s on %s.", g_piphoned_config_info.lines[i]->name, p_keypad->device);
+  }
+
+  return true;
+}
+
+/**
+ * Stops all listening threads.
+ */
+void piphoned_keypad_free()
+{
+  int i = 0;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct KeypadLine* p_keypad = &s_keypads[i];
+
+    if (!p_keypad->is_running)
+      continue;
+
+    pthread_mutex_lock(&p_keypad->mutex);
+    p_keypad->stop = true;
+    pthread_cond_signal(&p_keypad->cond);
+    pthread_mutex_unlock(&p_keypad->mutex);
+
+    pthread_join(p_keypad->thread, NULL);
+    pthread_cond_destroy(&p_keypad->cond);
+    pthread_mutex_destroy(&p_keypad->mutex);
+    p_keypad->is_running = false;
+  }
+
+  s_num_lines = 0;
+}
+
+/**
+ * Checks whether the given line is dialed with a keypad rather than
+ * a rotary dial.
+ */
+bool piphoned_keypad_is_keypad_line(int line)
+{
+  return strlen(g_piphoned_config_info.lines[line]->keypad_device) > 0;
+}
+
+/**
+ * Tell the keypad thread of the given line whether to capture and
+ * decode tones. Meant to be called on every mainloop iteration; does
+ * nothing if the setting does not change or the line has no keypad
+ * thread.
+ */
+void piphoned_keypad_listen(int line, bool listen)
+{
+  struct KeypadLine* p_keypad = NULL;
+
+  if (line >= s_num_lines || !s_keypads[line].is_running)
+    return;
+
+  p_keypad = &s_keypads[line];
+  if (__atomic_load_n(&p_keypad->listen, __ATOMIC_ACQUIRE) == listen)
+    return;
+
+  pthread_mutex_lock(&p_keypad->mutex);
+  __atomic_store_n(&p_keypad->listen, listen, __ATOMIC_RELEASE);
+  pthread_cond_signal(&p_keypad->cond);
+  pthread_mutex_unlock(&p_keypad->mutex);
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static void* keypad_thread(void* arg)
+{
+  struct KeypadLine* p_keypad = (struct KeypadLine*) arg;
+
+  /* Tones are short; the thread must not fall behind the device */
+  piphoned_rtsched_apply(PIPHONED_RTSCHED_AUDIO);
+
+  while (true) {
+    pthread_mutex_lock(&p_keypad->mutex);
+    while (!p_keypad->listen && !p_keypad->stop)
+      pthread_cond_wait(&p_keypad->cond, &p_keypad->mutex);
+    pthread_mutex_unlock(&p_keypad->mutex);
+
+    if (__atomic_load_n(&p_keypad->stop, __ATOMIC_ACQUIRE))
+      break;
+
+    capture(p_keypad);
+
+    /* If capturing failed, do not retry before the next time the
+     * handset is lifted */
+    pthread_mutex_lock(&p_keypad->mutex);
+    while (p_keypad->listen && !p_keypad->stop)
+      pthread_cond_wait(&p_keypad->cond, &p_keypad->mutex);
+    pthread_mutex_unlock(&p_keypad->mutex);
+  }
+
+  return NULL;
+}
+
+/**
+ * Captures from the keypad device and feeds the detector until
+ * listening is turned off or the device fails.
+ */
+static void capture(struct KeypadLine* p_keypad)
+{
+  snd_pcm_t* p_pcm = NULL;
+  char keys[MAX_CHUNK_KEYS];
+  int error = 0;
+
+  error = snd_pcm_open(&p_pcm, p_keypad->device, SND_PCM_STREAM_CAPTURE, 0);
+  if (error < 0) {
+    PIPHONED_LOG(LOG_ERR, "Cannot open keypad device of line %d: error %d.", p_keypad->line + 1, error);
+    return;
+  }
+
+  error = piphoned_soundparams_set(p_pcm, 1, PIPHONED_DTMF_SAMPLE_RATE, CAPTURE_LATENCY, p_keypad->line);
+  if (error < 0) {
+    PIPHONED_LOG(LOG_ERR, "Cannot capture 8 kHz mono audio from keypad device of line %d: error %d.", p_keypad->line + 1, error);
+    snd_pcm_close(p_pcm);
+    return;
+  }
+
+  piphoned_dtmfdetector_reset(&p_keypad->detector);
+
+  while (should_listen(p_keypad)) {
+    snd_pcm_sframes_t frames = snd_pcm_readi(p_pcm, p_keypad->samples, CAPTURE_CHUNK);
+    size_t count = 0;
+    size_t i = 0;
+
+    if (frames < 0) {
+      /* Overruns happen if the thread was starved; just go on */
+      if (snd_pcm_recover(p_pcm, frames, 1) < 0) {
+        PIPHONED_LOG(LOG_ERR, "Capturing from keypad device of line %d failed: error %d.", p_keypad->line + 1, (int) frames);
+        break;
+      }
+      piphoned_dtmfdetector_reset(&p_keypad->detector);
+      continue;
+    }
+
+    count = piphoned_dtmfdetector_process(&p_keypad->detector, p_keypad->samples, frames, keys, MAX_CHUNK_KEYS);
+    for(i=0; i < count; i++)
+      piphoned_hwactions_keypad_digit(p_keypad->line, keys[i]);
+  }
+
+  snd_pcm_close(p_pcm);
+}
+
+static bool should_listen(struct KeypadLine* p_keypad)
+{
+  return __atomic_load_n(&p_keypad->listen, __ATOMIC_ACQUIRE) && !__atomic_load_n(&p_keypad->stop, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,10 @@
+#ifndef PIPHONED_KEYPAD_H
+#define PIPHONED_KEYPAD_H
+#include <stdbool.h>
+
+bool piphoned_keypad_init();                  /*< Start listening threads for all keypad lines */
+void piphoned_keypad_free();                  /*< Stop all listening threads */
+bool piphoned_keypad_is_keypad_line(int line); /*< Is the line dialed with a keypad? */
+void piphoned_keypad_listen(int line, bool listen); /*< Capture and decode the line's tones or not */
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linphone/linphonecore.h>
+#include "load_controller.h"
+#include "configfile.h"
+#include "flightrec.h"
+
+/**
+ * Load control for calls. On a Raspberry Pi 1 or Zero a call competes
+ * with everything else on the single core, and once the CPU saturates
+ * the audio breaks up. While a call runs, the controller samples the
+ * system's and piphoned's CPU use and the share of audio packets that
+ * came too late to be played, i.e. the gaps the handset hears. If
+ * the load stays above `load_control_high` or packets keep coming late,
+ * it cuts the call's audio processing back one level (see
+ * Piphoned_LoadLevel); once the load stays below `load_control_low`
+ * for a while, it goes back up one level. The two marks and the
+ * different numbers of samples required keep it from flapping.
+ * Every change is logged and recorded in the flight recorder.
+ */
+
+#define SAMPLE_INTERVAL 1000 /* Milliseconds between two load samples */
+#define OVERLOAD_SAMPLES 2   /* Samples above the high mark before cutting back */
+#define RELAX_SAMPLES 10     /* Samples below the low mark before going back up */
+
+/**
+ * What each load level does.
+ */
+static const struct {
+  const char* name;
+  int bitrate_percent;  /* Share of the codec's normal bitrate */
+  bool echo_canceller;  /* Keep the echo canceller? */
+} s_levels[PIPHONED_NUM_LOAD_LEVELS] = {
+  {"normal",           100, true},
+  {"reduced bitrate",  66,  true},
+  {"no echo canceller", 66, false},
+  {"minimum bitrate",  33,  false}
+};
+
+static bool read_system_cpu(unsigned long long* p_busy, unsigned long long* p_total);
+static double process_cpu_seconds();
+static long milliseconds_between(const struct timespec* p_start, const struct timespec* p_end);
+static void set_level(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCore* p_core, enum Piphoned_LoadLevel level);
+
+/**
+ * Starts controlling the given call. Call this whenever the call's
+ * streams (re)start; it does nothing if the call is already under
+ * control, as the streams restart after each adjustment, too.
+ */
+void piphoned_loadcontroller_start(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCall* p_call)
+{
+  if (g_piphoned_config_info.load_control_high <= 0 || p_controller->p_call == p_call)
+    return;
+
+  memset(p_controller, '\0', sizeof(struct Piphoned_LoadController));
+  p_controller->p_call = p_call;
+  p_controller->echo_canceller_was_on = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &p_controller->last_sample);
+  read_system_cpu(&p_controller->cpu_busy, &p_controller->cpu_total);
+  p_controller->process_cpu = process_cpu_seconds();
+}
+
+/**
+ * Call this once in a mainloop iteration while the call is active.
+ * Takes a sample every SAMPLE_INTERVAL milliseconds and changes the
+ * level if needed.
+ */
+void piphoned_loadcontroller_update(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCore* p_core, const char* linename)
+{
+  struct Piphoned_SipCore_CallStats stats;
+  struct timespec now;
+  unsigned long long busy = 0;
+  unsigned long long total = 0;
+  double process_cpu = 0.0;
+  long elapsed = 0;
+  int system_load = 0;
+  int process_load = 0;
+  bool overloaded = false;
+  bool relaxed = false;
+
+  if (!p_controller->p_call)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = milliseconds_between(&p_controller->last_sample, &now);
+  if (elapsed < SAMPLE_INTERVAL)
+    return;
+
+  if (!read_system_cpu(&busy, &total) || total <= p_controller->cpu_total)
+    return;
+
+  process_cpu = process_cpu_seconds();
+  system_load = (int) (100 * (busy - p_controller->cpu_busy) / (total - p_controller->cpu_total));
+  process_load = (int) ((process_cpu - p_controller->process_cpu) * 100000.0 / elapsed);
+
+  p_controller->last_sample = now;
+  p_controller->cpu_busy = busy;
+  p_controller->cpu_total = total;
+  p_controller->process_cpu = process_cpu;
+
+  if (!p_core->p_ops->get_call_stats(p_controller->p_call, &stats))
+    memset(&stats, '\0', sizeof(stats));
+
+  overloaded = system_load >= g_piphoned_config_info.load_control_high
+    || process_load >= g_piphoned_config_info.load_control_high
+    || stats.late_rate >= g_piphoned_config_info.load_control_late;
+  relaxed = system_load < g_piphoned_config_info.load_control_low
+    && process_load < g_piphoned_config_info.load_control_low
+    && stats.late_rate < g_piphoned_config_info.load_control_late;
+
+  p_controller->overloaded_samples = overloaded ? p_controller->overloaded_samples + 1 : 0;
+  p_controller->relaxed_samples = relaxed ? p_controller->relaxed_samples + 1 : 0;
+
+  if (p_controller->overloaded_samples >= OVERLOAD_SAMPLES && p_controller->level + 1 < PIPHONED_NUM_LOAD_LEVELS) {
+    set_level(p_controller, p_core, p_controller->level + 1);
+  }
+  else if (p_controller->relaxed_samples >= RELAX_SAMPLES && p_controller->level > PIPHONED_LOAD_NORMAL) {
+    set_level(p_controller, p_core, p_controller->level - 1);
+  }
+  else {
+    return;
+  }
+
+  syslog(LOG_NOTICE, "Load control of line %s: %s (system CPU %d%%, piphoned CPU %d%%, late packets %.1f%%).", linename, s_levels[p_controller->level].name, system_load, process_load, stats.late_rate);
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_LOAD_LEVEL,
+                            p_controller->level,
+                            (system_load & 0xff) | ((process_load > 255 ? 255 : process_load) << 8) | (((int) (stats.late_rate * 10) & 0xffff) << 16));
+}
+
+/**
+ * Stops controlling the call, if any. The codec's bitrate is
+ * restored for later calls. Unless `call_alive` says the call goes
+ * on, e.g. on hold, the call itself is not touched, as it may be gone
+ * already. A call that goes on gets its echo canceller back right
+ * away and its bitrate with the next renegotiation, which resuming
+ * it is.
+ */
+void piphoned_loadcontroller_stop(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCore* p_core, const char* linename, bool call_alive)
+{
+  if (!p_controller->p_call)
+    return;
+
+  if (call_alive && !s_levels[p_controller->level].echo_canceller && p_controller->echo_canceller_was_on)
+    p_core->p_ops->set_call_echo_cancellation(p_controller->p_call, true);
+
+  if (s_levels[p_controller->level].bitrate_percent < 100)
+    p_core->p_ops->scale_call_bitrate(p_core, NULL, 100);
+
+  if (p_controller->adjustments > 0)
+    syslog(LOG_INFO, "Load control of line %s made %d adjustments during the call, up to %s.", linename, p_controller->adjustments, s_levels[p_controller->max_level].name);
+
+  memset(p_controller, '\0', sizeof(struct Piphoned_LoadController));
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Applies whatever differs between the current level and `level`
+ * to the call.
+ */
+static void set_level(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCore* p_core, enum Piphoned_LoadLevel level)
+{
+  struct Piphoned_SipCall* p_call = p_controller->p_call;
+  bool echo_canceller_before = s_levels[p_controller->level].echo_canceller;
+  bool echo_canceller_after = s_levels[level].echo_canceller;
+
+  if (echo_canceller_before && !echo_canceller_after)
+    p_controller->echo_canceller_was_on = p_core->p_ops->set_call_echo_cancellation(p_call, false);
+  else if (!echo_canceller_before && echo_canceller_after && p_controller->echo_canceller_was_on)
+    p_core->p_ops->set_call_echo_cancellation(p_call, true);
+
+  if (s_levels[level].bitrate_percent != s_levels[p_controller->level].bitrate_percent)
+    p_core->p_ops->scale_call_bitrate(p_core, p_call, s_levels[level].bitrate_percent);
+
+  p_controller->level = level;
+  p_controller->adjustments++;
+  p_controller->overloaded_samples = 0;
+  p_controller->relaxed_samples = 0;
+  if (level > p_controller->max_level)
+    p_controller->max_level = level;
+}
+
+/**
+ * Reads the busy and total CPU time of all cores from /proc/stat.
+ * Uses a plain read() into a stack buffer, as this runs in the
+ * mainloop once a second.
+ */
+static bool read_system_cpu(unsigned long long* p_busy, unsigned long long* p_total)
+{
+  unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+  char buf[256];
+  ssize_t len = 0;
+  int fd = open("/proc/stat", O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return false;
+  buf[len] = '\0';
+
+  if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) < 4)
+    return false;
+
+  *p_busy = user + nice + system + irq + softirq + steal;
+  *p_total = *p_busy + idle + iowait;
+  return true;
+}
+
+static double process_cpu_seconds()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static long milliseconds_between(const struct timespec* p_start, const struct timespec* p_end)
+{
+  return (p_end->tv_sec - p_start->tv_sec) * 1000 + (p_end->tv_nsec - p_start->tv_nsec) / 1000000;
+}
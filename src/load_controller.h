@@ -0,0 +1,42 @@
+#ifndef PIPHONED_LOAD_CONTROLLER_H
+#define PIPHONED_LOAD_CONTROLLER_H
+#include <stdbool.h>
+#include <time.h>
+#include "sipcore.h"
+
+/**
+ * How far a call's audio processing is cut back to save CPU. Each
+ * level includes the measures of the ones before it.
+ */
+enum Piphoned_LoadLevel {
+  PIPHONED_LOAD_NORMAL = 0,         /* Everything as negotiated */
+  PIPHONED_LOAD_REDUCED_BITRATE,    /* Codec at two thirds of its bitrate */
+  PIPHONED_LOAD_NO_ECHO_CANCELLER,  /* Echo canceller off */
+  PIPHONED_LOAD_MINIMUM_BITRATE,    /* Codec at a third of its bitrate */
+  PIPHONED_NUM_LOAD_LEVELS
+};
+
+/**
+ * Load control state of one line. It follows the line's active call
+ * only; see load_controller.c.
+ */
+struct Piphoned_LoadController
+{
+  struct Piphoned_SipCall* p_call; /*< Call under control; only compared, never dereferenced after it ended. NULL if none. */
+  enum Piphoned_LoadLevel level;   /*< Current level */
+  enum Piphoned_LoadLevel max_level; /*< Highest level during the call */
+  int adjustments;                 /*< Level changes during the call */
+  int overloaded_samples;          /*< Consecutive samples above the high mark */
+  int relaxed_samples;             /*< Consecutive samples below the low mark */
+  bool echo_canceller_was_on;      /*< Did the call have an echo canceller before we switched it off? */
+  struct timespec last_sample;     /*< When the CPU counters were read last */
+  unsigned long long cpu_busy;     /*< System CPU time spent busy at the last sample, in jiffies */
+  unsigned long long cpu_total;    /*< System CPU time in total at the last sample, in jiffies */
+  double process_cpu;              /*< CPU time of piphoned at the last sample, in seconds */
+};
+
+void piphoned_loadcontroller_start(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCall* p_call); /*< Take control of a call with running streams */
+void piphoned_loadcontroller_update(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCore* p_core, const char* linename); /*< Sample the load and adjust the call */
+void piphoned_loadcontroller_stop(struct Piphoned_LoadController* p_controller, struct Piphoned_SipCore* p_core, const char* linename, bool call_alive); /*< Give up the call and restore the codec and, if it goes on, the call */
+
+#endif
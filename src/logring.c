@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "logring.h"
+#include "commandline.h"
+
+/**
+ * Time in nanoseconds the flusher thread sleeps between two
+ * passes over the rings.
+ */
+#define FLUSH_INTERVAL 100000000L
+
+/**
+ * A single log message waiting to be formatted. Only the pointer
+ * to the format string is stored, which is why PIPHONED_LOG()
+ * requires it to be a string literal.
+ */
+struct LogRecord
+{
+  const char* format;      /*< Format string (literal, never freed) */
+  int priority;            /*< Syslog priority */
+  int saved_errno;         /*< `errno` at posting time, for %m */
+  unsigned int suppressed; /*< Messages the rate limit swallowed for this site before this one */
+  int args[PIPHONED_LOGRING_MAX_ARGS]; /*< Integer arguments for `format` */
+};
+
+enum LogRingState {
+  LOGRING_FREE = 0, /* Nobody owns this ring */
+  LOGRING_IN_USE,   /* A thread posts into this ring */
+  LOGRING_ORPHANED  /* The owning thread has exited; drain and release */
+};
+
+/**
+ * Single-producer single-consumer ring. The producer is the thread
+ * that claimed the ring, the consumer is the flusher thread. `head`
+ * is only written by the producer, `tail` only by the consumer, so
+ * no lock is needed.
+ */
+struct LogRing
+{
+  int state;               /*< One of the LogRingState values. Shared resource! */
+  unsigned long head;      /*< Next record to write. Shared resource! */
+  unsigned long tail;      /*< Next record to read. Shared resource! */
+  unsigned long overflows; /*< Messages lost because the ring was full. Shared resource! */
+  struct LogRecord records[PIPHONED_LOGRING_SIZE];
+};
+
+static struct LogRing s_rings[PIPHONED_LOGRING_MAX_THREADS];
+static __thread struct LogRing* sp_thread_ring = NULL; /* The ring owned by the current thread, if any */
+static pthread_key_t s_ring_key; /* For noticing thread exit */
+static pthread_t s_flusher_thread;
+static volatile bool s_running = false; /* Is the flusher thread active? */
+static bool s_to_console = false; /* Mirror messages to stderr? */
+static unsigned long s_total_overflows = 0; /* Sum of all ring overflows, reported on free */
+static unsigned long s_total_suppressed = 0; /* Sum of all rate limited messages, reported on free */
+
+static struct LogRing* claim_ring();
+static void release_ring(void* arg);
+static void* flusher(void* arg);
+static void flush_rings();
+static void flush_ring(struct LogRing* p_ring);
+static void emit(const struct LogRecord* p_record);
+
+/**
+ * Sets up the log ring and starts the background flusher thread.
+ * Messages posted with PIPHONED_LOG() before this function is called
+ * are written to syslog synchronously.
+ *
+ * \param to_console If true, all messages are additionally written
+ *                   to the standard error stream.
+ */
+void piphoned_logring_init(bool to_console)
+{
+  memset(s_rings, '\0', sizeof(s_rings));
+  s_to_console = to_console;
+  s_total_overflows = 0;
+  s_total_suppressed = 0;
+
+  if (pthread_key_create(&s_ring_key, release_ring) != 0) {
+    syslog(LOG_ERR, "Failed to create log ring thread key: %m. Logging synchronously.");
+    return;
+  }
+
+  s_running = true;
+  if (pthread_create(&s_flusher_thread, NULL, flusher, NULL) != 0) {
+    syslog(LOG_ERR, "Failed to start log ring flusher thread: %m. Logging synchronously.");
+    s_running = false;
+    pthread_key_delete(s_ring_key);
+    return;
+  }
+
+  syslog(LOG_DEBUG, "Log ring started with %d slots of %d messages each.", PIPHONED_LOGRING_MAX_THREADS, PIPHONED_LOGRING_SIZE);
+}
+
+/**
+ * Stops the flusher thread and writes out all messages that are
+ * still pending. Call this only after all threads that post
+ * messages have terminated.
+ */
+void piphoned_logring_free()
+{
+  if (!s_running)
+    return;
+
+  s_running = false;
+  pthread_join(s_flusher_thread, NULL);
+  flush_rings();
+  pthread_key_delete(s_ring_key);
+
+  if (s_total_overflows > 0 || s_total_suppressed > 0)
+    syslog(LOG_NOTICE, "Log ring statistics: %lu messages lost to full rings, %lu suppressed by rate limiting.", s_total_overflows, s_total_suppressed);
+}
+
+/**
+ * Queues a message for the flusher thread. This is the backend of
+ * PIPHONED_LOG(); see there for the restrictions on `format` and
+ * `args`. This function never blocks and never allocates memory; if
+ * the calling thread's ring is full, the message is dropped and
+ * counted.
+ */
+void piphoned_logring_post(struct Piphoned_LogRing_Site* p_site, int priority, const char* format, const int* args)
+{
+  int saved_errno = errno;
+  struct timespec now;
+  struct LogRing* p_ring = NULL;
+  struct LogRecord* p_record = NULL;
+  unsigned long head = 0;
+  unsigned int suppressed = 0;
+
+  if (LOG_PRI(priority) > g_cli_options.loglevel)
+    return;
+
+  /* Per-site rate limiting in one second windows. The races between
+   * several threads hitting the same site only affect the exact
+   * count, which is acceptable. */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (__atomic_load_n(&p_site->window_start, __ATOMIC_RELAXED) != now.tv_sec) {
+    __atomic_store_n(&p_site->window_start, now.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&p_site->window_count, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_add_fetch(&p_site->window_count, 1, __ATOMIC_RELAXED) > PIPHONED_LOGRING_RATE_LIMIT) {
+    __atomic_add_fetch(&p_site->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  suppressed = __atomic_exchange_n(&p_site->dropped, 0, __ATOMIC_RELAXED);
+
+  if (!s_running) {
+    errno = saved_errno;
+    syslog(priority, format, args[0], args[1], args[2], args[3]);
+    return;
+  }
+
+  p_ring = sp_thread_ring ? sp_thread_ring : claim_ring();
+  if (!p_ring) {
+    /* More threads than rings. Should not happen, but do not lose
+     * the message. */
+    errno = saved_errno;
+    syslog(priority, format, args[0], args[1], args[2], args[3]);
+    return;
+  }
+
+  head = p_ring->head;
+  if (head - __atomic_load_n(&p_ring->tail, __ATOMIC_ACQUIRE) >= PIPHONED_LOGRING_SIZE) {
+    __atomic_add_fetch(&p_ring->overflows, 1 + suppressed, __ATOMIC_RELAXED);
+    return;
+  }
+
+  p_record = &p_ring->records[head % PIPHONED_LOGRING_SIZE];
+  p_record->format      = format;
+  p_record->priority    = priority;
+  p_record->saved_errno = saved_errno;
+  p_record->suppressed  = suppressed;
+  memcpy(p_record->args, args, sizeof(p_record->args));
+
+  __atomic_store_n(&p_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Assigns a free ring to the calling thread. Returns NULL if all
+ * rings are taken.
+ */
+static struct LogRing* claim_ring()
+{
+  int i = 0;
+
+  for(i=0; i < PIPHONED_LOGRING_MAX_THREADS; i++) {
+    int expected = LOGRING_FREE;
+
+    if (__atomic_compare_exchange_n(&s_rings[i].state, &expected, LOGRING_IN_USE, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      sp_thread_ring = &s_rings[i];
+      pthread_setspecific(s_ring_key, sp_thread_ring); /* Triggers release_ring() on thread exit */
+      return sp_thread_ring;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Thread exit destructor. Marks the ring as orphaned so the flusher
+ * drains it and then hands it out again.
+ */
+static void release_ring(void* arg)
+{
+  struct LogRing* p_ring = (struct LogRing*) arg;
+  __atomic_store_n(&p_ring->state, LOGRING_ORPHANED, __ATOMIC_RELEASE);
+}
+
+/**
+ * The flusher thread. Periodically formats and writes out whatever
+ * the other threads posted.
+ */
+static void* flusher(void* arg)
+{
+  struct timespec interval;
+  interval.tv_sec  = 0;
+  interval.tv_nsec = FLUSH_INTERVAL;
+
+  while (s_running) {
+    flush_rings();
+    nanosleep(&interval, NULL);
+  }
+
+  return NULL;
+}
+
+static void flush_rings()
+{
+  int i = 0;
+
+  for(i=0; i < PIPHONED_LOGRING_MAX_THREADS; i++) {
+    int state = __atomic_load_n(&s_rings[i].state, __ATOMIC_ACQUIRE);
+
+    if (state == LOGRING_FREE)
+      continue;
+
+    flush_ring(&s_rings[i]);
+
+    /* The owner is gone and will not post anymore, so the ring can
+     * safely be reset and given to another thread. */
+    if (state == LOGRING_ORPHANED) {
+      s_rings[i].head = 0;
+      s_rings[i].tail = 0;
+      __atomic_store_n(&s_rings[i].state, LOGRING_FREE, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+/**
+ * Emits all pending records of the given ring.
+ */
+static void flush_ring(struct LogRing* p_ring)
+{
+  unsigned long head = __atomic_load_n(&p_ring->head, __ATOMIC_ACQUIRE);
+  unsigned long tail = p_ring->tail;
+  unsigned long overflows = 0;
+
+  for(; tail != head; tail++) {
+    emit(&p_ring->records[tail % PIPHONED_LOGRING_SIZE]);
+    __atomic_store_n(&p_ring->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  overflows = __atomic_exchange_n(&p_ring->overflows, 0, __ATOMIC_RELAXED);
+  if (overflows > 0) {
+    syslog(LOG_WARNING, "Log ring overflow: %lu messages were lost.", overflows);
+    s_total_overflows += overflows;
+  }
+}
+
+/**
+ * Formats and writes a single record.
+ */
+static void emit(const struct LogRecord* p_record)
+{
+  const int* args = p_record->args;
+
+  if (p_record->suppressed > 0) {
+    syslog(p_record->priority, "(%u similar messages suppressed by rate limiting)", p_record->suppressed);
+    s_total_suppressed += p_record->suppressed;
+
+    if (s_to_console)
+      fprintf(stderr, "(%u similar messages suppressed by rate limiting)\n", p_record->suppressed);
+  }
+
+  errno = p_record->saved_errno;
+  syslog(p_record->priority, p_record->format, args[0], args[1], args[2], args[3]);
+
+  if (s_to_console) {
+    errno = p_record->saved_errno;
+    fprintf(stderr, p_record->format, args[0], args[1], args[2], args[3]);
+    fputc('\n', stderr);
+  }
+}
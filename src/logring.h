@@ -0,0 +1,51 @@
+#ifndef PIPHONED_LOGRING_H
+#define PIPHONED_LOGRING_H
+#include <stdbool.h>
+#include "config.h"
+
+/**
+ * Maximum number of integer arguments a PIPHONED_LOG() message
+ * may carry.
+ */
+#define PIPHONED_LOGRING_MAX_ARGS 4
+
+/**
+ * Rate limiting state for a single PIPHONED_LOG() call site. One of
+ * these is created statically by each use of the macro; you should
+ * never need to create one yourself.
+ */
+struct Piphoned_LogRing_Site
+{
+  long window_start;         /*< Monotonic second the current rate limit window started in. Shared resource! */
+  unsigned int window_count; /*< Number of messages posted in the current window. Shared resource! */
+  unsigned int dropped;      /*< Number of messages suppressed and not yet reported. Shared resource! */
+};
+
+#define PIPHONED_LOGRING_FORMAT_(format, ...) format
+#define PIPHONED_LOGRING_ARGS_(format, ...) __VA_ARGS__
+
+/**
+ * Log a message through the log ring instead of calling syslog()
+ * directly. Use this on hot paths (interrupt handlers, dial callbacks)
+ * where a synchronous syslog() call would disturb the timing.
+ *
+ * The formatting is deferred to the flusher thread, hence the format
+ * string must be a string literal and all arguments must be of type
+ * `int`; at most PIPHONED_LOGRING_MAX_ARGS are allowed. %m is
+ * supported and refers to `errno` at the time of the PIPHONED_LOG()
+ * call.
+ */
+#define PIPHONED_LOG(priority, ...)                                     \
+  do {                                                                  \
+    static struct Piphoned_LogRing_Site s_logring_site;                 \
+    piphoned_logring_post(&s_logring_site,                              \
+                          (priority),                                   \
+                          PIPHONED_LOGRING_FORMAT_(__VA_ARGS__, 0),     \
+                          (const int[PIPHONED_LOGRING_MAX_ARGS + 1]) { PIPHONED_LOGRING_ARGS_(__VA_ARGS__, 0) }); \
+  } while(0)
+
+void piphoned_logring_init(bool to_console); /*< Start the background flusher thread */
+void piphoned_logring_free();                /*< Stop the flusher thread and flush everything that remains */
+void piphoned_logring_post(struct Piphoned_LogRing_Site* p_site, int priority, const char* format, const int* args); /*< Use PIPHONED_LOG() instead */
+
+#endif
@@ -7,7 +7,13 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <grp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <wiringPi.h>
 #include <linphone/linphonecore.h>
 #include "main.h"
@@ -15,6 +21,24 @@
 #include "hwactions.h"
 #include "commandline.h"
 #include "phone_manager.h"
+#include "logring.h"
+#include "flightrec.h"
+#include "benchmark.h"
+#include "simctl.h"
+#include "soak.h"
+#include "arena.h"
+#include "rtsched.h"
+#include "keypad.h"
+#include "tones.h"
+#include "ringer.h"
+#include "startup.h"
+#include "sdnotify.h"
+#include "handoff.h"
+#include "process.h"
+
+/* How long systemd is kept waiting for the registrations, in seconds.
+ * Less than TimeoutStartSec= of data/piphoned.service. */
+#define READY_TIMEOUT 60
 
 enum ZrtpNonceAcception {
   ZRTP_NONCE_UNKNOWN = 0,
@@ -23,35 +47,76 @@ enum ZrtpNonceAcception {
 };
 
 static int mainloop();
+static void update_line(int line);
+static enum Piphoned_Tone get_wanted_tone(int line, bool hung_up);
+static bool setup_signal_handlers();
+static bool is_simulated_command(enum Piphoned_Commandline_Command command);
+static void lock_memory();
+static bool all_lines_registered();
+static bool all_lines_idle();
+static bool handoff_lines_registered();
+static void write_handoff_pidfile();
+static bool watch_hardware();
+static void unwatch_hardware();
+static void reload_config();
 void handle_sigterm(int signum);
 void handle_sigusr1(int signum);
+void handle_sighup(int signum);
 int command_start();
 int command_stop();
 int command_restart();
+int command_benchmark();
+int command_simulate();
+int command_soak();
+
+/**
+ * Mainloop state of a single line.
+ */
+struct MainloopLine
+{
+  struct Piphoned_PhoneManager* p_phonemanager; /*< SIP side of the line */
+  bool was_hung_up;                             /*< Hook state in the last iteration */
+  enum ZrtpNonceAcception zrtp_sas_ok;          /*< Has the SAS of the line's call been confirmed? */
+  enum Piphoned_Tone tone;                      /*< Call progress tone the handset hears */
+};
 
 static volatile bool s_stop_mainloop = false;
-static volatile enum ZrtpNonceAcception s_zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
+static volatile bool s_zrtp_sas_confirmed = false;
+static volatile bool s_reload_config = false;
+static struct MainloopLine s_lines[PIPHONED_MAX_LINES];
+static int s_num_lines = 0;
+static bool s_take_over = false;    /* Is `restart' taking the phone over? */
+static int s_handoff_pidfile = -1;  /* PID file to fill in once the handoff is confirmed */
 
 int main(int argc, char* argv[])
 {
   int retval = 0;
 
-  /* We need root rights to initialize everything. */
-  if (getuid() != 0) {
+  piphoned_startup_init();
+  piphoned_commandline_info_from_argv(argc, argv); /* sets up g_cli_options */
+
+  /* We need root rights to initialize everything. The benchmark, the
+   * soak test and the simulation do not touch the hardware and run as
+   * any user. */
+  if (!is_simulated_command(g_cli_options.command) && getuid() != 0) {
     fprintf(stderr, "This program has to be run as root. Exiting.\n");
     return 1;
   }
 
-  piphoned_commandline_info_from_argv(argc, argv); /* sets up g_cli_options */
-
   setlogmask(LOG_UPTO(g_cli_options.loglevel));
   openlog("piphoned", LOG_CONS | LOG_ODELAY | LOG_PID, LOG_DAEMON);
   syslog(LOG_DEBUG, "Early startup phase entered.");
 
+  piphoned_startup_begin(PIPHONED_STARTUP_CONFIG, NULL);
   piphoned_config_init(g_cli_options.config_file); /* sets g_piphoned_config_info */
+  piphoned_startup_end(PIPHONED_STARTUP_CONFIG, NULL);
 
   /* Library initialisation */
-  wiringPiSetup(); /* Requires root */
+  if (!is_simulated_command(g_cli_options.command)) {
+    piphoned_startup_begin(PIPHONED_STARTUP_WIRINGPI, NULL);
+    wiringPiSetup(); /* Requires root */
+    piphoned_startup_end(PIPHONED_STARTUP_WIRINGPI, NULL);
+  }
 
   switch(g_cli_options.command) {
   case PIPHONED_COMMAND_START:
@@ -63,6 +128,15 @@ int main(int argc, char* argv[])
   case PIPHONED_COMMAND_RESTART:
     retval = command_restart();
     break;
+  case PIPHONED_COMMAND_BENCHMARK:
+    retval = command_benchmark();
+    break;
+  case PIPHONED_COMMAND_SIMULATE:
+    retval = command_simulate();
+    break;
+  case PIPHONED_COMMAND_SOAK:
+    retval = command_soak();
+    break;
   default:
     fprintf(stderr, "Invalid command %d. This is a bug.\n", g_cli_options.command);
     return 1;
@@ -90,7 +164,17 @@ int command_start()
    * Daemonising
    ***************************************/
 
-  if (g_cli_options.daemonize) {
+  if (piphoned_sdnotify_enabled()) {
+    /* systemd supervises this very process (Type=notify), so neither
+     * forking nor a PID file are needed. Readiness is reported once
+     * all lines are registered, see mainloop(). */
+    syslog(LOG_INFO, "Started by systemd, staying in the foreground.");
+
+    close(STDIN_FILENO);
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+  }
+  else if (g_cli_options.daemonize) {
     childpid = fork();
     if (childpid < 0) { /* Error */
       syslog(LOG_CRIT, "Fork failed: %m");
@@ -134,28 +218,44 @@ int command_start()
    * Last privileged operations
    ***************************************/
 
-  /* PID file */
-
-  /* If there is a PID file already, there may be something running.
-   * Reject start. */
-  file = fopen(g_piphoned_config_info.pidfile, "r");
-  if (file) {
-    syslog(LOG_CRIT, "PID file already exists! Exiting.");
-    fprintf(stderr, "PID file already exists, exiting.\n");
-    fclose(file);
+  /* Handoff. Returns once the running daemon freed the phone. */
+  if (s_take_over && !piphoned_handoff_take_over()) {
+    syslog(LOG_CRIT, "Failed to take over from the running daemon. Exiting.");
     retval = 3;
     goto finish;
   }
 
-  file = fopen(g_piphoned_config_info.pidfile, "w");
-  if (!file) {
-    syslog(LOG_CRIT, "Failed to open PID file '%s': %m", g_piphoned_config_info.pidfile);
-    retval = 3;
-    goto finish;
+  /* PID file */
+
+  /* If there is a PID file already, there may be something running.
+   * Reject start. Under systemd, it knows our PID anyway. When taking
+   * over, the old daemon's PID stays in it until the new one is
+   * confirmed, as the old one takes the phone back otherwise. */
+  if (s_take_over) {
+    s_handoff_pidfile = open(g_piphoned_config_info.pidfile, O_WRONLY | O_CREAT | O_CLOEXEC, 0640);
+    if (s_handoff_pidfile < 0)
+      syslog(LOG_ERR, "Failed to open PID file '%s': %m", g_piphoned_config_info.pidfile);
   }
+  else if (!piphoned_sdnotify_enabled()) {
+    file = fopen(g_piphoned_config_info.pidfile, "r");
+    if (file) {
+      syslog(LOG_CRIT, "PID file already exists! Exiting.");
+      fprintf(stderr, "PID file already exists, exiting.\n");
+      fclose(file);
+      retval = 3;
+      goto finish;
+    }
 
-  fprintf(file, "%d", getpid());
-  fclose(file);
+    file = fopen(g_piphoned_config_info.pidfile, "w");
+    if (!file) {
+      syslog(LOG_CRIT, "Failed to open PID file '%s': %m", g_piphoned_config_info.pidfile);
+      retval = 3;
+      goto finish;
+    }
+
+    fprintf(file, "%d", getpid());
+    fclose(file);
+  }
 
   /* ZRTP secrets file */
 
@@ -171,6 +271,24 @@ int command_start()
   chown(g_piphoned_config_info.zrtp_secrets_file, g_piphoned_config_info.uid, g_piphoned_config_info.gid);
   chmod(g_piphoned_config_info.zrtp_secrets_file, S_IRUSR | S_IWUSR);
 
+  /* Flight recorder. Failure is not fatal, we just run without it. */
+  if (strlen(g_piphoned_config_info.flightrec_file) > 0)
+    piphoned_flightrec_init(g_piphoned_config_info.flightrec_file, g_piphoned_config_info.flightrec_events);
+
+  /* Handoff socket, which a taking over process got passed already.
+   * Failure is not fatal, `restart' then stops and starts. systemd
+   * restarts the service on its own. */
+  if (!s_take_over && !piphoned_sdnotify_enabled())
+    piphoned_handoff_listen();
+
+  /* Needs root for lifting the memory lock limit */
+  if (g_piphoned_config_info.lock_memory)
+    lock_memory();
+
+  /* Needs root for raising RLIMIT_RTPRIO; the threads apply their
+   * priorities later on. Failure only means normal priorities. */
+  piphoned_rtsched_init();
+
   syslog(LOG_INFO, "Fork setup completed.");
 
   /***************************************
@@ -225,30 +343,8 @@ int command_start()
    * Signal handlers
    ***************************************/
 
-  /* Debian doesn’t have sigaction() yet as it doesn’t yet
-   * implement POSIX.1-2008. */
-  /*
-  struct sigaction term_signal_info;
-  term_signal_info.sa_handler = handle_sigterm;
-  term_signal_info.sa_mask = SIGINT;
-  if (sigaction(SIGTERM, &term_signal_info, NULL) < 0) {
-    syslog(LOG_CRIT, "Failed to setup SIGTERM signal handler: %m");
+  if (!setup_signal_handlers())
     goto finish;
-  }
-  */
-  /* So instead, use deprecated signal() for now. */
-  if (signal(SIGTERM, handle_sigterm) == SIG_ERR) {
-    syslog(LOG_CRIT, "Failed to setup SIGTERM signal handler: %m");
-    goto finish;
-  }
-  if (signal(SIGINT, handle_sigterm) == SIG_ERR) {
-    syslog(LOG_CRIT, "Failed to setup SIGINT signal handler: %m");
-    goto finish;
-  }
-  if (signal(SIGUSR1, handle_sigusr1) == SIG_ERR) {
-    syslog(LOG_CRIT, "Failed to setup SIGUSR1 signal handler: %m");
-    goto finish;
-  }
 
   /***************************************
    * Start of real code
@@ -261,6 +357,10 @@ int command_start()
    **************************************/
 
  finish:
+  piphoned_handoff_free();
+  if (s_handoff_pidfile >= 0)
+    close(s_handoff_pidfile);
+  piphoned_flightrec_free();
   syslog(LOG_NOTICE, "Program finished.");
 
   return retval;
@@ -271,6 +371,11 @@ int command_stop()
   FILE* p_pidfile = fopen(g_piphoned_config_info.pidfile, "r");
   char pidstr[16];
   int pid = 0;
+  int pidfd = -1;
+  int retval = 0;
+  struct timespec start;
+  struct timespec end;
+  double elapsed = 0.0;
 
   if (!p_pidfile) {
     int errcode = errno;
@@ -286,31 +391,70 @@ int command_stop()
   fclose(p_pidfile);
 
   pid = atoi(pidstr);
+
+  /* See process.c */
+  pidfd = piphoned_process_open(pid);
+  if (pidfd < 0 && errno != ENOSYS) {
+    int errcode = errno;
+
+    fprintf(stderr, "Cannot access process %d: %s\n", pid, strerror(errcode));
+    syslog(LOG_CRIT, "Cannot access process %d: %s", pid, strerror(errcode));
+
+    return 2;
+  }
+
   printf("Sending SIGTERM to process %d\n", pid);
   syslog(LOG_NOTICE, "Sending SIGTERM to process %d", pid);
-  if (kill(pid, SIGTERM) < 0) {
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (piphoned_process_signal(pid, pidfd, SIGTERM) < 0) {
     int errcode = errno;
 
     fprintf(stderr, "Cannot send SIGTERM to process %d: %s\n", pid, strerror(errcode));
     syslog(LOG_CRIT, "Cannot send SIGTERM to process %d: %s", pid, strerror(errcode));
 
-    return 2;
+    retval = 2;
+    goto finish;
+  }
+
+  /* Wait for the process to exit, and kill it if it takes too long */
+  if (!piphoned_process_wait_exit(pid, pidfd, g_piphoned_config_info.stop_timeout > 0 ? g_piphoned_config_info.stop_timeout * 1000 : -1)) {
+    printf("Process %d did not exit within %d seconds, sending SIGKILL\n", pid, g_piphoned_config_info.stop_timeout);
+    syslog(LOG_WARNING, "Process %d did not exit within %d seconds, sending SIGKILL", pid, g_piphoned_config_info.stop_timeout);
+
+    if (piphoned_process_signal(pid, pidfd, SIGKILL) < 0 || !piphoned_process_wait_exit(pid, pidfd, PIPHONED_PROCESS_KILL_TIMEOUT)) {
+      fprintf(stderr, "Cannot kill process %d.\n", pid);
+      syslog(LOG_CRIT, "Cannot kill process %d.", pid);
+
+      retval = 2;
+      goto finish;
+    }
   }
 
-  /* Wait for the process to exit */
-  while(kill(pid, 0) == 0)
-    sleep(1);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+  printf("Process %d exited after %.0f ms\n", pid, elapsed);
+  syslog(LOG_NOTICE, "Process %d exited after %.0f ms", pid, elapsed);
 
   /* Clean up PID file. The daemon doesn't have sufficient privileges to do so. */
   unlink(g_piphoned_config_info.pidfile);
 
-  return 0;
+ finish:
+  if (pidfd >= 0)
+    close(pidfd);
+
+  return retval;
 }
 
 int command_restart()
 {
   int retval = 0;
 
+  /* A daemon accepting handoffs keeps the phone until we have it */
+  if (strlen(g_piphoned_config_info.handoff_socket) > 0 && access(g_piphoned_config_info.handoff_socket, F_OK) == 0) {
+    s_take_over = true;
+    return command_start();
+  }
+
   retval = command_stop();
   if (retval != 0)
     return retval;
@@ -318,73 +462,614 @@ int command_restart()
   return command_start();
 }
 
-int mainloop()
+/**
+ * Runs the daemon in the foreground against the fake SIP backend
+ * and simulated hardware, placing `-n` calls and reporting the
+ * signalling latencies. No root rights, GPIO access, sound devices
+ * or SIP account are needed. The dialed number is not read back.
+ */
+int command_benchmark()
 {
-  char sip_uri[512]; /* TODO: Use MAX_SIP_URI_LENGTH (which is not global yet, but in hwactions.c...) */
-  struct Piphoned_PhoneManager* p_phonemanager = NULL;
+  int retval = 0;
 
-  s_stop_mainloop = false;
+  syslog(LOG_NOTICE, "Starting benchmark.");
+
+  /* The readback's seconds of sleeping would swamp the latencies */
+  g_piphoned_config_info.sip_backend = "fake";
+  g_piphoned_config_info.dial_readback = false;
+  piphoned_hwactions_set_simulated(true);
+
+  if (!setup_signal_handlers())
+    return 3;
+
+  retval = mainloop();
+
+  syslog(LOG_NOTICE, "Benchmark finished.");
+  return retval;
+}
+
+/**
+ * Runs the daemon in the foreground with the configured SIP backend,
+ * but with the hardware replaced by commands read from the standard
+ * input (see simctl.c). No root rights or GPIO access are needed.
+ */
+int command_simulate()
+{
+  int retval = 0;
+
+  syslog(LOG_NOTICE, "Starting with simulated hardware.");
+
+  if (strlen(g_piphoned_config_info.flightrec_file) > 0)
+    piphoned_flightrec_init(g_piphoned_config_info.flightrec_file, g_piphoned_config_info.flightrec_events);
+
+  piphoned_hwactions_set_simulated(true);
+
+  if (!setup_signal_handlers()) {
+    retval = 3;
+    goto finish;
+  }
+  if (!piphoned_simctl_start()) {
+    retval = 3;
+    goto finish;
+  }
+
+  retval = mainloop();
+  piphoned_simctl_stop();
+
+ finish:
+  piphoned_flightrec_free();
+  syslog(LOG_NOTICE, "Simulation finished.");
 
-  p_phonemanager = piphoned_phonemanager_new();
-  if (!p_phonemanager) {
-    syslog(LOG_CRIT, "Failed to set up phone manager. Exiting.");
-    return 4;
+  return retval;
+}
+
+/**
+ * Like command_benchmark(), but cycles through all kinds of calls
+ * `-n` times while watching the process' resource usage. See
+ * soak.c.
+ */
+int command_soak()
+{
+  int retval = 0;
+
+  syslog(LOG_NOTICE, "Starting soak test.");
+
+  /* With the readback, the cycles would take days and the setup
+   * latencies measure its sleeping */
+  g_piphoned_config_info.sip_backend = "fake";
+  g_piphoned_config_info.dial_readback = false;
+  piphoned_hwactions_set_simulated(true);
+
+  if (!setup_signal_handlers())
+    return 3;
+
+  retval = mainloop();
+
+  syslog(LOG_NOTICE, "Soak test finished.");
+  return retval;
+}
+
+/**
+ * Commands that replace the hardware by a simulation and hence
+ * neither need root rights nor wiringPi.
+ */
+static bool is_simulated_command(enum Piphoned_Commandline_Command command)
+{
+  return command == PIPHONED_COMMAND_BENCHMARK || command == PIPHONED_COMMAND_SIMULATE || command == PIPHONED_COMMAND_SOAK;
+}
+
+/**
+ * Has every line that has proxies registered with at least one of
+ * them?
+ */
+static bool all_lines_registered()
+{
+  int i = 0;
+
+  for(i=0; i < s_num_lines; i++) {
+    if (s_lines[i].p_phonemanager->num_proxies > 0 && !s_lines[i].p_phonemanager->is_registered)
+      return false;
   }
-  if (!piphoned_phonemanager_load_proxies(p_phonemanager)) {
-    syslog(LOG_CRIT, "Failed to load linphone proxies. Exiting.");
-    return 4;
+
+  return true;
+}
+
+/**
+ * Is no line in a call or ringing, and every handset on the hook?
+ */
+static bool all_lines_idle()
+{
+  int i = 0;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct Piphoned_PhoneManager* p_phonemanager = s_lines[i].p_phonemanager;
+
+    if (p_phonemanager->is_calling || p_phonemanager->has_incoming_call || p_phonemanager->num_held > 0 || !s_lines[i].was_hung_up)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Is every line that was registered in the daemon we took the phone
+ * over from registered again?
+ */
+static bool handoff_lines_registered()
+{
+  int i = 0;
+
+  for(i=0; i < s_num_lines; i++) {
+    if (piphoned_handoff_was_registered(s_lines[i].p_phonemanager->p_line->name) && !s_lines[i].p_phonemanager->is_registered)
+      return false;
   }
 
+  return true;
+}
+
+/**
+ * Puts our PID into the PID file opened before the handoff.
+ */
+static void write_handoff_pidfile()
+{
+  char pidstr[16];
+  int length = 0;
+
+  if (s_handoff_pidfile < 0)
+    return;
+
+  length = snprintf(pidstr, sizeof(pidstr), "%d", getpid());
+  if (ftruncate(s_handoff_pidfile, 0) < 0 || write(s_handoff_pidfile, pidstr, length) != length)
+    syslog(LOG_ERR, "Failed to write PID file '%s': %m", g_piphoned_config_info.pidfile);
+
+  close(s_handoff_pidfile);
+  s_handoff_pidfile = -1;
+}
+
+/**
+ * Starts watching the GPIO pins and, unless simulated, the keypad,
+ * tone and ringer devices.
+ */
+static bool watch_hardware()
+{
   piphoned_hwactions_init();
 
-  while(true) {
-    piphoned_phonemanager_update(p_phonemanager);
+  if (!is_simulated_command(g_cli_options.command) && !piphoned_keypad_init()) {
+    syslog(LOG_CRIT, "Failed to set up keypad listening. Exiting.");
+    return false;
+  }
+  if (!is_simulated_command(g_cli_options.command) && !piphoned_tones_init()) {
+    syslog(LOG_CRIT, "Failed to set up call progress tones. Exiting.");
+    return false;
+  }
+  if (!is_simulated_command(g_cli_options.command) && !piphoned_ringer_init()) {
+    syslog(LOG_CRIT, "Failed to set up the ringer. Exiting.");
+    return false;
+  }
 
-    if (p_phonemanager->has_incoming_call) {
-      if (!piphoned_hwactions_is_phone_hung_up()) {
-        s_zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
-        syslog(LOG_NOTICE, "Accepting call.");
-        piphoned_phonemanager_accept_incoming_call(p_phonemanager);
-      }
-      /* TODO: Find a way to input a call decline on the hardware... */
+  return true;
+}
+
+static void unwatch_hardware()
+{
+  piphoned_ringer_free();
+  piphoned_tones_free();
+  piphoned_keypad_free();
+  piphoned_hwactions_free();
+}
+
+/**
+ * Reads the configuration file again and applies what changed. The
+ * lines keep their registrations except on proxies whose sections
+ * changed. The hardware is watched anew, as its threads hold on to
+ * device names from the string pool the new configuration replaces.
+ * Call this only while no line has a call.
+ */
+static void reload_config()
+{
+  struct Piphoned_Config_ParsedFile* p_new = NULL;
+  bool same_lines = false;
+  int i = 0;
+
+  syslog(LOG_NOTICE, "Reloading the configuration file '%s'.", g_cli_options.config_file);
+  piphoned_sdnotify("RELOADING=1");
+
+  p_new = piphoned_config_parse_new(g_cli_options.config_file);
+  if (!p_new)
+    goto finish;
+
+  same_lines = piphoned_config_same_lines(p_new);
+
+  unwatch_hardware();
+
+  for(i=0; i < s_num_lines; i++)
+    piphoned_phonemanager_reload(s_lines[i].p_phonemanager, same_lines ? p_new->lines[i] : g_piphoned_config_info.lines[i], p_new);
+
+  piphoned_config_apply(p_new); /* Frees p_new */
+
+  if (!watch_hardware())
+    s_stop_mainloop = true;
+
+  /* The hardware threads are new; only media threads started from
+   * now on are to become audio threads */
+  piphoned_rtsched_mark_baseline();
+
+  syslog(LOG_NOTICE, "Configuration file reloaded.");
+
+ finish:
+  piphoned_sdnotify("READY=1");
+}
+
+/**
+ * Locks all current and future memory of the process into RAM, so
+ * that neither swapping nor lazily populated pages can cause page
+ * faults in the audio or interrupt handling threads. Failure is not
+ * fatal; the daemon just runs without the guarantee.
+ */
+static void lock_memory()
+{
+  struct rlimit limit;
+  volatile char stack[65536];
+
+  limit.rlim_cur = RLIM_INFINITY;
+  limit.rlim_max = RLIM_INFINITY;
+  if (setrlimit(RLIMIT_MEMLOCK, &limit) < 0)
+    syslog(LOG_WARNING, "Failed to lift the memory lock limit: %m");
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    syslog(LOG_ERR, "Failed to lock memory: %m. Continuing without.");
+    return;
+  }
+
+  /* Fault in the stack the mainloop is going to use */
+  memset((char*) stack, '\0', sizeof(stack));
+
+  syslog(LOG_INFO, "Locked all memory into RAM.");
+}
 
-      /* The termination of an accepted incoming call is exactly
-       * the same as of a call that was initiated by us. */
+/**
+ * Installs the handlers for SIGTERM, SIGINT, SIGUSR1 and SIGHUP.
+ */
+static bool setup_signal_handlers()
+{
+  /* Debian doesn’t have sigaction() yet as it doesn’t yet
+   * implement POSIX.1-2008. */
+  /*
+  struct sigaction term_signal_info;
+  term_signal_info.sa_handler = handle_sigterm;
+  term_signal_info.sa_mask = SIGINT;
+  if (sigaction(SIGTERM, &term_signal_info, NULL) < 0) {
+    syslog(LOG_CRIT, "Failed to setup SIGTERM signal handler: %m");
+    return false;
+  }
+  */
+  /* So instead, use deprecated signal() for now. */
+  if (signal(SIGTERM, handle_sigterm) == SIG_ERR) {
+    syslog(LOG_CRIT, "Failed to setup SIGTERM signal handler: %m");
+    return false;
+  }
+  if (signal(SIGINT, handle_sigterm) == SIG_ERR) {
+    syslog(LOG_CRIT, "Failed to setup SIGINT signal handler: %m");
+    return false;
+  }
+  if (signal(SIGUSR1, handle_sigusr1) == SIG_ERR) {
+    syslog(LOG_CRIT, "Failed to setup SIGUSR1 signal handler: %m");
+    return false;
+  }
+  if (signal(SIGHUP, handle_sighup) == SIG_ERR) {
+    syslog(LOG_CRIT, "Failed to setup SIGHUP signal handler: %m");
+    return false;
+  }
+
+  return true;
+}
+
+int mainloop()
+{
+  bool ready = false;
+  bool registered = false;
+  bool handing_off = false;
+  bool reload_announced = false;
+  struct timespec loop_start;
+  struct timespec now;
+  int retval = 0;
+  int i = 0;
+
+ start: /* Again after a failed handoff */
+  ready = false;
+  registered = false;
+  handing_off = false;
+  reload_announced = false;
+  s_stop_mainloop = false;
+  s_zrtp_sas_confirmed = false;
+  s_num_lines = 0;
+
+  /* All of our long-lived state comes from here, so that the
+   * mainloop itself never needs to allocate. */
+  piphoned_arena_init(PIPHONED_ARENA_SIZE * g_piphoned_config_info.num_lines);
+
+  /* Every line gets a SIP core of its own, as a linphone core can
+   * only carry the audio of one call at a time. */
+  for(i=0; i < g_piphoned_config_info.num_lines; i++) {
+    s_lines[i].p_phonemanager = piphoned_phonemanager_new(g_piphoned_config_info.lines[i]);
+    s_lines[i].was_hung_up = true;
+    s_lines[i].zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
+
+    if (!s_lines[i].p_phonemanager) {
+      syslog(LOG_CRIT, "Failed to set up phone manager for line '%s'. Exiting.", g_piphoned_config_info.lines[i]->name);
+      retval = 4;
+      goto fail;
     }
-    else {
-      if (p_phonemanager->is_calling) {
-        if (s_zrtp_sas_ok == ZRTP_NONCE_WRONG) {
-          piphoned_phonemanager_reject_zrtp_nonce(p_phonemanager);
-        }
-        else if (s_zrtp_sas_ok == ZRTP_NONCE_OK) {
-          piphoned_phonemanager_accept_zrtp_nonce(p_phonemanager);
-        }
-
-        if (piphoned_hwactions_is_phone_hung_up()) {
-          syslog(LOG_NOTICE, "Terminating call.");
-          piphoned_phonemanager_stop_call(p_phonemanager);
-          s_zrtp_sas_ok = ZRTP_NONCE_UNKNOWN; /* Reset for extra safety although not needed strictly */
-        }
+    s_num_lines++;
+
+    if (!piphoned_phonemanager_load_proxies(s_lines[i].p_phonemanager)) {
+      syslog(LOG_CRIT, "Failed to load linphone proxies for line '%s'. Exiting.", g_piphoned_config_info.lines[i]->name);
+      retval = 4;
+      goto fail;
+    }
+  }
+
+  syslog(LOG_INFO, "Driving %d line(s).", s_num_lines);
+
+  /* From here on, the interrupt handlers run and log through the
+   * log ring rather than blocking in syslog(). */
+  piphoned_logring_init(!g_cli_options.daemonize);
+  if (!watch_hardware())
+    s_stop_mainloop = true;
+
+  /* Threads starting after this are linphone's media threads */
+  piphoned_rtsched_apply(PIPHONED_RTSCHED_SIP);
+  piphoned_rtsched_mark_baseline();
+
+  /* Benchmark and soak test exercise the first line */
+  if (g_cli_options.command == PIPHONED_COMMAND_BENCHMARK) {
+    if (!piphoned_benchmark_start(s_lines[0].p_phonemanager->p_sipcore, g_cli_options.benchmark_cycles))
+      s_stop_mainloop = true;
+  }
+  else if (g_cli_options.command == PIPHONED_COMMAND_SOAK) {
+    if (!piphoned_soak_start(s_lines[0].p_phonemanager->p_sipcore, g_cli_options.benchmark_cycles, g_cli_options.soak_interval, g_cli_options.soak_max_growth))
+      s_stop_mainloop = true;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &loop_start);
+  while(true) {
+    /* SIGUSR1 confirms the SAS of whatever calls are running */
+    if (s_zrtp_sas_confirmed) {
+      s_zrtp_sas_confirmed = false;
+      for(i=0; i < s_num_lines; i++)
+        s_lines[i].zrtp_sas_ok = ZRTP_NONCE_OK;
+    }
+
+    for(i=0; i < s_num_lines; i++)
+      update_line(i);
+
+    if (s_stop_mainloop)
+      break;
+
+    /* SIGHUP reloads the configuration file between calls */
+    if (s_reload_config) {
+      if (all_lines_idle()) {
+        s_reload_config = false;
+        reload_announced = false;
+        reload_config();
       }
-      else {
-        if (!piphoned_hwactions_is_phone_hung_up()) {
-          piphoned_hwactions_get_sip_uri(sip_uri);
-          syslog(LOG_NOTICE, "Dialing SIP URI: %s", sip_uri);
-          s_zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
-          piphoned_phonemanager_place_call(p_phonemanager, sip_uri);
-        }
+      else if (!reload_announced) {
+        reload_announced = true;
+        syslog(LOG_NOTICE, "Reloading the configuration file once all calls ended.");
       }
     }
 
-    if (s_stop_mainloop)
+    /* A new process asked for the phone; hand it over between calls */
+    if (piphoned_handoff_requested() && all_lines_idle()) {
+      handing_off = true;
       break;
+    }
+
+    /* The GPIO pins are watched since before the loop, so the phone
+     * is usable once the SIP servers took the registrations. With a
+     * registrar out of reach, it is still reported ready after a
+     * while rather than restarted by systemd over and over. */
+    if (!registered && all_lines_registered()) {
+      registered = true;
+      ready = true;
+      piphoned_sdnotify("READY=1\nSTATUS=Registered, driving %d line(s)", s_num_lines);
+    }
+    else if (!ready) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec - loop_start.tv_sec >= READY_TIMEOUT) {
+        ready = true;
+        syslog(LOG_WARNING, "Not all lines registered within %d seconds, carrying on without.", READY_TIMEOUT);
+        piphoned_sdnotify("READY=1\nSTATUS=Waiting for registration, driving %d line(s)", s_num_lines);
+      }
+    }
+
+    /* Taking over, the old daemon exits once we are as registered as
+     * it was */
+    if (piphoned_handoff_is_pending() && handoff_lines_registered()) {
+      piphoned_handoff_confirm();
+      write_handoff_pidfile();
+    }
+
+    piphoned_phonemanager_wait();
   }
 
-  syslog(LOG_NOTICE, "Initiating shutdown.");
-  piphoned_phonemanager_free(p_phonemanager);
-  piphoned_hwactions_free();
+  if (handing_off)
+    syslog(LOG_NOTICE, "Handing the phone over.");
+  else {
+    syslog(LOG_NOTICE, "Initiating shutdown.");
+    piphoned_sdnotify("STOPPING=1");
+  }
+
+  /* In case a line never heard back from its SIP server */
+  piphoned_startup_report();
+
+  if (g_cli_options.command == PIPHONED_COMMAND_BENCHMARK)
+    retval = piphoned_benchmark_finish();
+  else if (g_cli_options.command == PIPHONED_COMMAND_SOAK)
+    retval = piphoned_soak_finish();
+
+  /* The registrations stay for the new process */
+  for(i=0; i < s_num_lines && handing_off; i++) {
+    piphoned_handoff_note_line(s_lines[i].p_phonemanager->p_line->name, s_lines[i].p_phonemanager->is_registered);
+    s_lines[i].p_phonemanager->keep_registrations = true;
+  }
+
+  for(i=0; i < s_num_lines; i++)
+    piphoned_phonemanager_free(s_lines[i].p_phonemanager);
+  s_num_lines = 0;
+
+  unwatch_hardware();
+  piphoned_logring_free();
+  piphoned_arena_free();
 
-  return 0;
+  if (handing_off) {
+    piphoned_handoff_release();
+    if (!piphoned_handoff_wait_confirmation()) {
+      syslog(LOG_ERR, "Handoff failed, taking the phone back.");
+      goto start;
+    }
+  }
+
+  return retval;
+
+ fail:
+  for(i=0; i < s_num_lines; i++)
+    piphoned_phonemanager_free(s_lines[i].p_phonemanager);
+  s_num_lines = 0;
+
+  piphoned_arena_free();
+  return retval;
+}
+
+/**
+ * One mainloop iteration for the given line: iterate its SIP core,
+ * then act on what happened on its handset.
+ */
+static void update_line(int line)
+{
+  char sip_uri[512]; /* TODO: Use MAX_SIP_URI_LENGTH (which is not global yet, but in hwactions.c...) */
+  struct MainloopLine* p_line = &s_lines[line];
+  struct Piphoned_PhoneManager* p_phonemanager = p_line->p_phonemanager;
+  bool hung_up = false;
+  char digit = '\0';
+  struct timespec dialed_at;
+  enum Piphoned_Tone tone = PIPHONED_TONE_NONE;
+
+  piphoned_phonemanager_update(p_phonemanager);
+
+  /* Only hold back hang-ups while a flash has something to switch to */
+  piphoned_hwactions_set_flash_wanted(line, p_phonemanager->is_calling && (p_phonemanager->has_incoming_call || p_phonemanager->num_held > 0));
+
+  hung_up = piphoned_hwactions_is_phone_hung_up(line);
+  if (hung_up != p_line->was_hung_up) {
+    p_line->was_hung_up = hung_up;
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_HOOK, hung_up, line);
+
+    /* A keypad number only counts for the time the handset is lifted */
+    if (hung_up && piphoned_keypad_is_keypad_line(line))
+      piphoned_hwactions_clear_sip_uri(line);
+  }
+
+  /* Keypad tones are only dialing before a call; in a call they are
+   * part of the call's audio. */
+  if (piphoned_keypad_is_keypad_line(line))
+    piphoned_keypad_listen(line, !hung_up && !p_phonemanager->is_calling && !p_phonemanager->has_incoming_call);
+
+  if (p_phonemanager->is_calling) {
+    if (p_line->zrtp_sas_ok == ZRTP_NONCE_WRONG) {
+      piphoned_phonemanager_reject_zrtp_nonce(p_phonemanager);
+    }
+    else if (p_line->zrtp_sas_ok == ZRTP_NONCE_OK) {
+      piphoned_phonemanager_accept_zrtp_nonce(p_phonemanager);
+    }
+
+    /* A flash takes a waiting call or swaps with a held one */
+    if (piphoned_hwactions_take_flash(line)) {
+      p_line->zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
+      piphoned_phonemanager_flash(p_phonemanager);
+    }
+
+    /* Digits dialed during the call are for the remote side, e.g. to
+     * navigate a phone menu */
+    while (piphoned_hwactions_take_incall_digit(line, &digit, &dialed_at))
+      piphoned_phonemanager_send_dtmf(p_phonemanager, digit, &dialed_at);
+
+    if (hung_up) {
+      syslog(LOG_NOTICE, "Terminating call on line '%s'.", p_phonemanager->p_line->name);
+      piphoned_phonemanager_stop_call(p_phonemanager);
+      p_line->zrtp_sas_ok = ZRTP_NONCE_UNKNOWN; /* Reset for extra safety although not needed strictly */
+    }
+  }
+  else if (p_phonemanager->has_incoming_call) {
+    if (!hung_up) {
+      p_line->zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
+      syslog(LOG_NOTICE, "Accepting call on line '%s'.", p_phonemanager->p_line->name);
+      piphoned_phonemanager_accept_incoming_call(p_phonemanager);
+    }
+    /* TODO: Find a way to input a call decline on the hardware... */
+
+    /* The termination of an accepted incoming call is exactly
+     * the same as of a call that was initiated by us. */
+  }
+  else {
+    /* Keypad phones are dialed after lifting the handset, so wait
+     * until the number is complete. */
+    if (!hung_up && (!piphoned_keypad_is_keypad_line(line) || piphoned_hwactions_is_number_complete(line))) {
+      piphoned_hwactions_get_sip_uri(line, sip_uri);
+      syslog(LOG_NOTICE, "Dialing SIP URI on line '%s': %s", p_phonemanager->p_line->name, sip_uri);
+      p_line->zrtp_sas_ok = ZRTP_NONCE_UNKNOWN;
+      piphoned_phonemanager_place_call(p_phonemanager, sip_uri);
+    }
+  }
+
+  /* Flashes and digits dialed off-hook outside of calls mean nothing */
+  if (!p_phonemanager->is_calling) {
+    piphoned_hwactions_take_flash(line);
+    while (piphoned_hwactions_take_incall_digit(line, &digit, &dialed_at))
+      ;
+  }
+
+  /* Only ring while nobody answered; a call arriving during another
+   * one gets the call waiting tone instead */
+  piphoned_ringer_ring(line, p_phonemanager->has_incoming_call && !p_phonemanager->is_calling);
+
+  tone = get_wanted_tone(line, hung_up);
+  if (tone != p_line->tone) {
+    syslog(LOG_DEBUG, "Call progress tone of line %s: %s.", p_phonemanager->p_line->name, piphoned_tones_get_name(tone));
+    p_line->tone = tone;
+    piphoned_tones_play(line, tone);
+  }
+}
+
+/**
+ * Which call progress tone the handset of the given line should hear
+ * right now.
+ */
+static enum Piphoned_Tone get_wanted_tone(int line, bool hung_up)
+{
+  struct Piphoned_PhoneManager* p_phonemanager = s_lines[line].p_phonemanager;
+
+  if (hung_up)
+    return PIPHONED_TONE_NONE;
+
+  if (!p_phonemanager->is_calling) {
+    /* Lifting the handset accepts a ringing call */
+    if (p_phonemanager->has_incoming_call || piphoned_hwactions_is_dialing(line))
+      return PIPHONED_TONE_NONE;
+    else
+      return PIPHONED_TONE_DIAL;
+  }
+
+  switch (p_phonemanager->progress) {
+  case PIPHONED_PROGRESS_RINGING:
+    return PIPHONED_TONE_RINGBACK;
+  case PIPHONED_PROGRESS_BUSY:
+    return PIPHONED_TONE_BUSY;
+  case PIPHONED_PROGRESS_FAILED:
+    return PIPHONED_TONE_CONGESTION;
+  default:
+    return PIPHONED_TONE_NONE;
+  }
 }
 
 void handle_sigterm(int signum)
@@ -394,5 +1079,10 @@ void handle_sigterm(int signum)
 
 void handle_sigusr1(int signum)
 {
-  s_zrtp_sas_ok = ZRTP_NONCE_OK;
+  s_zrtp_sas_confirmed = true;
+}
+
+void handle_sighup(int signum)
+{
+  s_reload_config = true;
 }
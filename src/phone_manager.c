@@ -9,15 +9,58 @@
 #include "phone_manager.h"
 #include "commandline.h"
 #include "configfile.h"
+#include "flightrec.h"
+#include "arena.h"
+#include "rtsched.h"
+#include "codecs.h"
+#include "sound_params.h"
+#include "sound_cache.h"
+#include "startup.h"
+#include "sdnotify.h"
 
 #define AUTHTOKEN_FILE "/tmp/zrtptoken"
 
 /**
- * Delay to wait between calls to linphone_core_iterate() to prevent
+ * Delay to wait between iterations of the SIP core to prevent
  * the process from grabbing 100% CPU.
  */
 #define LINPHONE_WAIT_DELAY 50000
 
+/**
+ * Size of the buffers the remote address of a call is copied into.
+ */
+#define MAX_SIP_ADDRESS_LENGTH 512
+
+/**
+ * Size of the buffer shell commands for creating voice files are
+ * built in.
+ */
+#define MAX_COMMAND_LENGTH 8192
+
+/**
+ * While a call is waiting, a short tone is played to the local user
+ * every CALL_WAITING_INTERVAL seconds. The SIP core plays DTMF tones
+ * only locally, so one of those serves as the call waiting tone.
+ */
+#define CALL_WAITING_INTERVAL 5
+#define CALL_WAITING_DIGIT '#'
+#define CALL_WAITING_DURATION 300
+
+/**
+ * Digits dialed during a call are sent within one mainloop iteration
+ * (LINPHONE_WAIT_DELAY). If one took longer than this many
+ * milliseconds, IVR menus may time out on it, so it is logged.
+ */
+#define DTMF_MAX_DELAY 200
+
+/**
+ * For the latency report of a call: the audio in one RTP packet in
+ * milliseconds, and the depth of linphone's jitter buffer if the
+ * line doesn't set `jitter_buffer'.
+ */
+#define PACKET_TIME 20
+#define DEFAULT_JITTER_BUFFER 60
+
 enum Piphoned_CallLogAction {
   PIPHONED_CALL_ACCEPTED = 1,
   PIPHONED_CALL_DECLINED,
@@ -26,115 +69,166 @@ enum Piphoned_CallLogAction {
   PIPHONED_CALL_BUSY
 };
 
-static LinphoneProxyConfig* load_linphone_proxy(LinphoneCore* p_linphone, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig);
-static void call_state_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, LinphoneCallState cstate, const char *msg);
-static void call_encryption_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, bool_t is_encrypted, const char* p_authtoken);
-static void handle_incoming_call(LinphoneCore* p_linphone, LinphoneCall* p_call);
-static void handle_running_streams(LinphoneCore* p_linphone, LinphoneCall* p_call);
-static void handle_call_ending(LinphoneCore* p_linphone, LinphoneCall* p_call);
-static void log_call(LinphoneCall* p_call, enum Piphoned_CallLogAction action);
+static void registration_state_changed(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, LinphoneRegistrationState rstate, const char* msg);
+static void call_state_changed(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, const char *msg);
+static void call_encryption_changed(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, bool is_encrypted, const char* p_authtoken);
+static void handle_incoming_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+static void handle_running_streams(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+static void handle_call_ending(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+static void log_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, enum Piphoned_CallLogAction action);
 static void determine_datadir(struct Piphoned_PhoneManager* p_manager);
-static void create_missed_call_voicefile(const struct Piphoned_PhoneManager* p_manager, const LinphoneCall* p_call);
+static void create_missed_call_voicefile(const struct Piphoned_PhoneManager* p_manager, struct Piphoned_SipCall* p_call);
+static void get_authtoken_path(const struct Piphoned_PhoneManager* p_manager, char* target);
+static struct Piphoned_CallSlot* take_slot(struct Piphoned_PhoneManager* p_manager, struct Piphoned_SipCall* p_call, enum Piphoned_CallSlotState state);
+static void release_slot(struct Piphoned_PhoneManager* p_manager, struct Piphoned_CallSlot* p_slot);
+static void terminate_slot(struct Piphoned_PhoneManager* p_manager, struct Piphoned_CallSlot* p_slot);
+static void play_call_waiting_tone(struct Piphoned_PhoneManager* p_manager);
+static void set_sound_rate(struct Piphoned_PhoneManager* p_manager);
+static void set_core_ringing(struct Piphoned_PhoneManager* p_manager, const struct Piphoned_Config_ParsedFile_LineTable* p_line, const struct Piphoned_Config_ParsedFile* p_config);
+static bool sound_devices_cached(const struct Piphoned_PhoneManager* p_manager);
+static bool check_sound_devices(struct Piphoned_PhoneManager* p_manager);
+static void report_latency(struct Piphoned_PhoneManager* p_manager);
+static bool same_proxy_config(const struct Piphoned_Config_ParsedFile_ProxyTable* p_a, const struct Piphoned_Config_ParsedFile_ProxyTable* p_b);
+static void reload_proxies(struct Piphoned_PhoneManager* p_manager, const struct Piphoned_Config_ParsedFile_LineTable* p_newline, const struct Piphoned_Config_ParsedFile* p_newconfig);
+static void reserve_proxies(struct Piphoned_PhoneManager* p_manager, long num);
+
+/* Sample rate mediastreamer opens all sound cards at; 0 if not forced */
+static int s_forced_sound_rate = 0;
 
 /**
- * Creates a new PhoneManager. Do not use more than one PhoneManager
- * instance in your program.
+ * Creates a new PhoneManager for the given line. Each line has its
+ * own PhoneManager with its own SIP core, so that the lines can use
+ * different sound devices and have calls at the same time.
  */
-struct Piphoned_PhoneManager* piphoned_phonemanager_new()
+struct Piphoned_PhoneManager* piphoned_phonemanager_new(const struct Piphoned_Config_ParsedFile_LineTable* p_line)
 {
-  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) malloc(sizeof(struct Piphoned_PhoneManager));
-  memset(p_manager, '\0', sizeof(struct Piphoned_PhoneManager));
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) piphoned_arena_alloc(sizeof(struct Piphoned_PhoneManager));
+  struct Piphoned_SipCore_Callbacks callbacks;
+  struct Piphoned_SipCore* p_core = NULL;
+  int i = 0;
 
+  p_manager->p_line = p_line;
   determine_datadir(p_manager);
 
-  /* Disable ORTP logs if running as a daemon.
-   * Otherwise output them to stdout. */
-  if (g_cli_options.daemonize)
-    linphone_core_set_log_level(0);
-  else
-    linphone_core_set_log_file(NULL);
-
-  /* Setup linphone callbacks */
-  p_manager->vtable.call_state_changed = call_state_changed;
-  p_manager->vtable.call_encryption_changed = call_encryption_changed;
-
-  p_manager->p_linphone = linphone_core_new(&p_manager->vtable, NULL, NULL, p_manager);
-
-  if (g_piphoned_config_info.firewall_policy == LinphonePolicyUseStun) {
-    if (strlen(g_piphoned_config_info.stunserver) > 0) {
-      linphone_core_set_stun_server(p_manager->p_linphone,
-                                    g_piphoned_config_info.stunserver);
-    }
-    else {
-      syslog(LOG_CRIT, "Use of STUN server requested, but 'stunserver' option unset. Exiting!");
-      exit(7);
-    }
+  /* All call table entries are free */
+  for(i=0; i < PIPHONED_MAX_CALLS; i++) {
+    p_manager->calls[i].index = i;
+    p_manager->free_slots[i] = PIPHONED_MAX_CALLS - 1 - i;
   }
+  p_manager->num_free_slots = PIPHONED_MAX_CALLS;
+
+  /* Setup SIP core callbacks */
+  callbacks.registration_state_changed = registration_state_changed;
+  callbacks.call_state_changed = call_state_changed;
+  callbacks.call_encryption_changed = call_encryption_changed;
+
+  piphoned_startup_begin(PIPHONED_STARTUP_SIP_CORE, p_line);
+  p_core = piphoned_sipcore_new(g_piphoned_config_info.sip_backend, &callbacks, p_manager);
+  piphoned_startup_end(PIPHONED_STARTUP_SIP_CORE, p_line);
+  if (!p_core) {
+    piphoned_arena_release(p_manager);
+    return NULL;
+  }
+  p_manager->p_sipcore = p_core;
 
-  linphone_core_set_firewall_policy(p_manager->p_linphone, g_piphoned_config_info.firewall_policy);
+  if (g_piphoned_config_info.firewall_policy == LinphonePolicyUseStun && strlen(g_piphoned_config_info.stunserver) == 0) {
+    syslog(LOG_CRIT, "Use of STUN server requested, but 'stunserver' option unset. Exiting!");
+    exit(7);
+  }
 
-  /* Setup the sound devices */
-  if (!linphone_core_sound_device_can_capture(p_manager->p_linphone, g_piphoned_config_info.capture_sound_device)) {
-    syslog(LOG_CRIT, "Sound device set as capture device (%s) cannot capture sound!", g_piphoned_config_info.capture_sound_device);
-    goto fail;
+  p_core->p_ops->set_firewall_policy(p_core, g_piphoned_config_info.firewall_policy, g_piphoned_config_info.stunserver);
+  p_core->p_ops->set_ports(p_core, p_line->sip_port, p_line->audio_port);
+  piphoned_codecs_configure(p_core, p_line->name);
+
+  /* Trade robustness against latency as the line wants it */
+  p_core->p_ops->set_jitter_buffer(p_core, p_line->jitter_buffer, p_line->adaptive_jitter_buffer);
+  if (p_line->echo_tail != 0)
+    p_core->p_ops->set_echo_canceller(p_core, p_line->echo_tail);
+
+  syslog(LOG_INFO, "Audio of line %s: jitter buffer %d ms (%s), echo canceller %s.",
+         p_line->name,
+         p_line->jitter_buffer > 0 ? p_line->jitter_buffer : DEFAULT_JITTER_BUFFER,
+         p_line->adaptive_jitter_buffer == 0 ? "fixed" : "adaptive",
+         p_line->echo_tail == PIPHONED_ECHO_CANCELLER_OFF ? "off" : "on");
+
+  /* Without sound hardware (for benchmarking), stream files instead */
+  if (strlen(g_piphoned_config_info.play_file) > 0) {
+    syslog(LOG_NOTICE, "Using sound files instead of sound devices: playing %s, recording to %s.", g_piphoned_config_info.play_file, g_piphoned_config_info.record_file);
+    p_core->p_ops->use_sound_files(p_core, g_piphoned_config_info.play_file, g_piphoned_config_info.record_file);
+    goto encryption;
   }
-  if (!linphone_core_sound_device_can_playback(p_manager->p_linphone, g_piphoned_config_info.playback_sound_device)) {
-    syslog(LOG_CRIT, "Sound device set as playback device (%s) cannot playback sound!", g_piphoned_config_info.playback_sound_device);
-    goto fail;
+
+  /* Setup the sound devices. Those that worked the last time with the
+   * same sound cards are checked only once the SIP side is up. */
+  if (sound_devices_cached(p_manager)) {
+    syslog(LOG_INFO, "Sound devices of line %s worked before, checking them after registration.", p_line->name);
+    p_manager->sound_check_pending = true;
   }
-  if (!linphone_core_sound_device_can_playback(p_manager->p_linphone, g_piphoned_config_info.ring_sound_device)) {
-    syslog(LOG_CRIT, "Sound device set as ringer device (%s) cannot playback sound!", g_piphoned_config_info.ring_sound_device);
+  else if (!check_sound_devices(p_manager))
     goto fail;
-  }
 
-  syslog(LOG_INFO, "All sound devices reported as working by liblinphone.");
+  p_core->p_ops->set_sound_devices(p_core,
+                                   p_line->ring_sound_device,
+                                   p_line->playback_sound_device,
+                                   p_line->capture_sound_device);
 
-  linphone_core_set_ringer_device(p_manager->p_linphone, g_piphoned_config_info.ring_sound_device);
-  linphone_core_set_playback_device(p_manager->p_linphone, g_piphoned_config_info.playback_sound_device);
-  linphone_core_set_capture_device(p_manager->p_linphone, g_piphoned_config_info.capture_sound_device);
+  syslog(LOG_INFO, "Ringer device of line %s: %s", p_line->name, p_line->ring_sound_device);
+  syslog(LOG_INFO, "Playback device of line %s: %s", p_line->name, p_line->playback_sound_device);
+  syslog(LOG_INFO, "Capture device of line %s: %s", p_line->name, p_line->capture_sound_device);
 
-  syslog(LOG_INFO, "Ringer device: %s", g_piphoned_config_info.ring_sound_device);
-  syslog(LOG_INFO, "Playback device: %s", g_piphoned_config_info.playback_sound_device);
-  syslog(LOG_INFO, "Capture device: %s", g_piphoned_config_info.capture_sound_device);
+  set_sound_rate(p_manager);
+  set_core_ringing(p_manager, p_line, &g_piphoned_config_info);
 
-  linphone_core_set_media_encryption(p_manager->p_linphone, LinphoneMediaEncryptionZRTP);
-  linphone_core_set_media_encryption_mandatory(p_manager->p_linphone, false); /* Drops encryption silently if we don’t communicate it to the user! This has to be done in a callback! */
-  linphone_core_set_zrtp_secrets_file(p_manager->p_linphone, g_piphoned_config_info.zrtp_secrets_file);
+ encryption:
+  p_core->p_ops->enable_zrtp(p_core, g_piphoned_config_info.zrtp_secrets_file);
   syslog(LOG_INFO, "Set preferred encryption method to ZRTP, allowing unencrypted call if unsupported.");
 
   return p_manager;
 
  fail:
 
-  linphone_core_destroy(p_manager->p_linphone);
-  free(p_manager);
+  piphoned_sipcore_free(p_core);
+  piphoned_arena_release(p_manager);
   return NULL;
 }
 
 /**
  * Clean up and free the given phone manager instance. This
- * also deauthenticates properly from the SIP server.
+ * also deauthenticates properly from the SIP server, unless
+ * `keep_registrations' is set for a handoff (see handoff.c).
  */
 void piphoned_phonemanager_free(struct Piphoned_PhoneManager* p_manager)
 {
+  struct Piphoned_SipCore* p_core = NULL;
   int i = 0;
 
   if (!p_manager)
     return;
 
+  p_core = p_manager->p_sipcore;
+  piphoned_loadcontroller_stop(&p_manager->load_controller, p_core, p_manager->p_line->name, false);
+
+  for(i=0; i < PIPHONED_MAX_CALLS; i++) {
+    if (p_manager->calls[i].p_call)
+      release_slot(p_manager, &p_manager->calls[i]);
+  }
+
+  if (p_manager->keep_registrations) {
+    p_core->p_ops->detach_proxies(p_core);
+    p_manager->num_proxies = 0;
+  }
+
   for(i=0; i < p_manager->num_proxies; i++) {
     struct timeval timestamp_now;
     struct timeval timestamp_last;
-    LinphoneProxyConfig* p_proxy = p_manager->proxies[i];
+    struct Piphoned_SipProxy* p_proxy = p_manager->proxies[i];
 
-    linphone_proxy_config_edit(p_proxy);
-    linphone_proxy_config_enable_register(p_proxy, FALSE); /* Advises linphone to send deauth request */
-    linphone_proxy_config_done(p_proxy);
+    p_core->p_ops->unregister_proxy(p_core, p_proxy);
 
     /* Allow for the deauthentication requests */
     gettimeofday(&timestamp_last, NULL);
-    while (linphone_proxy_config_get_state(p_proxy) != LinphoneRegistrationCleared) {
-      linphone_core_iterate(p_manager->p_linphone);
+    while (p_core->p_ops->get_proxy_state(p_core, p_proxy) != LinphoneRegistrationCleared) {
+      p_core->p_ops->iterate(p_core);
       ms_usleep(LINPHONE_WAIT_DELAY);
 
       /* If for nothing happens for some time, terminate. */
@@ -151,24 +245,41 @@ void piphoned_phonemanager_free(struct Piphoned_PhoneManager* p_manager)
   }
 
   p_manager->num_proxies = 0;
-  linphone_core_destroy(p_manager->p_linphone);
-  free(p_manager);
+  piphoned_arena_release(p_manager->proxies);
+  piphoned_arena_release(p_manager->proxy_configs);
+  piphoned_sipcore_free(p_core);
+  piphoned_arena_release(p_manager);
 }
 
 /**
- * Loads the configured proxy from the parsed configuration.
- * TODO: Allow for more than one proxy!
+ * Loads the proxies the line is bound to from the parsed
+ * configuration; all of them if the line's `proxy` setting is unset.
  */
 bool piphoned_phonemanager_load_proxies(struct Piphoned_PhoneManager* p_manager)
 {
+  const char* binding = p_manager->p_line->proxy;
+  long num = 0;
   int i;
 
+  piphoned_startup_begin(PIPHONED_STARTUP_REGISTER, p_manager->p_line);
+
+  for(i=0; i < g_piphoned_config_info.num_proxies; i++) {
+    if (strlen(binding) == 0 || strcmp(binding, g_piphoned_config_info.proxies[i]->name) == 0)
+      num++;
+  }
+  reserve_proxies(p_manager, num);
+
   for(i=0; i < g_piphoned_config_info.num_proxies; i++) {
     struct Piphoned_Config_ParsedFile_ProxyTable* p_config = g_piphoned_config_info.proxies[i];
-    LinphoneProxyConfig* p_proxy = load_linphone_proxy(p_manager->p_linphone, p_config);
+    struct Piphoned_SipProxy* p_proxy = NULL;
+    bool is_first = p_manager->num_proxies == 0;
 
+    if (strlen(binding) > 0 && strcmp(binding, p_config->name) != 0)
+      continue;
+
+    p_proxy = p_manager->p_sipcore->p_ops->add_proxy(p_manager->p_sipcore, p_config, is_first); /* First proxy is default proxy */
     if (!p_proxy) {
-      if (i == 0) {
+      if (is_first) {
         syslog(LOG_ERR, "Default (= first) proxy is misconfigured. Not loading any other proxy configurations.");
         return false;
       }
@@ -178,24 +289,96 @@ bool piphoned_phonemanager_load_proxies(struct Piphoned_PhoneManager* p_manager)
       }
     }
 
-    linphone_core_add_proxy_config(p_manager->p_linphone, p_proxy); /* Side effect: Makes linphone manage the memory of p_proxy */
+    if (is_first)
+      p_manager->dtmf_method = p_config->dtmf_method;
+
+    p_manager->proxy_configs[p_manager->num_proxies] = p_config;
     p_manager->proxies[p_manager->num_proxies++] = p_proxy;
+  }
 
-    /* First proxy is default proxy */
-    if (i==0)
-      linphone_core_set_default_proxy(p_manager->p_linphone, p_proxy);
+  if (p_manager->num_proxies == 0 && strlen(binding) > 0) {
+    syslog(LOG_ERR, "Line %s is bound to proxy '%s', but there is no such provider section.", p_manager->p_line->name, binding);
+    return false;
   }
 
+  /* Nothing to wait for */
+  if (p_manager->num_proxies == 0)
+    piphoned_startup_end(PIPHONED_STARTUP_REGISTER, p_manager->p_line);
+
   return true;
 }
 
 /**
- * Call this once in a mainloop iteration. Instructs linphone to
- * do the necessary communication with the SIP server.
+ * Applies a reloaded configuration file to the line's SIP core,
+ * before piphoned_config_apply() makes it the current one. Only the
+ * proxies whose sections were added, changed or removed are touched,
+ * so the other registrations stay as they are. Call this only while
+ * the line has no call.
+ */
+void piphoned_phonemanager_reload(struct Piphoned_PhoneManager* p_manager, const struct Piphoned_Config_ParsedFile_LineTable* p_newline, const struct Piphoned_Config_ParsedFile* p_newconfig)
+{
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line = p_manager->p_line;
+
+  if (strlen(g_piphoned_config_info.play_file) == 0
+      && (strcmp(p_newline->ring_sound_device, p_line->ring_sound_device) != 0
+          || strcmp(p_newline->playback_sound_device, p_line->playback_sound_device) != 0
+          || strcmp(p_newline->capture_sound_device, p_line->capture_sound_device) != 0)) {
+    syslog(LOG_NOTICE, "Switching line %s to ringer device '%s', playback device '%s', capture device '%s'.", p_line->name, p_newline->ring_sound_device, p_newline->playback_sound_device, p_newline->capture_sound_device);
+    p_core->p_ops->set_sound_devices(p_core, p_newline->ring_sound_device, p_newline->playback_sound_device, p_newline->capture_sound_device);
+  }
+
+  /* The ringer and tone player are rebuilt from the new settings */
+  if (strlen(g_piphoned_config_info.play_file) == 0)
+    set_core_ringing(p_manager, p_newline, p_newconfig);
+
+  /* Take effect with the next call */
+  if (p_newline->jitter_buffer != p_line->jitter_buffer || p_newline->adaptive_jitter_buffer != p_line->adaptive_jitter_buffer)
+    p_core->p_ops->set_jitter_buffer(p_core, p_newline->jitter_buffer, p_newline->adaptive_jitter_buffer);
+  if (p_newline->echo_tail != p_line->echo_tail && p_newline->echo_tail != 0)
+    p_core->p_ops->set_echo_canceller(p_core, p_newline->echo_tail);
+
+  reload_proxies(p_manager, p_newline, p_newconfig);
+}
+
+/**
+ * Call this once in a mainloop iteration for each line. Instructs
+ * the SIP core to do the necessary communication with the SIP server,
+ * reminds the user of a waiting call and keeps the active call within
+ * the CPU's means.
  */
 void piphoned_phonemanager_update(struct Piphoned_PhoneManager* p_manager)
 {
-  linphone_core_iterate(p_manager->p_linphone);
+  struct Piphoned_LoadController* p_controller = &p_manager->load_controller;
+
+  p_manager->p_sipcore->p_ops->iterate(p_manager->p_sipcore);
+
+  if (p_manager->p_incoming && p_manager->p_active)
+    play_call_waiting_tone(p_manager);
+
+  /* Load control follows the active call */
+  if (p_controller->p_call && (!p_manager->p_active || p_manager->p_active->p_call != p_controller->p_call))
+    piphoned_loadcontroller_stop(p_controller, p_manager->p_sipcore, p_manager->p_line->name, false);
+  else
+    piphoned_loadcontroller_update(p_controller, p_manager->p_sipcore, p_manager->p_line->name);
+
+  /* Check the sound devices taken from the sound cache, now that
+   * registration no longer waits for them */
+  if (p_manager->sound_check_due) {
+    p_manager->sound_check_due = false;
+    check_sound_devices(p_manager);
+  }
+
+  if (p_manager->p_active && p_manager->p_active->p_call != p_manager->p_latency_reported)
+    report_latency(p_manager);
+}
+
+/**
+ * Call this once at the end of a mainloop iteration, after updating
+ * all phone managers, to prevent the process from grabbing 100% CPU.
+ */
+void piphoned_phonemanager_wait()
+{
   ms_usleep(LINPHONE_WAIT_DELAY);
 }
 
@@ -209,6 +392,8 @@ void piphoned_phonemanager_update(struct Piphoned_PhoneManager* p_manager)
  */
 void piphoned_phonemanager_place_call(struct Piphoned_PhoneManager* p_manager, const char* sip_uri)
 {
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  struct Piphoned_SipCall* p_call = NULL;
   int i = 0;
 
   if (p_manager->is_calling) {
@@ -217,16 +402,19 @@ void piphoned_phonemanager_place_call(struct Piphoned_PhoneManager* p_manager, c
   }
   if (strlen(sip_uri) == 0) {
     syslog(LOG_ERR, "Will not dial an empty SIP URI.");
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_INVALID_URI, 0);
     p_manager->error_counter++;
     return;
   }
   if (strlen(sip_uri) < 5) { /* Each sip URI must at least have "sip:" at the beginning. */
     syslog(LOG_ERR, "Will not dial incomplete SIP URI.");
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_INVALID_URI, 1);
     p_manager->error_counter++;
     return;
   }
   if (sip_uri[4] == '@') { /* SIP URI looks like "sip:@foo". This happens surprisingly often. */
     syslog(LOG_ERR, "Will not dial SIP URI without user part.");
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_INVALID_URI, 2);
     p_manager->error_counter++;
     return;
   }
@@ -241,30 +429,40 @@ void piphoned_phonemanager_place_call(struct Piphoned_PhoneManager* p_manager, c
   /* Give acustic feedback for the dialed URI so the user may spot
    * errors he made, or that have technical reasons (unwanted digits
    * counted due to hardware defect, for example */
-  linphone_core_play_dtmf(p_manager->p_linphone, '0', 2000);
-  ms_sleep(3);
-  for(i=4; sip_uri[i] != '@'; i++) {
-    linphone_core_play_dtmf(p_manager->p_linphone, sip_uri[i], 100);
-    ms_usleep(300000);
+  if (g_piphoned_config_info.dial_readback) {
+    p_core->p_ops->play_dtmf(p_core, '0', 2000);
+    ms_sleep(3);
+    for(i=4; sip_uri[i] != '@'; i++) {
+      p_core->p_ops->play_dtmf(p_core, sip_uri[i], 100);
+      ms_usleep(300000);
+    }
+  }
+
+  if (p_manager->num_free_slots == 0) {
+    syslog(LOG_ERR, "Cannot place a call, all %d calls of line %s are in use.", PIPHONED_MAX_CALLS, p_manager->p_line->name);
+    return;
   }
 
-  p_manager->p_call = linphone_core_invite(p_manager->p_linphone, sip_uri);
-  if (!p_manager->p_call) {
+  p_call = p_core->p_ops->invite(p_core, sip_uri);
+  if (!p_call) {
     syslog(LOG_ERR, "Failed to place call.");
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_INVITE, 0);
     return;
   }
 
   syslog(LOG_NOTICE, "Started call to '%s'", sip_uri);
-  log_call(p_manager->p_call, PIPHONED_CALL_OUTGOING);
-  linphone_call_ref(p_manager->p_call);
+  log_call(p_core, p_call, PIPHONED_CALL_OUTGOING);
+  p_manager->p_active = take_slot(p_manager, p_call, PIPHONED_CALLSLOT_ACTIVE);
 
   /* piphoned_phone_place_call(p_linphone, sip_uri); */
   p_manager->is_calling = true;
+  p_manager->progress = PIPHONED_PROGRESS_NONE;
 }
 
 /**
- * Stop a call that is in progress. Does nothing if no call is in
- * progress.
+ * Stop the call that is in progress, together with all held calls.
+ * A waiting call is left alone; it rings once the handset is back on
+ * the hook. Does nothing if no call is in progress.
  *
  * The `is_calling` member of the object struct is set to false when
  * this method returns and will stay so until the next call to
@@ -272,17 +470,23 @@ void piphoned_phonemanager_place_call(struct Piphoned_PhoneManager* p_manager, c
  */
 void piphoned_phonemanager_stop_call(struct Piphoned_PhoneManager* p_manager)
 {
+  int i = 0;
+
   /* Do nothing if no call is running */
   if (!p_manager->is_calling)
     return;
 
   /* Terminating a call that has been ended by the other side already should
    * do no harm. */
-  linphone_core_terminate_call(p_manager->p_linphone, p_manager->p_call);
-  linphone_call_unref(p_manager->p_call);
+  for(i=0; i < PIPHONED_MAX_CALLS; i++) {
+    struct Piphoned_CallSlot* p_slot = &p_manager->calls[i];
+
+    if (p_slot->state == PIPHONED_CALLSLOT_ACTIVE || p_slot->state == PIPHONED_CALLSLOT_HELD)
+      terminate_slot(p_manager, p_slot);
+  }
 
-  p_manager->p_call = NULL;
   p_manager->is_calling = false;
+  p_manager->progress = PIPHONED_PROGRESS_NONE;
 }
 
 /**
@@ -300,36 +504,124 @@ void piphoned_phonemanager_accept_incoming_call(struct Piphoned_PhoneManager* p_
     return;
   }
 
-  log_call(p_manager->p_call, PIPHONED_CALL_ACCEPTED);
-  linphone_core_accept_call(p_manager->p_linphone, p_manager->p_call);
+  log_call(p_manager->p_sipcore, p_manager->p_incoming->p_call, PIPHONED_CALL_ACCEPTED);
+  p_manager->p_sipcore->p_ops->accept_call(p_manager->p_sipcore, p_manager->p_incoming->p_call);
 
   /* Now go into the same state as if the call was initiated by us. */
+  p_manager->p_active = p_manager->p_incoming;
+  p_manager->p_active->state = PIPHONED_CALLSLOT_ACTIVE;
+  p_manager->p_incoming = NULL;
   p_manager->is_calling = true;
   p_manager->has_incoming_call = false;
 }
 
 /**
- * Decline an incoming call. After this method returns, you can proceed
- * as if the call was terminated by you using piphoned_phonemanager_stop_call().
+ * Decline an incoming call, be it ringing or waiting. Other calls
+ * are not affected.
  */
 void piphoned_phonemanager_decline_incoming_call(struct Piphoned_PhoneManager* p_manager)
 {
+  struct Piphoned_SipCall* p_call = NULL;
+
   if (!p_manager->has_incoming_call) {
     syslog(LOG_ERR, "Can't decline a call when there is no incoming call.");
     return;
   }
-  else if (p_manager->is_calling) {
-    syslog(LOG_ERR, "Can't decline a call when another call is running.");
+
+  p_call = p_manager->p_incoming->p_call;
+  log_call(p_manager->p_sipcore, p_call, PIPHONED_CALL_DECLINED);
+
+  /* Forget the call before declining it, so that its end is not
+   * taken for a missed call. */
+  p_manager->p_sipcore->p_ops->ref_call(p_call);
+  release_slot(p_manager, p_manager->p_incoming);
+  p_manager->p_sipcore->p_ops->decline_call(p_manager->p_sipcore, p_call, LinphoneReasonDeclined);
+  p_manager->p_sipcore->p_ops->unref_call(p_call);
+}
+
+/**
+ * Handle a hook flash during a call. If a call is waiting, the
+ * active call is put on hold and the waiting one is taken. Otherwise,
+ * the active call and a held call are swapped. Does nothing if there
+ * is neither a waiting nor a held call.
+ */
+void piphoned_phonemanager_flash(struct Piphoned_PhoneManager* p_manager)
+{
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  struct Piphoned_CallSlot* p_next = NULL;
+  int i = 0;
+
+  if (!p_manager->is_calling)
     return;
+
+  if (p_manager->p_incoming) {
+    p_next = p_manager->p_incoming;
+  }
+  else if (p_manager->num_held > 0) {
+    for(i=0; i < PIPHONED_MAX_CALLS && !p_next; i++) {
+      if (p_manager->calls[i].state == PIPHONED_CALLSLOT_HELD)
+        p_next = &p_manager->calls[i];
+    }
   }
 
-  log_call(p_manager->p_call, PIPHONED_CALL_DECLINED);
-  linphone_core_decline_call(p_manager->p_linphone, p_manager->p_call, LinphoneReasonDeclined);
+  if (!p_next) {
+    syslog(LOG_INFO, "Ignoring hook flash on line %s without a waiting or held call.", p_manager->p_line->name);
+    return;
+  }
 
-  /* Now go into the same state as if the call was terminated by us. */
-  linphone_call_unref(p_manager->p_call);
-  p_manager->has_incoming_call = false;
-  p_manager->p_call = NULL;
+  if (p_manager->p_active) {
+    if (!p_core->p_ops->pause_call(p_core, p_manager->p_active->p_call)) {
+      syslog(LOG_WARNING, "Cannot put the call on line %s on hold yet, ignoring hook flash.", p_manager->p_line->name);
+      return;
+    }
+
+    syslog(LOG_NOTICE, "Putting call on line %s on hold.", p_manager->p_line->name);
+    piphoned_loadcontroller_stop(&p_manager->load_controller, p_core, p_manager->p_line->name, true);
+    p_manager->p_active->state = PIPHONED_CALLSLOT_HELD;
+    p_manager->num_held++;
+  }
+
+  if (p_next == p_manager->p_incoming) {
+    syslog(LOG_NOTICE, "Taking waiting call on line %s.", p_manager->p_line->name);
+    log_call(p_core, p_next->p_call, PIPHONED_CALL_ACCEPTED);
+    p_core->p_ops->accept_call(p_core, p_next->p_call);
+    p_manager->p_incoming = NULL;
+    p_manager->has_incoming_call = false;
+  }
+  else {
+    syslog(LOG_NOTICE, "Resuming held call on line %s.", p_manager->p_line->name);
+    p_core->p_ops->resume_call(p_core, p_next->p_call);
+    p_manager->num_held--;
+  }
+
+  p_next->state = PIPHONED_CALLSLOT_ACTIVE;
+  p_manager->p_active = p_next;
+  p_manager->progress = PIPHONED_PROGRESS_NONE;
+}
+
+/**
+ * Send a digit dialed during a call to the remote side of the active
+ * call, using the DTMF method configured for the line's default
+ * proxy. `p_dialed_at` is when the digit was dialed (CLOCK_MONOTONIC).
+ */
+void piphoned_phonemanager_send_dtmf(struct Piphoned_PhoneManager* p_manager, char digit, const struct timespec* p_dialed_at)
+{
+  struct timespec now;
+  long delay = 0;
+
+  if (!p_manager->p_active) {
+    syslog(LOG_INFO, "Ignoring digit %c dialed on line %s without an active call.", digit, p_manager->p_line->name);
+    return;
+  }
+
+  p_manager->p_sipcore->p_ops->send_dtmf(p_manager->p_sipcore, p_manager->p_active->p_call, digit, p_manager->dtmf_method);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  delay = (now.tv_sec - p_dialed_at->tv_sec) * 1000 + (now.tv_nsec - p_dialed_at->tv_nsec) / 1000000;
+  if (delay > DTMF_MAX_DELAY)
+    syslog(LOG_WARNING, "Digit %c on line %s was sent %ld ms after it was dialed.", digit, p_manager->p_line->name, delay);
+  else
+    syslog(LOG_DEBUG, "Sent digit %c on line %s after %ld ms.", digit, p_manager->p_line->name, delay);
 }
 
 /**
@@ -337,25 +629,25 @@ void piphoned_phonemanager_decline_incoming_call(struct Piphoned_PhoneManager* p
  */
 void piphoned_phonemanager_accept_zrtp_nonce(struct Piphoned_PhoneManager* p_manager)
 {
-  if (!p_manager->is_calling)
+  if (!p_manager->p_active)
     return;
 
   syslog(LOG_NOTICE, "ZRTP SAS accepted.");
-  linphone_call_set_authentication_token_verified(p_manager->p_call, true);
+  p_manager->p_sipcore->p_ops->set_authentication_token_verified(p_manager->p_active->p_call, true);
 }
 
 /**
  * Reject the ZRTP SAS authentication nonce string. This immediately
- * terminates the call.
+ * terminates the active call; held calls stay.
  */
 void piphoned_phonemanager_reject_zrtp_nonce(struct Piphoned_PhoneManager* p_manager)
 {
-  if (!p_manager->is_calling)
+  if (!p_manager->p_active)
     return;
 
   syslog(LOG_WARNING, "ZRTP SAS rejected. Terminating call immediately.");
-  linphone_call_set_authentication_token_verified(p_manager->p_call, false);
-  piphoned_phonemanager_stop_call(p_manager);
+  p_manager->p_sipcore->p_ops->set_authentication_token_verified(p_manager->p_active->p_call, false);
+  terminate_slot(p_manager, p_manager->p_active);
 }
 
 /***************************************
@@ -363,63 +655,102 @@ void piphoned_phonemanager_reject_zrtp_nonce(struct Piphoned_PhoneManager* p_man
  ***************************************/
 
 /**
- * Load a linphone proxy from the configuration file and return it.
- *
- * Currently only works for the first proxy in the configuration file.
+ * SIP core callback called when the registration state of a proxy
+ * changes.
  */
-LinphoneProxyConfig* load_linphone_proxy(LinphoneCore* p_linphone, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig)
+void registration_state_changed(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, LinphoneRegistrationState rstate, const char* msg)
 {
-  LinphoneProxyConfig* p_proxy = NULL;
-  LinphoneAuthInfo* p_auth = NULL;
-  char str[PATH_MAX];
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) p_core->p_userdata;
+  int i = 0;
 
-  p_proxy = linphone_proxy_config_new();
-  p_auth  = linphone_auth_info_new(p_proxyconfig->username,
-                                   NULL,
-                                   p_proxyconfig->password,
-                                   NULL,
-                                   p_proxyconfig->realm); /* linphone >= 3.8 requires an additional domain paramater that can be set to NULL */
+  /* Find out which of our proxies this is */
+  for(i=0; i < p_manager->num_proxies; i++) {
+    if (p_manager->proxies[i] == p_proxy)
+      break;
+  }
 
-  linphone_core_add_auth_info(p_linphone, p_auth); /* Side effect: lets linphone-core manage memory of p_auth */
+  /* One removed by a configuration reload, unregistering */
+  if (i == p_manager->num_proxies) {
+    syslog(LOG_DEBUG, "Registration state of a removed proxy changed: %s", msg);
+    return;
+  }
 
-  memset(str, '\0', PATH_MAX);
-  sprintf(str, "\"%s\" <sip:%s@%s>", p_proxyconfig->displayname, p_proxyconfig->username, p_proxyconfig->server);
-  syslog(LOG_INFO, "Using SIP identity for realm %s: %s", p_proxyconfig->realm, str);
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_REGISTRATION, rstate, i);
 
-  linphone_proxy_config_set_identity(p_proxy, str);
-  linphone_proxy_config_set_server_addr(p_proxy, p_proxyconfig->server);
-  linphone_proxy_config_enable_register(p_proxy, TRUE);
+  if (rstate == LinphoneRegistrationOk || rstate == LinphoneRegistrationFailed) {
+    piphoned_startup_end(PIPHONED_STARTUP_REGISTER, p_manager->p_line);
 
-  if (p_proxyconfig->use_publish)
-    linphone_proxy_config_enable_publish(p_proxy, TRUE);
+    if (p_manager->sound_check_pending) {
+      p_manager->sound_check_pending = false;
+      p_manager->sound_check_due = true;
+    }
+  }
 
-  return p_proxy;
+  switch (rstate) {
+  case LinphoneRegistrationOk:
+    syslog(LOG_INFO, "Registration on proxy %d successful.", i + 1);
+    p_manager->is_registered = true;
+    break;
+  case LinphoneRegistrationFailed:
+    syslog(LOG_WARNING, "Registration on proxy %d failed: %s", i + 1, msg);
+    piphoned_sdnotify("STATUS=Registration of line %s on proxy %d failed: %s", p_manager->p_line->name, i + 1, msg);
+    break;
+  default:
+    syslog(LOG_DEBUG, "Registration state of proxy %d changed: %s", i + 1, msg);
+    break;
+  }
 }
 
 /**
- * Linphone callback called when something of importance related to a call
+ * SIP core callback called when something of importance related to a call
  * happens.
  */
-void call_state_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, LinphoneCallState cstate, const char *msg)
+void call_state_changed(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, const char *msg)
 {
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) p_core->p_userdata;
+  struct Piphoned_CallSlot* p_slot = (struct Piphoned_CallSlot*) p_core->p_ops->get_call_userdata(p_call);
+
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_CALL_STATE, cstate, (uint32_t) (uintptr_t) p_call);
+
   switch (cstate) {
   case LinphoneCallOutgoingRinging:
     syslog(LOG_DEBUG, "Remote device is ringing.");
+    if (p_slot && p_slot == p_manager->p_active)
+      p_manager->progress = PIPHONED_PROGRESS_RINGING;
+    break;
+  case LinphoneCallOutgoingEarlyMedia:
+    /* The provider sends its own ringback or announcement */
+    syslog(LOG_DEBUG, "Receiving early media.");
+    if (p_slot && p_slot == p_manager->p_active)
+      p_manager->progress = PIPHONED_PROGRESS_NONE;
     break;
   case LinphoneCallConnected:
     syslog(LOG_DEBUG, "Connection established.");
+    if (p_slot && p_slot == p_manager->p_active)
+      p_manager->progress = PIPHONED_PROGRESS_NONE;
     break;
   case LinphoneCallStreamsRunning:
-    handle_running_streams(p_linphone, p_call);
+    handle_running_streams(p_core, p_call);
     break;
   case LinphoneCallEnd:
-    handle_call_ending(p_linphone, p_call);
+    handle_call_ending(p_core, p_call);
     break;
   case LinphoneCallError:
     syslog(LOG_WARNING, "Failed to establish call.");
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_CALL, (uint32_t) (uintptr_t) p_call);
+    handle_call_ending(p_core, p_call);
+    break;
+  case LinphoneCallPaused:
+    syslog(LOG_DEBUG, "Call is on hold.");
+    break;
+  case LinphoneCallPausedByRemote:
+    syslog(LOG_NOTICE, "Remote side put the call on hold.");
+    break;
+  case LinphoneCallResuming:
+    syslog(LOG_DEBUG, "Resuming call.");
     break;
   case LinphoneCallIncomingReceived:
-    handle_incoming_call(p_linphone, p_call);
+    handle_incoming_call(p_core, p_call);
   default:
     syslog(LOG_DEBUG, "Unhandled notification on call: %i", cstate);
     break;
@@ -427,11 +758,12 @@ void call_state_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, Linphone
 }
 
 /**
- * Linphone callback called when the encryption state of a call changes.
+ * SIP core callback called when the encryption state of a call changes.
  */
-static void call_encryption_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, bool_t is_encrypted, const char* p_authtoken)
+static void call_encryption_changed(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, bool is_encrypted, const char* p_authtoken)
 {
-  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) linphone_core_get_user_data(p_linphone);
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) p_core->p_userdata;
+  struct Piphoned_CallSlot* p_slot = NULL;
 
   if (is_encrypted)
     syslog(LOG_NOTICE, "*** Encryption enabled ***");
@@ -439,58 +771,214 @@ static void call_encryption_changed(LinphoneCore* p_linphone, LinphoneCall* p_ca
     syslog(LOG_NOTICE, "*** Encryption disabled ***");
 
   if (p_authtoken) {
-    FILE* p_file = fopen(AUTHTOKEN_FILE, "w");
+    char path[PATH_MAX];
+    FILE* p_file = NULL;
+
+    get_authtoken_path(p_manager, path);
+    p_file = fopen(path, "w");
     if (!p_file) {
-      syslog(LOG_ERR, "Failed to open authtoken file %s: %m", AUTHTOKEN_FILE);
+      syslog(LOG_ERR, "Failed to open authtoken file %s: %m", path);
       syslog(LOG_ERR, "Terminating call for security reasons.");
-      piphoned_phonemanager_stop_call(p_manager); /* Emergency termination */
+      piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_AUTHTOKEN, 0);
+
+      /* Emergency termination */
+      p_slot = (struct Piphoned_CallSlot*) p_core->p_ops->get_call_userdata(p_call);
+      if (p_slot)
+        terminate_slot(p_manager, p_slot);
+      return;
     }
 
     fprintf(p_file, "ZRTP SAS token: >%s<\n", p_authtoken);
     fclose(p_file);
-    syslog(LOG_NOTICE, "ZRTP authtoken written to %s.", AUTHTOKEN_FILE);
+    syslog(LOG_NOTICE, "ZRTP authtoken written to %s.", path);
   }
 }
 
 /**
  * Set up state for an incoming call so that the mainloop can accept it
- * later on.
+ * later on. During a call, the new call waits until the user takes it
+ * with a hook flash.
  */
-void handle_incoming_call(LinphoneCore* p_linphone, LinphoneCall* p_call)
+void handle_incoming_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
 {
-  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) linphone_core_get_user_data(p_linphone);
-  char* straddr = linphone_call_get_remote_address_as_string(p_call);
-  syslog(LOG_NOTICE, "Incoming call from %s", straddr);
-  ms_free(straddr);
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) p_core->p_userdata;
+  char straddr[MAX_SIP_ADDRESS_LENGTH];
 
-  /* Deny calls while busy. We can’t have two calls at once. */
-  if (p_manager->is_calling) {
-    syslog(LOG_NOTICE, "Denying incoming call while another call is active.");
-    log_call(p_call, PIPHONED_CALL_BUSY);
-    linphone_core_decline_call(p_linphone, p_call, LinphoneReasonBusy);
+  p_core->p_ops->get_remote_address(p_call, straddr, MAX_SIP_ADDRESS_LENGTH);
+  syslog(LOG_NOTICE, "Incoming call on line %s from %s", p_manager->p_line->name, straddr);
+
+  /* If the phone is ringing or a call is waiting already, do not
+   * accept calls from another one */
+  if (p_manager->has_incoming_call) {
+    syslog(LOG_NOTICE, "Denying incoming call while another call is %s.", p_manager->is_calling ? "waiting" : "ringing");
+    log_call(p_core, p_call, PIPHONED_CALL_BUSY);
+    p_core->p_ops->decline_call(p_core, p_call, LinphoneReasonBusy);
     return;
   }
-  else if (p_manager->has_incoming_call) {
-    /* Also, if the phone is ringing for someone, do not accept
-     * calls from another one */
-    syslog(LOG_NOTICE, "Denying incoming call while the phone is ringing for another call.");
-    log_call(p_call, PIPHONED_CALL_BUSY);
-    linphone_core_decline_call(p_linphone, p_call, LinphoneReasonBusy);
+  else if (p_manager->num_free_slots == 0) {
+    syslog(LOG_NOTICE, "Denying incoming call, all %d calls of the line are in use.", PIPHONED_MAX_CALLS);
+    log_call(p_core, p_call, PIPHONED_CALL_BUSY);
+    p_core->p_ops->decline_call(p_core, p_call, LinphoneReasonBusy);
     return;
   }
 
-  p_manager->p_call = p_call;
+  p_manager->p_incoming = take_slot(p_manager, p_call, PIPHONED_CALLSLOT_INCOMING);
   p_manager->has_incoming_call = true;
-  linphone_call_ref(p_call);
+
+  if (p_manager->is_calling) {
+    syslog(LOG_NOTICE, "Call waiting on line %s.", p_manager->p_line->name);
+    memset(&p_manager->last_waiting_tone, '\0', sizeof(struct timespec)); /* Tone right away */
+  }
+}
+
+/**
+ * Did all sound devices of the line work the last time with the
+ * same sound cards? See sound_cache.c.
+ */
+bool sound_devices_cached(const struct Piphoned_PhoneManager* p_manager)
+{
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line = p_manager->p_line;
+  const struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+
+  return piphoned_soundcache_known(p_core, p_line->capture_sound_device, true)
+    && piphoned_soundcache_known(p_core, p_line->playback_sound_device, false)
+    && piphoned_soundcache_known(p_core, p_line->ring_sound_device, false);
 }
 
 /**
- * Log some information about the now running call.
+ * Asks the SIP core whether the sound devices of the line work, and
+ * remembers the answer in the sound cache.
  */
-void handle_running_streams(LinphoneCore* p_linphone, LinphoneCall* p_call)
+bool check_sound_devices(struct Piphoned_PhoneManager* p_manager)
 {
-  const LinphoneCallParams* p_params = linphone_call_get_current_params(p_call);
-  LinphoneMediaEncryption enc = linphone_call_params_get_media_encryption(p_params);
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line = p_manager->p_line;
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  bool success = false;
+
+  piphoned_startup_begin(PIPHONED_STARTUP_SOUND_PROBE, p_line);
+
+  if (!p_core->p_ops->sound_device_can_capture(p_core, p_line->capture_sound_device)) {
+    syslog(LOG_CRIT, "Sound device set as capture device (%s) of line %s cannot capture sound!", p_line->capture_sound_device, p_line->name);
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_SOUND_DEVICE, 0);
+    piphoned_soundcache_forget(p_line->capture_sound_device, true);
+    goto finish;
+  }
+  if (!p_core->p_ops->sound_device_can_playback(p_core, p_line->playback_sound_device)) {
+    syslog(LOG_CRIT, "Sound device set as playback device (%s) of line %s cannot playback sound!", p_line->playback_sound_device, p_line->name);
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_SOUND_DEVICE, 0);
+    piphoned_soundcache_forget(p_line->playback_sound_device, false);
+    goto finish;
+  }
+  if (!p_core->p_ops->sound_device_can_playback(p_core, p_line->ring_sound_device)) {
+    syslog(LOG_CRIT, "Sound device set as ringer device (%s) of line %s cannot playback sound!", p_line->ring_sound_device, p_line->name);
+    piphoned_flightrec_record(PIPHONED_FLIGHTREC_ERROR, PIPHONED_FLIGHTREC_ERR_SOUND_DEVICE, 0);
+    piphoned_soundcache_forget(p_line->ring_sound_device, false);
+    goto finish;
+  }
+
+  piphoned_soundcache_store(p_line->capture_sound_device, true);
+  piphoned_soundcache_store(p_line->playback_sound_device, false);
+  piphoned_soundcache_store(p_line->ring_sound_device, false);
+
+  syslog(LOG_INFO, "All sound devices of line %s reported as working by the SIP core.", p_line->name);
+  success = true;
+
+ finish:
+  piphoned_startup_end(PIPHONED_STARTUP_SOUND_PROBE, p_line);
+  return success;
+}
+
+/**
+ * Leaves the ring and ringback tone to the SIP core unless the line
+ * plays them itself (see ringer.c and tones.c), so that the handset
+ * neither rings twice nor stays silent.
+ */
+void set_core_ringing(struct Piphoned_PhoneManager* p_manager, const struct Piphoned_Config_ParsedFile_LineTable* p_line, const struct Piphoned_Config_ParsedFile* p_config)
+{
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+
+  if (strlen(p_line->tone_device) > 0)
+    p_core->p_ops->disable_ringback(p_core);
+  else
+    p_core->p_ops->enable_ringback(p_core);
+
+  if (p_line->bell_pin >= 0 || (strlen(p_line->ringer_device) > 0 && strlen(p_config->ring_file) > 0))
+    p_core->p_ops->disable_ring(p_core);
+  else
+    p_core->p_ops->enable_ring(p_core);
+}
+
+/**
+ * Makes the SIP core open the sound cards at the line's `sound_rate',
+ * if it has one. Mediastreamer knows only a single forced rate for
+ * all cards, so the first line setting one wins.
+ */
+void set_sound_rate(struct Piphoned_PhoneManager* p_manager)
+{
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line = p_manager->p_line;
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  int rate = p_line->sound_rate;
+
+  if (rate == 0)
+    return;
+
+  if (rate == PIPHONED_SOUND_RATE_NATIVE) {
+    rate = piphoned_soundparams_native_rate(p_line->capture_sound_device);
+    if (rate == 0) {
+      syslog(LOG_WARNING, "Cannot determine the native sample rate of %s, leaving it to the SIP core on line %s.", p_line->capture_sound_device, p_line->name);
+      return;
+    }
+  }
+
+  if (s_forced_sound_rate > 0 && s_forced_sound_rate != rate) {
+    syslog(LOG_WARNING, "Line %s wants sound at %d Hz, but an earlier line already set all sound cards to %d Hz.", p_line->name, rate, s_forced_sound_rate);
+    return;
+  }
+
+  s_forced_sound_rate = rate;
+  p_core->p_ops->set_sound_rate(p_core, rate);
+  syslog(LOG_INFO, "Sound cards of line %s run at %d Hz.", p_line->name, rate);
+}
+
+/**
+ * Logs how much of the mouth-to-ear delay of the active call each
+ * stage adds, once the SIP core has measured the network round trip.
+ * The sound devices add their buffers on top of that; sound_params.c
+ * logs those when it opens them.
+ */
+void report_latency(struct Piphoned_PhoneManager* p_manager)
+{
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  struct Piphoned_SipCall* p_call = p_manager->p_active->p_call;
+  struct Piphoned_SipCore_CallStats stats;
+  int network = 0;
+  int jitter = p_manager->p_line->jitter_buffer > 0 ? p_manager->p_line->jitter_buffer : DEFAULT_JITTER_BUFFER;
+
+  if (!p_call || !p_core->p_ops->get_call_stats(p_call, &stats) || stats.round_trip_delay <= 0.0f)
+    return;
+
+  network = (int) (stats.round_trip_delay * 1000.0f / 2.0f);
+  syslog(LOG_INFO, "Latency of the call on line %s: network %d ms, packetization %d ms, jitter buffer %d ms, %d ms one way before the sound devices.",
+         p_manager->p_line->name, network, PACKET_TIME, jitter, network + PACKET_TIME + jitter);
+
+  p_manager->p_latency_reported = p_call;
+}
+
+/**
+ * Log some information about the now running call, give the media
+ * threads their scheduling class and put the call under load control
+ * if the handset is connected to it.
+ */
+void handle_running_streams(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) p_core->p_userdata;
+  struct Piphoned_CallSlot* p_slot = (struct Piphoned_CallSlot*) p_core->p_ops->get_call_userdata(p_call);
+  LinphoneMediaEncryption enc = p_core->p_ops->get_media_encryption(p_call);
+
+  piphoned_rtsched_adopt_new_threads(PIPHONED_RTSCHED_AUDIO);
+
+  if (p_slot && p_slot == p_manager->p_active)
+    piphoned_loadcontroller_start(&p_manager->load_controller, p_call);
 
   switch(enc) {
   case LinphoneMediaEncryptionNone:
@@ -509,31 +997,56 @@ void handle_running_streams(LinphoneCore* p_linphone, LinphoneCall* p_call)
 }
 
 /**
- * Clean up state after a call has ended. This is mainly used for the case
- * where the mainloop didn’t accept a call (i.e. the call was missed by
- * the user), where state would screw up if we didn’t cleaned it up.
+ * Clean up state after the remote side ended a call. This is mainly
+ * used for the case where the mainloop didn’t accept a call (i.e. the
+ * call was missed by the user), where state would screw up if we
+ * didn’t cleaned it up. Calls we ended ourselves are not in the call
+ * table anymore when this is called.
  */
-void handle_call_ending(LinphoneCore* p_linphone, LinphoneCall* p_call)
+void handle_call_ending(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
 {
-  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) linphone_core_get_user_data(p_linphone);
+  struct Piphoned_PhoneManager* p_manager = (struct Piphoned_PhoneManager*) p_core->p_userdata;
+  struct Piphoned_CallSlot* p_slot = (struct Piphoned_CallSlot*) p_core->p_ops->get_call_userdata(p_call);
+  char path[PATH_MAX];
   struct stat s;
 
-  if (p_manager->has_incoming_call) {
+  /* Only the call we are ringing for counts as missed, not one that
+   * was just declined as busy while ringing. */
+  if (p_slot && p_slot->state == PIPHONED_CALLSLOT_INCOMING) {
     syslog(LOG_NOTICE, "Call not accepted. Resetting to normal state.");
-    log_call(p_call, PIPHONED_CALL_MISSED);
+    log_call(p_core, p_call, PIPHONED_CALL_MISSED);
     create_missed_call_voicefile(p_manager, p_call);
 
     /* If we didn't do this, the mainloop would be tricked into trying
      * to accept a call that doesn't exist anymore when the user in
      * reality wanted to start a totally unrelated new call. */
-    p_manager->has_incoming_call = false;
-    linphone_call_unref(p_manager->p_call);
-    p_manager->p_call = NULL;
+    release_slot(p_manager, p_slot);
+  }
+  else if (p_slot && p_slot->state == PIPHONED_CALLSLOT_HELD) {
+    syslog(LOG_NOTICE, "Held call on line %s ended by the remote side.", p_manager->p_line->name);
+    release_slot(p_manager, p_slot);
+  }
+  else if (p_slot) {
+    LinphoneReason reason = p_core->p_ops->get_reason(p_call);
+
+    /* The handset stays in the call until it is hung up, but a held
+     * call may be resumed with a flash. Until then, it hears the busy
+     * tone, or the congestion tone if the call failed for another
+     * reason than the remote side. */
+    if (p_manager->num_held > 0)
+      syslog(LOG_NOTICE, "Remote side ended the call on line %s, %d call(s) on hold.", p_manager->p_line->name, p_manager->num_held);
+    else if (reason == LinphoneReasonNone || reason == LinphoneReasonBusy || reason == LinphoneReasonDeclined)
+      p_manager->progress = PIPHONED_PROGRESS_BUSY;
+    else
+      p_manager->progress = PIPHONED_PROGRESS_FAILED;
+
+    release_slot(p_manager, p_slot);
   }
 
   /* Remove any ZRTP SAS nonce file if that was an encrypted call. */
-  if (stat(AUTHTOKEN_FILE, &s) == 0) {
-    unlink(AUTHTOKEN_FILE);
+  get_authtoken_path(p_manager, path);
+  if (stat(path, &s) == 0) {
+    unlink(path);
   }
 
   syslog(LOG_DEBUG, "Connection closed.");
@@ -542,13 +1055,15 @@ void handle_call_ending(LinphoneCore* p_linphone, LinphoneCall* p_call)
 /**
  * Logging helper function for writing the call log file.
  */
-void log_call(LinphoneCall* p_call, enum Piphoned_CallLogAction action)
+void log_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, enum Piphoned_CallLogAction action)
 {
   char timestamp[512];
-  char* sip_uri = linphone_call_get_remote_address_as_string(p_call);
+  char sip_uri[MAX_SIP_ADDRESS_LENGTH];
   time_t t = time(NULL);
   struct tm* time = localtime(&t);
 
+  p_core->p_ops->get_remote_address(p_call, sip_uri, MAX_SIP_ADDRESS_LENGTH);
+
   memset(timestamp, '\0', 512);
   strftime(timestamp, 512, "%Y-%m-%dT%H:%M:%S%z", time);
 
@@ -572,8 +1087,6 @@ void log_call(LinphoneCall* p_call, enum Piphoned_CallLogAction action)
     fprintf(g_piphoned_config_info.p_calllogfile, "%s UNKNOWN %s\n", timestamp, sip_uri);
     break;
   }
-
-  ms_free(sip_uri);
 }
 
 void determine_datadir(struct Piphoned_PhoneManager* p_manager)
@@ -622,10 +1135,10 @@ void determine_datadir(struct Piphoned_PhoneManager* p_manager)
   exit(7);
 }
 
-void create_missed_call_voicefile(const struct Piphoned_PhoneManager* p_manager, const LinphoneCall* p_call)
+void create_missed_call_voicefile(const struct Piphoned_PhoneManager* p_manager, struct Piphoned_SipCall* p_call)
 {
-  const LinphoneAddress* p_address = linphone_call_get_remote_address(p_call);
-  const char* username = linphone_address_get_username(p_address); /* username is the phone number in regular phone usage; otherwise we have real SIP VOIP without compatbility */
+  const struct Piphoned_SipCore_Ops* p_ops = p_manager->p_sipcore->p_ops;
+  const char* username = p_ops->get_remote_username(p_call); /* username is the phone number in regular phone usage; otherwise we have real SIP VOIP without compatbility */
   char target_filename[PATH_MAX];
   time_t cursec;
   struct tm* timeinfo = NULL;
@@ -638,12 +1151,12 @@ void create_missed_call_voicefile(const struct Piphoned_PhoneManager* p_manager,
   sprintf(target_filename, "%s/%s.wav", g_piphoned_config_info.messages_dir, timebuf);
 
   if (strcmp(username, "anonymous") == 0) { /* anonymous number */
-    char buf[PATH_MAX];
-    char* command = NULL;
-    sprintf(buf, "%s/anonym.wav", p_manager->datadir);
+    char command[MAX_COMMAND_LENGTH];
 
-    command = (char*) malloc(strlen("cp '") + strlen(buf) + strlen("' '") + strlen(target_filename) + strlen("'") + 1 /* NUL */);
-    sprintf(command, "cp '%s' '%s'", buf, target_filename);
+    if (snprintf(command, MAX_COMMAND_LENGTH, "cp '%s/anonym.wav' '%s'", p_manager->datadir, target_filename) >= MAX_COMMAND_LENGTH) {
+      syslog(LOG_ERR, "Command for copying the anonymous voice file too long, not executing.");
+      return;
+    }
 
     syslog(LOG_DEBUG, "Executing: %s", command);
 
@@ -651,41 +1164,260 @@ void create_missed_call_voicefile(const struct Piphoned_PhoneManager* p_manager,
       syslog(LOG_ERR, "Command execution failed, could not create voice file for anonymous call.");
     else
       syslog(LOG_INFO, "Created voice file for anonymous call.");
-
-    free(command);
   }
   else if (strpbrk(username, "0123456789") == NULL) { /* TODO: Would be better to check if the domain is equal to the phone service domain, but there's no way to obtain that one? */
     /* Non-numeric username, i.e. real VOIP other than
      * the local phone service provider. Can't log this currently. */
-    syslog(LOG_NOTICE, "Call from non-numeric SIP identity %s@%s. Cannot create a voice file for this, ignoring.", username, linphone_address_get_domain(p_address));
+    syslog(LOG_NOTICE, "Call from non-numeric SIP identity %s@%s. Cannot create a voice file for this, ignoring.", username, p_ops->get_remote_domain(p_call));
   }
   else { /* Normal call from phone line */
-    char * command = NULL;
+    char command[MAX_COMMAND_LENGTH];
+    size_t length = 0;
     int i;
 
-    command = (char*) malloc(strlen("sox") + 1); /* +1 for NUL */
-    strcpy(command, "sox");
+    /* Built on the stack, the daemon should not allocate while running */
+    length = snprintf(command, MAX_COMMAND_LENGTH, "sox");
+    for (i=0; username[i] != '\0' && length < MAX_COMMAND_LENGTH; i++)
+      length += snprintf(command + length, MAX_COMMAND_LENGTH - length, " '%s/digits/%c.wav'", p_manager->datadir, username[i]);
 
-    for (i=0; i < strlen(username); i++) {
-      char buf[PATH_MAX];
-      sprintf(buf, " '%s/digits/%c.wav'", p_manager->datadir, username[i]);
+    if (length < MAX_COMMAND_LENGTH)
+      length += snprintf(command + length, MAX_COMMAND_LENGTH - length, " '%s'", target_filename);
 
-      command = (char*) realloc(command, strlen(buf));
-      strcat(command, buf);
+    if (length >= MAX_COMMAND_LENGTH) {
+      syslog(LOG_ERR, "Command for writing the voice file of %s too long, not executing.", username);
+      return;
     }
 
-    command = (char*) realloc(command, strlen(target_filename) + 3); /* +3 for space and two quotes */
-    strcat(command, " '");
-    strcat(command, target_filename);
-    strcat(command, "'");
-
     syslog(LOG_DEBUG, "Executing: %s", command);
 
     if (system(command) != 0)
       syslog(LOG_ERR, "Command failed. Could not write voice file.");
     else
       syslog(LOG_INFO, "Wrote voice file '%s'.", target_filename);
+  }
+}
+
+/**
+ * Where the ZRTP SAS token of the line's call is written to. With a
+ * single line, that is AUTHTOKEN_FILE as it always was; otherwise
+ * the line's name is appended. `target` must hold PATH_MAX bytes.
+ */
+void get_authtoken_path(const struct Piphoned_PhoneManager* p_manager, char* target)
+{
+  if (g_piphoned_config_info.num_lines > 1)
+    snprintf(target, PATH_MAX, "%s.%s", AUTHTOKEN_FILE, p_manager->p_line->name);
+  else
+    snprintf(target, PATH_MAX, "%s", AUTHTOKEN_FILE);
+}
+
+/**
+ * Enters `p_call` into a free entry of the call table and takes a
+ * reference on it. The caller has to ensure there is a free entry.
+ */
+struct Piphoned_CallSlot* take_slot(struct Piphoned_PhoneManager* p_manager, struct Piphoned_SipCall* p_call, enum Piphoned_CallSlotState state)
+{
+  const struct Piphoned_SipCore_Ops* p_ops = p_manager->p_sipcore->p_ops;
+  struct Piphoned_CallSlot* p_slot = &p_manager->calls[p_manager->free_slots[--p_manager->num_free_slots]];
+
+  p_slot->p_call = p_call;
+  p_slot->state = state;
+  p_ops->ref_call(p_call);
+  p_ops->set_call_userdata(p_call, p_slot);
+
+  return p_slot;
+}
+
+/**
+ * Removes a call from the call table and drops the table's reference.
+ */
+void release_slot(struct Piphoned_PhoneManager* p_manager, struct Piphoned_CallSlot* p_slot)
+{
+  const struct Piphoned_SipCore_Ops* p_ops = p_manager->p_sipcore->p_ops;
+
+  if (p_slot == p_manager->p_active)
+    p_manager->p_active = NULL;
+  if (p_slot == p_manager->p_incoming) {
+    p_manager->p_incoming = NULL;
+    p_manager->has_incoming_call = false;
+  }
+  if (p_slot->state == PIPHONED_CALLSLOT_HELD)
+    p_manager->num_held--;
+
+  p_ops->set_call_userdata(p_slot->p_call, NULL);
+  p_ops->unref_call(p_slot->p_call);
+
+  p_slot->p_call = NULL;
+  p_slot->state = PIPHONED_CALLSLOT_FREE;
+  p_manager->free_slots[p_manager->num_free_slots++] = p_slot->index;
+}
+
+/**
+ * Hangs up the call in the given entry and removes it from the call
+ * table.
+ */
+void terminate_slot(struct Piphoned_PhoneManager* p_manager, struct Piphoned_CallSlot* p_slot)
+{
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  struct Piphoned_SipCall* p_call = p_slot->p_call;
+
+  /* Keep the call alive until it is terminated, but forget it
+   * first, so that its end is not handled as a remote hangup. */
+  p_core->p_ops->ref_call(p_call);
+  release_slot(p_manager, p_slot);
+  p_core->p_ops->terminate_call(p_core, p_call);
+  p_core->p_ops->unref_call(p_call);
+}
+
+/**
+ * Plays the call waiting tone if it has not been played for
+ * CALL_WAITING_INTERVAL seconds.
+ */
+void play_call_waiting_tone(struct Piphoned_PhoneManager* p_manager)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - p_manager->last_waiting_tone.tv_sec < CALL_WAITING_INTERVAL && p_manager->last_waiting_tone.tv_sec != 0)
+    return;
+
+  p_manager->p_sipcore->p_ops->play_dtmf(p_manager->p_sipcore, CALL_WAITING_DIGIT, CALL_WAITING_DURATION);
+  p_manager->last_waiting_tone = now;
+}
+
+/**
+ * Whether two proxy sections configure the same registration. The
+ * DTMF method does not need the proxy touched.
+ */
+static bool same_proxy_config(const struct Piphoned_Config_ParsedFile_ProxyTable* p_a, const struct Piphoned_Config_ParsedFile_ProxyTable* p_b)
+{
+  return strcmp(p_a->username, p_b->username) == 0
+    && strcmp(p_a->password, p_b->password) == 0
+    && strcmp(p_a->displayname, p_b->displayname) == 0
+    && strcmp(p_a->server, p_b->server) == 0
+    && strcmp(p_a->realm, p_b->realm) == 0
+    && p_a->use_publish == p_b->use_publish;
+}
+
+/**
+ * Diffs the proxies the line is bound to in the reloaded
+ * configuration against the loaded ones by section name. Removed
+ * sections are unregistered, changed ones edited (which registers
+ * them anew), and added ones registered. Afterwards, `proxies'
+ * follows the order of the new file and `proxy_configs' points into
+ * `p_newconfig'.
+ */
+static void reload_proxies(struct Piphoned_PhoneManager* p_manager, const struct Piphoned_Config_ParsedFile_LineTable* p_newline, const struct Piphoned_Config_ParsedFile* p_newconfig)
+{
+  struct Piphoned_SipCore* p_core = p_manager->p_sipcore;
+  struct Piphoned_SipProxy** proxies = (struct Piphoned_SipProxy**) calloc(p_newconfig->num_proxies + 1, sizeof(struct Piphoned_SipProxy*));
+  const struct Piphoned_Config_ParsedFile_ProxyTable** proxy_configs = (const struct Piphoned_Config_ParsedFile_ProxyTable**) calloc(p_newconfig->num_proxies + 1, sizeof(struct Piphoned_Config_ParsedFile_ProxyTable*));
+  bool* kept = (bool*) calloc(p_manager->num_proxies + 1, sizeof(bool));
+  struct Piphoned_SipProxy* p_old_default = p_manager->num_proxies > 0 ? p_manager->proxies[0] : NULL;
+  const char* binding = p_newline->proxy;
+  long num_proxies = 0;
+  int i = 0;
+  int j = 0;
+
+  /* Rather keep the line registered than bound to nothing */
+  if (strlen(binding) > 0) {
+    for(i=0; i < p_newconfig->num_proxies; i++) {
+      if (strcmp(binding, p_newconfig->proxies[i]->name) == 0)
+        break;
+    }
+
+    if (i == p_newconfig->num_proxies) {
+      syslog(LOG_ERR, "Line %s is bound to proxy '%s', but there is no such provider section. Keeping the old binding.", p_manager->p_line->name, binding);
+      binding = p_manager->p_line->proxy;
+    }
+  }
+
+  /* What the new file binds the line to, in its order */
+  for(i=0; i < p_newconfig->num_proxies; i++) {
+    const struct Piphoned_Config_ParsedFile_ProxyTable* p_config = p_newconfig->proxies[i];
+
+    if (strlen(binding) > 0 && strcmp(binding, p_config->name) != 0)
+      continue;
+
+    for(j=0; j < p_manager->num_proxies; j++) {
+      if (!kept[j] && strcmp(p_manager->proxy_configs[j]->name, p_config->name) == 0)
+        break;
+    }
+
+    if (j < p_manager->num_proxies) {
+      kept[j] = true;
+      proxies[num_proxies] = p_manager->proxies[j];
+      if (!same_proxy_config(p_manager->proxy_configs[j], p_config)) {
+        syslog(LOG_NOTICE, "Section [%s] of line %s changed, registering anew.", p_config->name, p_manager->p_line->name);
+        p_core->p_ops->edit_proxy(p_core, proxies[num_proxies], p_config);
+      }
+    }
+    else {
+      syslog(LOG_NOTICE, "Section [%s] added to line %s, registering.", p_config->name, p_manager->p_line->name);
+      proxies[num_proxies] = p_core->p_ops->add_proxy(p_core, p_config, false);
+      if (!proxies[num_proxies]) {
+        syslog(LOG_WARNING, "Invalid proxy configuration in section [%s], ignoring.", p_config->name);
+        continue;
+      }
+    }
+
+    proxy_configs[num_proxies++] = p_config;
+  }
 
-    free(command);
+  for(j=0; j < p_manager->num_proxies; j++) {
+    if (!kept[j]) {
+      syslog(LOG_NOTICE, "Section [%s] removed from line %s, unregistering.", p_manager->proxy_configs[j]->name, p_manager->p_line->name);
+      p_core->p_ops->remove_proxy(p_core, p_manager->proxies[j]);
+    }
+  }
+
+  reserve_proxies(p_manager, num_proxies);
+  memcpy(p_manager->proxies, proxies, num_proxies * sizeof(struct Piphoned_SipProxy*));
+  memcpy(p_manager->proxy_configs, proxy_configs, num_proxies * sizeof(struct Piphoned_Config_ParsedFile_ProxyTable*));
+  p_manager->num_proxies = num_proxies;
+
+  /* First proxy is default proxy */
+  if (num_proxies > 0) {
+    if (proxies[0] != p_old_default)
+      p_core->p_ops->set_default_proxy(p_core, proxies[0]);
+    p_manager->dtmf_method = proxy_configs[0]->dtmf_method;
+  }
+
+  free(proxies);
+  free(proxy_configs);
+  free(kept);
+}
+
+/**
+ * Makes room for `num` proxies in `proxies' and `proxy_configs',
+ * keeping the loaded ones. They are sized for the proxies the line
+ * is bound to rather than for PIPHONED_MAX_PROXY_NUM, and only grow.
+ * The arena does not take back the old ones, so a reload that needs
+ * more room at least doubles it; reloads adding one proxy after
+ * another do not keep eating into the arena.
+ */
+static void reserve_proxies(struct Piphoned_PhoneManager* p_manager, long num)
+{
+  struct Piphoned_SipProxy** proxies = NULL;
+  const struct Piphoned_Config_ParsedFile_ProxyTable** proxy_configs = NULL;
+
+  if (num <= p_manager->max_proxies)
+    return;
+
+  if (p_manager->max_proxies > 0 && num < 2 * p_manager->max_proxies)
+    num = 2 * p_manager->max_proxies < PIPHONED_MAX_PROXY_NUM ? 2 * p_manager->max_proxies : PIPHONED_MAX_PROXY_NUM;
+
+  proxies = (struct Piphoned_SipProxy**) piphoned_arena_alloc(num * sizeof(struct Piphoned_SipProxy*));
+  proxy_configs = (const struct Piphoned_Config_ParsedFile_ProxyTable**) piphoned_arena_alloc(num * sizeof(struct Piphoned_Config_ParsedFile_ProxyTable*));
+
+  if (p_manager->num_proxies > 0) {
+    memcpy(proxies, p_manager->proxies, p_manager->num_proxies * sizeof(struct Piphoned_SipProxy*));
+    memcpy(proxy_configs, p_manager->proxy_configs, p_manager->num_proxies * sizeof(struct Piphoned_Config_ParsedFile_ProxyTable*));
   }
+
+  piphoned_arena_release(p_manager->proxies);
+  piphoned_arena_release(p_manager->proxy_configs);
+
+  p_manager->proxies = proxies;
+  p_manager->proxy_configs = proxy_configs;
+  p_manager->max_proxies = num;
 }
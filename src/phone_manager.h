@@ -3,27 +3,83 @@
 #include <stdbool.h>
 #include <linphone/linphonecore.h>
 #include "config.h"
+#include "sipcore.h"
+#include "configfile.h"
+#include "load_controller.h"
 
+enum Piphoned_CallSlotState {
+  PIPHONED_CALLSLOT_FREE = 0, /* Slot not in use */
+  PIPHONED_CALLSLOT_INCOMING, /* Ringing, or waiting while another call is active */
+  PIPHONED_CALLSLOT_ACTIVE,   /* The call the handset is connected to */
+  PIPHONED_CALLSLOT_HELD      /* Put on hold by us */
+};
+
+/**
+ * What the handset should hear about the outgoing call before it is
+ * connected or after it ended. See tones.c.
+ */
+enum Piphoned_CallProgress {
+  PIPHONED_PROGRESS_NONE = 0, /* Nothing to signal, or the call's own audio */
+  PIPHONED_PROGRESS_RINGING,  /* The remote side rings */
+  PIPHONED_PROGRESS_BUSY,     /* The remote side is busy or hung up */
+  PIPHONED_PROGRESS_FAILED    /* The call could not be set up */
+};
+
+/**
+ * One entry of a line's call table. The SIP call's user data points
+ * back to its slot, so that call events find it without searching.
+ */
+struct Piphoned_CallSlot {
+  struct Piphoned_SipCall* p_call;   /*< The call; holds a reference. NULL if the slot is free. */
+  enum Piphoned_CallSlotState state; /*< What the call is doing */
+  int index;                         /*< Position in the call table */
+};
+
+/**
+ * Manages the SIP side of one line: its SIP core, the proxies it is
+ * registered with and its calls. At most one call is active; others
+ * may be held, and one more may be waiting to be taken.
+ */
 struct Piphoned_PhoneManager {
-  LinphoneCoreVTable vtable; /*< Linphone callback table */
-  LinphoneCore* p_linphone;  /*< Linphone Core object */
-  LinphoneCall* p_call;      /*< Current call, if any (NULL otherwise) */
-  LinphoneProxyConfig* proxies[PIPHONED_MAX_PROXY_NUM]; /*< All loaded proxies */
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line; /*< Configuration of the line */
+  struct Piphoned_SipCore* p_sipcore; /*< SIP core (linphone or the fake) */
+  struct Piphoned_CallSlot calls[PIPHONED_MAX_CALLS]; /*< Call table */
+  int free_slots[PIPHONED_MAX_CALLS]; /*< Stack of the indices of free entries in `calls' */
+  int num_free_slots;                 /*< Count of entries in `free_slots' */
+  struct Piphoned_CallSlot* p_active;   /*< Call the handset is connected to, NULL if none */
+  struct Piphoned_CallSlot* p_incoming; /*< Call ringing or waiting, NULL if none */
+  int num_held;              /*< Count of held calls */
+  struct timespec last_waiting_tone; /*< When the call waiting tone was played last */
+  struct Piphoned_SipProxy** proxies; /*< All loaded proxies */
+  const struct Piphoned_Config_ParsedFile_ProxyTable** proxy_configs; /*< Configuration each of `proxies' was loaded from */
+  enum Piphoned_DtmfMethod dtmf_method; /*< How the default proxy wants in-call digits sent */
   long num_proxies;          /*< Count of all loaded proxies in `proxies' */
+  long max_proxies;          /*< Room in `proxies' and `proxy_configs' */
   char ipv4[512];            /*< Our public IPv4 */
-  bool is_calling;           /*< Is a call in progress? */
-  bool has_incoming_call;    /*< Is an incoming call awaiting acceptance? */
+  bool is_registered;        /*< Has any proxy of the line accepted a registration? */
+  bool is_calling;           /*< Is the handset in a call (even if the other side hung up already)? */
+  bool has_incoming_call;    /*< Is an incoming call ringing or waiting for acceptance? */
+  enum Piphoned_CallProgress progress; /*< Progress of the outgoing call, while `is_calling' */
+  struct Piphoned_LoadController load_controller; /*< Cuts the active call back when the CPU is overloaded */
+  struct Piphoned_SipCall* p_latency_reported; /*< Call whose latency was logged last */
+  bool sound_check_pending;  /*< Were the sound devices taken from the sound cache unchecked? */
+  bool sound_check_due;      /*< Check them in the next update, registration is through */
+  bool keep_registrations;   /*< Leave the registrations to the next process when freed */
   long error_counter;        /*< For preventing unwated dialing */
   char datadir[PATH_MAX];    /* Location of the data/ directory, without trailing slash */
 };
 
-struct Piphoned_PhoneManager* piphoned_phonemanager_new();
+struct Piphoned_PhoneManager* piphoned_phonemanager_new(const struct Piphoned_Config_ParsedFile_LineTable* p_line);
 bool piphoned_phonemanager_load_proxies(struct Piphoned_PhoneManager* ptr);
+void piphoned_phonemanager_reload(struct Piphoned_PhoneManager* ptr, const struct Piphoned_Config_ParsedFile_LineTable* p_newline, const struct Piphoned_Config_ParsedFile* p_newconfig);
 void piphoned_phonemanager_update(struct Piphoned_PhoneManager* ptr);
+void piphoned_phonemanager_wait();
 void piphoned_phonemanager_place_call(struct Piphoned_PhoneManager* ptr, const char* sip_uri);
 void piphoned_phonemanager_stop_call(struct Piphoned_PhoneManager* ptr);
 void piphoned_phonemanager_accept_incoming_call(struct Piphoned_PhoneManager* ptr);
 void piphoned_phonemanager_decline_incoming_call(struct Piphoned_PhoneManager* ptr);
+void piphoned_phonemanager_flash(struct Piphoned_PhoneManager* ptr);
+void piphoned_phonemanager_send_dtmf(struct Piphoned_PhoneManager* ptr, char digit, const struct timespec* p_dialed_at);
 void piphoned_phonemanager_accept_zrtp_nonce(struct Piphoned_PhoneManager* ptr);
 void piphoned_phonemanager_reject_zrtp_nonce(struct Piphoned_PhoneManager* ptr);
 void piphoned_phonemanager_free(struct Piphoned_PhoneManager* ptr);
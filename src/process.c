@@ -0,0 +1,83 @@
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include "process.h"
+
+/**
+ * Watching other piphoned processes, for `stop' and the handoff on
+ * restart. A pidfd keeps referring to the very process it was
+ * opened for even if the PID is reused, and becomes readable the
+ * moment the process exits. Kernels before 5.3 lack it; then the
+ * PID is used and polled.
+ */
+
+/* Without pidfds, check whether the process exited this often
+ * (milliseconds) */
+#define POLL_INTERVAL 10
+
+/* Not yet known to the C library on all systems */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+/**
+ * Opens a pidfd for the process `pid`. Returns -1 with errno set to
+ * ENOSYS if the kernel has no pidfds, in which case the other
+ * functions fall back to the PID; other errors mean the process
+ * cannot be accessed.
+ */
+int piphoned_process_open(pid_t pid)
+{
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/**
+ * Sends a signal through the pidfd if there is one, by PID
+ * otherwise.
+ */
+int piphoned_process_signal(pid_t pid, int pidfd, int signum)
+{
+  if (pidfd >= 0)
+    return syscall(SYS_pidfd_send_signal, pidfd, signum, NULL, 0);
+
+  return kill(pid, signum);
+}
+
+/**
+ * Waits up to `timeout` milliseconds, or forever if it is negative,
+ * for the process to exit. Returns whether it did.
+ */
+bool piphoned_process_wait_exit(pid_t pid, int pidfd, int timeout)
+{
+  struct pollfd pfd;
+  struct timespec interval = {0, POLL_INTERVAL * 1000000L};
+  int waited = 0;
+  int result = 0;
+
+  if (pidfd >= 0) {
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    while ((result = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+      ;
+
+    return result > 0;
+  }
+
+  while (kill(pid, 0) == 0) {
+    if (timeout >= 0 && waited >= timeout)
+      return false;
+
+    nanosleep(&interval, NULL);
+    waited += POLL_INTERVAL;
+  }
+
+  return true;
+}
@@ -0,0 +1,13 @@
+#ifndef PIPHONED_PROCESS_H
+#define PIPHONED_PROCESS_H
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* How long to wait for a process to die after SIGKILL (milliseconds) */
+#define PIPHONED_PROCESS_KILL_TIMEOUT 2000
+
+int piphoned_process_open(pid_t pid);                            /*< pidfd of the process; -1 with errno ENOSYS without pidfds */
+int piphoned_process_signal(pid_t pid, int pidfd, int signum);   /*< Send a signal through the pidfd, by PID without one */
+bool piphoned_process_wait_exit(pid_t pid, int pidfd, int timeout); /*< Wait up to `timeout' ms (forever if negative) for the process to exit */
+
+#endif
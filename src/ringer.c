@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <alsa/asoundlib.h>
+#include <wiringPi.h>
+#include <linphone/linphonecore.h>
+#include "ringer.h"
+#include "configfile.h"
+#include "logring.h"
+#include "rtsched.h"
+#include "sound_params.h"
+
+/**
+ * The ringer. Instead of linphone decoding its ring file anew for
+ * every incoming call, the `ring_file` is decoded once at startup
+ * and kept in memory. For each line with a `ringer_device` or a
+ * `bell_pin`, a thread plays it to that ALSA device and switches the
+ * bell on and off, following `ring_cadence`. The thread waits in
+ * poll() on a timerfd for the steps of the cadence, so the bell
+ * follows it exactly however the audio is doing, on an eventfd for
+ * the mainloop's start and stop requests, and while ringing on the
+ * sound device. The device is only held open while ringing.
+ */
+
+/* Longest ring file kept in memory; longer ones are cut */
+#define MAX_RING_SECONDS 30
+
+/* Buffer latency requested from ALSA, in microseconds */
+#define RING_LATENCY 100000
+
+/**
+ * The ringer of one line.
+ */
+struct Ringer
+{
+  int line;                  /*< Index of the line */
+  const char* device;        /*< ALSA PCM to play to; empty for none */
+  int bell_pin;              /*< Output pin of the bell; -1 for none */
+  pthread_t thread;          /*< Ringing thread */
+  bool is_running;           /*< Was `thread` started? */
+  bool wanted;               /*< Should the line ring? Shared resource! */
+  bool stop;                 /*< Should the thread terminate? Shared resource! */
+  int wake_fd;               /*< eventfd signalled when `wanted` or `stop` change */
+  int timer_fd;              /*< timerfd expiring at the end of each cadence step */
+
+  /* Only used by `thread` */
+  bool is_ringing;           /*< Is the line ringing? */
+  int step;                  /*< Current step of the cadence; even ones are on */
+  struct timespec step_end;  /*< When `step` ends (CLOCK_MONOTONIC) */
+  snd_pcm_t* p_pcm;          /*< Open sound device, NULL if none */
+  size_t position;           /*< Next frame of the ring file */
+};
+
+static int16_t* sp_ring_frames = NULL; /* Decoded ring file, interleaved */
+static size_t s_ring_length = 0;       /* Frames in `sp_ring_frames` */
+static unsigned int s_ring_channels = 0;
+static unsigned int s_ring_rate = 0;
+
+static struct Ringer s_ringers[PIPHONED_MAX_LINES];
+static int s_num_lines = 0;
+
+static bool load_ring_file(const char* path);
+static void* ringer_thread(void* arg);
+static void start_ringing(struct Ringer* p_ringer);
+static void stop_ringing(struct Ringer* p_ringer);
+static void next_step(struct Ringer* p_ringer);
+static void arm_timer(struct Ringer* p_ringer);
+static void open_device(struct Ringer* p_ringer);
+static void close_device(struct Ringer* p_ringer);
+static void feed_device(struct Ringer* p_ringer);
+static unsigned int get16(const unsigned char* source);
+static unsigned long get32(const unsigned char* source);
+
+/**
+ * Decodes the ring file and starts a ringer thread for each line
+ * with a ringer device or a bell. The threads stay idle until
+ * piphoned_ringer_ring() is called.
+ */
+bool piphoned_ringer_init()
+{
+  int i = 0;
+
+  if (strlen(g_piphoned_config_info.ring_file) > 0 && !load_ring_file(g_piphoned_config_info.ring_file))
+    return false;
+
+  s_num_lines = g_piphoned_config_info.num_lines;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct Ringer* p_ringer = &s_ringers[i];
+
+    memset(p_ringer, '\0', sizeof(struct Ringer));
+    p_ringer->line = i;
+    p_ringer->device = sp_ring_frames ? g_piphoned_config_info.lines[i]->ringer_device : "";
+    p_ringer->bell_pin = g_piphoned_config_info.lines[i]->bell_pin;
+    p_ringer->wake_fd = -1;
+    p_ringer->timer_fd = -1;
+
+    if (!piphoned_ringer_is_ringer_line(i))
+      continue;
+
+    if (p_ringer->bell_pin >= 0) {
+      pinMode(p_ringer->bell_pin, OUTPUT);
+      digitalWrite(p_ringer->bell_pin, LOW);
+    }
+
+    p_ringer->wake_fd = eventfd(0, EFD_CLOEXEC);
+    p_ringer->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (p_ringer->wake_fd < 0 || p_ringer->timer_fd < 0) {
+      syslog(LOG_ERR, "Failed to create ringer events for line %s: %m", g_piphoned_config_info.lines[i]->name);
+      goto fail;
+    }
+
+    if (pthread_create(&p_ringer->thread, NULL, ringer_thread, p_ringer) != 0) {
+      syslog(LOG_ERR, "Failed to start ringer thread for line %s: %m", g_piphoned_config_info.lines[i]->name);
+      goto fail;
+    }
+
+    p_ringer->is_running = true;
+    syslog(LOG_INFO, "Ringing line %s%s%s%s.", g_piphoned_config_info.lines[i]->name,
+           strlen(p_ringer->device) > 0 ? " on " : "", p_ringer->device,
+           p_ringer->bell_pin >= 0 ? " and its bell" : "");
+  }
+
+  return true;
+
+ fail:
+  if (s_ringers[i].wake_fd >= 0)
+    close(s_ringers[i].wake_fd);
+  if (s_ringers[i].timer_fd >= 0)
+    close(s_ringers[i].timer_fd);
+
+  /* Stop the threads of the lines before, and free the ring file */
+  piphoned_ringer_free();
+  return false;
+}
+
+/**
+ * Stops all ringer threads, silencing the bells, and frees the ring
+ * file.
+ */
+void piphoned_ringer_free()
+{
+  uint64_t one = 1;
+  int i = 0;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct Ringer* p_ringer = &s_ringers[i];
+
+    if (!p_ringer->is_running)
+      continue;
+
+    __atomic_store_n(&p_ringer->stop, true, __ATOMIC_RELEASE);
+    if (write(p_ringer->wake_fd, &one, sizeof(one)) < 0)
+      syslog(LOG_WARNING, "Failed to wake ringer thread: %m");
+
+    pthread_join(p_ringer->thread, NULL);
+    close(p_ringer->wake_fd);
+    close(p_ringer->timer_fd);
+    p_ringer->is_running = false;
+  }
+
+  free(sp_ring_frames);
+  sp_ring_frames = NULL;
+  s_ring_length = 0;
+  s_num_lines = 0;
+}
+
+/**
+ * Checks whether piphoned rings the given line itself, i.e. whether
+ * it has a bell or a ringer device with a ring file to play on it.
+ * linphone's own ringer is disabled for such lines.
+ */
+bool piphoned_ringer_is_ringer_line(int line)
+{
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line = g_piphoned_config_info.lines[line];
+
+  return p_line->bell_pin >= 0 || (strlen(p_line->ringer_device) > 0 && strlen(g_piphoned_config_info.ring_file) > 0);
+}
+
+/**
+ * Start or stop ringing the given line. Meant to be called on every
+ * mainloop iteration; does nothing if the setting does not change or
+ * the line has no ringer thread.
+ */
+void piphoned_ringer_ring(int line, bool ring)
+{
+  struct Ringer* p_ringer = NULL;
+  uint64_t one = 1;
+
+  if (line >= s_num_lines || !s_ringers[line].is_running)
+    return;
+
+  p_ringer = &s_ringers[line];
+  if (__atomic_load_n(&p_ringer->wanted, __ATOMIC_ACQUIRE) == ring)
+    return;
+
+  __atomic_store_n(&p_ringer->wanted, ring, __ATOMIC_RELEASE);
+  if (write(p_ringer->wake_fd, &one, sizeof(one)) < 0)
+    PIPHONED_LOG(LOG_WARNING, "Failed to wake ringer thread of line %d.", line + 1);
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Reads a 16 bit PCM WAV file of any rate with one or two channels
+ * into `sp_ring_frames`.
+ */
+static bool load_ring_file(const char* path)
+{
+  unsigned char chunk[8];
+  unsigned char format[16];
+  bool has_format = false;
+  FILE* p_file = NULL;
+  size_t i = 0;
+
+  p_file = fopen(path, "rb");
+  if (!p_file) {
+    syslog(LOG_ERR, "Cannot open ring file '%s': %m", path);
+    return false;
+  }
+
+  if (fread(chunk, 8, 1, p_file) != 1 || memcmp(chunk, "RIFF", 4) != 0
+      || fread(chunk, 4, 1, p_file) != 1 || memcmp(chunk, "WAVE", 4) != 0) {
+    syslog(LOG_ERR, "Ring file '%s' is not a WAV file.", path);
+    goto fail;
+  }
+
+  while (fread(chunk, 8, 1, p_file) == 1) {
+    unsigned long size = get32(chunk + 4);
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+      if (fread(format, 16, 1, p_file) != 1)
+        break;
+      fseek(p_file, size - 16 + (size & 1), SEEK_CUR);
+      has_format = true;
+    }
+    else if (memcmp(chunk, "data", 4) == 0) {
+      size_t samples = 0;
+
+      if (!has_format || get16(format) != 1 || get16(format + 2) < 1 || get16(format + 2) > 2 || get16(format + 14) != 16) {
+        syslog(LOG_ERR, "Ring file '%s' is not 16 bit PCM with one or two channels.", path);
+        goto fail;
+      }
+
+      s_ring_channels = get16(format + 2);
+      s_ring_rate = get32(format + 4);
+      s_ring_length = size / 2 / s_ring_channels;
+      if (s_ring_length > (size_t) MAX_RING_SECONDS * s_ring_rate) {
+        syslog(LOG_WARNING, "Ring file '%s' is longer than %d seconds, cutting it.", path, MAX_RING_SECONDS);
+        s_ring_length = (size_t) MAX_RING_SECONDS * s_ring_rate;
+      }
+
+      samples = s_ring_length * s_ring_channels;
+      sp_ring_frames = (int16_t*) malloc(samples * sizeof(int16_t));
+      if (!sp_ring_frames) {
+        syslog(LOG_ERR, "Cannot allocate %zu bytes for the ring file: %m", samples * sizeof(int16_t));
+        goto fail;
+      }
+
+      for(i=0; i < samples; i++) {
+        unsigned char bytes[2];
+
+        if (fread(bytes, 2, 1, p_file) != 1)
+          break;
+        sp_ring_frames[i] = (int16_t) get16(bytes);
+      }
+      s_ring_length = i / s_ring_channels;
+
+      if (s_ring_length == 0) {
+        free(sp_ring_frames);
+        sp_ring_frames = NULL;
+        break;
+      }
+
+      fclose(p_file);
+      syslog(LOG_INFO, "Loaded ring file '%s': %zu frames at %u Hz, %u channel(s).", path, s_ring_length, s_ring_rate, s_ring_channels);
+      return true;
+    }
+    else {
+      fseek(p_file, size + (size & 1), SEEK_CUR);
+    }
+  }
+
+  syslog(LOG_ERR, "Ring file '%s' has no audio data.", path);
+
+ fail:
+  fclose(p_file);
+  return false;
+}
+
+static void* ringer_thread(void* arg)
+{
+  struct Ringer* p_ringer = (struct Ringer*) arg;
+  struct pollfd fds[8];
+
+  /* The bell's timing is as critical as the dial's */
+  piphoned_rtsched_apply(p_ringer->bell_pin >= 0 ? PIPHONED_RTSCHED_GPIO : PIPHONED_RTSCHED_AUDIO);
+
+  while (true) {
+    int num_fds = 2;
+    uint64_t count = 0;
+
+    fds[0].fd = p_ringer->wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = p_ringer->timer_fd;
+    fds[1].events = POLLIN;
+
+    /* Audio is only played during the on steps */
+    if (p_ringer->p_pcm && p_ringer->step % 2 == 0)
+      num_fds += snd_pcm_poll_descriptors(p_ringer->p_pcm, fds + 2, 6);
+
+    if (poll(fds, num_fds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      PIPHONED_LOG(LOG_ERR, "Ringer of line %d cannot wait for events: error %d.", p_ringer->line + 1, errno);
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if (read(p_ringer->wake_fd, &count, sizeof(count)) < 0)
+        count = 0;
+      if (__atomic_load_n(&p_ringer->stop, __ATOMIC_ACQUIRE))
+        break;
+
+      if (__atomic_load_n(&p_ringer->wanted, __ATOMIC_ACQUIRE) && !p_ringer->is_ringing)
+        start_ringing(p_ringer);
+      else if (!__atomic_load_n(&p_ringer->wanted, __ATOMIC_ACQUIRE) && p_ringer->is_ringing)
+        stop_ringing(p_ringer);
+
+      continue; /* The descriptors may have changed */
+    }
+
+    if (fds[1].revents & POLLIN) {
+      if (read(p_ringer->timer_fd, &count, sizeof(count)) > 0 && p_ringer->is_ringing)
+        next_step(p_ringer);
+      continue;
+    }
+
+    if (num_fds > 2) {
+      unsigned short revents = 0;
+
+      snd_pcm_poll_descriptors_revents(p_ringer->p_pcm, fds + 2, num_fds - 2, &revents);
+      if (revents & (POLLOUT | POLLERR))
+        feed_device(p_ringer);
+    }
+  }
+
+  if (p_ringer->is_ringing)
+    stop_ringing(p_ringer);
+
+  return NULL;
+}
+
+/**
+ * Starts the first on step of the cadence right away.
+ */
+static void start_ringing(struct Ringer* p_ringer)
+{
+  p_ringer->is_ringing = true;
+  p_ringer->step = 0;
+  clock_gettime(CLOCK_MONOTONIC, &p_ringer->step_end);
+
+  if (p_ringer->bell_pin >= 0)
+    digitalWrite(p_ringer->bell_pin, HIGH);
+
+  arm_timer(p_ringer);
+
+  if (strlen(p_ringer->device) > 0) {
+    open_device(p_ringer);
+    feed_device(p_ringer);
+  }
+}
+
+static void stop_ringing(struct Ringer* p_ringer)
+{
+  struct itimerspec off;
+
+  memset(&off, '\0', sizeof(struct itimerspec));
+  timerfd_settime(p_ringer->timer_fd, 0, &off, NULL);
+
+  if (p_ringer->bell_pin >= 0)
+    digitalWrite(p_ringer->bell_pin, LOW);
+
+  close_device(p_ringer);
+  p_ringer->is_ringing = false;
+}
+
+/**
+ * Moves on to the next step of the cadence, whose end is counted
+ * from the end of the previous one so that the cadence does not
+ * drift.
+ */
+static void next_step(struct Ringer* p_ringer)
+{
+  bool is_on = false;
+
+  p_ringer->step = (p_ringer->step + 1) % g_piphoned_config_info.ring_cadence_steps;
+  is_on = p_ringer->step % 2 == 0;
+
+  if (p_ringer->bell_pin >= 0)
+    digitalWrite(p_ringer->bell_pin, is_on ? HIGH : LOW);
+
+  arm_timer(p_ringer);
+
+  if (p_ringer->p_pcm) {
+    /* Cut the ring off at the end of the on step, and start the ring
+     * file from its beginning with the next one */
+    snd_pcm_drop(p_ringer->p_pcm);
+    if (is_on) {
+      snd_pcm_prepare(p_ringer->p_pcm);
+      p_ringer->position = 0;
+      feed_device(p_ringer);
+    }
+  }
+}
+
+/**
+ * Makes the timer expire at the end of the current step.
+ */
+static void arm_timer(struct Ringer* p_ringer)
+{
+  struct itimerspec due;
+  long ms = g_piphoned_config_info.ring_cadence[p_ringer->step];
+
+  p_ringer->step_end.tv_sec += ms / 1000;
+  p_ringer->step_end.tv_nsec += (ms % 1000) * 1000000L;
+  if (p_ringer->step_end.tv_nsec >= 1000000000L) {
+    p_ringer->step_end.tv_sec++;
+    p_ringer->step_end.tv_nsec -= 1000000000L;
+  }
+
+  memset(&due, '\0', sizeof(struct itimerspec));
+  due.it_value = p_ringer->step_end;
+  timerfd_settime(p_ringer->timer_fd, TFD_TIMER_ABSTIME, &due, NULL);
+}
+
+static void open_device(struct Ringer* p_ringer)
+{
+  int error = 0;
+
+  error = snd_pcm_open(&p_ringer->p_pcm, p_ringer->device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+  if (error < 0) {
+    PIPHONED_LOG(LOG_ERR, "Cannot open ringer device of line %d: error %d.", p_ringer->line + 1, error);
+    p_ringer->p_pcm = NULL;
+    return;
+  }
+
+  error = piphoned_soundparams_set(p_ringer->p_pcm, s_ring_channels, s_ring_rate, RING_LATENCY, p_ringer->line);
+  if (error < 0) {
+    PIPHONED_LOG(LOG_ERR, "Cannot play the ring file on ringer device of line %d: error %d.", p_ringer->line + 1, error);
+    close_device(p_ringer);
+    return;
+  }
+
+  p_ringer->position = 0;
+}
+
+static void close_device(struct Ringer* p_ringer)
+{
+  if (!p_ringer->p_pcm)
+    return;
+
+  snd_pcm_drop(p_ringer->p_pcm);
+  snd_pcm_close(p_ringer->p_pcm);
+  p_ringer->p_pcm = NULL;
+}
+
+/**
+ * Writes as much of the ring file as the device takes without
+ * blocking, looping it if it is shorter than the on step.
+ */
+static void feed_device(struct Ringer* p_ringer)
+{
+  while (p_ringer->p_pcm) {
+    snd_pcm_sframes_t frames = s_ring_length - p_ringer->position;
+
+    frames = snd_pcm_writei(p_ringer->p_pcm, sp_ring_frames + p_ringer->position * s_ring_channels, frames);
+    if (frames == -EAGAIN || frames == 0)
+      break;
+
+    if (frames < 0) {
+      if (snd_pcm_recover(p_ringer->p_pcm, frames, 1) < 0) {
+        PIPHONED_LOG(LOG_ERR, "Playing on ringer device of line %d failed: error %d.", p_ringer->line + 1, (int) frames);
+        close_device(p_ringer);
+      }
+      break;
+    }
+
+    p_ringer->position += frames;
+    if (p_ringer->position >= s_ring_length)
+      p_ringer->position = 0;
+  }
+}
+
+/* WAV files are little endian, whatever the machine is */
+
+static unsigned int get16(const unsigned char* source)
+{
+  return source[0] | (source[1] << 8);
+}
+
+static unsigned long get32(const unsigned char* source)
+{
+  return get16(source) | ((unsigned long) get16(source + 2) << 16);
+}
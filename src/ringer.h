@@ -0,0 +1,10 @@
+#ifndef PIPHONED_RINGER_H
+#define PIPHONED_RINGER_H
+#include <stdbool.h>
+
+bool piphoned_ringer_init();                     /*< Load the ring file and start the ringer threads */
+void piphoned_ringer_free();                     /*< Stop the ringer threads and free the ring file */
+bool piphoned_ringer_is_ringer_line(int line);   /*< Does piphoned ring the line rather than linphone? */
+void piphoned_ringer_ring(int line, bool ring);  /*< Start or stop ringing the line */
+
+#endif
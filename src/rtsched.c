@@ -0,0 +1,287 @@
+#define _GNU_SOURCE /* CPU affinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "rtsched.h"
+#include "configfile.h"
+
+/**
+ * Real-time scheduling profile. On a small Pi, the GPIO threads
+ * timing the dial pulses and linphone's media threads compete with
+ * everything else the system does. The configuration assigns each
+ * class of thread a SCHED_FIFO or SCHED_RR priority (0 meaning the
+ * normal scheduler) and optionally a CPU core to run on.
+ *
+ * piphoned_rtsched_init() must run as root before the privileges
+ * are dropped: it raises RLIMIT_RTPRIO so that the unprivileged
+ * daemon may still switch threads to the requested priorities
+ * later. If that fails, the priorities are clamped to whatever the
+ * limit allows, down to not using real-time scheduling at all.
+ *
+ * Our own threads apply their class themselves. Linphone's media
+ * threads are not under our control; they are recognised as the
+ * threads that did not exist yet when the mainloop was set up (see
+ * piphoned_rtsched_mark_baseline()). All classes are applied with
+ * SCHED_RESET_ON_FORK, so that neither linphone's other threads nor
+ * the processes we spawn inherit a real-time priority.
+ */
+
+#define MAX_BASELINE_THREADS 64 /* More threads than that exceed anything linphone starts */
+
+static bool s_initialized = false;
+static bool s_failed = false; /* Set on the first EPERM so we warn only once */
+static int s_rtprio_limit = 0;
+static pid_t s_baseline[MAX_BASELINE_THREADS];
+static int s_num_baseline = 0;
+
+static int class_priority(enum Piphoned_RtSched_Class thread_class);
+static int class_cpu(enum Piphoned_RtSched_Class thread_class);
+static void apply_to_thread(pid_t tid, enum Piphoned_RtSched_Class thread_class);
+static bool is_baseline_thread(pid_t tid);
+
+static const char* s_class_names[PIPHONED_RTSCHED_NUM_CLASSES] = {"GPIO", "audio", "SIP"};
+
+/**
+ * Checks the configured profile and raises RLIMIT_RTPRIO to the
+ * highest configured priority. Call this while still being root.
+ *
+ * \returns false if real-time priorities cannot be used at all,
+ * true otherwise (also if none are configured). CPU pinning works
+ * in both cases.
+ */
+bool piphoned_rtsched_init()
+{
+  struct rlimit limit;
+  int wanted = 0;
+  int maxprio = sched_get_priority_max(g_piphoned_config_info.rt_policy);
+  int i = 0;
+
+  s_initialized = true;
+  s_failed = false;
+
+  for(i=0; i < PIPHONED_RTSCHED_NUM_CLASSES; i++) {
+    if (class_priority(i) > wanted)
+      wanted = class_priority(i);
+  }
+
+  if (wanted == 0)
+    return true;
+
+  if (wanted > maxprio) {
+    syslog(LOG_WARNING, "Real-time priority %d exceeds the maximum of %d. Clamping.", wanted, maxprio);
+    wanted = maxprio;
+  }
+
+  if (getrlimit(RLIMIT_RTPRIO, &limit) < 0) {
+    syslog(LOG_ERR, "Failed to query RLIMIT_RTPRIO: %m. Using normal priorities.");
+    s_rtprio_limit = 0;
+    return false;
+  }
+
+  if (limit.rlim_cur < (rlim_t) wanted) {
+    struct rlimit raised;
+
+    raised.rlim_cur = wanted;
+    raised.rlim_max = limit.rlim_max > (rlim_t) wanted ? limit.rlim_max : (rlim_t) wanted;
+
+    if (setrlimit(RLIMIT_RTPRIO, &raised) == 0) {
+      limit = raised;
+    }
+    else {
+      /* Not root? Go as far as the hard limit allows. */
+      syslog(LOG_WARNING, "Failed to raise RLIMIT_RTPRIO to %d: %m", wanted);
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_RTPRIO, &limit);
+      getrlimit(RLIMIT_RTPRIO, &limit);
+    }
+  }
+
+  s_rtprio_limit = limit.rlim_cur < (rlim_t) wanted ? (int) limit.rlim_cur : wanted;
+
+  if (s_rtprio_limit == 0) {
+    syslog(LOG_WARNING, "RLIMIT_RTPRIO is 0; running all threads with normal priorities.");
+    return false;
+  }
+  if (s_rtprio_limit < wanted)
+    syslog(LOG_WARNING, "RLIMIT_RTPRIO only allows priorities up to %d. Clamping.", s_rtprio_limit);
+
+  syslog(LOG_INFO, "Real-time scheduling enabled (GPIO %d, audio %d, SIP %d).",
+         class_priority(PIPHONED_RTSCHED_GPIO), class_priority(PIPHONED_RTSCHED_AUDIO), class_priority(PIPHONED_RTSCHED_SIP));
+  return true;
+}
+
+/**
+ * Applies the priority and CPU of the given class to the calling
+ * thread. Does nothing if piphoned_rtsched_init() was not called,
+ * as for the simulated commands.
+ */
+void piphoned_rtsched_apply(enum Piphoned_RtSched_Class thread_class)
+{
+  if (!s_initialized)
+    return;
+
+  apply_to_thread(0, thread_class);
+}
+
+/**
+ * Remembers the threads of the process that exist right now. Call
+ * this when the mainloop is set up and before the first call.
+ */
+void piphoned_rtsched_mark_baseline()
+{
+  DIR* p_dir = NULL;
+  struct dirent* p_entry = NULL;
+
+  if (!s_initialized)
+    return;
+
+  s_num_baseline = 0;
+
+  p_dir = opendir("/proc/self/task");
+  if (!p_dir) {
+    syslog(LOG_WARNING, "Failed to list threads: %m");
+    return;
+  }
+
+  while ((p_entry = readdir(p_dir)) && s_num_baseline < MAX_BASELINE_THREADS) {
+    if (p_entry->d_name[0] != '.')
+      s_baseline[s_num_baseline++] = atoi(p_entry->d_name);
+  }
+
+  closedir(p_dir);
+}
+
+/**
+ * Applies the given class to every thread that was started after
+ * piphoned_rtsched_mark_baseline(). This is how linphone's media
+ * threads get their priority: call it once a call's streams are
+ * running.
+ */
+void piphoned_rtsched_adopt_new_threads(enum Piphoned_RtSched_Class thread_class)
+{
+  DIR* p_dir = NULL;
+  struct dirent* p_entry = NULL;
+  pid_t tid = 0;
+
+  if (!s_initialized || s_num_baseline == 0)
+    return;
+
+  p_dir = opendir("/proc/self/task");
+  if (!p_dir)
+    return;
+
+  while ((p_entry = readdir(p_dir))) {
+    if (p_entry->d_name[0] == '.')
+      continue;
+
+    tid = atoi(p_entry->d_name);
+    if (!is_baseline_thread(tid))
+      apply_to_thread(tid, thread_class);
+  }
+
+  closedir(p_dir);
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static int class_priority(enum Piphoned_RtSched_Class thread_class)
+{
+  int prio = 0;
+
+  switch (thread_class) {
+  case PIPHONED_RTSCHED_GPIO:
+    prio = g_piphoned_config_info.gpio_priority;
+    break;
+  case PIPHONED_RTSCHED_AUDIO:
+    prio = g_piphoned_config_info.audio_priority;
+    break;
+  case PIPHONED_RTSCHED_SIP:
+    prio = g_piphoned_config_info.sip_priority;
+    break;
+  default:
+    break;
+  }
+
+  return prio < 0 ? 0 : prio;
+}
+
+static int class_cpu(enum Piphoned_RtSched_Class thread_class)
+{
+  switch (thread_class) {
+  case PIPHONED_RTSCHED_GPIO:
+    return g_piphoned_config_info.gpio_cpu;
+  case PIPHONED_RTSCHED_AUDIO:
+    return g_piphoned_config_info.audio_cpu;
+  case PIPHONED_RTSCHED_SIP:
+    return g_piphoned_config_info.sip_cpu;
+  default:
+    return -1;
+  }
+}
+
+/**
+ * Sets the scheduling policy and CPU affinity of the thread `tid`
+ * (0 for the calling thread). Failures are logged, but never fatal.
+ */
+static void apply_to_thread(pid_t tid, enum Piphoned_RtSched_Class thread_class)
+{
+  struct sched_param param;
+  int prio = class_priority(thread_class);
+  int cpu = class_cpu(thread_class);
+  int error = 0;
+
+  if (prio > s_rtprio_limit)
+    prio = s_rtprio_limit;
+
+  memset(&param, '\0', sizeof(struct sched_param));
+  param.sched_priority = prio;
+
+  if (prio > 0 && !s_failed) {
+    if (sched_setscheduler(tid, g_piphoned_config_info.rt_policy | SCHED_RESET_ON_FORK, &param) < 0) {
+      error = errno; /* syslog() may change it */
+
+      /* E.g. RT throttling in a cgroup without an RT budget. Don't retry for every thread. */
+      syslog(LOG_WARNING, "Failed to set real-time priority %d for %s thread %d: %m. Using normal priorities.",
+             prio, s_class_names[thread_class], tid ? tid : (int) syscall(SYS_gettid));
+      if (error == EPERM)
+        s_failed = true;
+    }
+  }
+
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+
+    if (cpu >= CPU_SETSIZE || cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+      syslog(LOG_WARNING, "Cannot pin %s thread to CPU %d: no such CPU.", s_class_names[thread_class], cpu);
+      return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(tid, sizeof(cpu_set_t), &cpus) < 0)
+      syslog(LOG_WARNING, "Failed to pin %s thread to CPU %d: %m", s_class_names[thread_class], cpu);
+  }
+}
+
+static bool is_baseline_thread(pid_t tid)
+{
+  int i = 0;
+
+  for(i=0; i < s_num_baseline; i++) {
+    if (s_baseline[i] == tid)
+      return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,20 @@
+#ifndef PIPHONED_RTSCHED_H
+#define PIPHONED_RTSCHED_H
+#include <stdbool.h>
+
+/**
+ * The kinds of threads that get their own scheduling settings.
+ */
+enum Piphoned_RtSched_Class {
+  PIPHONED_RTSCHED_GPIO = 0, /* GPIO edge threads (pulse dial, hook switch) */
+  PIPHONED_RTSCHED_AUDIO,    /* Media threads linphone starts for a call */
+  PIPHONED_RTSCHED_SIP,      /* The mainloop, which iterates the SIP core */
+  PIPHONED_RTSCHED_NUM_CLASSES
+};
+
+bool piphoned_rtsched_init();                                     /*< Prepare the scheduling profile; needs root */
+void piphoned_rtsched_apply(enum Piphoned_RtSched_Class thread_class); /*< Apply a class to the calling thread */
+void piphoned_rtsched_mark_baseline();                            /*< Remember the threads that exist now */
+void piphoned_rtsched_adopt_new_threads(enum Piphoned_RtSched_Class thread_class); /*< Apply a class to threads started since the baseline */
+
+#endif
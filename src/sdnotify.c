@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sdnotify.h"
+
+/**
+ * The systemd notification protocol (sd_notify(3)), spoken directly
+ * so that piphoned does not need libsystemd. systemd passes the path
+ * of a datagram socket in $NOTIFY_SOCKET to Type=notify services;
+ * a leading '@' denotes a socket in the abstract namespace. Without
+ * that variable, nothing is sent.
+ */
+
+#define MAX_NOTIFY_LENGTH 256
+
+bool piphoned_sdnotify_enabled()
+{
+  const char* path = getenv("NOTIFY_SOCKET");
+
+  return path && (path[0] == '/' || path[0] == '@');
+}
+
+void piphoned_sdnotify(const char* format, ...)
+{
+  const char* path = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un address;
+  socklen_t address_length = 0;
+  char message[MAX_NOTIFY_LENGTH];
+  va_list args;
+  int length = 0;
+  int fd = -1;
+
+  if (!piphoned_sdnotify_enabled() || strlen(path) >= sizeof(address.sun_path))
+    return;
+
+  va_start(args, format);
+  length = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (length < 0)
+    return;
+  if (length >= (int) sizeof(message))
+    length = sizeof(message) - 1;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  if (address.sun_path[0] == '@')
+    address.sun_path[0] = '\0';
+  address_length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    syslog(LOG_WARNING, "Failed to create a socket for notifying systemd: %m");
+    return;
+  }
+
+  if (sendto(fd, message, length, MSG_NOSIGNAL, (struct sockaddr*) &address, address_length) < 0)
+    syslog(LOG_WARNING, "Failed to notify systemd: %m");
+
+  close(fd);
+}
@@ -0,0 +1,8 @@
+#ifndef PIPHONED_SDNOTIFY_H
+#define PIPHONED_SDNOTIFY_H
+#include <stdbool.h>
+
+bool piphoned_sdnotify_enabled(); /*< Was piphoned started by systemd as a Type=notify service? */
+void piphoned_sdnotify(const char* format, ...) __attribute__((format(printf, 1, 2))); /*< Send a state like "READY=1" or "STATUS=..." to systemd */
+
+#endif
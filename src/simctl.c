@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <linphone/linphonecore.h>
+#include "simctl.h"
+#include "hwactions.h"
+#include "configfile.h"
+
+/**
+ * Drives the simulated hardware from commands read on the standard
+ * input, one per line:
+ *
+ *   dial DIGITS   Dial DIGITS on the rotary dial
+ *   keypad KEYS   Press KEYS on the touch-tone keypad
+ *   lift          Take the handset off the hook
+ *   hangup        Put the handset back on the hook
+ *   flash         Flash the hook switch
+ *   line N        Apply the following commands to line N (counting
+ *                 from 1 in the order of the [Line] sections)
+ *   quit          Terminate the daemon
+ *
+ * Commands apply to the first line until a "line" command says
+ * otherwise.
+ *
+ * End of input also terminates the daemon. This allows external
+ * programs like piphoned-sipbench to script the phone.
+ */
+
+static pthread_t s_thread;
+static bool s_running = false;
+
+static void* simctl_thread(void* arg);
+
+/**
+ * Starts the thread reading the commands. The simulated hardware
+ * must have been enabled with piphoned_hwactions_set_simulated().
+ */
+bool piphoned_simctl_start()
+{
+  if (pthread_create(&s_thread, NULL, simctl_thread, NULL) != 0) {
+    syslog(LOG_CRIT, "Failed to start hardware simulation thread: %m");
+    return false;
+  }
+
+  s_running = true;
+  return true;
+}
+
+/**
+ * Stops the command thread. It is usually blocked reading the
+ * standard input, hence it is cancelled rather than joined.
+ */
+void piphoned_simctl_stop()
+{
+  if (!s_running)
+    return;
+
+  pthread_cancel(s_thread);
+  pthread_join(s_thread, NULL);
+  s_running = false;
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static void* simctl_thread(void* arg)
+{
+  char line[512];
+  int phoneline = 0;
+
+  while (fgets(line, 512, stdin)) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strncmp(line, "dial ", 5) == 0) {
+      syslog(LOG_DEBUG, "Simulating dialing of %s.", line + 5);
+      piphoned_hwactions_simulate_digits(phoneline, line + 5);
+    }
+    else if (strncmp(line, "keypad ", 7) == 0) {
+      const char* key = NULL;
+
+      syslog(LOG_DEBUG, "Simulating keypad tones of %s.", line + 7);
+      for(key=line + 7; *key; key++)
+        piphoned_hwactions_keypad_digit(phoneline, *key);
+    }
+    else if (strcmp(line, "lift") == 0) {
+      syslog(LOG_DEBUG, "Simulating lifting of the handset.");
+      piphoned_hwactions_simulate_hook(phoneline, false);
+    }
+    else if (strcmp(line, "hangup") == 0) {
+      syslog(LOG_DEBUG, "Simulating hanging up.");
+      piphoned_hwactions_simulate_hook(phoneline, true);
+    }
+    else if (strcmp(line, "flash") == 0) {
+      syslog(LOG_DEBUG, "Simulating a hook flash.");
+      piphoned_hwactions_simulate_flash(phoneline);
+    }
+    else if (strncmp(line, "line ", 5) == 0) {
+      int number = atoi(line + 5);
+
+      if (number < 1 || number > g_piphoned_config_info.num_lines)
+        syslog(LOG_WARNING, "Ignoring selection of nonexistant line %d.", number);
+      else
+        phoneline = number - 1;
+    }
+    else if (strcmp(line, "quit") == 0) {
+      break;
+    }
+    else if (line[0] != '\0') {
+      syslog(LOG_WARNING, "Ignoring unknown hardware simulation command '%s'.", line);
+    }
+  }
+
+  syslog(LOG_NOTICE, "End of hardware simulation commands, terminating.");
+  kill(getpid(), SIGTERM);
+
+  return NULL;
+}
@@ -0,0 +1,8 @@
+#ifndef PIPHONED_SIMCTL_H
+#define PIPHONED_SIMCTL_H
+#include <stdbool.h>
+
+bool piphoned_simctl_start(); /*< Start reading hardware commands from stdin */
+void piphoned_simctl_stop();  /*< Stop reading them */
+
+#endif
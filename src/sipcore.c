@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "sipcore.h"
+#include "arena.h"
+
+/* All available backends */
+static const struct Piphoned_SipCore_Ops* s_backends[] = {
+  &g_piphoned_sipcore_linphone_ops,
+  &g_piphoned_sipcore_fake_ops,
+  NULL
+};
+
+/**
+ * Creates a new SIP core using the backend of the given name
+ * ("linphone" for the real thing, "fake" for the simulation used
+ * by the benchmark).
+ *
+ * \param backend Name of the backend to use.
+ * \param[in] p_callbacks Notification callbacks. Copied.
+ * \param[in] p_userdata Custom pointer stored in the `p_userdata`
+ *                       member of the returned instance.
+ *
+ * \returns the new instance, or NULL if the backend does not exist
+ * or failed to initialise.
+ */
+struct Piphoned_SipCore* piphoned_sipcore_new(const char* backend, const struct Piphoned_SipCore_Callbacks* p_callbacks, void* p_userdata)
+{
+  struct Piphoned_SipCore* p_core = NULL;
+  int i = 0;
+
+  for(i=0; s_backends[i]; i++) {
+    if (strcmp(s_backends[i]->name, backend) == 0)
+      break;
+  }
+
+  if (!s_backends[i]) {
+    syslog(LOG_CRIT, "Unknown SIP backend '%s'.", backend);
+    return NULL;
+  }
+
+  p_core = (struct Piphoned_SipCore*) piphoned_arena_alloc(sizeof(struct Piphoned_SipCore));
+  p_core->p_ops = s_backends[i];
+  p_core->callbacks = *p_callbacks;
+  p_core->p_userdata = p_userdata;
+
+  if (!p_core->p_ops->init(p_core)) {
+    syslog(LOG_CRIT, "Failed to initialise SIP backend '%s'.", backend);
+    piphoned_arena_release(p_core);
+    return NULL;
+  }
+
+  syslog(LOG_INFO, "Using SIP backend '%s'.", backend);
+  return p_core;
+}
+
+/**
+ * Shuts down the backend and frees the instance.
+ */
+void piphoned_sipcore_free(struct Piphoned_SipCore* p_core)
+{
+  if (!p_core)
+    return;
+
+  p_core->p_ops->free(p_core);
+  piphoned_arena_release(p_core);
+}
@@ -0,0 +1,171 @@
+#ifndef PIPHONED_SIPCORE_H
+#define PIPHONED_SIPCORE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <linphone/linphonecore.h>
+#include "configfile.h"
+
+/* Opaque handles. What they point to depends on the backend. */
+struct Piphoned_SipCall;
+struct Piphoned_SipProxy;
+struct Piphoned_SipCore;
+
+/* Maximum number of audio codecs a SIP core reports */
+#define PIPHONED_SIPCORE_MAX_CODECS 32
+
+/**
+ * An audio codec (payload type) of a SIP core, as far as choosing
+ * codecs is concerned.
+ */
+struct Piphoned_SipCore_Codec
+{
+  char mime[32]; /*< Encoding name, e.g. "opus" */
+  int rate;      /*< Clock rate in Hz */
+  int channels;  /*< Number of channels */
+  int bitrate;   /*< Typical bitrate in bit/s */
+  bool enabled;  /*< Is the codec offered in calls? */
+};
+
+/**
+ * How well the audio of a running call arrives.
+ */
+struct Piphoned_SipCore_CallStats
+{
+  float late_rate;        /*< Percentage of received packets that came too late to be played */
+  float loss_rate;        /*< Percentage of received packets that were lost */
+  float round_trip_delay; /*< Network round trip time in seconds; 0 if not measured yet */
+};
+
+/**
+ * Notifications from the SIP core. They are only ever delivered from
+ * within piphoned_sipcore_iterate() or from within one of the
+ * functions acting on calls, never from another thread. The states
+ * and reasons are the ones linphone uses, also for the fake backend.
+ */
+struct Piphoned_SipCore_Callbacks
+{
+  void (*registration_state_changed)(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, LinphoneRegistrationState rstate, const char* msg);
+  void (*call_state_changed)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, const char* msg);
+  void (*call_encryption_changed)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, bool is_encrypted, const char* p_authtoken);
+};
+
+/**
+ * The functions a SIP backend has to implement. Each backend exports
+ * one constant instance of this struct.
+ */
+struct Piphoned_SipCore_Ops
+{
+  const char* name; /*< Value of the `sip_backend` setting selecting this backend */
+
+  bool (*init)(struct Piphoned_SipCore* p_core);
+  void (*free)(struct Piphoned_SipCore* p_core);
+  void (*iterate)(struct Piphoned_SipCore* p_core);
+
+  void (*set_firewall_policy)(struct Piphoned_SipCore* p_core, LinphoneFirewallPolicy policy, const char* stunserver);
+  void (*set_ports)(struct Piphoned_SipCore* p_core, int sip_port, int audio_port);
+  void (*use_sound_files)(struct Piphoned_SipCore* p_core, const char* play_file, const char* record_file);
+  bool (*sound_device_can_capture)(struct Piphoned_SipCore* p_core, const char* device);
+  bool (*sound_device_can_playback)(struct Piphoned_SipCore* p_core, const char* device);
+  void (*set_sound_devices)(struct Piphoned_SipCore* p_core, const char* ring_device, const char* playback_device, const char* capture_device);
+  void (*enable_zrtp)(struct Piphoned_SipCore* p_core, const char* secrets_file);
+  void (*play_dtmf)(struct Piphoned_SipCore* p_core, char digit, int duration_ms);
+  void (*disable_ringback)(struct Piphoned_SipCore* p_core);
+  void (*disable_ring)(struct Piphoned_SipCore* p_core);
+  void (*enable_ringback)(struct Piphoned_SipCore* p_core);
+  void (*enable_ring)(struct Piphoned_SipCore* p_core);
+  int (*get_audio_codecs)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCore_Codec* codecs, int max);
+  void (*set_audio_codecs)(struct Piphoned_SipCore* p_core, const struct Piphoned_SipCore_Codec* codecs, int count);
+  double (*measure_codec)(struct Piphoned_SipCore* p_core, const struct Piphoned_SipCore_Codec* p_codec);
+  void (*set_sound_rate)(struct Piphoned_SipCore* p_core, int rate);
+  void (*set_jitter_buffer)(struct Piphoned_SipCore* p_core, int ms, int adaptive);
+  void (*set_echo_canceller)(struct Piphoned_SipCore* p_core, int tail_ms);
+
+  struct Piphoned_SipProxy* (*add_proxy)(struct Piphoned_SipCore* p_core, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig, bool is_default);
+  void (*edit_proxy)(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig);
+  void (*remove_proxy)(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy);
+  void (*set_default_proxy)(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy);
+  void (*unregister_proxy)(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy);
+  LinphoneRegistrationState (*get_proxy_state)(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy);
+  void (*detach_proxies)(struct Piphoned_SipCore* p_core);
+
+  struct Piphoned_SipCall* (*invite)(struct Piphoned_SipCore* p_core, const char* sip_uri);
+  void (*terminate_call)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+  void (*accept_call)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+  void (*decline_call)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneReason reason);
+  bool (*pause_call)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+  void (*resume_call)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call);
+  void (*send_dtmf)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, char digit, enum Piphoned_DtmfMethod method);
+  void (*ref_call)(struct Piphoned_SipCall* p_call);
+  void (*unref_call)(struct Piphoned_SipCall* p_call);
+  void (*set_call_userdata)(struct Piphoned_SipCall* p_call, void* p_userdata);
+  void* (*get_call_userdata)(struct Piphoned_SipCall* p_call);
+  void (*get_remote_address)(struct Piphoned_SipCall* p_call, char* target, size_t size);
+  const char* (*get_remote_username)(struct Piphoned_SipCall* p_call);
+  const char* (*get_remote_domain)(struct Piphoned_SipCall* p_call);
+  LinphoneMediaEncryption (*get_media_encryption)(struct Piphoned_SipCall* p_call);
+  LinphoneReason (*get_reason)(struct Piphoned_SipCall* p_call);
+  bool (*get_call_stats)(struct Piphoned_SipCall* p_call, struct Piphoned_SipCore_CallStats* p_stats);
+  void (*scale_call_bitrate)(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, int percent);
+  bool (*set_call_echo_cancellation)(struct Piphoned_SipCall* p_call, bool enable);
+  void (*set_authentication_token_verified)(struct Piphoned_SipCall* p_call, bool verified);
+};
+
+/**
+ * A SIP core instance: the backend operations, the callbacks to
+ * deliver notifications to and the backend's private data.
+ */
+struct Piphoned_SipCore
+{
+  const struct Piphoned_SipCore_Ops* p_ops;   /*< Backend implementation */
+  struct Piphoned_SipCore_Callbacks callbacks; /*< Where notifications go */
+  void* p_userdata;                            /*< Custom pointer for the callbacks */
+  void* p_backend;                             /*< Backend-private data */
+};
+
+/**
+ * How the simulated remote party of the fake backend reacts to
+ * outgoing calls.
+ */
+enum Piphoned_SipCore_FakeOutcome {
+  PIPHONED_SIPCORE_FAKE_ANSWER = 1, /* Ring, then answer */
+  PIPHONED_SIPCORE_FAKE_BUSY,       /* Reject as busy */
+  PIPHONED_SIPCORE_FAKE_NOANSWER,   /* Ring forever */
+  PIPHONED_SIPCORE_FAKE_ERROR       /* Fail immediately */
+};
+
+/**
+ * Timestamps of the most recent signalling the fake backend sent,
+ * for measuring latencies. Zero if it never happened.
+ */
+struct Piphoned_SipCore_FakeStats
+{
+  struct timespec last_invite; /*< When the last INVITE went out */
+  struct timespec last_bye;    /*< When the last BYE (or CANCEL) went out */
+  struct timespec last_accept; /*< When the last 200 OK to an INVITE went out */
+  struct timespec last_dtmf;   /*< When the last in-call digit went out */
+  unsigned long invites;       /*< Number of INVITEs sent */
+  unsigned long byes;          /*< Number of BYEs and CANCELs sent */
+  unsigned long incoming;      /*< Number of incoming calls delivered */
+  unsigned long accepts;       /*< Number of incoming calls accepted */
+  unsigned long declines;      /*< Number of incoming calls declined */
+  unsigned long dtmfs;         /*< Number of in-call digits sent */
+  unsigned int active_calls;   /*< Calls not released yet */
+};
+
+struct Piphoned_SipCore* piphoned_sipcore_new(const char* backend, const struct Piphoned_SipCore_Callbacks* p_callbacks, void* p_userdata);
+void piphoned_sipcore_free(struct Piphoned_SipCore* p_core);
+
+/* Scripting interface of the fake backend. These may be called from
+ * any thread; the resulting notifications are delivered from within
+ * the next piphoned_sipcore_iterate(). */
+void piphoned_sipcore_fake_set_outcome(struct Piphoned_SipCore* p_core, enum Piphoned_SipCore_FakeOutcome outcome, unsigned int ring_ms, unsigned int answer_ms);
+void piphoned_sipcore_fake_incoming_call(struct Piphoned_SipCore* p_core, const char* username, const char* domain);
+void piphoned_sipcore_fake_remote_hangup(struct Piphoned_SipCore* p_core);
+void piphoned_sipcore_fake_set_encryption(struct Piphoned_SipCore* p_core, bool is_encrypted, const char* p_authtoken);
+void piphoned_sipcore_fake_get_stats(struct Piphoned_SipCore* p_core, struct Piphoned_SipCore_FakeStats* p_stats);
+
+extern const struct Piphoned_SipCore_Ops g_piphoned_sipcore_linphone_ops;
+extern const struct Piphoned_SipCore_Ops g_piphoned_sipcore_fake_ops;
+
+#endif
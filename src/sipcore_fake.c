@@ -0,0 +1,1021 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "sipcore.h"
+#include "arena.h"
+
+/**
+ * The fake SIP backend. It simulates a SIP server and the remote
+ * parties of all calls without any network or sound device access,
+ * so that everything above the SIP core can be exercised and
+ * measured on any machine. What the remote side does is controlled
+ * through the piphoned_sipcore_fake_*() functions.
+ */
+
+#define MAX_EVENTS 64   /* Maximum number of pending timed events */
+#define MAX_COMMANDS 16 /* Maximum number of pending commands from other threads */
+#define MAX_CALLS 8     /* Maximum number of simultaneous calls */
+#define MAX_CALL_HANDLES (2 * MAX_CALLS) /* Calls, including released ones somebody still holds a reference to */
+#define MAX_PROXIES 32  /* Maximum number of proxies */
+#define REGISTRATION_DELAY 10 /* Simulated REGISTER round trip in milliseconds */
+#define FAKE_ROUND_TRIP 40    /* Simulated RTP round trip in milliseconds */
+
+/**
+ * The codecs the fake backend pretends to have, with their share of
+ * one core in percent as a Raspberry Pi 1 would roughly need it for
+ * encoding and decoding.
+ */
+static const struct {
+  struct Piphoned_SipCore_Codec codec;
+  double cost;
+} s_fake_codecs[] = {
+  {{"opus",  48000, 2, 20000,  true},  9.0},
+  {{"speex", 16000, 1, 28000,  true},  5.5},
+  {{"speex", 8000,  1, 15000,  true},  2.5},
+  {{"G722",  8000,  1, 64000,  false}, 1.2},
+  {{"GSM",   8000,  1, 13200,  true},  1.8},
+  {{"PCMU",  8000,  1, 64000,  true},  0.1},
+  {{"PCMA",  8000,  1, 64000,  true},  0.1}
+};
+#define NUM_FAKE_CODECS ((int) (sizeof(s_fake_codecs) / sizeof(s_fake_codecs[0])))
+
+struct Piphoned_SipCall
+{
+  int refcount;                     /*< References held on this call; 0 means the slot is free */
+  unsigned long serial;             /*< Creation order, for finding the most recent call */
+  LinphoneCallState state;          /*< Current state */
+  bool incoming;                    /*< Was this call initiated by the remote side? */
+  LinphoneMediaEncryption encryption; /*< Current media encryption */
+  LinphoneReason reason;            /*< Why the call failed or ended */
+  int bitrate_percent;              /*< Share of the codec's normal bitrate in use */
+  bool echo_cancellation;           /*< Is the echo canceller on? */
+  char username[128];               /*< User part of the remote address */
+  char domain[256];                 /*< Domain part of the remote address */
+  void* p_userdata;                 /*< Custom pointer of the user of the call */
+};
+
+struct Piphoned_SipProxy
+{
+  LinphoneRegistrationState state; /*< Current registration state */
+  bool removed;                    /*< Removed, waiting for its unregistration to be delivered */
+};
+
+enum FakeEventType {
+  FAKE_EVENT_CALL_STATE = 1,    /* Move a call into `cstate` */
+  FAKE_EVENT_REGISTRATION_STATE /* Move a proxy into `rstate` */
+};
+
+/**
+ * Something the simulated remote side does at a given time.
+ */
+struct FakeEvent
+{
+  struct timespec due;       /*< When to deliver */
+  unsigned long serial;      /*< Scheduling order, for events due at the same time */
+  enum FakeEventType type;
+  struct Piphoned_SipCall* p_call;   /*< For call events; holds a reference */
+  struct Piphoned_SipProxy* p_proxy; /*< For registration events */
+  LinphoneCallState cstate;
+  LinphoneRegistrationState rstate;
+};
+
+enum FakeCommandType {
+  FAKE_COMMAND_INCOMING = 1,
+  FAKE_COMMAND_REMOTE_HANGUP,
+  FAKE_COMMAND_ENCRYPTION
+};
+
+/**
+ * A request from the scripting interface, which may run in another
+ * thread than the one calling iterate().
+ */
+struct FakeCommand
+{
+  enum FakeCommandType type;
+  char username[128];
+  char domain[256];
+  bool is_encrypted;
+  char authtoken[32];
+};
+
+struct FakeBackend
+{
+  pthread_mutex_t mutex; /*< Protects `commands`, `num_commands`, the outcome settings and `stats` */
+  struct FakeCommand commands[MAX_COMMANDS];
+  int num_commands;
+  enum Piphoned_SipCore_FakeOutcome outcome;
+  unsigned int ring_ms;
+  unsigned int answer_ms;
+  struct Piphoned_SipCore_FakeStats stats;
+
+  /* Only touched by the thread calling the ops */
+  struct FakeEvent events[MAX_EVENTS];
+  int num_events;
+  struct Piphoned_SipCall call_pool[MAX_CALL_HANDLES]; /*< Storage for all calls, so that calls need no allocation */
+  struct Piphoned_SipCall* calls[MAX_CALLS]; /*< Live calls, each holding a reference */
+  struct Piphoned_SipProxy* proxies[MAX_PROXIES];
+  int num_proxies;
+  unsigned long next_serial; /*< Serial number for the next call or event */
+  struct Piphoned_SipCore_Codec codecs[NUM_FAKE_CODECS]; /*< Codecs in the order they are offered */
+};
+
+#define BACKEND(p_core) ((struct FakeBackend*) (p_core)->p_backend)
+
+static void schedule_call_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, unsigned int delay_ms);
+static void schedule_registration_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, LinphoneRegistrationState rstate, unsigned int delay_ms);
+static void set_call_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, const char* msg);
+static struct Piphoned_SipCall* new_call(struct Piphoned_SipCore* p_core, bool incoming, const char* username, const char* domain);
+static struct Piphoned_SipCall* current_call(struct Piphoned_SipCore* p_core);
+static bool call_is_over(const struct Piphoned_SipCall* p_call);
+static void run_command(struct Piphoned_SipCore* p_core, const struct FakeCommand* p_command);
+static void push_command(struct Piphoned_SipCore* p_core, const struct FakeCommand* p_command);
+static void add_milliseconds(struct timespec* p_time, unsigned int ms);
+static bool time_reached(const struct timespec* p_due, const struct timespec* p_now);
+static bool event_before(const struct FakeEvent* p_a, const struct FakeEvent* p_b);
+static bool same_codec(const struct Piphoned_SipCore_Codec* p_a, const struct Piphoned_SipCore_Codec* p_b);
+
+static bool fake_init(struct Piphoned_SipCore* p_core)
+{
+  struct FakeBackend* p_backend = (struct FakeBackend*) piphoned_arena_alloc(sizeof(struct FakeBackend));
+  int i = 0;
+
+  pthread_mutex_init(&p_backend->mutex, NULL);
+  p_backend->outcome   = PIPHONED_SIPCORE_FAKE_ANSWER;
+  p_backend->ring_ms   = 100;
+  p_backend->answer_ms = 100;
+
+  for(i=0; i < NUM_FAKE_CODECS; i++)
+    p_backend->codecs[i] = s_fake_codecs[i].codec;
+
+  p_core->p_backend = p_backend;
+  return true;
+}
+
+static void fake_free(struct Piphoned_SipCore* p_core)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  int i = 0;
+
+  for(i=0; i < p_backend->num_events; i++) {
+    if (p_backend->events[i].p_call)
+      p_core->p_ops->unref_call(p_backend->events[i].p_call);
+    else if (p_backend->events[i].p_proxy->removed)
+      piphoned_arena_release(p_backend->events[i].p_proxy);
+  }
+  for(i=0; i < MAX_CALLS; i++) {
+    if (p_backend->calls[i])
+      p_core->p_ops->unref_call(p_backend->calls[i]);
+  }
+  for(i=0; i < p_backend->num_proxies; i++)
+    piphoned_arena_release(p_backend->proxies[i]);
+
+  pthread_mutex_destroy(&p_backend->mutex);
+  piphoned_arena_release(p_backend);
+  p_core->p_backend = NULL;
+}
+
+/**
+ * Runs pending commands and delivers all timed events that are due.
+ */
+static void fake_iterate(struct Piphoned_SipCore* p_core)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct FakeCommand commands[MAX_COMMANDS];
+  int num_commands = 0;
+  struct timespec now;
+  int i = 0;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  num_commands = p_backend->num_commands;
+  memcpy(commands, p_backend->commands, num_commands * sizeof(struct FakeCommand));
+  p_backend->num_commands = 0;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  for(i=0; i < num_commands; i++)
+    run_command(p_core, &commands[i]);
+
+  /* Deliver due events in order. Delivering one may schedule
+   * others, so always search anew. */
+  while (true) {
+    struct FakeEvent event;
+    int next = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(i=0; i < p_backend->num_events; i++) {
+      if (time_reached(&p_backend->events[i].due, &now) && (next < 0 || event_before(&p_backend->events[i], &p_backend->events[next])))
+        next = i;
+    }
+
+    if (next < 0)
+      break;
+
+    event = p_backend->events[next];
+    p_backend->events[next] = p_backend->events[--p_backend->num_events];
+
+    if (event.type == FAKE_EVENT_REGISTRATION_STATE) {
+      event.p_proxy->state = event.rstate;
+      if (p_core->callbacks.registration_state_changed)
+        p_core->callbacks.registration_state_changed(p_core, event.p_proxy, event.rstate, "Simulated registration");
+      if (event.p_proxy->removed)
+        piphoned_arena_release(event.p_proxy);
+    }
+    else {
+      /* Events for calls that ended meanwhile are stale, except for
+       * the final release. */
+      if (!call_is_over(event.p_call) || event.cstate == LinphoneCallReleased)
+        set_call_state(p_core, event.p_call, event.cstate, "Simulated call state");
+
+      p_core->p_ops->unref_call(event.p_call);
+    }
+  }
+}
+
+static void fake_set_firewall_policy(struct Piphoned_SipCore* p_core, LinphoneFirewallPolicy policy, const char* stunserver)
+{
+}
+
+static void fake_set_ports(struct Piphoned_SipCore* p_core, int sip_port, int audio_port)
+{
+}
+
+static void fake_use_sound_files(struct Piphoned_SipCore* p_core, const char* play_file, const char* record_file)
+{
+}
+
+static bool fake_sound_device_can_capture(struct Piphoned_SipCore* p_core, const char* device)
+{
+  return true;
+}
+
+static bool fake_sound_device_can_playback(struct Piphoned_SipCore* p_core, const char* device)
+{
+  return true;
+}
+
+static void fake_set_sound_devices(struct Piphoned_SipCore* p_core, const char* ring_device, const char* playback_device, const char* capture_device)
+{
+}
+
+static void fake_enable_zrtp(struct Piphoned_SipCore* p_core, const char* secrets_file)
+{
+}
+
+static void fake_play_dtmf(struct Piphoned_SipCore* p_core, char digit, int duration_ms)
+{
+}
+
+static void fake_disable_ringback(struct Piphoned_SipCore* p_core)
+{
+}
+
+static void fake_disable_ring(struct Piphoned_SipCore* p_core)
+{
+}
+
+static void fake_enable_ringback(struct Piphoned_SipCore* p_core)
+{
+}
+
+static void fake_enable_ring(struct Piphoned_SipCore* p_core)
+{
+}
+
+static void fake_set_sound_rate(struct Piphoned_SipCore* p_core, int rate)
+{
+}
+
+static void fake_set_jitter_buffer(struct Piphoned_SipCore* p_core, int ms, int adaptive)
+{
+}
+
+static void fake_set_echo_canceller(struct Piphoned_SipCore* p_core, int tail_ms)
+{
+}
+
+static int fake_get_audio_codecs(struct Piphoned_SipCore* p_core, struct Piphoned_SipCore_Codec* codecs, int max)
+{
+  int count = NUM_FAKE_CODECS < max ? NUM_FAKE_CODECS : max;
+
+  memcpy(codecs, BACKEND(p_core)->codecs, count * sizeof(struct Piphoned_SipCore_Codec));
+  return count;
+}
+
+static void fake_set_audio_codecs(struct Piphoned_SipCore* p_core, const struct Piphoned_SipCore_Codec* codecs, int count)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct Piphoned_SipCore_Codec ordered[NUM_FAKE_CODECS];
+  bool taken[NUM_FAKE_CODECS] = {false};
+  int num_ordered = 0;
+  int i = 0;
+  int j = 0;
+
+  for(i=0; i < count; i++) {
+    for(j=0; j < NUM_FAKE_CODECS; j++) {
+      if (!taken[j] && same_codec(&codecs[i], &p_backend->codecs[j])) {
+        ordered[num_ordered] = p_backend->codecs[j];
+        ordered[num_ordered++].enabled = codecs[i].enabled;
+        taken[j] = true;
+        break;
+      }
+    }
+  }
+  for(j=0; j < NUM_FAKE_CODECS; j++) {
+    if (!taken[j])
+      ordered[num_ordered++] = p_backend->codecs[j];
+  }
+
+  memcpy(p_backend->codecs, ordered, sizeof(ordered));
+}
+
+static double fake_measure_codec(struct Piphoned_SipCore* p_core, const struct Piphoned_SipCore_Codec* p_codec)
+{
+  int i = 0;
+
+  for(i=0; i < NUM_FAKE_CODECS; i++) {
+    if (same_codec(p_codec, &s_fake_codecs[i].codec))
+      return s_fake_codecs[i].cost;
+  }
+
+  return -1.0;
+}
+
+static struct Piphoned_SipProxy* fake_add_proxy(struct Piphoned_SipCore* p_core, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig, bool is_default)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct Piphoned_SipProxy* p_proxy = NULL;
+
+  if (p_backend->num_proxies >= MAX_PROXIES) {
+    syslog(LOG_ERR, "Fake SIP backend supports only %d proxies.", MAX_PROXIES);
+    return NULL;
+  }
+
+  p_proxy = (struct Piphoned_SipProxy*) piphoned_arena_alloc(sizeof(struct Piphoned_SipProxy));
+  p_proxy->state = LinphoneRegistrationNone;
+  p_backend->proxies[p_backend->num_proxies++] = p_proxy;
+
+  schedule_registration_state(p_core, p_proxy, LinphoneRegistrationProgress, 0);
+  schedule_registration_state(p_core, p_proxy, LinphoneRegistrationOk, REGISTRATION_DELAY);
+
+  return p_proxy;
+}
+
+static void fake_edit_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig)
+{
+  schedule_registration_state(p_core, p_proxy, LinphoneRegistrationProgress, 0);
+  schedule_registration_state(p_core, p_proxy, LinphoneRegistrationOk, REGISTRATION_DELAY);
+}
+
+/**
+ * Unregisters the proxy and forgets it, making room for another. It
+ * is freed once the unregistration was delivered, which is the only
+ * event left for it.
+ */
+static void fake_remove_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  int i = 0;
+
+  for(i=0; i < p_backend->num_proxies && p_backend->proxies[i] != p_proxy; i++)
+    ;
+  if (i == p_backend->num_proxies)
+    return;
+
+  memmove(&p_backend->proxies[i], &p_backend->proxies[i + 1], (p_backend->num_proxies - i - 1) * sizeof(struct Piphoned_SipProxy*));
+  p_backend->num_proxies--;
+
+  /* Registration states still on their way are moot */
+  for(i=p_backend->num_events - 1; i >= 0; i--) {
+    if (p_backend->events[i].type == FAKE_EVENT_REGISTRATION_STATE && p_backend->events[i].p_proxy == p_proxy)
+      p_backend->events[i] = p_backend->events[--p_backend->num_events];
+  }
+
+  if (p_backend->num_events >= MAX_EVENTS) {
+    piphoned_arena_release(p_proxy);
+    return;
+  }
+
+  p_proxy->removed = true;
+  schedule_registration_state(p_core, p_proxy, LinphoneRegistrationCleared, REGISTRATION_DELAY);
+}
+
+static void fake_set_default_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  /* Simulated calls do not go through a proxy */
+}
+
+static void fake_unregister_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  schedule_registration_state(p_core, p_proxy, LinphoneRegistrationCleared, REGISTRATION_DELAY);
+}
+
+static void fake_detach_proxies(struct Piphoned_SipCore* p_core)
+{
+  /* No registrar keeps our bindings */
+}
+
+static LinphoneRegistrationState fake_get_proxy_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  return p_proxy->state;
+}
+
+/**
+ * Places a simulated call. The remote side reacts as configured with
+ * piphoned_sipcore_fake_set_outcome().
+ */
+static struct Piphoned_SipCall* fake_invite(struct Piphoned_SipCore* p_core, const char* sip_uri)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct Piphoned_SipCall* p_call = NULL;
+  enum Piphoned_SipCore_FakeOutcome outcome;
+  unsigned int ring_ms = 0;
+  unsigned int answer_ms = 0;
+  char username[128];
+  char domain[256];
+
+  memset(username, '\0', 128);
+  memset(domain, '\0', 256);
+  if (sscanf(sip_uri, "sip:%127[^@]@%255s", username, domain) < 1) {
+    syslog(LOG_ERR, "Fake SIP backend cannot parse SIP URI '%s'.", sip_uri);
+    return NULL;
+  }
+
+  p_call = new_call(p_core, false, username, domain);
+  if (!p_call)
+    return NULL;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  outcome   = p_backend->outcome;
+  ring_ms   = p_backend->ring_ms;
+  answer_ms = p_backend->answer_ms;
+  clock_gettime(CLOCK_MONOTONIC, &p_backend->stats.last_invite);
+  p_backend->stats.invites++;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  set_call_state(p_core, p_call, LinphoneCallOutgoingInit, "Starting outgoing call");
+  schedule_call_state(p_core, p_call, LinphoneCallOutgoingProgress, 0);
+
+  switch (outcome) {
+  case PIPHONED_SIPCORE_FAKE_ANSWER:
+    schedule_call_state(p_core, p_call, LinphoneCallOutgoingRinging, ring_ms);
+    schedule_call_state(p_core, p_call, LinphoneCallConnected, ring_ms + answer_ms);
+    schedule_call_state(p_core, p_call, LinphoneCallStreamsRunning, ring_ms + answer_ms);
+    break;
+  case PIPHONED_SIPCORE_FAKE_BUSY:
+    p_call->reason = LinphoneReasonBusy;
+    schedule_call_state(p_core, p_call, LinphoneCallError, ring_ms);
+    break;
+  case PIPHONED_SIPCORE_FAKE_NOANSWER:
+    schedule_call_state(p_core, p_call, LinphoneCallOutgoingRinging, ring_ms);
+    break;
+  case PIPHONED_SIPCORE_FAKE_ERROR:
+    p_call->reason = LinphoneReasonNotFound;
+    schedule_call_state(p_core, p_call, LinphoneCallError, 0);
+    break;
+  }
+
+  return p_call;
+}
+
+static void fake_terminate_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (call_is_over(p_call))
+    return;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &p_backend->stats.last_bye);
+  p_backend->stats.byes++;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  set_call_state(p_core, p_call, LinphoneCallEnd, "Call terminated");
+}
+
+static void fake_accept_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (p_call->state != LinphoneCallIncomingReceived)
+    return;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &p_backend->stats.last_accept);
+  p_backend->stats.accepts++;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  set_call_state(p_core, p_call, LinphoneCallConnected, "Connected");
+  schedule_call_state(p_core, p_call, LinphoneCallStreamsRunning, 0);
+}
+
+static void fake_decline_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneReason reason)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (call_is_over(p_call))
+    return;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  p_backend->stats.declines++;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  set_call_state(p_core, p_call, LinphoneCallEnd, "Call declined");
+}
+
+/**
+ * Puts a running call on hold. The remote side confirms at once.
+ * Returns false if the call is not running.
+ */
+static bool fake_pause_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  if (p_call->state != LinphoneCallStreamsRunning && p_call->state != LinphoneCallConnected)
+    return false;
+
+  set_call_state(p_core, p_call, LinphoneCallPausing, "Pausing call");
+  schedule_call_state(p_core, p_call, LinphoneCallPaused, 0);
+  return true;
+}
+
+static void fake_resume_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  if (p_call->state != LinphoneCallPaused && p_call->state != LinphoneCallPausing)
+    return;
+
+  set_call_state(p_core, p_call, LinphoneCallResuming, "Resuming call");
+  schedule_call_state(p_core, p_call, LinphoneCallStreamsRunning, 0);
+}
+
+static void fake_send_dtmf(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, char digit, enum Piphoned_DtmfMethod method)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (p_call->state != LinphoneCallStreamsRunning && p_call->state != LinphoneCallConnected)
+    return;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &p_backend->stats.last_dtmf);
+  p_backend->stats.dtmfs++;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  syslog(LOG_DEBUG, "Fake SIP backend sending digit %c by %s.", digit, method == PIPHONED_DTMF_SIP_INFO ? "SIP INFO" : "RFC 2833");
+}
+
+static void fake_ref_call(struct Piphoned_SipCall* p_call)
+{
+  p_call->refcount++;
+}
+
+/**
+ * Drops a reference. The call's slot in the pool becomes free when
+ * the last one is gone.
+ */
+static void fake_unref_call(struct Piphoned_SipCall* p_call)
+{
+  p_call->refcount--;
+}
+
+static void fake_set_call_userdata(struct Piphoned_SipCall* p_call, void* p_userdata)
+{
+  p_call->p_userdata = p_userdata;
+}
+
+static void* fake_get_call_userdata(struct Piphoned_SipCall* p_call)
+{
+  return p_call->p_userdata;
+}
+
+static void fake_get_remote_address(struct Piphoned_SipCall* p_call, char* target, size_t size)
+{
+  snprintf(target, size, "sip:%s@%s", p_call->username, p_call->domain);
+}
+
+static const char* fake_get_remote_username(struct Piphoned_SipCall* p_call)
+{
+  return p_call->username;
+}
+
+static const char* fake_get_remote_domain(struct Piphoned_SipCall* p_call)
+{
+  return p_call->domain;
+}
+
+static LinphoneMediaEncryption fake_get_media_encryption(struct Piphoned_SipCall* p_call)
+{
+  return p_call->encryption;
+}
+
+static LinphoneReason fake_get_reason(struct Piphoned_SipCall* p_call)
+{
+  return p_call->reason;
+}
+
+/**
+ * The simulated network delivers every packet in time, with the
+ * round trip time of a typical DSL line.
+ */
+static bool fake_get_call_stats(struct Piphoned_SipCall* p_call, struct Piphoned_SipCore_CallStats* p_stats)
+{
+  p_stats->late_rate = 0.0f;
+  p_stats->loss_rate = 0.0f;
+  p_stats->round_trip_delay = FAKE_ROUND_TRIP / 1000.0f;
+  return true;
+}
+
+static void fake_scale_call_bitrate(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, int percent)
+{
+  if (p_call)
+    p_call->bitrate_percent = percent;
+}
+
+static bool fake_set_call_echo_cancellation(struct Piphoned_SipCall* p_call, bool enable)
+{
+  bool was_enabled = p_call->echo_cancellation;
+
+  p_call->echo_cancellation = enable;
+  return was_enabled;
+}
+
+static void fake_set_authentication_token_verified(struct Piphoned_SipCall* p_call, bool verified)
+{
+}
+
+/***************************************
+ * Scripting interface
+ ***************************************/
+
+/**
+ * Sets how the remote side reacts to the following outgoing calls.
+ *
+ * \param outcome   What the remote party does.
+ * \param ring_ms   Milliseconds from the INVITE until the remote
+ *                  side rings (or rejects the call).
+ * \param answer_ms Milliseconds from ringing until the remote side
+ *                  answers, if it does.
+ */
+void piphoned_sipcore_fake_set_outcome(struct Piphoned_SipCore* p_core, enum Piphoned_SipCore_FakeOutcome outcome, unsigned int ring_ms, unsigned int answer_ms)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (p_core->p_ops != &g_piphoned_sipcore_fake_ops)
+    return;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  p_backend->outcome   = outcome;
+  p_backend->ring_ms   = ring_ms;
+  p_backend->answer_ms = answer_ms;
+  pthread_mutex_unlock(&p_backend->mutex);
+}
+
+/**
+ * Simulates an incoming call from `username`@`domain`.
+ */
+void piphoned_sipcore_fake_incoming_call(struct Piphoned_SipCore* p_core, const char* username, const char* domain)
+{
+  struct FakeCommand command;
+
+  memset(&command, '\0', sizeof(struct FakeCommand));
+  command.type = FAKE_COMMAND_INCOMING;
+  strncpy(command.username, username, 127);
+  strncpy(command.domain, domain, 255);
+
+  push_command(p_core, &command);
+}
+
+/**
+ * Makes the remote side of the most recent unfinished call hang up
+ * (or give up, if the call has not been answered yet).
+ */
+void piphoned_sipcore_fake_remote_hangup(struct Piphoned_SipCore* p_core)
+{
+  struct FakeCommand command;
+
+  memset(&command, '\0', sizeof(struct FakeCommand));
+  command.type = FAKE_COMMAND_REMOTE_HANGUP;
+
+  push_command(p_core, &command);
+}
+
+/**
+ * Changes the encryption of the most recent unfinished call, as if
+ * ZRTP had been negotiated (or dropped).
+ */
+void piphoned_sipcore_fake_set_encryption(struct Piphoned_SipCore* p_core, bool is_encrypted, const char* p_authtoken)
+{
+  struct FakeCommand command;
+
+  memset(&command, '\0', sizeof(struct FakeCommand));
+  command.type = FAKE_COMMAND_ENCRYPTION;
+  command.is_encrypted = is_encrypted;
+  if (p_authtoken)
+    strncpy(command.authtoken, p_authtoken, 31);
+
+  push_command(p_core, &command);
+}
+
+/**
+ * Copies the signalling statistics into `p_stats`.
+ */
+void piphoned_sipcore_fake_get_stats(struct Piphoned_SipCore* p_core, struct Piphoned_SipCore_FakeStats* p_stats)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (p_core->p_ops != &g_piphoned_sipcore_fake_ops) {
+    memset(p_stats, '\0', sizeof(struct Piphoned_SipCore_FakeStats));
+    return;
+  }
+
+  pthread_mutex_lock(&p_backend->mutex);
+  *p_stats = p_backend->stats;
+  pthread_mutex_unlock(&p_backend->mutex);
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static void push_command(struct Piphoned_SipCore* p_core, const struct FakeCommand* p_command)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+
+  if (p_core->p_ops != &g_piphoned_sipcore_fake_ops)
+    return;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  if (p_backend->num_commands < MAX_COMMANDS)
+    p_backend->commands[p_backend->num_commands++] = *p_command;
+  else
+    syslog(LOG_ERR, "Fake SIP backend command queue full, dropping command %d.", p_command->type);
+  pthread_mutex_unlock(&p_backend->mutex);
+}
+
+static void run_command(struct Piphoned_SipCore* p_core, const struct FakeCommand* p_command)
+{
+  struct Piphoned_SipCall* p_call = NULL;
+
+  switch (p_command->type) {
+  case FAKE_COMMAND_INCOMING:
+    p_call = new_call(p_core, true, p_command->username, p_command->domain);
+    if (p_call) {
+      pthread_mutex_lock(&BACKEND(p_core)->mutex);
+      BACKEND(p_core)->stats.incoming++;
+      pthread_mutex_unlock(&BACKEND(p_core)->mutex);
+
+      set_call_state(p_core, p_call, LinphoneCallIncomingReceived, "Incoming call");
+    }
+    break;
+  case FAKE_COMMAND_REMOTE_HANGUP:
+    p_call = current_call(p_core);
+    if (p_call)
+      set_call_state(p_core, p_call, LinphoneCallEnd, "Call ended by remote side");
+    break;
+  case FAKE_COMMAND_ENCRYPTION:
+    p_call = current_call(p_core);
+    if (p_call) {
+      p_call->encryption = p_command->is_encrypted ? LinphoneMediaEncryptionZRTP : LinphoneMediaEncryptionNone;
+      if (p_core->callbacks.call_encryption_changed)
+        p_core->callbacks.call_encryption_changed(p_core, p_call, p_command->is_encrypted, strlen(p_command->authtoken) > 0 ? p_command->authtoken : NULL);
+    }
+    break;
+  }
+}
+
+/**
+ * Creates a call and registers it as live. The backend holds one
+ * reference until the call is released.
+ */
+static struct Piphoned_SipCall* new_call(struct Piphoned_SipCore* p_core, bool incoming, const char* username, const char* domain)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct Piphoned_SipCall* p_call = NULL;
+  int i = 0;
+  int j = 0;
+
+  for(i=0; i < MAX_CALLS && p_backend->calls[i]; i++)
+    ;
+
+  if (i >= MAX_CALLS) {
+    syslog(LOG_ERR, "Fake SIP backend supports only %d simultaneous calls.", MAX_CALLS);
+    return NULL;
+  }
+
+  for(j=0; j < MAX_CALL_HANDLES && p_backend->call_pool[j].refcount > 0; j++)
+    ;
+
+  if (j >= MAX_CALL_HANDLES) {
+    syslog(LOG_ERR, "Fake SIP backend ran out of call handles; somebody leaks call references.");
+    return NULL;
+  }
+
+  p_call = &p_backend->call_pool[j];
+  memset(p_call, '\0', sizeof(struct Piphoned_SipCall));
+  p_call->refcount   = 1;
+  p_call->serial     = p_backend->next_serial++;
+  p_call->state      = LinphoneCallIdle;
+  p_call->incoming   = incoming;
+  p_call->encryption = LinphoneMediaEncryptionNone;
+  p_call->reason = LinphoneReasonNone;
+  p_call->bitrate_percent = 100;
+  p_call->echo_cancellation = true;
+  strncpy(p_call->username, username, 127);
+  strncpy(p_call->domain, domain, 255);
+
+  p_backend->calls[i] = p_call;
+
+  pthread_mutex_lock(&p_backend->mutex);
+  p_backend->stats.active_calls++;
+  pthread_mutex_unlock(&p_backend->mutex);
+
+  return p_call;
+}
+
+/**
+ * The most recently created call that has not ended yet.
+ */
+static struct Piphoned_SipCall* current_call(struct Piphoned_SipCore* p_core)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct Piphoned_SipCall* p_current = NULL;
+  int i = 0;
+
+  for(i=0; i < MAX_CALLS; i++) {
+    struct Piphoned_SipCall* p_call = p_backend->calls[i];
+
+    if (p_call && !call_is_over(p_call) && (!p_current || p_call->serial > p_current->serial))
+      p_current = p_call;
+  }
+
+  return p_current;
+}
+
+static bool call_is_over(const struct Piphoned_SipCall* p_call)
+{
+  return p_call->state == LinphoneCallEnd || p_call->state == LinphoneCallError || p_call->state == LinphoneCallReleased;
+}
+
+/**
+ * Moves the call into the given state and notifies the callback. A
+ * call that ends is released shortly after, like linphone does.
+ */
+static void set_call_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, const char* msg)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  int i = 0;
+
+  p_call->state = cstate;
+
+  /* Keep the call alive during the callback */
+  fake_ref_call(p_call);
+
+  if (p_core->callbacks.call_state_changed)
+    p_core->callbacks.call_state_changed(p_core, p_call, cstate, msg);
+
+  if (cstate == LinphoneCallEnd || cstate == LinphoneCallError) {
+    schedule_call_state(p_core, p_call, LinphoneCallReleased, 0);
+  }
+  else if (cstate == LinphoneCallReleased) {
+    for(i=0; i < MAX_CALLS; i++) {
+      if (p_backend->calls[i] == p_call) {
+        p_backend->calls[i] = NULL;
+        fake_unref_call(p_call); /* The backend's own reference */
+
+        pthread_mutex_lock(&p_backend->mutex);
+        p_backend->stats.active_calls--;
+        pthread_mutex_unlock(&p_backend->mutex);
+        break;
+      }
+    }
+  }
+
+  fake_unref_call(p_call);
+}
+
+static void schedule_call_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneCallState cstate, unsigned int delay_ms)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct FakeEvent* p_event = NULL;
+
+  if (p_backend->num_events >= MAX_EVENTS) {
+    syslog(LOG_ERR, "Fake SIP backend event queue full, dropping call state %d.", cstate);
+    return;
+  }
+
+  p_event = &p_backend->events[p_backend->num_events++];
+  memset(p_event, '\0', sizeof(struct FakeEvent));
+  clock_gettime(CLOCK_MONOTONIC, &p_event->due);
+  add_milliseconds(&p_event->due, delay_ms);
+  p_event->serial = p_backend->next_serial++;
+  p_event->type   = FAKE_EVENT_CALL_STATE;
+  p_event->p_call = p_call;
+  p_event->cstate = cstate;
+
+  fake_ref_call(p_call); /* Released after delivery */
+}
+
+static void schedule_registration_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, LinphoneRegistrationState rstate, unsigned int delay_ms)
+{
+  struct FakeBackend* p_backend = BACKEND(p_core);
+  struct FakeEvent* p_event = NULL;
+
+  if (p_backend->num_events >= MAX_EVENTS) {
+    syslog(LOG_ERR, "Fake SIP backend event queue full, dropping registration state %d.", rstate);
+    return;
+  }
+
+  p_event = &p_backend->events[p_backend->num_events++];
+  memset(p_event, '\0', sizeof(struct FakeEvent));
+  clock_gettime(CLOCK_MONOTONIC, &p_event->due);
+  add_milliseconds(&p_event->due, delay_ms);
+  p_event->serial  = p_backend->next_serial++;
+  p_event->type    = FAKE_EVENT_REGISTRATION_STATE;
+  p_event->p_proxy = p_proxy;
+  p_event->rstate  = rstate;
+}
+
+static void add_milliseconds(struct timespec* p_time, unsigned int ms)
+{
+  p_time->tv_sec  += ms / 1000;
+  p_time->tv_nsec += (ms % 1000) * 1000000L;
+  if (p_time->tv_nsec >= 1000000000L) {
+    p_time->tv_sec++;
+    p_time->tv_nsec -= 1000000000L;
+  }
+}
+
+/**
+ * Is `p_due` at or before `p_now`?
+ */
+static bool time_reached(const struct timespec* p_due, const struct timespec* p_now)
+{
+  return p_due->tv_sec < p_now->tv_sec || (p_due->tv_sec == p_now->tv_sec && p_due->tv_nsec <= p_now->tv_nsec);
+}
+
+/**
+ * Is event `p_a` to be delivered before event `p_b`?
+ */
+static bool event_before(const struct FakeEvent* p_a, const struct FakeEvent* p_b)
+{
+  if (p_a->due.tv_sec != p_b->due.tv_sec || p_a->due.tv_nsec != p_b->due.tv_nsec)
+    return time_reached(&p_a->due, &p_b->due);
+
+  return p_a->serial < p_b->serial;
+}
+
+static bool same_codec(const struct Piphoned_SipCore_Codec* p_a, const struct Piphoned_SipCore_Codec* p_b)
+{
+  return strcasecmp(p_a->mime, p_b->mime) == 0 && p_a->rate == p_b->rate && p_a->channels == p_b->channels;
+}
+
+const struct Piphoned_SipCore_Ops g_piphoned_sipcore_fake_ops = {
+  .name = "fake",
+  .init = fake_init,
+  .free = fake_free,
+  .iterate = fake_iterate,
+  .set_firewall_policy = fake_set_firewall_policy,
+  .set_ports = fake_set_ports,
+  .use_sound_files = fake_use_sound_files,
+  .sound_device_can_capture = fake_sound_device_can_capture,
+  .sound_device_can_playback = fake_sound_device_can_playback,
+  .set_sound_devices = fake_set_sound_devices,
+  .enable_zrtp = fake_enable_zrtp,
+  .play_dtmf = fake_play_dtmf,
+  .disable_ringback = fake_disable_ringback,
+  .disable_ring = fake_disable_ring,
+  .enable_ringback = fake_enable_ringback,
+  .enable_ring = fake_enable_ring,
+  .get_audio_codecs = fake_get_audio_codecs,
+  .set_audio_codecs = fake_set_audio_codecs,
+  .measure_codec = fake_measure_codec,
+  .set_sound_rate = fake_set_sound_rate,
+  .set_jitter_buffer = fake_set_jitter_buffer,
+  .set_echo_canceller = fake_set_echo_canceller,
+  .add_proxy = fake_add_proxy,
+  .edit_proxy = fake_edit_proxy,
+  .remove_proxy = fake_remove_proxy,
+  .set_default_proxy = fake_set_default_proxy,
+  .unregister_proxy = fake_unregister_proxy,
+  .detach_proxies = fake_detach_proxies,
+  .get_proxy_state = fake_get_proxy_state,
+  .invite = fake_invite,
+  .terminate_call = fake_terminate_call,
+  .accept_call = fake_accept_call,
+  .decline_call = fake_decline_call,
+  .pause_call = fake_pause_call,
+  .resume_call = fake_resume_call,
+  .send_dtmf = fake_send_dtmf,
+  .ref_call = fake_ref_call,
+  .unref_call = fake_unref_call,
+  .set_call_userdata = fake_set_call_userdata,
+  .get_call_userdata = fake_get_call_userdata,
+  .get_remote_address = fake_get_remote_address,
+  .get_remote_username = fake_get_remote_username,
+  .get_remote_domain = fake_get_remote_domain,
+  .get_media_encryption = fake_get_media_encryption,
+  .get_reason = fake_get_reason,
+  .get_call_stats = fake_get_call_stats,
+  .scale_call_bitrate = fake_scale_call_bitrate,
+  .set_call_echo_cancellation = fake_set_call_echo_cancellation,
+  .set_authentication_token_verified = fake_set_authentication_token_verified
+};
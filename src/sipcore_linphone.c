@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <math.h>
+#include <linux/limits.h>
+#include <mediastreamer2/msfilter.h>
+#include <mediastreamer2/msticker.h>
+#include "sipcore.h"
+#include "configfile.h"
+#include "commandline.h"
+#include "arena.h"
+
+/**
+ * Private data of the linphone backend. Calls and proxies are the
+ * linphone objects themselves, cast to the opaque handle types.
+ */
+struct LinphoneBackend
+{
+  LinphoneCoreVTable vtable; /*< Linphone callback table */
+  LinphoneCore* p_linphone;  /*< Linphone Core object */
+  PayloadType* p_scaled_pt;  /*< Codec whose bitrate scale_call_bitrate() lowered; NULL if none */
+  int unscaled_bitrate;      /*< Bitrate of `p_scaled_pt` before, in bit/s */
+  char ringback[PATH_MAX];   /*< linphone's ringback tone before disable_ringback(); empty if enabled */
+  char ring[PATH_MAX];       /*< linphone's ring tone before disable_ring(); empty if enabled */
+};
+
+#define BACKEND(p_core) ((struct LinphoneBackend*) (p_core)->p_backend)
+#define LINPHONE(p_core) (BACKEND(p_core)->p_linphone)
+#define CALL(p_call) ((LinphoneCall*) (p_call))
+#define PROXY(p_proxy) ((LinphoneProxyConfig*) (p_proxy))
+
+/* Mediastreamer's ALSA card has no header of its own; linphone
+ * declares this the same way. */
+extern void ms_alsa_card_set_forced_sample_rate(int samplerate);
+
+#define CODEC_TEST_SECONDS 2  /* Length of the test signal measure_codec() pushes through a codec */
+#define CODEC_TEST_FRAME_MS 20 /* Packet time of the test signal */
+
+static void registration_state_changed(LinphoneCore* p_linphone, LinphoneProxyConfig* p_proxy, LinphoneRegistrationState rstate, const char* msg);
+static void call_state_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, LinphoneCallState cstate, const char* msg);
+static void call_encryption_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, bool_t is_encrypted, const char* p_authtoken);
+static MSFilter* create_codec_filter(const struct Piphoned_SipCore_Codec* p_codec, bool encoder);
+static double thread_cpu_seconds();
+
+static bool lp_init(struct Piphoned_SipCore* p_core)
+{
+  struct LinphoneBackend* p_backend = (struct LinphoneBackend*) piphoned_arena_alloc(sizeof(struct LinphoneBackend));
+
+  /* Disable ORTP logs if running as a daemon.
+   * Otherwise output them to stdout. */
+  if (g_cli_options.daemonize)
+    linphone_core_set_log_level(0);
+  else
+    linphone_core_set_log_file(NULL);
+
+  /* Setup linphone callbacks */
+  p_backend->vtable.registration_state_changed = registration_state_changed;
+  p_backend->vtable.call_state_changed = call_state_changed;
+  p_backend->vtable.call_encryption_changed = call_encryption_changed;
+
+  p_backend->p_linphone = linphone_core_new(&p_backend->vtable, NULL, NULL, p_core);
+  if (!p_backend->p_linphone) {
+    piphoned_arena_release(p_backend);
+    return false;
+  }
+
+  p_core->p_backend = p_backend;
+  return true;
+}
+
+static void lp_free(struct Piphoned_SipCore* p_core)
+{
+  linphone_core_destroy(LINPHONE(p_core));
+  piphoned_arena_release(p_core->p_backend);
+  p_core->p_backend = NULL;
+}
+
+static void lp_iterate(struct Piphoned_SipCore* p_core)
+{
+  linphone_core_iterate(LINPHONE(p_core));
+}
+
+static void lp_set_firewall_policy(struct Piphoned_SipCore* p_core, LinphoneFirewallPolicy policy, const char* stunserver)
+{
+  if (policy == LinphonePolicyUseStun)
+    linphone_core_set_stun_server(LINPHONE(p_core), stunserver);
+
+  linphone_core_set_firewall_policy(LINPHONE(p_core), policy);
+}
+
+/**
+ * Sets the local UDP ports for SIP and RTP audio. A port of 0 keeps
+ * linphone's default.
+ */
+static void lp_set_ports(struct Piphoned_SipCore* p_core, int sip_port, int audio_port)
+{
+  if (sip_port > 0)
+    linphone_core_set_sip_port(LINPHONE(p_core), sip_port);
+  if (audio_port > 0)
+    linphone_core_set_audio_port(LINPHONE(p_core), audio_port);
+}
+
+/**
+ * Makes linphone play `play_file` to the remote side and record the
+ * remote side into `record_file` instead of using the sound card.
+ */
+static void lp_use_sound_files(struct Piphoned_SipCore* p_core, const char* play_file, const char* record_file)
+{
+  linphone_core_set_use_files(LINPHONE(p_core), TRUE);
+  linphone_core_set_play_file(LINPHONE(p_core), play_file);
+  linphone_core_set_record_file(LINPHONE(p_core), record_file);
+}
+
+static bool lp_sound_device_can_capture(struct Piphoned_SipCore* p_core, const char* device)
+{
+  return linphone_core_sound_device_can_capture(LINPHONE(p_core), device);
+}
+
+static bool lp_sound_device_can_playback(struct Piphoned_SipCore* p_core, const char* device)
+{
+  return linphone_core_sound_device_can_playback(LINPHONE(p_core), device);
+}
+
+static void lp_set_sound_devices(struct Piphoned_SipCore* p_core, const char* ring_device, const char* playback_device, const char* capture_device)
+{
+  linphone_core_set_ringer_device(LINPHONE(p_core), ring_device);
+  linphone_core_set_playback_device(LINPHONE(p_core), playback_device);
+  linphone_core_set_capture_device(LINPHONE(p_core), capture_device);
+}
+
+static void lp_enable_zrtp(struct Piphoned_SipCore* p_core, const char* secrets_file)
+{
+  linphone_core_set_media_encryption(LINPHONE(p_core), LinphoneMediaEncryptionZRTP);
+  linphone_core_set_media_encryption_mandatory(LINPHONE(p_core), false); /* Drops encryption silently if we don’t communicate it to the user! This has to be done in a callback! */
+  linphone_core_set_zrtp_secrets_file(LINPHONE(p_core), secrets_file);
+}
+
+static void lp_play_dtmf(struct Piphoned_SipCore* p_core, char digit, int duration_ms)
+{
+  linphone_core_play_dtmf(LINPHONE(p_core), digit, duration_ms);
+}
+
+/**
+ * Turns linphone's ringback tone off, remembering the file for
+ * lp_enable_ringback().
+ */
+static void lp_disable_ringback(struct Piphoned_SipCore* p_core)
+{
+  const char* file = linphone_core_get_ringback(LINPHONE(p_core));
+
+  if (file)
+    snprintf(BACKEND(p_core)->ringback, PATH_MAX, "%s", file);
+  linphone_core_set_ringback(LINPHONE(p_core), NULL);
+}
+
+/**
+ * Turns linphone's ring tone off, remembering the file for
+ * lp_enable_ring().
+ */
+static void lp_disable_ring(struct Piphoned_SipCore* p_core)
+{
+  const char* file = linphone_core_get_ring(LINPHONE(p_core));
+
+  if (file)
+    snprintf(BACKEND(p_core)->ring, PATH_MAX, "%s", file);
+  linphone_core_set_ring(LINPHONE(p_core), NULL);
+}
+
+static void lp_enable_ringback(struct Piphoned_SipCore* p_core)
+{
+  struct LinphoneBackend* p_backend = BACKEND(p_core);
+
+  if (strlen(p_backend->ringback) == 0)
+    return;
+
+  linphone_core_set_ringback(p_backend->p_linphone, p_backend->ringback);
+  p_backend->ringback[0] = '\0';
+}
+
+static void lp_enable_ring(struct Piphoned_SipCore* p_core)
+{
+  struct LinphoneBackend* p_backend = BACKEND(p_core);
+
+  if (strlen(p_backend->ring) == 0)
+    return;
+
+  linphone_core_set_ring(p_backend->p_linphone, p_backend->ring);
+  p_backend->ring[0] = '\0';
+}
+
+/**
+ * Makes mediastreamer open all ALSA cards at the given rate. This is
+ * a process-wide setting of mediastreamer.
+ */
+static void lp_set_sound_rate(struct Piphoned_SipCore* p_core, int rate)
+{
+  ms_alsa_card_set_forced_sample_rate(rate);
+}
+
+/**
+ * Sets the jitter buffer depth in ms, unless 0, and whether it may
+ * adapt to the network, unless -1.
+ */
+static void lp_set_jitter_buffer(struct Piphoned_SipCore* p_core, int ms, int adaptive)
+{
+  if (ms > 0)
+    linphone_core_set_audio_jittcomp(LINPHONE(p_core), ms);
+  if (adaptive >= 0)
+    linphone_core_enable_audio_adaptive_jittcomp(LINPHONE(p_core), adaptive);
+}
+
+/**
+ * Switches the echo canceller off (PIPHONED_ECHO_CANCELLER_OFF) or
+ * on with a tail of `tail_ms`. Linphone reads the tail from its
+ * configuration whenever a call's streams start.
+ */
+static void lp_set_echo_canceller(struct Piphoned_SipCore* p_core, int tail_ms)
+{
+  if (tail_ms == PIPHONED_ECHO_CANCELLER_OFF) {
+    linphone_core_enable_echo_cancellation(LINPHONE(p_core), FALSE);
+    return;
+  }
+
+  linphone_core_enable_echo_cancellation(LINPHONE(p_core), TRUE);
+  lp_config_set_int(linphone_core_get_config(LINPHONE(p_core)), "sound", "ec_tail_len", tail_ms);
+}
+
+static int lp_get_audio_codecs(struct Piphoned_SipCore* p_core, struct Piphoned_SipCore_Codec* codecs, int max)
+{
+  const MSList* p_elem = NULL;
+  int count = 0;
+
+  for(p_elem = linphone_core_get_audio_codecs(LINPHONE(p_core)); p_elem && count < max; p_elem = p_elem->next) {
+    PayloadType* p_pt = (PayloadType*) p_elem->data;
+
+    memset(&codecs[count], 0, sizeof(struct Piphoned_SipCore_Codec));
+    strncpy(codecs[count].mime, p_pt->mime_type, sizeof(codecs[count].mime) - 1);
+    codecs[count].rate     = p_pt->clock_rate;
+    codecs[count].channels = p_pt->channels;
+    codecs[count].bitrate  = p_pt->normal_bitrate;
+    codecs[count].enabled  = linphone_core_payload_type_enabled(LINPHONE(p_core), p_pt);
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * Enables or disables the given codecs and makes linphone offer them
+ * in the given order. Codecs linphone has but `codecs` does not
+ * mention keep their state and go to the end of the list.
+ */
+static void lp_set_audio_codecs(struct Piphoned_SipCore* p_core, const struct Piphoned_SipCore_Codec* codecs, int count)
+{
+  MSList* p_list = NULL;
+  const MSList* p_elem = NULL;
+  int i = 0;
+
+  for(i=0; i < count; i++) {
+    PayloadType* p_pt = linphone_core_find_payload_type(LINPHONE(p_core), codecs[i].mime, codecs[i].rate, codecs[i].channels);
+
+    if (!p_pt || ms_list_find(p_list, p_pt))
+      continue;
+
+    linphone_core_enable_payload_type(LINPHONE(p_core), p_pt, codecs[i].enabled);
+    p_list = ms_list_append(p_list, p_pt);
+  }
+
+  for(p_elem = linphone_core_get_audio_codecs(LINPHONE(p_core)); p_elem; p_elem = p_elem->next) {
+    if (!ms_list_find(p_list, p_elem->data))
+      p_list = ms_list_append(p_list, p_elem->data);
+  }
+
+  /* Linphone takes over the list */
+  linphone_core_set_audio_codecs(LINPHONE(p_core), p_list);
+}
+
+/**
+ * Pushes CODEC_TEST_SECONDS of a synthetic speech-like signal through
+ * the codec's mediastreamer encoder and decoder and returns the CPU
+ * time this took as percentage of one core in real time. Returns -1
+ * if mediastreamer has no encoder or decoder for the codec.
+ */
+static double lp_measure_codec(struct Piphoned_SipCore* p_core, const struct Piphoned_SipCore_Codec* p_codec)
+{
+  MSFilter* p_encoder = NULL;
+  MSFilter* p_decoder = NULL;
+  MSTicker* p_ticker = NULL;
+  MSQueue input;
+  MSQueue output;
+  int channels = p_codec->channels > 0 ? p_codec->channels : 1;
+  int frame_samples = p_codec->rate * CODEC_TEST_FRAME_MS / 1000;
+  int num_frames = CODEC_TEST_SECONDS * 1000 / CODEC_TEST_FRAME_MS;
+  unsigned int noise = 0x1234567;
+  uint32_t timestamp = 0;
+  double start = 0.0;
+  double cost = -1.0;
+  int i = 0;
+  int j = 0;
+
+  if (frame_samples <= 0)
+    return -1.0;
+
+  p_encoder = create_codec_filter(p_codec, true);
+  p_decoder = create_codec_filter(p_codec, false);
+  if (!p_encoder || !p_decoder)
+    goto finish;
+
+  ms_queue_init(&input);
+  ms_queue_init(&output);
+  p_encoder->inputs[0] = &input;
+  p_decoder->outputs[0] = &output;
+  ms_filter_link(p_encoder, 0, p_decoder, 0);
+
+  p_ticker = ms_ticker_new();
+  ms_filter_preprocess(p_encoder, p_ticker);
+  ms_filter_preprocess(p_decoder, p_ticker);
+
+  start = thread_cpu_seconds();
+  for(i=0; i < num_frames; i++) {
+    mblk_t* p_block = allocb(frame_samples * channels * sizeof(int16_t), 0);
+    int16_t* p_samples = (int16_t*) p_block->b_wptr;
+
+    /* A gliding tone plus noise, so that the codec cannot take
+     * shortcuts for silence or a steady signal */
+    for(j=0; j < frame_samples * channels; j++) {
+      double t = (double) (i * frame_samples + j / channels) / p_codec->rate;
+      noise = noise * 1103515245 + 12345;
+      p_samples[j] = (int16_t) (8000.0 * sin(2.0 * M_PI * (300.0 + 200.0 * t) * t) + (int) ((noise >> 16) & 0x0fff) - 0x800);
+    }
+    p_block->b_wptr += frame_samples * channels * sizeof(int16_t);
+    mblk_set_timestamp_info(p_block, timestamp);
+    timestamp += frame_samples;
+
+    ms_queue_put(&input, p_block);
+    ms_filter_process(p_encoder);
+    ms_filter_process(p_decoder);
+    ms_queue_flush(&output);
+  }
+  cost = (thread_cpu_seconds() - start) * 100.0 / CODEC_TEST_SECONDS;
+
+  ms_filter_postprocess(p_encoder);
+  ms_filter_postprocess(p_decoder);
+  ms_ticker_destroy(p_ticker);
+  ms_filter_unlink(p_encoder, 0, p_decoder, 0);
+  p_encoder->inputs[0] = NULL;
+  p_decoder->outputs[0] = NULL;
+  ms_queue_flush(&input);
+  ms_queue_flush(&output);
+
+ finish:
+  if (p_encoder)
+    ms_filter_destroy(p_encoder);
+  if (p_decoder)
+    ms_filter_destroy(p_decoder);
+
+  return cost;
+}
+
+/**
+ * Creates a codec's mediastreamer encoder or decoder, set up for the
+ * codec's clock rate and channel count. Returns NULL if mediastreamer
+ * has no such filter.
+ */
+static MSFilter* create_codec_filter(const struct Piphoned_SipCore_Codec* p_codec, bool encoder)
+{
+  MSFilter* p_filter = encoder ? ms_filter_create_encoder(p_codec->mime) : ms_filter_create_decoder(p_codec->mime);
+  int rate = p_codec->rate;
+  int channels = p_codec->channels > 0 ? p_codec->channels : 1;
+
+  if (!p_filter)
+    return NULL;
+
+  ms_filter_call_method(p_filter, MS_FILTER_SET_SAMPLE_RATE, &rate);
+  ms_filter_call_method(p_filter, MS_FILTER_SET_NCHANNELS, &channels);
+
+  return p_filter;
+}
+
+static double thread_cpu_seconds()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Creates a linphone proxy from the configuration file and hands it
+ * to linphone-core, which manages its memory from then on.
+ */
+static struct Piphoned_SipProxy* lp_add_proxy(struct Piphoned_SipCore* p_core, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig, bool is_default)
+{
+  LinphoneProxyConfig* p_proxy = NULL;
+  LinphoneAuthInfo* p_auth = NULL;
+  char str[PATH_MAX];
+
+  p_proxy = linphone_proxy_config_new();
+  p_auth  = linphone_auth_info_new(p_proxyconfig->username,
+                                   NULL,
+                                   p_proxyconfig->password,
+                                   NULL,
+                                   p_proxyconfig->realm); /* linphone >= 3.8 requires an additional domain paramater that can be set to NULL */
+
+  linphone_core_add_auth_info(LINPHONE(p_core), p_auth); /* Side effect: lets linphone-core manage memory of p_auth */
+
+  memset(str, '\0', PATH_MAX);
+  sprintf(str, "\"%s\" <sip:%s@%s>", p_proxyconfig->displayname, p_proxyconfig->username, p_proxyconfig->server);
+  syslog(LOG_INFO, "Using SIP identity for realm %s: %s", p_proxyconfig->realm, str);
+
+  linphone_proxy_config_set_identity(p_proxy, str);
+  linphone_proxy_config_set_server_addr(p_proxy, p_proxyconfig->server);
+  linphone_proxy_config_enable_register(p_proxy, TRUE);
+
+  if (p_proxyconfig->use_publish)
+    linphone_proxy_config_enable_publish(p_proxy, TRUE);
+
+  linphone_core_add_proxy_config(LINPHONE(p_core), p_proxy); /* Side effect: Makes linphone manage the memory of p_proxy */
+
+  if (is_default)
+    linphone_core_set_default_proxy(LINPHONE(p_core), p_proxy);
+
+  return (struct Piphoned_SipProxy*) p_proxy;
+}
+
+/**
+ * Points an existing linphone proxy at a changed configuration
+ * section, which makes linphone register it anew.
+ */
+static void lp_edit_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy, const struct Piphoned_Config_ParsedFile_ProxyTable* p_proxyconfig)
+{
+  LinphoneAuthInfo* p_auth = NULL;
+  char str[PATH_MAX];
+
+  p_auth = linphone_auth_info_new(p_proxyconfig->username,
+                                  NULL,
+                                  p_proxyconfig->password,
+                                  NULL,
+                                  p_proxyconfig->realm);
+  linphone_core_add_auth_info(LINPHONE(p_core), p_auth); /* Replaces the one for the same username and realm; manages p_auth's memory */
+
+  memset(str, '\0', PATH_MAX);
+  sprintf(str, "\"%s\" <sip:%s@%s>", p_proxyconfig->displayname, p_proxyconfig->username, p_proxyconfig->server);
+  syslog(LOG_INFO, "Changing SIP identity for realm %s: %s", p_proxyconfig->realm, str);
+
+  linphone_proxy_config_edit(PROXY(p_proxy));
+  linphone_proxy_config_set_identity(PROXY(p_proxy), str);
+  linphone_proxy_config_set_server_addr(PROXY(p_proxy), p_proxyconfig->server);
+  linphone_proxy_config_enable_publish(PROXY(p_proxy), p_proxyconfig->use_publish);
+  linphone_proxy_config_done(PROXY(p_proxy));
+}
+
+/**
+ * Unregisters the proxy. linphone-core frees it once the
+ * unregistration went through.
+ */
+static void lp_remove_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  linphone_core_remove_proxy_config(LINPHONE(p_core), PROXY(p_proxy));
+}
+
+static void lp_set_default_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  linphone_core_set_default_proxy(LINPHONE(p_core), PROXY(p_proxy));
+}
+
+static void lp_unregister_proxy(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  linphone_proxy_config_edit(PROXY(p_proxy));
+  linphone_proxy_config_enable_register(PROXY(p_proxy), FALSE); /* Advises linphone to send deauth request */
+  linphone_proxy_config_done(PROXY(p_proxy));
+}
+
+/**
+ * Taking the network away makes linphone drop its registrations
+ * locally, so that destroying the core sends no unregistration and
+ * the bindings stay with the registrars for the next process.
+ */
+static void lp_detach_proxies(struct Piphoned_SipCore* p_core)
+{
+  linphone_core_set_network_reachable(LINPHONE(p_core), FALSE);
+}
+
+static LinphoneRegistrationState lp_get_proxy_state(struct Piphoned_SipCore* p_core, struct Piphoned_SipProxy* p_proxy)
+{
+  return linphone_proxy_config_get_state(PROXY(p_proxy));
+}
+
+static struct Piphoned_SipCall* lp_invite(struct Piphoned_SipCore* p_core, const char* sip_uri)
+{
+  return (struct Piphoned_SipCall*) linphone_core_invite(LINPHONE(p_core), sip_uri);
+}
+
+static void lp_terminate_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  linphone_core_terminate_call(LINPHONE(p_core), CALL(p_call));
+}
+
+static void lp_accept_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  linphone_core_accept_call(LINPHONE(p_core), CALL(p_call));
+}
+
+static void lp_decline_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, LinphoneReason reason)
+{
+  linphone_core_decline_call(LINPHONE(p_core), CALL(p_call), reason);
+}
+
+/**
+ * Puts a call with running streams on hold. Returns false if the
+ * call cannot be paused, e.g. while it still rings.
+ */
+static bool lp_pause_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  LinphoneCallState state = linphone_call_get_state(CALL(p_call));
+
+  if (state != LinphoneCallStreamsRunning && state != LinphoneCallPausedByRemote)
+    return false;
+
+  return linphone_core_pause_call(LINPHONE(p_core), CALL(p_call)) == 0;
+}
+
+static void lp_resume_call(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call)
+{
+  linphone_core_resume_call(LINPHONE(p_core), CALL(p_call));
+}
+
+/**
+ * Linphone only knows the DTMF method per core, so it is switched
+ * before every digit to the one of the proxy the call belongs to.
+ */
+static void lp_send_dtmf(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, char digit, enum Piphoned_DtmfMethod method)
+{
+  linphone_core_set_use_rfc2833_for_dtmf(LINPHONE(p_core), method == PIPHONED_DTMF_RFC2833);
+  linphone_core_set_use_info_for_dtmf(LINPHONE(p_core), method == PIPHONED_DTMF_SIP_INFO);
+  linphone_call_send_dtmf(CALL(p_call), digit);
+}
+
+static void lp_ref_call(struct Piphoned_SipCall* p_call)
+{
+  linphone_call_ref(CALL(p_call));
+}
+
+static void lp_unref_call(struct Piphoned_SipCall* p_call)
+{
+  linphone_call_unref(CALL(p_call));
+}
+
+static void lp_set_call_userdata(struct Piphoned_SipCall* p_call, void* p_userdata)
+{
+  linphone_call_set_user_data(CALL(p_call), p_userdata);
+}
+
+static void* lp_get_call_userdata(struct Piphoned_SipCall* p_call)
+{
+  return linphone_call_get_user_data(CALL(p_call));
+}
+
+/**
+ * Formats the remote address from its parts rather than with
+ * linphone_call_get_remote_address_as_string(), which allocates.
+ */
+static void lp_get_remote_address(struct Piphoned_SipCall* p_call, char* target, size_t size)
+{
+  const LinphoneAddress* p_address = linphone_call_get_remote_address(CALL(p_call));
+  const char* username = linphone_address_get_username(p_address);
+
+  if (username)
+    snprintf(target, size, "sip:%s@%s", username, linphone_address_get_domain(p_address));
+  else
+    snprintf(target, size, "sip:%s", linphone_address_get_domain(p_address));
+}
+
+static const char* lp_get_remote_username(struct Piphoned_SipCall* p_call)
+{
+  return linphone_address_get_username(linphone_call_get_remote_address(CALL(p_call)));
+}
+
+static const char* lp_get_remote_domain(struct Piphoned_SipCall* p_call)
+{
+  return linphone_address_get_domain(linphone_call_get_remote_address(CALL(p_call)));
+}
+
+static LinphoneMediaEncryption lp_get_media_encryption(struct Piphoned_SipCall* p_call)
+{
+  const LinphoneCallParams* p_params = linphone_call_get_current_params(CALL(p_call));
+  return linphone_call_params_get_media_encryption(p_params);
+}
+
+static LinphoneReason lp_get_reason(struct Piphoned_SipCall* p_call)
+{
+  return linphone_call_get_reason(CALL(p_call));
+}
+
+static bool lp_get_call_stats(struct Piphoned_SipCall* p_call, struct Piphoned_SipCore_CallStats* p_stats)
+{
+  const LinphoneCallStats* p_audio_stats = linphone_call_get_audio_stats(CALL(p_call));
+
+  if (!p_audio_stats)
+    return false;
+
+  p_stats->late_rate = p_audio_stats->local_late_rate;
+  p_stats->loss_rate = p_audio_stats->local_loss_rate;
+  p_stats->round_trip_delay = p_audio_stats->round_trip_delay;
+  return true;
+}
+
+/**
+ * Lowers the bitrate of the call's codec to `percent` of its normal
+ * bitrate, or restores it with 100. Linphone only applies this to
+ * codecs with a variable bitrate, and running streams keep their
+ * encoder settings, so the call is updated with a re-INVITE, which
+ * restarts the streams. Restoring without a call only resets the
+ * codec for future calls.
+ */
+static void lp_scale_call_bitrate(struct Piphoned_SipCore* p_core, struct Piphoned_SipCall* p_call, int percent)
+{
+  struct LinphoneBackend* p_backend = BACKEND(p_core);
+  const PayloadType* p_used = NULL;
+  PayloadType* p_pt = NULL;
+  LinphoneCallParams* p_params = NULL;
+
+  if (p_backend->p_scaled_pt) {
+    linphone_core_set_payload_type_bitrate(LINPHONE(p_core), p_backend->p_scaled_pt, p_backend->unscaled_bitrate / 1000);
+    p_backend->p_scaled_pt = NULL;
+  }
+
+  if (!p_call)
+    return;
+
+  p_used = linphone_call_params_get_used_audio_codec(linphone_call_get_current_params(CALL(p_call)));
+  if (!p_used)
+    return;
+
+  p_pt = linphone_core_find_payload_type(LINPHONE(p_core), p_used->mime_type, p_used->clock_rate, p_used->channels);
+  if (!p_pt)
+    return;
+
+  if (percent < 100) {
+    p_backend->p_scaled_pt = p_pt;
+    p_backend->unscaled_bitrate = p_pt->normal_bitrate;
+    linphone_core_set_payload_type_bitrate(LINPHONE(p_core), p_pt, p_pt->normal_bitrate * percent / 100000);
+  }
+
+  p_params = linphone_core_create_call_params(LINPHONE(p_core), CALL(p_call));
+  linphone_core_update_call(LINPHONE(p_core), CALL(p_call), p_params);
+  linphone_call_params_unref(p_params);
+}
+
+/**
+ * Switches the echo canceller of a running call on or off and
+ * returns whether it was on before.
+ */
+static bool lp_set_call_echo_cancellation(struct Piphoned_SipCall* p_call, bool enable)
+{
+  bool was_enabled = linphone_call_echo_cancellation_enabled(CALL(p_call));
+
+  linphone_call_enable_echo_cancellation(CALL(p_call), enable);
+  return was_enabled;
+}
+
+static void lp_set_authentication_token_verified(struct Piphoned_SipCall* p_call, bool verified)
+{
+  linphone_call_set_authentication_token_verified(CALL(p_call), verified);
+}
+
+/***************************************
+ * Linphone callbacks
+ ***************************************/
+
+static void registration_state_changed(LinphoneCore* p_linphone, LinphoneProxyConfig* p_proxy, LinphoneRegistrationState rstate, const char* msg)
+{
+  struct Piphoned_SipCore* p_core = (struct Piphoned_SipCore*) linphone_core_get_user_data(p_linphone);
+
+  if (p_core->callbacks.registration_state_changed)
+    p_core->callbacks.registration_state_changed(p_core, (struct Piphoned_SipProxy*) p_proxy, rstate, msg);
+}
+
+static void call_state_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, LinphoneCallState cstate, const char* msg)
+{
+  struct Piphoned_SipCore* p_core = (struct Piphoned_SipCore*) linphone_core_get_user_data(p_linphone);
+
+  if (p_core->callbacks.call_state_changed)
+    p_core->callbacks.call_state_changed(p_core, (struct Piphoned_SipCall*) p_call, cstate, msg);
+}
+
+static void call_encryption_changed(LinphoneCore* p_linphone, LinphoneCall* p_call, bool_t is_encrypted, const char* p_authtoken)
+{
+  struct Piphoned_SipCore* p_core = (struct Piphoned_SipCore*) linphone_core_get_user_data(p_linphone);
+
+  if (p_core->callbacks.call_encryption_changed)
+    p_core->callbacks.call_encryption_changed(p_core, (struct Piphoned_SipCall*) p_call, is_encrypted, p_authtoken);
+}
+
+const struct Piphoned_SipCore_Ops g_piphoned_sipcore_linphone_ops = {
+  .name = "linphone",
+  .init = lp_init,
+  .free = lp_free,
+  .iterate = lp_iterate,
+  .set_firewall_policy = lp_set_firewall_policy,
+  .set_ports = lp_set_ports,
+  .use_sound_files = lp_use_sound_files,
+  .sound_device_can_capture = lp_sound_device_can_capture,
+  .sound_device_can_playback = lp_sound_device_can_playback,
+  .set_sound_devices = lp_set_sound_devices,
+  .enable_zrtp = lp_enable_zrtp,
+  .play_dtmf = lp_play_dtmf,
+  .disable_ringback = lp_disable_ringback,
+  .disable_ring = lp_disable_ring,
+  .enable_ringback = lp_enable_ringback,
+  .enable_ring = lp_enable_ring,
+  .get_audio_codecs = lp_get_audio_codecs,
+  .set_audio_codecs = lp_set_audio_codecs,
+  .measure_codec = lp_measure_codec,
+  .set_sound_rate = lp_set_sound_rate,
+  .set_jitter_buffer = lp_set_jitter_buffer,
+  .set_echo_canceller = lp_set_echo_canceller,
+  .add_proxy = lp_add_proxy,
+  .edit_proxy = lp_edit_proxy,
+  .remove_proxy = lp_remove_proxy,
+  .set_default_proxy = lp_set_default_proxy,
+  .unregister_proxy = lp_unregister_proxy,
+  .detach_proxies = lp_detach_proxies,
+  .get_proxy_state = lp_get_proxy_state,
+  .invite = lp_invite,
+  .terminate_call = lp_terminate_call,
+  .accept_call = lp_accept_call,
+  .decline_call = lp_decline_call,
+  .pause_call = lp_pause_call,
+  .resume_call = lp_resume_call,
+  .send_dtmf = lp_send_dtmf,
+  .ref_call = lp_ref_call,
+  .unref_call = lp_unref_call,
+  .set_call_userdata = lp_set_call_userdata,
+  .get_call_userdata = lp_get_call_userdata,
+  .get_remote_address = lp_get_remote_address,
+  .get_remote_username = lp_get_remote_username,
+  .get_remote_domain = lp_get_remote_domain,
+  .get_media_encryption = lp_get_media_encryption,
+  .get_reason = lp_get_reason,
+  .get_call_stats = lp_get_call_stats,
+  .scale_call_bitrate = lp_scale_call_bitrate,
+  .set_call_echo_cancellation = lp_set_call_echo_cancellation,
+  .set_authentication_token_verified = lp_set_authentication_token_verified
+};
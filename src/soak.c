@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "soak.h"
+#include "hwactions.h"
+#include "allocstats.h"
+
+/**
+ * The soak test is the long-running sibling of the benchmark. It
+ * cycles through all kinds of calls the phone manager handles --
+ * outgoing, accepted, declined by the remote side, missed, waiting
+ * and held, and rejected as busy -- for a very long time against
+ * the fake SIP backend. Every `sample_interval` cycles it samples the process'
+ * resident memory, heap usage, open file descriptors and threads
+ * together with the call setup latencies of that window, so that
+ * leaks and slowdowns show up as a trend rather than as a crash
+ * months into operation.
+ *
+ * The first sample is the baseline; the caches of libc and the SIP
+ * core should be warm by then. The soak test fails if memory grew
+ * by more than `max_growth_kb` or if any descriptor or thread leaked
+ * until the last sample. When built with PIPHONED_COUNT_ALLOCATIONS,
+ * it also fails if piphoned's own code allocated any memory after
+ * the baseline; the steady state is meant to be allocation-free.
+ */
+
+#define SOAK_NUMBER "5551234"     /* Digits dialed, and the caller of incoming calls */
+#define SOAK_MENU_DIGIT "1"        /* Digit dialed during outgoing calls */
+#define SOAK_DOMAIN "soak.invalid" /* Domain of incoming calls */
+#define STEP_TIMEOUT 10000         /* Milliseconds to wait for each step of a cycle */
+#define CALL_HOLD_TIME 100         /* Milliseconds to stay in a call, or to let it ring */
+#define IDLE_TIME 150              /* Milliseconds to stay idle after hanging up; more than two mainloop iterations */
+
+enum SoakScenario {
+  SOAK_OUTGOING = 0, /* We call, the remote side answers, we dial a digit into the call */
+  SOAK_ACCEPTED,     /* The remote side calls, we answer */
+  SOAK_DECLINED,     /* We call, the remote side rejects the call */
+  SOAK_MISSED,       /* The remote side calls and gives up */
+  SOAK_WAITING,      /* The remote side calls while we are in a call; we take it and swap back */
+  SOAK_BUSY,         /* Two more calls arrive during a call; one waits, one is busy */
+  SOAK_NUM_SCENARIOS
+};
+
+/**
+ * Resource usage of the process at one point in time.
+ */
+struct SoakSample
+{
+  unsigned int cycles;       /*< Cycles completed when sampled */
+  long rss_kb;               /*< Resident set size */
+  long heap_kb;              /*< Heap memory in use according to malloc */
+  int fds;                   /*< Open file descriptors */
+  int threads;               /*< Threads of the process */
+  unsigned long allocations; /*< Heap allocations by piphoned's code, if counted */
+};
+
+static struct Piphoned_SipCore* sp_core = NULL;
+static unsigned int s_cycles = 0;
+static unsigned int s_sample_interval = 0;
+static unsigned long s_max_growth_kb = 0;
+static unsigned int s_completed = 0;
+static unsigned int s_scenario_counts[SOAK_NUM_SCENARIOS];
+static double* sp_window_latencies = NULL; /* Setup latencies in the current sample window */
+static unsigned int s_window_count = 0;
+static struct SoakSample s_baseline;
+static struct SoakSample s_last;
+static unsigned int s_num_samples = 0;
+static pthread_t s_thread;
+static bool s_running = false;
+static bool s_abort = false; /* Shared resource! */
+
+static const char* s_scenario_names[SOAK_NUM_SCENARIOS] = {"outgoing", "accepted", "declined", "missed", "waiting", "busy"};
+
+static void* soak_thread(void* arg);
+static bool run_scenario(enum SoakScenario scenario);
+static bool dial_and_lift(struct Piphoned_SipCore_FakeStats* p_stats);
+static bool hang_up(bool expect_bye);
+static void take_sample();
+static void sample_resources(struct SoakSample* p_sample);
+static int count_fds();
+static int count_threads();
+static bool wait_for_counter(struct Piphoned_SipCore_FakeStats* p_stats, const unsigned long* p_counter, unsigned long old_value);
+static bool wait_until_idle();
+static bool sleep_milliseconds(unsigned int ms);
+static double milliseconds_between(const struct timespec* p_start, const struct timespec* p_end);
+static int compare_doubles(const void* p_a, const void* p_b);
+
+/**
+ * Starts the soak thread. The simulated hardware must have been
+ * enabled with piphoned_hwactions_set_simulated() and `p_core` must
+ * be using the fake backend. When all `cycles` have been run, the
+ * process sends itself SIGTERM to end the mainloop.
+ */
+bool piphoned_soak_start(struct Piphoned_SipCore* p_core, unsigned int cycles, unsigned int sample_interval, unsigned long max_growth_kb)
+{
+  sp_core = p_core;
+  s_cycles = cycles;
+  s_sample_interval = sample_interval;
+  s_max_growth_kb = max_growth_kb;
+  s_completed = 0;
+  s_num_samples = 0;
+  s_window_count = 0;
+  s_abort = false;
+  memset(s_scenario_counts, '\0', sizeof(s_scenario_counts));
+
+  sp_window_latencies = (double*) malloc(sample_interval * sizeof(double));
+
+  if (pthread_create(&s_thread, NULL, soak_thread, NULL) != 0) {
+    syslog(LOG_CRIT, "Failed to start soak test thread: %m");
+    free(sp_window_latencies);
+    sp_window_latencies = NULL;
+    return false;
+  }
+
+  s_running = true;
+  syslog(LOG_NOTICE, "Soak test started with %u call cycles, sampling every %u cycles.", cycles, sample_interval);
+  return true;
+}
+
+/**
+ * Stops the soak thread if it is still running and compares the
+ * last resource sample with the baseline.
+ *
+ * \returns 0 if all cycles completed without excess growth, 5 if
+ * cycles failed or were not run, 8 if resources leaked.
+ */
+int piphoned_soak_finish()
+{
+  int retval = 0;
+  long rss_growth = 0;
+  long heap_growth = 0;
+  int i = 0;
+
+  if (!s_running)
+    return 5;
+
+  __atomic_store_n(&s_abort, true, __ATOMIC_RELEASE);
+  pthread_join(s_thread, NULL);
+  s_running = false;
+
+  printf("Completed %u of %u call cycles (", s_completed, s_cycles);
+  for(i=0; i < SOAK_NUM_SCENARIOS; i++)
+    printf("%s%u %s", i > 0 ? ", " : "", s_scenario_counts[i], s_scenario_names[i]);
+  printf(").\n");
+  syslog(LOG_NOTICE, "Soak test completed %u of %u call cycles.", s_completed, s_cycles);
+
+  if (s_completed < s_cycles)
+    retval = 5;
+
+  if (s_num_samples < 2) {
+    printf("Too few samples to judge resource growth; use more cycles or a smaller sample interval.\n");
+    goto finish;
+  }
+
+  rss_growth = s_last.rss_kb - s_baseline.rss_kb;
+  heap_growth = s_last.heap_kb - s_baseline.heap_kb;
+
+  printf("Growth over %u cycles since the baseline: RSS %+ldkB, heap %+ldkB, fds %+d, threads %+d.\n",
+         s_last.cycles - s_baseline.cycles, rss_growth, heap_growth,
+         s_last.fds - s_baseline.fds, s_last.threads - s_baseline.threads);
+  syslog(LOG_NOTICE, "Soak test growth over %u cycles: RSS %+ldkB, heap %+ldkB, fds %+d, threads %+d.",
+         s_last.cycles - s_baseline.cycles, rss_growth, heap_growth,
+         s_last.fds - s_baseline.fds, s_last.threads - s_baseline.threads);
+
+  if (rss_growth > (long) s_max_growth_kb || heap_growth > (long) s_max_growth_kb) {
+    printf("FAILED: memory grew by more than %lukB.\n", s_max_growth_kb);
+    syslog(LOG_ERR, "Soak test failed: memory grew by more than %lukB.", s_max_growth_kb);
+    retval = 8;
+  }
+  if (s_last.fds > s_baseline.fds) {
+    printf("FAILED: file descriptors leaked.\n");
+    syslog(LOG_ERR, "Soak test failed: file descriptors leaked.");
+    retval = 8;
+  }
+  if (s_last.threads > s_baseline.threads) {
+    printf("FAILED: threads leaked.\n");
+    syslog(LOG_ERR, "Soak test failed: threads leaked.");
+    retval = 8;
+  }
+  if (piphoned_allocstats_enabled()) {
+    printf("Allocations over %u cycles since the baseline: %lu.\n",
+           s_last.cycles - s_baseline.cycles, s_last.allocations - s_baseline.allocations);
+    if (s_last.allocations > s_baseline.allocations) {
+      printf("FAILED: heap allocations in the steady state.\n");
+      syslog(LOG_ERR, "Soak test failed: %lu heap allocations in the steady state.", s_last.allocations - s_baseline.allocations);
+      retval = 8;
+    }
+  }
+
+ finish:
+  free(sp_window_latencies);
+  sp_window_latencies = NULL;
+  sp_core = NULL;
+
+  return retval;
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static void* soak_thread(void* arg)
+{
+  unsigned int i = 0;
+
+  /* Give the proxies time to register */
+  sleep_milliseconds(IDLE_TIME);
+
+  for(i=0; i < s_cycles; i++) {
+    enum SoakScenario scenario = (enum SoakScenario) (i % SOAK_NUM_SCENARIOS);
+
+    if (!run_scenario(scenario)) {
+      if (!__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE))
+        syslog(LOG_ERR, "Soak cycle %u (%s call) failed.", i + 1, s_scenario_names[scenario]);
+      break;
+    }
+
+    s_scenario_counts[scenario]++;
+    s_completed++;
+
+    if (s_completed % s_sample_interval == 0)
+      take_sample();
+  }
+
+  /* Ask the mainloop to terminate unless somebody else did already */
+  if (!__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE))
+    kill(getpid(), SIGTERM);
+
+  return NULL;
+}
+
+/**
+ * Runs one call cycle of the given kind. Returns to the idle state
+ * with all calls released.
+ */
+static bool run_scenario(enum SoakScenario scenario)
+{
+  struct Piphoned_SipCore_FakeStats stats;
+  struct timespec start;
+
+  switch (scenario) {
+  case SOAK_OUTGOING:
+    piphoned_sipcore_fake_set_outcome(sp_core, PIPHONED_SIPCORE_FAKE_ANSWER, 0, 0);
+    if (!dial_and_lift(&stats) || !sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+    piphoned_hwactions_simulate_digits(0, SOAK_MENU_DIGIT);
+    if (!wait_for_counter(&stats, &stats.dtmfs, stats.dtmfs))
+      return false;
+    return hang_up(true);
+  case SOAK_ACCEPTED:
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+    piphoned_sipcore_fake_incoming_call(sp_core, SOAK_NUMBER, SOAK_DOMAIN);
+    if (!wait_for_counter(&stats, &stats.incoming, stats.incoming))
+      return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    piphoned_hwactions_simulate_hook(0, false);
+    if (!wait_for_counter(&stats, &stats.accepts, stats.accepts))
+      return false;
+    sp_window_latencies[s_window_count++] = milliseconds_between(&start, &stats.last_accept);
+
+    if (!sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+    return hang_up(true);
+  case SOAK_DECLINED:
+    piphoned_sipcore_fake_set_outcome(sp_core, PIPHONED_SIPCORE_FAKE_BUSY, 0, 0);
+    if (!dial_and_lift(&stats) || !wait_until_idle())
+      return false;
+    return hang_up(false); /* The call is over already, nothing to send */
+  case SOAK_MISSED:
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+    piphoned_sipcore_fake_incoming_call(sp_core, SOAK_NUMBER, SOAK_DOMAIN);
+    if (!wait_for_counter(&stats, &stats.incoming, stats.incoming) || !sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+
+    piphoned_sipcore_fake_remote_hangup(sp_core);
+    return wait_until_idle();
+  case SOAK_WAITING:
+    piphoned_sipcore_fake_set_outcome(sp_core, PIPHONED_SIPCORE_FAKE_ANSWER, 0, 0);
+    if (!dial_and_lift(&stats) || !sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+    piphoned_sipcore_fake_incoming_call(sp_core, SOAK_NUMBER, SOAK_DOMAIN);
+    if (!wait_for_counter(&stats, &stats.incoming, stats.incoming))
+      return false;
+
+    /* Take the waiting call, putting the first one on hold... */
+    piphoned_hwactions_simulate_flash(0);
+    if (!wait_for_counter(&stats, &stats.accepts, stats.accepts) || !sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+
+    /* ...swap back, and hang up on both */
+    piphoned_hwactions_simulate_flash(0);
+    if (!sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+    return hang_up(true);
+  case SOAK_BUSY:
+    piphoned_sipcore_fake_set_outcome(sp_core, PIPHONED_SIPCORE_FAKE_ANSWER, 0, 0);
+    if (!dial_and_lift(&stats) || !sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+
+    /* The first caller waits, the second one gets busy */
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+    piphoned_sipcore_fake_incoming_call(sp_core, SOAK_NUMBER, SOAK_DOMAIN);
+    piphoned_sipcore_fake_incoming_call(sp_core, SOAK_NUMBER, SOAK_DOMAIN);
+    if (!wait_for_counter(&stats, &stats.declines, stats.declines))
+      return false;
+
+    /* The waiting caller gives up */
+    piphoned_sipcore_fake_remote_hangup(sp_core);
+    if (!sleep_milliseconds(CALL_HOLD_TIME))
+      return false;
+    return hang_up(true);
+  default:
+    return false;
+  }
+}
+
+/**
+ * Dials and lifts the handset, then waits for the INVITE and
+ * records the setup latency.
+ */
+static bool dial_and_lift(struct Piphoned_SipCore_FakeStats* p_stats)
+{
+  struct timespec start;
+
+  piphoned_hwactions_simulate_digits(0, SOAK_NUMBER);
+  piphoned_sipcore_fake_get_stats(sp_core, p_stats);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  piphoned_hwactions_simulate_hook(0, false);
+
+  if (!wait_for_counter(p_stats, &p_stats->invites, p_stats->invites))
+    return false;
+
+  sp_window_latencies[s_window_count++] = milliseconds_between(&start, &p_stats->last_invite);
+  return true;
+}
+
+/**
+ * Hangs up, optionally waits for the BYE, then waits for all calls
+ * to be released and for the mainloop to notice the hook.
+ */
+static bool hang_up(bool expect_bye)
+{
+  struct Piphoned_SipCore_FakeStats stats;
+
+  piphoned_sipcore_fake_get_stats(sp_core, &stats);
+  piphoned_hwactions_simulate_hook(0, true);
+
+  if (expect_bye && !wait_for_counter(&stats, &stats.byes, stats.byes))
+    return false;
+  if (!wait_until_idle())
+    return false;
+
+  return sleep_milliseconds(IDLE_TIME);
+}
+
+/**
+ * Samples the resources and reports them together with the setup
+ * latencies of the window since the last sample.
+ */
+static void take_sample()
+{
+  struct SoakSample sample;
+  double p50 = 0.0;
+  double p95 = 0.0;
+  double max = 0.0;
+
+  sample_resources(&sample);
+  sample.cycles = s_completed;
+
+  if (s_window_count > 0) {
+    qsort(sp_window_latencies, s_window_count, sizeof(double), compare_doubles);
+    p50 = sp_window_latencies[(s_window_count - 1) * 50 / 100];
+    p95 = sp_window_latencies[(s_window_count - 1) * 95 / 100];
+    max = sp_window_latencies[s_window_count - 1];
+  }
+
+  printf("cycles=%u rss=%ldkB heap=%ldkB fds=%d threads=%d setup p50=%.3fms p95=%.3fms max=%.3fms\n",
+         sample.cycles, sample.rss_kb, sample.heap_kb, sample.fds, sample.threads, p50, p95, max);
+  fflush(stdout);
+  syslog(LOG_NOTICE, "Soak sample: cycles=%u rss=%ldkB heap=%ldkB fds=%d threads=%d setup p50=%.3fms p95=%.3fms max=%.3fms",
+         sample.cycles, sample.rss_kb, sample.heap_kb, sample.fds, sample.threads, p50, p95, max);
+
+  if (s_num_samples == 0)
+    s_baseline = sample;
+
+  s_last = sample;
+  s_num_samples++;
+  s_window_count = 0;
+}
+
+static void sample_resources(struct SoakSample* p_sample)
+{
+  FILE* p_file = NULL;
+  long size = 0;
+  long pages = 0;
+
+  memset(p_sample, '\0', sizeof(struct SoakSample));
+
+  /* Second field of statm is the resident set in pages */
+  p_file = fopen("/proc/self/statm", "r");
+  if (p_file) {
+    if (fscanf(p_file, "%ld %ld", &size, &pages) == 2)
+      p_sample->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    fclose(p_file);
+  }
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  {
+    struct mallinfo2 info = mallinfo2();
+    p_sample->heap_kb = (info.uordblks + info.hblkhd) / 1024;
+  }
+#else
+  {
+    struct mallinfo info = mallinfo(); /* Wraps at 2 GiB, which we won't reach */
+    p_sample->heap_kb = ((unsigned long) info.uordblks + (unsigned long) info.hblkhd) / 1024;
+  }
+#endif
+
+  p_sample->fds = count_fds();
+  p_sample->threads = count_threads();
+  p_sample->allocations = piphoned_allocstats_count();
+}
+
+static int count_fds()
+{
+  DIR* p_dir = opendir("/proc/self/fd");
+  struct dirent* p_entry = NULL;
+  int count = 0;
+
+  if (!p_dir)
+    return 0;
+
+  while ((p_entry = readdir(p_dir))) {
+    if (p_entry->d_name[0] != '.')
+      count++;
+  }
+
+  closedir(p_dir);
+  return count - 1; /* The directory itself */
+}
+
+static int count_threads()
+{
+  FILE* p_file = fopen("/proc/self/status", "r");
+  char line[256];
+  int threads = 0;
+
+  if (!p_file)
+    return 0;
+
+  while (fgets(line, 256, p_file)) {
+    if (sscanf(line, "Threads: %d", &threads) == 1)
+      break;
+  }
+
+  fclose(p_file);
+  return threads;
+}
+
+/**
+ * Polls the fake backend's statistics into `p_stats` until the
+ * counter pointed to by `p_counter`, which must be a member of
+ * `p_stats`, differs from `old_value`.
+ *
+ * \returns false on timeout or if the soak test is aborted.
+ */
+static bool wait_for_counter(struct Piphoned_SipCore_FakeStats* p_stats, const unsigned long* p_counter, unsigned long old_value)
+{
+  unsigned int waited = 0;
+
+  while (waited < STEP_TIMEOUT) {
+    piphoned_sipcore_fake_get_stats(sp_core, p_stats);
+    if (*p_counter != old_value)
+      return true;
+
+    if (!sleep_milliseconds(1))
+      return false;
+    waited++;
+  }
+
+  return false;
+}
+
+/**
+ * Waits until the fake backend has released all calls.
+ *
+ * \returns false on timeout or if the soak test is aborted.
+ */
+static bool wait_until_idle()
+{
+  struct Piphoned_SipCore_FakeStats stats;
+  unsigned int waited = 0;
+
+  while (waited < STEP_TIMEOUT) {
+    piphoned_sipcore_fake_get_stats(sp_core, &stats);
+    if (stats.active_calls == 0)
+      return true;
+
+    if (!sleep_milliseconds(1))
+      return false;
+    waited++;
+  }
+
+  return false;
+}
+
+/**
+ * Sleeps for the given time unless the soak test is aborted.
+ *
+ * \returns false if the soak test was aborted.
+ */
+static bool sleep_milliseconds(unsigned int ms)
+{
+  struct timespec duration;
+
+  if (__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE))
+    return false;
+
+  duration.tv_sec = ms / 1000;
+  duration.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&duration, NULL);
+
+  return !__atomic_load_n(&s_abort, __ATOMIC_ACQUIRE);
+}
+
+static double milliseconds_between(const struct timespec* p_start, const struct timespec* p_end)
+{
+  return (p_end->tv_sec - p_start->tv_sec) * 1000.0 + (p_end->tv_nsec - p_start->tv_nsec) / 1000000.0;
+}
+
+static int compare_doubles(const void* p_a, const void* p_b)
+{
+  double a = *(const double*) p_a;
+  double b = *(const double*) p_b;
+
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
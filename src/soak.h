@@ -0,0 +1,9 @@
+#ifndef PIPHONED_SOAK_H
+#define PIPHONED_SOAK_H
+#include <stdbool.h>
+#include "sipcore.h"
+
+bool piphoned_soak_start(struct Piphoned_SipCore* p_core, unsigned int cycles, unsigned int sample_interval, unsigned long max_growth_kb); /*< Start cycling through simulated calls */
+int piphoned_soak_finish(); /*< Wait for the soak test and judge the resource growth */
+
+#endif
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+#include "sound_cache.h"
+#include "configfile.h"
+#include "cache_file.h"
+
+/**
+ * Remembering which sound devices worked. Asking the SIP core
+ * whether a device can capture or play back means waiting for the
+ * sound system on every start, although the sound cards of a phone
+ * hardly ever change. If `sound_cache` is set, the devices that
+ * passed are written to it together with a fingerprint of the
+ * installed cards, and the next start with the same cards trusts
+ * the file and checks the devices only once the SIP side is up.
+ */
+
+#define CACHE_MAGIC "piphoned-sound 1"
+#define MAX_ENTRIES (3 * PIPHONED_MAX_LINES)
+
+/**
+ * A device that worked.
+ */
+struct SoundCacheEntry
+{
+  bool capture;     /*< Checked for capture rather than playback */
+  char device[512]; /*< Name of the device as in the configuration */
+};
+
+static struct SoundCacheEntry s_entries[MAX_ENTRIES];
+static int s_num_entries = 0;
+static bool s_cache_loaded = false; /* Has the cache file been tried already? */
+static uint32_t s_cards_key = 0; /* Identifies the sound cards and SIP backend the entries are valid for */
+
+static void compute_cards_key(const struct Piphoned_SipCore* p_core);
+static void load_cache();
+static void save_cache();
+static int find_entry(const char* device, bool capture);
+
+bool piphoned_soundcache_known(const struct Piphoned_SipCore* p_core, const char* device, bool capture)
+{
+  if (strlen(g_piphoned_config_info.sound_cache) == 0)
+    return false;
+
+  if (!s_cache_loaded) {
+    compute_cards_key(p_core);
+    load_cache();
+    s_cache_loaded = true;
+  }
+
+  return find_entry(device, capture) >= 0;
+}
+
+void piphoned_soundcache_store(const char* device, bool capture)
+{
+  struct SoundCacheEntry* p_entry = NULL;
+
+  if (!s_cache_loaded || find_entry(device, capture) >= 0)
+    return;
+
+  if (s_num_entries >= MAX_ENTRIES) {
+    syslog(LOG_WARNING, "Sound cache full, not remembering %s.", device);
+    return;
+  }
+
+  p_entry = &s_entries[s_num_entries++];
+  p_entry->capture = capture;
+  strncpy(p_entry->device, device, sizeof(p_entry->device) - 1);
+  p_entry->device[sizeof(p_entry->device) - 1] = '\0';
+
+  save_cache();
+}
+
+void piphoned_soundcache_forget(const char* device, bool capture)
+{
+  int i = find_entry(device, capture);
+
+  if (i < 0)
+    return;
+
+  s_entries[i] = s_entries[--s_num_entries];
+  save_cache();
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+/**
+ * Derives the cache key from the sound cards as /proc/asound/cards
+ * lists them and from the SIP backend, using FNV-1a.
+ */
+static void compute_cards_key(const struct Piphoned_SipCore* p_core)
+{
+  FILE* p_file = fopen("/proc/asound/cards", "r");
+  char line[512];
+
+  s_cards_key = piphoned_cachefile_hash(PIPHONED_CACHEFILE_HASH_START, p_core->p_ops->name);
+
+  if (p_file) {
+    while (fgets(line, sizeof(line), p_file))
+      s_cards_key = piphoned_cachefile_hash(s_cards_key, line);
+    fclose(p_file);
+  }
+}
+
+/**
+ * Reads the working devices from the cache file, if there is one and
+ * it was written with the same sound cards.
+ */
+static void load_cache()
+{
+  FILE* p_file = NULL;
+  char line[600];
+  char* p_device = NULL;
+  bool stale = false;
+
+  p_file = piphoned_cachefile_open(g_piphoned_config_info.sound_cache, CACHE_MAGIC, s_cards_key, &stale);
+  if (stale)
+    syslog(LOG_NOTICE, "Sound cards changed since '%s' was written, probing them.", g_piphoned_config_info.sound_cache);
+  if (!p_file)
+    return;
+
+  while (s_num_entries < MAX_ENTRIES && fgets(line, sizeof(line), p_file)) {
+    struct SoundCacheEntry* p_entry = &s_entries[s_num_entries];
+
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "capture ", 8) == 0)
+      p_entry->capture = true;
+    else if (strncmp(line, "playback ", 9) == 0)
+      p_entry->capture = false;
+    else
+      continue;
+
+    p_device = strchr(line, ' ') + 1;
+    strncpy(p_entry->device, p_device, sizeof(p_entry->device) - 1);
+    p_entry->device[sizeof(p_entry->device) - 1] = '\0';
+    s_num_entries++;
+  }
+
+  syslog(LOG_INFO, "Read %d working sound devices from '%s'.", s_num_entries, g_piphoned_config_info.sound_cache);
+  fclose(p_file);
+}
+
+static void save_cache()
+{
+  FILE* p_file = NULL;
+  int i = 0;
+
+  p_file = piphoned_cachefile_create(g_piphoned_config_info.sound_cache, CACHE_MAGIC, s_cards_key);
+  if (!p_file)
+    return;
+
+  for(i=0; i < s_num_entries; i++)
+    fprintf(p_file, "%s %s\n", s_entries[i].capture ? "capture" : "playback", s_entries[i].device);
+
+  fclose(p_file);
+}
+
+static int find_entry(const char* device, bool capture)
+{
+  int i = 0;
+
+  for(i=0; i < s_num_entries; i++) {
+    if (s_entries[i].capture == capture && strcmp(s_entries[i].device, device) == 0)
+      return i;
+  }
+
+  return -1;
+}
@@ -0,0 +1,10 @@
+#ifndef PIPHONED_SOUND_CACHE_H
+#define PIPHONED_SOUND_CACHE_H
+#include <stdbool.h>
+#include "sipcore.h"
+
+bool piphoned_soundcache_known(const struct Piphoned_SipCore* p_core, const char* device, bool capture); /*< Did the device work the last time with the same sound cards? */
+void piphoned_soundcache_store(const char* device, bool capture);  /*< Remember that the device works */
+void piphoned_soundcache_forget(const char* device, bool capture); /*< Remember that the device does not work anymore */
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <linphone/linphonecore.h>
+#include "sound_params.h"
+#include "configfile.h"
+#include "logring.h"
+
+/**
+ * ALSA parameters of the sound devices piphoned opens itself (tone,
+ * ringer and keypad devices). By default each asks ALSA for a buffer
+ * of a given latency and lets it pick the period; the `sound_period`
+ * and `sound_buffer` settings of a line override that with explicit
+ * sizes in frames. What ALSA actually granted is logged, as drivers
+ * round to what the hardware supports.
+ */
+
+#define NATIVE_RATE_HINT 48000 /* Rate most sound hardware runs at natively */
+
+/**
+ * Like snd_pcm_set_params() for 16 bit interleaved samples, but using
+ * the period and buffer size configured for the line, if any, instead
+ * of `default_latency` (in microseconds). May be called from any
+ * thread. Returns 0 or a negative ALSA error code; -EINVAL if the
+ * device cannot run at exactly `rate`, as the callers' tone tables
+ * and detectors are computed for it.
+ */
+int piphoned_soundparams_set(snd_pcm_t* p_pcm, unsigned int channels, unsigned int rate, unsigned int default_latency, int line)
+{
+  const struct Piphoned_Config_ParsedFile_LineTable* p_line = g_piphoned_config_info.lines[line];
+  snd_pcm_hw_params_t* p_hw = NULL;
+  snd_pcm_sw_params_t* p_sw = NULL;
+  snd_pcm_uframes_t period = 0;
+  snd_pcm_uframes_t buffer = 0;
+  unsigned int exact_rate = rate;
+  int error = 0;
+
+  if (p_line->sound_period <= 0 && p_line->sound_buffer <= 0)
+    return snd_pcm_set_params(p_pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, channels, rate, 1, default_latency);
+
+  snd_pcm_hw_params_alloca(&p_hw);
+  snd_pcm_sw_params_alloca(&p_sw);
+
+  if ((error = snd_pcm_hw_params_any(p_pcm, p_hw)) < 0
+      || (error = snd_pcm_hw_params_set_access(p_pcm, p_hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0
+      || (error = snd_pcm_hw_params_set_format(p_pcm, p_hw, SND_PCM_FORMAT_S16)) < 0
+      || (error = snd_pcm_hw_params_set_channels(p_pcm, p_hw, channels)) < 0
+      || (error = snd_pcm_hw_params_set_rate_resample(p_pcm, p_hw, 1)) < 0 /* As snd_pcm_set_params() does */
+      || (error = snd_pcm_hw_params_set_rate_near(p_pcm, p_hw, &exact_rate, NULL)) < 0)
+    return error;
+
+  if (exact_rate != rate) {
+    PIPHONED_LOG(LOG_ERR, "Sound device of line %d cannot run at %d Hz, only at %d Hz.", line + 1, (int) rate, (int) exact_rate);
+    return -EINVAL;
+  }
+
+  if (p_line->sound_period > 0) {
+    period = p_line->sound_period;
+    if ((error = snd_pcm_hw_params_set_period_size_near(p_pcm, p_hw, &period, NULL)) < 0)
+      return error;
+  }
+  if (p_line->sound_buffer > 0) {
+    buffer = p_line->sound_buffer;
+    error = snd_pcm_hw_params_set_buffer_size_near(p_pcm, p_hw, &buffer);
+  }
+  else {
+    error = snd_pcm_hw_params_set_buffer_time_near(p_pcm, p_hw, &default_latency, NULL);
+  }
+  if (error < 0 || (error = snd_pcm_hw_params(p_pcm, p_hw)) < 0)
+    return error;
+
+  /* Start once the buffer is filled with whole periods and wake up
+   * for each period, as snd_pcm_set_params() does */
+  snd_pcm_hw_params_get_period_size(p_hw, &period, NULL);
+  snd_pcm_hw_params_get_buffer_size(p_hw, &buffer);
+  if ((error = snd_pcm_sw_params_current(p_pcm, p_sw)) < 0
+      || (error = snd_pcm_sw_params_set_start_threshold(p_pcm, p_sw, (buffer / period) * period)) < 0
+      || (error = snd_pcm_sw_params_set_avail_min(p_pcm, p_sw, period)) < 0
+      || (error = snd_pcm_sw_params(p_pcm, p_sw)) < 0)
+    return error;
+
+  PIPHONED_LOG(LOG_DEBUG, "Sound device of line %d runs at %d Hz with periods of %d and a buffer of %d frames.", line + 1, (int) exact_rate, (int) period, (int) buffer);
+  return 0;
+}
+
+/**
+ * Finds the sample rate the hardware behind a linphone sound card ID
+ * like "ALSA: USB PnP Sound Device" runs at natively, by opening the
+ * card's capture device with ALSA's automatic resampling disabled
+ * and asking for the rate closest to NATIVE_RATE_HINT. Returns 0 if
+ * the card is not an ALSA card or cannot be opened.
+ */
+int piphoned_soundparams_native_rate(const char* card)
+{
+  snd_pcm_t* p_pcm = NULL;
+  snd_pcm_hw_params_t* p_hw = NULL;
+  unsigned int rate = NATIVE_RATE_HINT;
+  char pcmname[32];
+  char* name = NULL;
+  int index = -1;
+  bool found = false;
+
+  if (strncmp(card, "ALSA: ", 6) != 0)
+    return 0;
+
+  while (!found && snd_card_next(&index) == 0 && index >= 0) {
+    if (snd_card_get_name(index, &name) == 0) {
+      found = strcmp(name, card + 6) == 0;
+      free(name);
+    }
+  }
+  if (!found)
+    return 0;
+
+  sprintf(pcmname, "hw:%d", index);
+  if (snd_pcm_open(&p_pcm, pcmname, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE) < 0)
+    return 0;
+
+  snd_pcm_hw_params_alloca(&p_hw);
+  if (snd_pcm_hw_params_any(p_pcm, p_hw) < 0 || snd_pcm_hw_params_set_rate_near(p_pcm, p_hw, &rate, NULL) < 0)
+    rate = 0;
+
+  snd_pcm_close(p_pcm);
+  return (int) rate;
+}
@@ -0,0 +1,8 @@
+#ifndef PIPHONED_SOUND_PARAMS_H
+#define PIPHONED_SOUND_PARAMS_H
+#include <alsa/asoundlib.h>
+
+int piphoned_soundparams_set(snd_pcm_t* p_pcm, unsigned int channels, unsigned int rate, unsigned int default_latency, int line); /*< snd_pcm_set_params() with the line's period and buffer size */
+int piphoned_soundparams_native_rate(const char* card); /*< Sample rate a linphone ALSA card runs at without resampling; 0 if unknown */
+
+#endif
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <linphone/linphonecore.h>
+#include "startup.h"
+#include "configfile.h"
+#include "commandline.h"
+#include "flightrec.h"
+#include "sdnotify.h"
+
+/**
+ * Startup profiling. Each phase of the startup is timed with the
+ * monotonic clock from the moment main() was entered. Once every line
+ * heard back from its SIP server, or the mainloop ends before that,
+ * the phases are logged, recorded in the flight recorder and, with
+ * --startup-trace, written as a Chrome trace that chrome://tracing or
+ * Perfetto can display. Under systemd, each phase also becomes the
+ * service's status. Only the thread running the mainloop may call
+ * this.
+ */
+
+/* Phases may run several times, e.g. `gpio edge' once per pin */
+#define MAX_SPANS 128
+
+/**
+ * One run of a phase.
+ */
+struct StartupSpan
+{
+  enum Piphoned_StartupPhase phase;
+  int line;                   /*< Index of the line; -1 for the whole process */
+  struct timespec start;
+  struct timespec end;        /*< tv_sec is -1 while the phase runs */
+};
+
+static const char* s_phase_names[PIPHONED_NUM_STARTUP_PHASES] = {
+  "config file", "user lookup", "wiringPi", "gpio edge", "SIP core", "sound probe", "registration"
+};
+
+static struct timespec s_start;
+static struct StartupSpan s_spans[MAX_SPANS];
+static int s_num_spans = 0;
+static bool s_reported = false;
+
+static int line_index(const struct Piphoned_Config_ParsedFile_LineTable* p_line);
+static double ms_between(const struct timespec* p_from, const struct timespec* p_to);
+static void write_json_chars(FILE* p_file, const char* str);
+static void write_trace(const char* path);
+
+void piphoned_startup_init()
+{
+  clock_gettime(CLOCK_MONOTONIC, &s_start);
+  s_num_spans = 0;
+  s_reported = false;
+}
+
+void piphoned_startup_begin(enum Piphoned_StartupPhase phase, const struct Piphoned_Config_ParsedFile_LineTable* p_line)
+{
+  struct StartupSpan* p_span = NULL;
+
+  if (s_reported || s_num_spans >= MAX_SPANS)
+    return;
+
+  p_span = &s_spans[s_num_spans++];
+  p_span->phase = phase;
+  p_span->line = line_index(p_line);
+  p_span->end.tv_sec = -1;
+  clock_gettime(CLOCK_MONOTONIC, &p_span->start);
+
+  if (p_line)
+    piphoned_sdnotify("STATUS=Starting: %s of line %s", s_phase_names[phase], p_line->name);
+  else
+    piphoned_sdnotify("STATUS=Starting: %s", s_phase_names[phase]);
+}
+
+void piphoned_startup_end(enum Piphoned_StartupPhase phase, const struct Piphoned_Config_ParsedFile_LineTable* p_line)
+{
+  int line = line_index(p_line);
+  int registered = 0;
+  int i = 0;
+
+  if (s_reported)
+    return;
+
+  for(i=s_num_spans-1; i >= 0; i--) {
+    if (s_spans[i].phase == phase && s_spans[i].line == line && s_spans[i].end.tv_sec < 0) {
+      clock_gettime(CLOCK_MONOTONIC, &s_spans[i].end);
+      break;
+    }
+  }
+
+  if (phase != PIPHONED_STARTUP_REGISTER)
+    return;
+
+  for(i=0; i < s_num_spans; i++) {
+    if (s_spans[i].phase == PIPHONED_STARTUP_REGISTER && s_spans[i].end.tv_sec >= 0)
+      registered++;
+  }
+
+  if (registered >= g_piphoned_config_info.num_lines)
+    piphoned_startup_report();
+}
+
+void piphoned_startup_report()
+{
+  double totals[PIPHONED_MAX_LINES + 1][PIPHONED_NUM_STARTUP_PHASES];
+  struct timespec now;
+  double elapsed = 0.0;
+  int phase = 0;
+  int i = 0;
+
+  if (s_reported)
+    return;
+  s_reported = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = ms_between(&s_start, &now);
+  memset(totals, 0, sizeof(totals));
+
+  /* Unfinished phases count until now */
+  for(i=0; i < s_num_spans; i++) {
+    if (s_spans[i].end.tv_sec < 0)
+      s_spans[i].end = now;
+    totals[s_spans[i].line + 1][s_spans[i].phase] += ms_between(&s_spans[i].start, &s_spans[i].end);
+  }
+
+  syslog(LOG_NOTICE, "Startup took %.1f ms until all lines heard back from their SIP server.", elapsed);
+  piphoned_flightrec_record(PIPHONED_FLIGHTREC_STARTUP_PHASE, PIPHONED_NUM_STARTUP_PHASES, (uint32_t) elapsed);
+
+  for(i=0; i <= g_piphoned_config_info.num_lines; i++) {
+    for(phase=0; phase < PIPHONED_NUM_STARTUP_PHASES; phase++) {
+      if (totals[i][phase] == 0.0)
+        continue;
+
+      if (i == 0)
+        syslog(LOG_INFO, "Startup phase %s: %.1f ms", s_phase_names[phase], totals[i][phase]);
+      else
+        syslog(LOG_INFO, "Startup phase %s of line %s: %.1f ms", s_phase_names[phase], g_piphoned_config_info.lines[i - 1]->name, totals[i][phase]);
+
+      piphoned_flightrec_record(PIPHONED_FLIGHTREC_STARTUP_PHASE, phase | i << 8, (uint32_t) totals[i][phase]);
+    }
+  }
+
+  if (g_cli_options.startup_trace)
+    write_trace(g_cli_options.startup_trace);
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static int line_index(const struct Piphoned_Config_ParsedFile_LineTable* p_line)
+{
+  int i = 0;
+
+  for(i=0; p_line && i < g_piphoned_config_info.num_lines; i++) {
+    if (g_piphoned_config_info.lines[i] == p_line)
+      return i;
+  }
+
+  return -1;
+}
+
+static double ms_between(const struct timespec* p_from, const struct timespec* p_to)
+{
+  return (p_to->tv_sec - p_from->tv_sec) * 1000.0 + (p_to->tv_nsec - p_from->tv_nsec) / 1000000.0;
+}
+
+/**
+ * Writes `str` escaped for the inside of a JSON string. Line names
+ * come from the configuration file and may contain anything.
+ */
+static void write_json_chars(FILE* p_file, const char* str)
+{
+  for(; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\')
+      fprintf(p_file, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(p_file, "\\u%04x", c);
+    else
+      fputc(c, p_file);
+  }
+}
+
+/**
+ * Writes all spans in the Chrome trace event format, one trace
+ * thread for the process and one per line.
+ */
+static void write_trace(const char* path)
+{
+  FILE* p_file = fopen(path, "w");
+  pid_t pid = getpid();
+  int i = 0;
+
+  if (!p_file) {
+    syslog(LOG_WARNING, "Failed to write startup trace '%s': %m", path);
+    return;
+  }
+
+  fprintf(p_file, "{\"traceEvents\":[\n");
+  fprintf(p_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"piphoned\"}}", pid);
+  for(i=0; i < g_piphoned_config_info.num_lines; i++) {
+    fprintf(p_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"line ", pid, i + 1);
+    write_json_chars(p_file, g_piphoned_config_info.lines[i]->name);
+    fprintf(p_file, "\"}}");
+  }
+
+  for(i=0; i < s_num_spans; i++) {
+    fprintf(p_file, ",\n{\"name\":\"%s\",\"cat\":\"startup\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d}",
+            s_phase_names[s_spans[i].phase],
+            ms_between(&s_start, &s_spans[i].start) * 1000.0,
+            ms_between(&s_spans[i].start, &s_spans[i].end) * 1000.0,
+            pid, s_spans[i].line + 1);
+  }
+  fprintf(p_file, "\n]}\n");
+
+  fclose(p_file);
+  syslog(LOG_INFO, "Wrote startup trace to '%s'.", path);
+}
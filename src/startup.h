@@ -0,0 +1,26 @@
+#ifndef PIPHONED_STARTUP_H
+#define PIPHONED_STARTUP_H
+
+struct Piphoned_Config_ParsedFile_LineTable;
+
+/**
+ * What piphoned spends its startup time on. The phases of a line
+ * run once per line.
+ */
+enum Piphoned_StartupPhase {
+  PIPHONED_STARTUP_CONFIG = 0,  /* Parsing the configuration file */
+  PIPHONED_STARTUP_USERINFO,    /* Looking up users and groups (part of the configuration) */
+  PIPHONED_STARTUP_WIRINGPI,    /* wiringPiSetup() */
+  PIPHONED_STARTUP_GPIO_EDGE,   /* Running `gpio edge' for the interrupt pins */
+  PIPHONED_STARTUP_SIP_CORE,    /* Creating a line's SIP core */
+  PIPHONED_STARTUP_SOUND_PROBE, /* Checking a line's sound devices */
+  PIPHONED_STARTUP_REGISTER,    /* Loading a line's proxies until the first one answered */
+  PIPHONED_NUM_STARTUP_PHASES
+};
+
+void piphoned_startup_init(); /*< Start the clock; call first thing in main() */
+void piphoned_startup_begin(enum Piphoned_StartupPhase phase, const struct Piphoned_Config_ParsedFile_LineTable* p_line); /*< A phase starts; `p_line' is NULL for the whole process */
+void piphoned_startup_end(enum Piphoned_StartupPhase phase, const struct Piphoned_Config_ParsedFile_LineTable* p_line);   /*< A phase ended; reports once all lines registered */
+void piphoned_startup_report(); /*< Log the startup report and write the trace, unless done already */
+
+#endif
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include <linphone/linphonecore.h>
+#include "tones.h"
+#include "configfile.h"
+#include "logring.h"
+#include "rtsched.h"
+#include "sound_params.h"
+
+/**
+ * Call progress tones. Dial tone, ringback, busy and congestion tone
+ * are played by piphoned itself rather than left to linphone and the
+ * provider's early media, so that they follow the state of the line
+ * right away. For each line with a `tone_device`, a thread plays the
+ * tone the mainloop asks for with piphoned_tones_play() to that ALSA
+ * device. The samples are computed once at startup: one table per
+ * tone holding a whole number of periods of its frequencies, so that
+ * playing is only copying it out in a loop, switched on and off by
+ * the tone's cadence. The device is only held open while a tone is
+ * played, so that linphone can have it during the call.
+ */
+
+/* Sample rate of the tables */
+#define TONE_RATE 8000
+
+/* Samples written to the device at once (10 ms). A new tone is heard
+ * no later than after one chunk. */
+#define TONE_CHUNK 80
+
+/* Buffer latency requested from ALSA, in microseconds. Kept short, as
+ * what is in the buffer is dropped on each change anyway. */
+#define TONE_LATENCY 40000
+
+/* Peak amplitude of each frequency of a tone; -20 dBFS */
+#define TONE_AMPLITUDE 3277.0
+
+/* Longest table: the least common multiple of the period lengths of
+ * a tone's two frequencies (in samples) must not exceed this. */
+#define MAX_TABLE_SAMPLES 800
+
+/* Longest cadence, in on and off steps */
+#define MAX_CADENCE 4
+
+/**
+ * How a tone sounds: up to two frequencies (Hz, 0 if unused) and the
+ * durations (ms) it is alternately on and off for, repeated. An empty
+ * cadence means the tone is on all the time.
+ */
+struct ToneSpec
+{
+  int frequencies[2];
+  int cadence[MAX_CADENCE];
+};
+
+/**
+ * The tones of one country, after ITU-T E.180. Indexed by enum
+ * Piphoned_Tone; the entry for PIPHONED_TONE_NONE is unused.
+ */
+struct Country
+{
+  const char* name; /*< Value of the `tone_country` setting */
+  struct ToneSpec tones[PIPHONED_NUM_TONES];
+};
+
+static const struct Country s_countries[] = {
+  {"de", {{{0}, {0}},
+          {{425, 0}, {0}},
+          {{425, 0}, {1000, 4000}},
+          {{425, 0}, {480, 480}},
+          {{425, 0}, {240, 240}}}},
+  {"us", {{{0}, {0}},
+          {{350, 440}, {0}},
+          {{440, 480}, {2000, 4000}},
+          {{480, 620}, {500, 500}},
+          {{480, 620}, {250, 250}}}},
+  {"uk", {{{0}, {0}},
+          {{350, 440}, {0}},
+          {{400, 450}, {400, 200, 400, 2000}},
+          {{400, 0}, {375, 375}},
+          {{400, 0}, {400, 350, 225, 525}}}}
+};
+
+/**
+ * A tone ready to be played.
+ */
+struct ToneTable
+{
+  int16_t samples[MAX_TABLE_SAMPLES]; /*< Whole periods of the tone */
+  int length;                         /*< Samples used in `samples` */
+  int cadence[MAX_CADENCE];           /*< On and off steps in samples */
+  int num_steps;                      /*< Steps used in `cadence`; 0 for always on */
+};
+
+/**
+ * The player of one line.
+ */
+struct TonePlayer
+{
+  int line;                     /*< Index of the line */
+  const char* device;           /*< ALSA PCM to play to */
+  pthread_t thread;             /*< Playing thread */
+  bool is_running;              /*< Was `thread` started? */
+  enum Piphoned_Tone wanted;    /*< Tone to play. Shared resource! */
+  bool stop;                    /*< Should the thread terminate? Shared resource! */
+  pthread_mutex_t mutex;        /*< Protects `wanted` and `stop` */
+  pthread_cond_t cond;          /*< Signalled when `wanted` or `stop` change */
+  int position;                 /*< Next sample of the table. Only used by `thread` */
+  int step;                     /*< Current step of the cadence. Only used by `thread` */
+  int step_left;                /*< Samples left of `step`. Only used by `thread` */
+  int16_t chunk[TONE_CHUNK];    /*< Only used by `thread` */
+};
+
+static const char* s_tone_names[PIPHONED_NUM_TONES] = {"none", "dial", "ringback", "busy", "congestion"};
+static struct ToneTable s_tables[PIPHONED_NUM_TONES];
+static struct TonePlayer s_players[PIPHONED_MAX_LINES];
+static int s_num_lines = 0;
+
+static bool build_tables(const struct Country* p_country);
+static int period_length(int frequency);
+static int gcd(int a, int b);
+static void* player_thread(void* arg);
+static void play(struct TonePlayer* p_player);
+static void fill_chunk(struct TonePlayer* p_player, const struct ToneTable* p_table);
+
+/**
+ * Computes the tones of the configured country and starts a player
+ * thread for each line with a `tone_device`. The threads stay idle
+ * until piphoned_tones_play() asks for a tone.
+ */
+bool piphoned_tones_init()
+{
+  const struct Country* p_country = NULL;
+  int i = 0;
+
+  for(i=0; i < (int) (sizeof(s_countries) / sizeof(struct Country)); i++) {
+    if (strcmp(s_countries[i].name, g_piphoned_config_info.tone_country) == 0)
+      p_country = &s_countries[i];
+  }
+
+  if (!p_country) {
+    syslog(LOG_ERR, "Unknown tone_country '%s', using '%s'.", g_piphoned_config_info.tone_country, s_countries[0].name);
+    p_country = &s_countries[0];
+  }
+
+  if (!build_tables(p_country))
+    return false;
+
+  s_num_lines = g_piphoned_config_info.num_lines;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct TonePlayer* p_player = &s_players[i];
+
+    memset(p_player, '\0', sizeof(struct TonePlayer));
+    p_player->line = i;
+    p_player->device = g_piphoned_config_info.lines[i]->tone_device;
+
+    if (strlen(p_player->device) == 0)
+      continue;
+
+    pthread_mutex_init(&p_player->mutex, NULL);
+    pthread_cond_init(&p_player->cond, NULL);
+
+    if (pthread_create(&p_player->thread, NULL, player_thread, p_player) != 0) {
+      syslog(LOG_ERR, "Failed to start tone thread for line %s: %m", g_piphoned_config_info.lines[i]->name);
+      pthread_cond_destroy(&p_player->cond);
+      pthread_mutex_destroy(&p_player->mutex);
+      return false;
+    }
+
+    p_player->is_running = true;
+    syslog(LOG_INFO, "Playing %s call progress tones of line %s on %s.", p_country->name, g_piphoned_config_info.lines[i]->name, p_player->device);
+  }
+
+  return true;
+}
+
+/**
+ * Stops all player threads.
+ */
+void piphoned_tones_free()
+{
+  int i = 0;
+
+  for(i=0; i < s_num_lines; i++) {
+    struct TonePlayer* p_player = &s_players[i];
+
+    if (!p_player->is_running)
+      continue;
+
+    pthread_mutex_lock(&p_player->mutex);
+    p_player->stop = true;
+    pthread_cond_signal(&p_player->cond);
+    pthread_mutex_unlock(&p_player->mutex);
+
+    pthread_join(p_player->thread, NULL);
+    pthread_cond_destroy(&p_player->cond);
+    pthread_mutex_destroy(&p_player->mutex);
+    p_player->is_running = false;
+  }
+
+  s_num_lines = 0;
+}
+
+/**
+ * Switch the tone the handset of the given line hears. Meant to be
+ * called on every mainloop iteration; does nothing if the tone does
+ * not change or the line has no tone device. PIPHONED_TONE_NONE
+ * closes the device.
+ */
+void piphoned_tones_play(int line, enum Piphoned_Tone tone)
+{
+  struct TonePlayer* p_player = NULL;
+
+  if (line >= s_num_lines || !s_players[line].is_running)
+    return;
+
+  p_player = &s_players[line];
+  if (__atomic_load_n(&p_player->wanted, __ATOMIC_ACQUIRE) == tone)
+    return;
+
+  pthread_mutex_lock(&p_player->mutex);
+  __atomic_store_n(&p_player->wanted, tone, __ATOMIC_RELEASE);
+  pthread_cond_signal(&p_player->cond);
+  pthread_mutex_unlock(&p_player->mutex);
+}
+
+const char* piphoned_tones_get_name(enum Piphoned_Tone tone)
+{
+  return s_tone_names[tone];
+}
+
+/***************************************
+ * Private helpers
+ ***************************************/
+
+static bool build_tables(const struct Country* p_country)
+{
+  int tone = 0;
+  int i = 0;
+
+  memset(s_tables, '\0', sizeof(s_tables));
+
+  for(tone=PIPHONED_TONE_DIAL; tone < PIPHONED_NUM_TONES; tone++) {
+    const struct ToneSpec* p_spec = &p_country->tones[tone];
+    struct ToneTable* p_table = &s_tables[tone];
+    int length = period_length(p_spec->frequencies[0]);
+
+    if (p_spec->frequencies[1] > 0) {
+      int second = period_length(p_spec->frequencies[1]);
+      length = length / gcd(length, second) * second;
+    }
+
+    if (length > MAX_TABLE_SAMPLES) {
+      syslog(LOG_CRIT, "The %s tone of '%s' needs %d samples per period, more than %d.", s_tone_names[tone], p_country->name, length, MAX_TABLE_SAMPLES);
+      return false;
+    }
+
+    p_table->length = length;
+    for(i=0; i < length; i++) {
+      double value = sin(2.0 * M_PI * p_spec->frequencies[0] * i / TONE_RATE);
+
+      if (p_spec->frequencies[1] > 0)
+        value += sin(2.0 * M_PI * p_spec->frequencies[1] * i / TONE_RATE);
+
+      p_table->samples[i] = (int16_t) lround(value * TONE_AMPLITUDE);
+    }
+
+    for(i=0; i < MAX_CADENCE && p_spec->cadence[i] > 0; i++)
+      p_table->cadence[i] = p_spec->cadence[i] * TONE_RATE / 1000;
+    p_table->num_steps = i;
+  }
+
+  return true;
+}
+
+/**
+ * Length in samples after which a tone of the given frequency repeats
+ * exactly.
+ */
+static int period_length(int frequency)
+{
+  return TONE_RATE / gcd(TONE_RATE, frequency);
+}
+
+static int gcd(int a, int b)
+{
+  while (b != 0) {
+    int rest = a % b;
+    a = b;
+    b = rest;
+  }
+
+  return a;
+}
+
+static void* player_thread(void* arg)
+{
+  struct TonePlayer* p_player = (struct TonePlayer*) arg;
+
+  /* Gaps in a tone are as audible as in a call */
+  piphoned_rtsched_apply(PIPHONED_RTSCHED_AUDIO);
+
+  while (true) {
+    pthread_mutex_lock(&p_player->mutex);
+    while (p_player->wanted == PIPHONED_TONE_NONE && !p_player->stop)
+      pthread_cond_wait(&p_player->cond, &p_player->mutex);
+    pthread_mutex_unlock(&p_player->mutex);
+
+    if (__atomic_load_n(&p_player->stop, __ATOMIC_ACQUIRE))
+      break;
+
+    play(p_player);
+
+    /* If playing failed, do not retry before the line goes quiet */
+    pthread_mutex_lock(&p_player->mutex);
+    while (p_player->wanted != PIPHONED_TONE_NONE && !p_player->stop)
+      pthread_cond_wait(&p_player->cond, &p_player->mutex);
+    pthread_mutex_unlock(&p_player->mutex);
+  }
+
+  return NULL;
+}
+
+/**
+ * Plays the wanted tones until silence is wanted or the device
+ * fails. On a change of the tone, whatever of the old one is still
+ * buffered is dropped, so that the new one is heard right away.
+ */
+static void play(struct TonePlayer* p_player)
+{
+  snd_pcm_t* p_pcm = NULL;
+  enum Piphoned_Tone tone = PIPHONED_TONE_NONE;
+  int error = 0;
+
+  error = snd_pcm_open(&p_pcm, p_player->device, SND_PCM_STREAM_PLAYBACK, 0);
+  if (error < 0) {
+    PIPHONED_LOG(LOG_ERR, "Cannot open tone device of line %d: error %d.", p_player->line + 1, error);
+    return;
+  }
+
+  error = piphoned_soundparams_set(p_pcm, 1, TONE_RATE, TONE_LATENCY, p_player->line);
+  if (error < 0) {
+    PIPHONED_LOG(LOG_ERR, "Cannot play 8 kHz mono audio on tone device of line %d: error %d.", p_player->line + 1, error);
+    snd_pcm_close(p_pcm);
+    return;
+  }
+
+  while (!__atomic_load_n(&p_player->stop, __ATOMIC_ACQUIRE)) {
+    enum Piphoned_Tone wanted = __atomic_load_n(&p_player->wanted, __ATOMIC_ACQUIRE);
+    snd_pcm_sframes_t frames = 0;
+
+    if (wanted == PIPHONED_TONE_NONE)
+      break;
+
+    if (wanted != tone) {
+      if (tone != PIPHONED_TONE_NONE) {
+        snd_pcm_drop(p_pcm);
+        snd_pcm_prepare(p_pcm);
+      }
+
+      tone = wanted;
+      p_player->position = 0;
+      p_player->step = 0;
+      p_player->step_left = s_tables[tone].cadence[0];
+    }
+
+    fill_chunk(p_player, &s_tables[tone]);
+
+    frames = snd_pcm_writei(p_pcm, p_player->chunk, TONE_CHUNK);
+    if (frames < 0 && snd_pcm_recover(p_pcm, frames, 1) < 0) {
+      PIPHONED_LOG(LOG_ERR, "Playing on tone device of line %d failed: error %d.", p_player->line + 1, (int) frames);
+      break;
+    }
+  }
+
+  snd_pcm_drop(p_pcm);
+  snd_pcm_close(p_pcm);
+}
+
+/**
+ * Copies the next TONE_CHUNK samples of the tone into the player's
+ * chunk, silencing the off steps of the cadence.
+ */
+static void fill_chunk(struct TonePlayer* p_player, const struct ToneTable* p_table)
+{
+  int i = 0;
+
+  for(i=0; i < TONE_CHUNK; i++) {
+    /* Even steps are on, odd ones off */
+    if (p_table->num_steps == 0 || p_player->step % 2 == 0)
+      p_player->chunk[i] = p_table->samples[p_player->position];
+    else
+      p_player->chunk[i] = 0;
+
+    if (++p_player->position == p_table->length)
+      p_player->position = 0;
+
+    if (p_table->num_steps > 0 && --p_player->step_left == 0) {
+      p_player->step = (p_player->step + 1) % p_table->num_steps;
+      p_player->step_left = p_table->cadence[p_player->step];
+    }
+  }
+}
@@ -0,0 +1,22 @@
+#ifndef PIPHONED_TONES_H
+#define PIPHONED_TONES_H
+#include <stdbool.h>
+
+/**
+ * Call progress tones the handset can hear.
+ */
+enum Piphoned_Tone {
+  PIPHONED_TONE_NONE = 0,   /* Silence; the tone device is closed */
+  PIPHONED_TONE_DIAL,       /* Handset lifted, nothing dialed yet */
+  PIPHONED_TONE_RINGBACK,   /* The remote side rings */
+  PIPHONED_TONE_BUSY,       /* The remote side is busy or hung up */
+  PIPHONED_TONE_CONGESTION, /* The call could not be set up */
+  PIPHONED_NUM_TONES
+};
+
+bool piphoned_tones_init();                                /*< Precompute the tones and start the players */
+void piphoned_tones_free();                                /*< Stop all players */
+void piphoned_tones_play(int line, enum Piphoned_Tone tone); /*< Switch the line's tone */
+const char* piphoned_tones_get_name(enum Piphoned_Tone tone); /*< Name of the tone for logging */
+
+#endif
@@ -5,6 +5,8 @@
 #include <wiringPi.h>
 #include "interrupt_handler.h"
 #include "trigger_monitor.h"
+#include "logring.h"
+#include "arena.h"
 
 static void monitor_callback(int pin, void* arg);
 
@@ -30,8 +32,7 @@ static void monitor_callback(int pin, void* arg);
  */
 struct Piphoned_HwActions_TriggerMonitor* piphoned_hwactions_triggermonitor_new(unsigned long grace_time, int pin, void (*p_callback)(int, void*), void* p_userdata)
 {
-  struct Piphoned_HwActions_TriggerMonitor* p_monitor = (struct Piphoned_HwActions_TriggerMonitor*) malloc(sizeof(struct Piphoned_HwActions_TriggerMonitor));
-  memset(p_monitor, '\0', sizeof(struct Piphoned_HwActions_TriggerMonitor));
+  struct Piphoned_HwActions_TriggerMonitor* p_monitor = (struct Piphoned_HwActions_TriggerMonitor*) piphoned_arena_alloc(sizeof(struct Piphoned_HwActions_TriggerMonitor));
   p_monitor->grace_time = grace_time;
   p_monitor->p_callback = p_callback;
   p_monitor->p_userdata = p_userdata;
@@ -48,7 +49,7 @@ void piphoned_hwactions_triggermonitor_free(struct Piphoned_HwActions_TriggerMon
   if (p_monitor) {
     syslog(LOG_DEBUG, "Stopping and freeing monitor on pin %d", p_monitor->pin);
     piphoned_terminate_pin_interrupt_handler(p_monitor->pin);
-    free(p_monitor);
+    piphoned_arena_release(p_monitor);
   }
 }
 
@@ -104,7 +105,7 @@ void monitor_callback(int pin, void* arg)
     goto unlock_mutex;
 
   /* Actual action */
-  syslog(LOG_DEBUG, "Received relevant unfiltered interrupt on pin %d", pin);
+  PIPHONED_LOG(LOG_DEBUG, "Received relevant unfiltered interrupt on pin %d", pin);
   p_monitor->p_callback(pin, p_monitor->p_userdata);
 
   /* Update last timestamp so gracetime check works for next time */
@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <grp.h>
 #include "userinfo.h"
+#include "startup.h"
 
 /**
  * Returns the UID for the given user name. Returns -1 if there
@@ -12,6 +13,7 @@ uid_t piphoned_userinfo_get_uid(const char* username)
   struct passwd* p_passwd = NULL;
   uid_t uid = -1;
 
+  piphoned_startup_begin(PIPHONED_STARTUP_USERINFO, NULL);
   while ((p_passwd = getpwent())) {
     if (strcmp(p_passwd->pw_name, username) == 0) {
       uid = p_passwd->pw_uid;
@@ -20,6 +22,7 @@ uid_t piphoned_userinfo_get_uid(const char* username)
   }
 
   endpwent();
+  piphoned_startup_end(PIPHONED_STARTUP_USERINFO, NULL);
   return uid;
 }
 
@@ -32,6 +35,7 @@ gid_t piphoned_userinfo_get_gid(const char* groupname)
   struct group* p_group = NULL;
   gid_t gid = -1;
 
+  piphoned_startup_begin(PIPHONED_STARTUP_USERINFO, NULL);
   while ((p_group = getgrent())) {
     if (strcmp(p_group->gr_name, groupname) == 0) {
       gid = p_group->gr_gid;
@@ -40,5 +44,6 @@ gid_t piphoned_userinfo_get_gid(const char* groupname)
   }
 
   endgrent();
+  piphoned_startup_end(PIPHONED_STARTUP_USERINFO, NULL);
   return gid;
 }